@@ -77,6 +77,39 @@ static inline u32 ovpn_ipv6_hash(const struct in6_addr *addr,
 }
 #endif
 
+/* return the hash of a remote IPv4 transport endpoint */
+static inline u32 ovpn_transp_ipv4_hash(const __be32 addr, const __be16 port)
+{
+	return ovpn_hash_3words(AF_INET, (__force u32)addr, (__force u32)port);
+}
+
+#if IS_ENABLED(CONFIG_IPV6)
+/* return the hash of a remote IPv6 transport endpoint */
+static inline u32 ovpn_transp_ipv6_hash(const struct in6_addr *addr,
+					const __be16 port)
+{
+	return jhash_2words(AF_INET6, (__force u32)port,
+			    __ipv6_addr_jhash(addr, ovpn_hashrnd));
+}
+#endif
+
+/* return the hash of the transport endpoint stored in an ovpn_sockaddr */
+static inline u32 ovpn_sockaddr_hash(const struct ovpn_sockaddr *sa)
+{
+	switch (sa->family) {
+	case AF_INET:
+		return ovpn_transp_ipv4_hash(sa->u.in4.sin_addr.s_addr,
+					     sa->u.in4.sin_port);
+#if IS_ENABLED(CONFIG_IPV6)
+	case AF_INET6:
+		return ovpn_transp_ipv6_hash(&sa->u.in6.sin6_addr,
+					     sa->u.in6.sin6_port);
+#endif
+	default:
+		return 0;
+	}
+}
+
 /* Compare two ovpn_sockaddr_pair objects for equality,
  * considering family, addr, and port.
  * Note: we assume that the local/remote family values
@@ -8,16 +8,51 @@
 #include "ovpn.h"
 #include "addr.h"
 #include "bind.h"
+#include "ovpnstruct.h"
+#include "peer.h"
 
 #include <linux/types.h>
 #include <net/ip6_route.h>
 #include <net/route.h>
 #include <net/sock.h>
 
-/* Given a remote/local sockaddr pair, compute the skb hash
- * and get a dst_entry so we can send packets to the remote.
- * Called from process context or softirq (must be indicated with
- * process_context bool).
+/* Fill the outer header template of bind. Length, checksums, IPv4 ID and
+ * TTL/hop limit are left to the transmit path
+ */
+static void ovpn_bind_hdr_init(struct ovpn_bind *bind)
+{
+	const struct ovpn_sockaddr_pair *sapair = &bind->sapair;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+
+	switch (sapair->local.family) {
+	case AF_INET:
+		iph = &bind->hdr.v4.ip;
+		iph->version = 4;
+		iph->ihl = sizeof(*iph) >> 2;
+		iph->protocol = IPPROTO_UDP;
+		iph->saddr = sapair->local.u.in4.sin_addr.s_addr;
+		iph->daddr = sapair->remote.u.in4.sin_addr.s_addr;
+
+		bind->hdr.v4.udp.source = sapair->local.u.in4.sin_port;
+		bind->hdr.v4.udp.dest = sapair->remote.u.in4.sin_port;
+		break;
+	case AF_INET6:
+		ip6h = &bind->hdr.v6.ip;
+		ip6_flow_hdr(ip6h, 0, 0);
+		ip6h->nexthdr = IPPROTO_UDP;
+		ip6h->saddr = sapair->local.u.in6.sin6_addr;
+		ip6h->daddr = sapair->remote.u.in6.sin6_addr;
+
+		bind->hdr.v6.udp.source = sapair->local.u.in6.sin6_port;
+		bind->hdr.v6.udp.dest = sapair->remote.u.in6.sin6_port;
+		break;
+	}
+}
+
+/* Given a remote/local sockaddr pair, build the binding used to send packets
+ * to the remote: an empty route cache and the outer header template.
+ * Called from process context.
  */
 struct ovpn_bind *
 ovpn_bind_from_sockaddr_pair(const struct ovpn_sockaddr_pair *pair)
@@ -29,17 +64,25 @@ ovpn_bind_from_sockaddr_pair(const struct ovpn_sockaddr_pair *pair)
 	if (err < 0)
 		return ERR_PTR(err);
 
-	bind = kmalloc(sizeof(*bind), GFP_KERNEL);
+	bind = kzalloc(sizeof(*bind), GFP_KERNEL);
 	if (unlikely(!bind))
 		return ERR_PTR(-ENOMEM);
 
+	err = dst_cache_init(&bind->dst_cache, GFP_KERNEL);
+	if (unlikely(err < 0)) {
+		kfree(bind);
+		return ERR_PTR(err);
+	}
+
 	bind->sapair = *pair;
+	ovpn_bind_hdr_init(bind);
 
 	return bind;
 }
 
 static void ovpn_bind_release(struct ovpn_bind *bind)
 {
+	dst_cache_destroy(&bind->dst_cache);
 	kfree(bind);
 }
 
@@ -62,34 +105,43 @@ void ovpn_bind_reset(struct ovpn_peer *peer, struct ovpn_bind *new)
 		call_rcu(&old->rcu, ovpn_bind_release_rcu);
 }
 
-/* Save sockaddr of incoming packet.
- * rcu_read_lock must be held on entry but
- * will be released prior to exit.
- * Called in softirq context.
+/* Bind peer to the transport endpoints in sapair, i.e. the ones an
+ * authenticated packet was last received from (see ovpn_peer_float()).
+ * In server mode the peer is moved to the by_transp_addr bucket matching its
+ * new remote address.
+ * Called from process context.
  */
 int ovpn_bind_record_peer(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
-			  struct sk_buff *skb, spinlock_t *lock)
+			  const struct ovpn_sockaddr_pair *sapair)
 {
-	struct ovpn_sockaddr_pair sapair;
 	struct ovpn_bind *bind;
-	struct socket *sock;
-	int err;
-
-	ovpn_rcu_lockdep_assert_held();
-
-	err = ovpn_sockaddr_pair_from_skb(&sapair, skb);
-	if (unlikely(err < 0))
-		return err;
 
-	sock = peer->sock;
-	if (unlikely(!sock))
+	if (unlikely(!peer->sock))
 		return -ENODEV;
 
-	bind = ovpn_bind_from_sockaddr_pair(&sapair);
+	bind = ovpn_bind_from_sockaddr_pair(sapair);
 	if (IS_ERR(bind))
 		return PTR_ERR(bind);
 
+	if (!ovpn->peers) {
+		ovpn_bind_reset(peer, bind);
+		return 0;
+	}
+
+	spin_lock_bh(&ovpn->peers->lock);
+	/* nothing to rehash if the peer was removed in the meantime. Readers
+	 * walking the old bucket may miss entries while the peer is moved:
+	 * this table is used for control packets only, which are retransmitted
+	 */
+	if (!hlist_unhashed(&peer->hash_entry_id)) {
+		if (!hlist_unhashed(&peer->hash_entry_transp_addr))
+			hash_del_rcu(&peer->hash_entry_transp_addr);
+		hash_add_rcu(ovpn->peers->by_transp_addr,
+			     &peer->hash_entry_transp_addr,
+			     ovpn_sockaddr_hash(&bind->sapair.remote));
+	}
 	ovpn_bind_reset(peer, bind);
+	spin_unlock_bh(&ovpn->peers->lock);
 
 	return 0;
 }
@@ -11,29 +11,58 @@
 #include "addr.h"
 #include "rcu.h"
 
+#include <net/dst_cache.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
+#include <linux/udp.h>
 
 struct ovpn_bind {
 	struct ovpn_sockaddr_pair sapair;  /* local/remote sockaddrs */
+
+	/* route to remote. A new bind starts with an empty cache, therefore
+	 * the route is looked up again whenever the peer is rebound
+	 */
+	struct dst_cache dst_cache;
+	/* MTU of the route to remote minus the outer headers, 0 until the
+	 * first packet is sent. Refreshed by the transmit path on each route
+	 * lookup, so that it follows the PMTU updates of the route
+	 */
+	unsigned int pmtu;
+
+	/* outer headers of the packets sent to remote, built once by
+	 * ovpn_bind_from_sockaddr_pair(). The transmit path copies them in
+	 * front of each packet and fills in only the fields depending on the
+	 * packet or on the route
+	 */
+	union {
+		struct {
+			struct iphdr ip;
+			struct udphdr udp;
+		} __packed v4;
+		struct {
+			struct ipv6hdr ip;
+			struct udphdr udp;
+		} __packed v6;
+	} hdr;
+
 	struct rcu_head rcu;
 };
 
+/* Return true if skb was exchanged over the transport endpoints of bind.
+ * Addresses and ports are compared directly: skb_get_hash() is not used as it
+ * may have to compute the flow hash in software
+ */
 static inline bool ovpn_bind_skb_match(const struct ovpn_bind *bind,
 				       struct sk_buff *skb)
 {
 	const unsigned short family = skb_protocol_to_family(skb);
 	const struct ovpn_sockaddr_pair *sap = &bind->sapair;
-	const u32 hash_key = skb_get_hash(skb);
 
 	if (unlikely(!bind))
 		return false;
 
-	if (unlikely(bind->sapair.skb_hash_defined &&
-		     bind->sapair.skb_hash != hash_key))
-		return false;
-
 	if (unlikely(bind->sapair.local.family != family))
 		return false;
 
@@ -104,7 +133,7 @@ struct ovpn_struct;
 struct ovpn_peer;
 
 int ovpn_bind_record_peer(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
-			  struct sk_buff *skb, spinlock_t *lock);
+			  const struct ovpn_sockaddr_pair *sapair);
 
 struct ovpn_bind *
 ovpn_bind_from_sockaddr_pair(const struct ovpn_sockaddr_pair *pair);
@@ -13,11 +13,13 @@
 #include "crypto.h"
 
 #include <uapi/linux/ovpn_dco.h>
+#include <linux/slab.h>
 
 static struct ovpn_crypto_key_slot *
-ovpn_ks_new(const struct ovpn_crypto_ops *ops, const struct ovpn_key_config *kc)
+ovpn_ks_new(const struct ovpn_crypto_ops *ops, const struct ovpn_key_config *kc,
+	    struct ovpn_tfm_cache *cache)
 {
-	return ops->new(kc);
+	return ops->new(kc, cache);
 }
 
 static void ovpn_ks_destroy_rcu(struct rcu_head *head)
@@ -41,94 +43,68 @@ void ovpn_crypto_key_slot_release(struct kref *kref)
  */
 void ovpn_crypto_state_release(struct ovpn_crypto_state *cs)
 {
-	struct ovpn_crypto_key_slot *ks;
-
-	ks = rcu_access_pointer(cs->primary);
-	if (ks) {
-		RCU_INIT_POINTER(cs->primary, NULL);
-		ovpn_crypto_key_slot_put(ks);
-	}
-
-	ks = rcu_access_pointer(cs->secondary);
-	if (ks) {
-		RCU_INIT_POINTER(cs->secondary, NULL);
-		ovpn_crypto_key_slot_put(ks);
+	struct ovpn_crypto_key_slots *slots;
+
+	slots = rcu_access_pointer(cs->slots);
+	if (slots) {
+		RCU_INIT_POINTER(cs->slots, NULL);
+		if (slots->primary)
+			ovpn_crypto_key_slot_put(slots->primary);
+		if (slots->secondary)
+			ovpn_crypto_key_slot_put(slots->secondary);
+		kfree(slots);
 	}
 
 	mutex_destroy(&cs->mutex);
 }
 
-/* Reset the ovpn_crypto_state object in a way that is atomic
- * to RCU readers.
+static struct ovpn_crypto_key_slots *
+ovpn_crypto_key_slots_deref(struct ovpn_crypto_state *cs)
+	__must_hold(cs->mutex)
+{
+	return rcu_dereference_protected(cs->slots,
+					 lockdep_is_held(&cs->mutex));
+}
+
+/* Publish the pair (primary, secondary) in place of the current one.
+ * References to slots being installed are transferred from the caller, those
+ * to slots that are not part of the new pair anymore are dropped.
+ * Readers see either the old or the new pair, which is freed only after a
+ * grace period.
+ *
+ * Return 0 on success or -ENOMEM, in which case nothing is changed
  */
-int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
-			    const struct ovpn_peer_key_reset *pkr)
+static int ovpn_crypto_key_slots_set(struct ovpn_crypto_state *cs,
+				     struct ovpn_crypto_key_slot *primary,
+				     struct ovpn_crypto_key_slot *secondary)
 	__must_hold(cs->mutex)
 {
-	struct ovpn_crypto_key_slot *old = NULL;
-	struct ovpn_crypto_key_slot *new;
+	struct ovpn_crypto_key_slots *old, *new = NULL;
 
 	lockdep_assert_held(&cs->mutex);
 
-	new = ovpn_ks_new(cs->ops, &pkr->key);
-	if (IS_ERR(new))
-		return PTR_ERR(new);
-
-	new->remote_peer_id = pkr->remote_peer_id;
+	if (primary || secondary) {
+		new = kmalloc(sizeof(*new), GFP_KERNEL);
+		if (!new)
+			return -ENOMEM;
 
-	switch (pkr->slot) {
-	case OVPN_KEY_SLOT_PRIMARY:
-		old = rcu_replace_pointer(cs->primary, new,
-					  lockdep_is_held(&cs->mutex));
-		break;
-	case OVPN_KEY_SLOT_SECONDARY:
-		old = rcu_replace_pointer(cs->secondary, new,
-					  lockdep_is_held(&cs->mutex));
-		break;
-	default:
-		goto free_key;
+		new->primary = primary;
+		new->secondary = secondary;
 	}
 
-	pr_debug("*** NEW KEY INSTALLED id=%u remote_pid=%u\n",
-		 new->key_id, new->remote_peer_id);
+	old = rcu_replace_pointer(cs->slots, new, lockdep_is_held(&cs->mutex));
+	if (!old)
+		return 0;
 
-	if (old)
-		ovpn_crypto_key_slot_put(old);
+	if (old->primary && old->primary != primary &&
+	    old->primary != secondary)
+		ovpn_crypto_key_slot_put(old->primary);
+	if (old->secondary && old->secondary != primary &&
+	    old->secondary != secondary)
+		ovpn_crypto_key_slot_put(old->secondary);
+	kfree_rcu(old, rcu);
 
 	return 0;
-free_key:
-	ovpn_crypto_key_slot_put(new);
-	return -EINVAL;
-}
-
-void ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
-				 enum ovpn_key_slot slot)
-{
-	struct ovpn_crypto_key_slot *ks = NULL;
-
-	mutex_lock(&cs->mutex);
-	switch (slot) {
-	case OVPN_KEY_SLOT_PRIMARY:
-		ks = rcu_replace_pointer(cs->primary, NULL,
-					 lockdep_is_held(&cs->mutex));
-		break;
-	case OVPN_KEY_SLOT_SECONDARY:
-		ks = rcu_replace_pointer(cs->secondary, NULL,
-					 lockdep_is_held(&cs->mutex));
-		break;
-	default:
-		pr_warn("Invalid slot to release: %u\n", slot);
-		break;
-	}
-	mutex_unlock(&cs->mutex);
-
-	if (!ks) {
-		pr_debug("Key slot already released: %u\n", slot);
-		return;
-	}
-	pr_debug("deleting key slot %u, key_id=%u\n", slot, ks->key_id);
-
-	ovpn_crypto_key_slot_put(ks);
 }
 
 static const struct ovpn_crypto_ops *
@@ -146,24 +122,116 @@ ovpn_crypto_select_family(const struct ovpn_peer_key_reset *pkr)
 	}
 }
 
-int ovpn_crypto_state_select_family(struct ovpn_crypto_state *cs,
-				    const struct ovpn_peer_key_reset *pkr)
-	__must_hold(cs->mutex)
+/* Install a new key in the slot selected by pkr, replacing the current one.
+ * The key slot, including its crypto transforms, is created before cs->mutex
+ * is taken; the change then becomes visible to the datapath at once.
+ */
+int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
+			    const struct ovpn_peer_key_reset *pkr,
+			    struct ovpn_tfm_cache *cache)
 {
-	const struct ovpn_crypto_ops *new_ops;
+	struct ovpn_crypto_key_slot *primary = NULL, *secondary = NULL;
+	const struct ovpn_crypto_ops *ops;
+	struct ovpn_crypto_key_slots *old;
+	struct ovpn_crypto_key_slot *new;
+	int ret;
 
-	lockdep_assert_held(&cs->mutex);
+	if (pkr->slot != OVPN_KEY_SLOT_PRIMARY &&
+	    pkr->slot != OVPN_KEY_SLOT_SECONDARY)
+		return -EINVAL;
 
-	new_ops = ovpn_crypto_select_family(pkr);
-	if (!new_ops)
+	ops = ovpn_crypto_select_family(pkr);
+	if (!ops)
 		return -EOPNOTSUPP;
 
-	if (cs->ops && cs->ops != new_ops) /* family changed? */
-		return -EINVAL;
+	new = ovpn_ks_new(ops, &pkr->key, cache);
+	if (IS_ERR(new))
+		return PTR_ERR(new);
 
-	cs->ops = new_ops;
+	new->remote_peer_id = pkr->remote_peer_id;
+
+	mutex_lock(&cs->mutex);
+	/* the crypto family can't change over the lifetime of a peer */
+	if (cs->ops && cs->ops != ops) {
+		pr_debug("cannot select crypto family for peer\n");
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	old = ovpn_crypto_key_slots_deref(cs);
+	if (old) {
+		primary = old->primary;
+		secondary = old->secondary;
+	}
+
+	if (pkr->slot == OVPN_KEY_SLOT_PRIMARY)
+		primary = new;
+	else
+		secondary = new;
+
+	ret = ovpn_crypto_key_slots_set(cs, primary, secondary);
+	if (ret < 0)
+		goto unlock;
+
+	cs->ops = ops;
+	mutex_unlock(&cs->mutex);
+
+	pr_debug("*** NEW KEY INSTALLED id=%u remote_pid=%u\n",
+		 new->key_id, new->remote_peer_id);
 
 	return 0;
+unlock:
+	mutex_unlock(&cs->mutex);
+	ovpn_crypto_key_slot_put(new);
+	return ret;
+}
+
+/* Remove a key slot from cs. Packets may still be using it within an RCU
+ * read-side critical section (see ovpn_crypto_key_id_to_slot_rcu()): this is
+ * safe as the slot is destroyed only after an RCU grace period, once the last
+ * reference is dropped
+ */
+int ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
+				enum ovpn_key_slot slot)
+{
+	struct ovpn_crypto_key_slot *ks = NULL, *primary, *secondary;
+	struct ovpn_crypto_key_slots *old;
+	int ret = 0;
+
+	mutex_lock(&cs->mutex);
+	old = ovpn_crypto_key_slots_deref(cs);
+	if (!old)
+		goto unlock;
+
+	primary = old->primary;
+	secondary = old->secondary;
+
+	switch (slot) {
+	case OVPN_KEY_SLOT_PRIMARY:
+		ks = primary;
+		primary = NULL;
+		break;
+	case OVPN_KEY_SLOT_SECONDARY:
+		ks = secondary;
+		secondary = NULL;
+		break;
+	default:
+		pr_warn("Invalid slot to release: %u\n", slot);
+		break;
+	}
+
+	if (ks) {
+		pr_debug("deleting key slot %u, key_id=%u\n", slot,
+			 ks->key_id);
+		ret = ovpn_crypto_key_slots_set(cs, primary, secondary);
+	}
+unlock:
+	mutex_unlock(&cs->mutex);
+
+	if (!ks)
+		pr_debug("Key slot already released: %u\n", slot);
+
+	return ret;
 }
 
 enum ovpn_crypto_families
@@ -180,25 +248,73 @@ ovpn_keys_familiy_get(const struct ovpn_key_config *kc)
 	}
 }
 
-/* this swap is not atomic, but there will be a very short time frame where the
- * old_secondary key won't be available. This should not be a big deal as most
- * likely both peers are already using the new primary at this point.
+/* Swap primary and secondary slots. Both change at once for the datapath,
+ * which therefore always finds both keys
  */
-void ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs)
+int ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs)
 {
-	const struct ovpn_crypto_key_slot *old_primary, *old_secondary;
+	struct ovpn_crypto_key_slots *old;
+	int ret;
 
 	mutex_lock(&cs->mutex);
 
-	old_secondary = rcu_dereference_protected(cs->secondary,
-						  lockdep_is_held(&cs->mutex));
-	old_primary = rcu_replace_pointer(cs->primary, old_secondary,
-					  lockdep_is_held(&cs->mutex));
-	rcu_assign_pointer(cs->secondary, old_primary);
+	old = ovpn_crypto_key_slots_deref(cs);
+	if (!old) {
+		mutex_unlock(&cs->mutex);
+		return 0;
+	}
 
 	pr_debug("key swapped: %u <-> %u\n",
-		 old_primary ? old_primary->key_id : 0,
-		 old_secondary ? old_secondary->key_id : 0);
+		 old->primary ? old->primary->key_id : 0,
+		 old->secondary ? old->secondary->key_id : 0);
+
+	ret = ovpn_crypto_key_slots_set(cs, old->secondary, old->primary);
 
 	mutex_unlock(&cs->mutex);
+
+	return ret;
+}
+
+/* Let the key slots of cs release what they haven't used for timeout jiffies.
+ * Called in an RCU read-side critical section
+ */
+void ovpn_crypto_state_shrink(struct ovpn_crypto_state *cs,
+			      unsigned long timeout)
+{
+	struct ovpn_crypto_key_slots *slots;
+
+	slots = rcu_dereference(cs->slots);
+	if (!slots)
+		return;
+
+	if (slots->primary && slots->primary->ops->shrink)
+		slots->primary->ops->shrink(slots->primary, timeout);
+	if (slots->secondary && slots->secondary->ops->shrink)
+		slots->secondary->ops->shrink(slots->secondary, timeout);
+}
+
+/* Return the memory used by the key slots of cs, whose number is added to
+ * *slots. Called in an RCU read-side critical section
+ */
+size_t ovpn_crypto_state_mem(struct ovpn_crypto_state *cs,
+			     unsigned int *slots)
+{
+	struct ovpn_crypto_key_slots *pair;
+	size_t bytes;
+
+	pair = rcu_dereference(cs->slots);
+	if (!pair)
+		return 0;
+
+	bytes = sizeof(*pair);
+	if (pair->primary) {
+		bytes += pair->primary->ops->mem(pair->primary);
+		(*slots)++;
+	}
+	if (pair->secondary) {
+		bytes += pair->secondary->ops->mem(pair->secondary);
+		(*slots)++;
+	}
+
+	return bytes;
 }
@@ -12,12 +12,15 @@
 
 #include "main.h"
 #include "pktid.h"
+#include "proto.h"
 
 #include <uapi/linux/ovpn_dco.h>
 #include <linux/skbuff.h>
 
 struct ovpn_peer;
 struct ovpn_crypto_key_slot;
+struct ovpn_aead_pool;
+struct ovpn_tfm_cache;
 
 enum ovpn_crypto_families {
 	OVPN_CRYPTO_FAMILY_UNDEF = 0,
@@ -39,6 +42,8 @@ struct ovpn_key_config {
 	u16 key_id;
 	struct ovpn_key_direction encrypt;
 	struct ovpn_key_direction decrypt;
+	/* replay window size in packets, 0 for the default */
+	u32 replay_window;
 };
 
 /* used to pass settings from netlink to the crypto engine */
@@ -57,11 +62,35 @@ struct ovpn_crypto_ops {
 		       struct sk_buff *skb,
 		       unsigned int op);
 
-	struct ovpn_crypto_key_slot *(*new)(const struct ovpn_key_config *kc);
+	/* optional: encrypt n packets at once, so that per-call setup can be
+	 * shared and multi-buffer implementations can work on several packets
+	 * in parallel. The result of each packet is stored in rets, with the
+	 * same meaning as the value returned by encrypt
+	 */
+	void (*encrypt_batch)(struct ovpn_crypto_key_slot *ks,
+			      struct sk_buff **skbs, int *rets,
+			      unsigned int n);
+
+	/* cache may be NULL, otherwise it is used to speed up the allocation
+	 * of the transforms needed by the new slot
+	 */
+	struct ovpn_crypto_key_slot *(*new)(const struct ovpn_key_config *kc,
+					    struct ovpn_tfm_cache *cache);
 
 	void (*destroy)(struct ovpn_crypto_key_slot *ks);
 
 	int (*encap_overhead)(const struct ovpn_crypto_key_slot *ks);
+
+	/* optional: release the resources ks hasn't used for timeout jiffies
+	 * and can allocate again when needed. Called in an RCU read-side
+	 * critical section
+	 */
+	void (*shrink)(struct ovpn_crypto_key_slot *ks, unsigned long timeout);
+
+	/* estimate of the memory used by ks, called in an RCU read-side
+	 * critical section
+	 */
+	size_t (*mem)(const struct ovpn_crypto_key_slot *ks);
 };
 
 struct ovpn_crypto_key_slot {
@@ -71,6 +100,11 @@ struct ovpn_crypto_key_slot {
 
 	struct crypto_aead *encrypt;
 	struct crypto_aead *decrypt;
+	/* pre-allocated requests for the tfms above */
+	struct ovpn_aead_pool *encrypt_pool;
+	struct ovpn_aead_pool *decrypt_pool;
+	/* true if encrypt/decrypt may complete asynchronously */
+	bool async;
 	struct ovpn_nonce_tail nonce_tail_xmit;
 	struct ovpn_nonce_tail nonce_tail_recv;
 
@@ -80,12 +114,25 @@ struct ovpn_crypto_key_slot {
 	struct rcu_head rcu;
 };
 
+/* The primary and secondary slots of a peer. The pair is never modified once
+ * published: any change installs a new copy with a single pointer swap, so
+ * that the datapath can't observe a half-updated state (e.g. the same slot as
+ * both primary and secondary, or no slot at all, while swapping).
+ * Each pair holds a reference to the slots it points to
+ */
+struct ovpn_crypto_key_slots {
+	struct ovpn_crypto_key_slot *primary;
+	struct ovpn_crypto_key_slot *secondary;
+	struct rcu_head rcu;
+};
+
 struct ovpn_crypto_state {
-	struct ovpn_crypto_key_slot __rcu *primary;
-	struct ovpn_crypto_key_slot __rcu *secondary;
+	struct ovpn_crypto_key_slots __rcu *slots;
 	const struct ovpn_crypto_ops *ops;
 
-	/* protects primary, secondary slots and ops */
+	/* serializes updates of slots and ops. Key slots are created before
+	 * taking it, so that it is held only for the pointer swap
+	 */
 	struct mutex mutex;
 };
 
@@ -96,52 +143,60 @@ static inline bool ovpn_crypto_key_slot_hold(struct ovpn_crypto_key_slot *ks)
 
 static inline void ovpn_crypto_state_init(struct ovpn_crypto_state *cs)
 {
-	RCU_INIT_POINTER(cs->primary, NULL);
-	RCU_INIT_POINTER(cs->secondary, NULL);
+	RCU_INIT_POINTER(cs->slots, NULL);
 	cs->ops = NULL;
 	mutex_init(&cs->mutex);
 }
 
+/* The datapath looks key slots up without taking a reference, so that
+ * packets don't bounce the refcount cache line between CPUs: a slot stays
+ * valid until the end of the RCU read-side critical section it was found in,
+ * because its destruction is deferred by call_rcu() in
+ * ovpn_crypto_key_slot_release(). A reference is needed only by packets
+ * leaving the critical section, i.e. those handled by an asynchronous engine.
+ */
 static inline struct ovpn_crypto_key_slot *
-ovpn_crypto_key_id_to_slot(const struct ovpn_crypto_state *cs, int key_id)
+ovpn_crypto_key_id_to_slot_rcu(const struct ovpn_crypto_state *cs, int key_id)
 {
-	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_crypto_key_slots *slots;
 
-	if (unlikely(!cs))
+	slots = rcu_dereference(cs->slots);
+	if (unlikely(!slots))
 		return NULL;
 
-	rcu_read_lock();
-	ks = rcu_dereference(cs->primary);
-	if (ks && ks->key_id == key_id) {
-		if (unlikely(!ovpn_crypto_key_slot_hold(ks)))
-			ks = NULL;
-		goto out;
-	}
+	if (slots->primary && slots->primary->key_id == key_id)
+		return slots->primary;
 
-	ks = rcu_dereference(cs->secondary);
-	if (ks && ks->key_id == key_id) {
-		if (unlikely(!ovpn_crypto_key_slot_hold(ks)))
-			ks = NULL;
-		goto out;
-	}
+	if (slots->secondary && slots->secondary->key_id == key_id)
+		return slots->secondary;
 
-	/* when both key slots are occupied but no matching key ID is found, ks has to be reset to
-	 * NULL to avoid carrying a stale pointer
-	 */
-	ks = NULL;
-out:
-	rcu_read_unlock();
+	return NULL;
+}
 
-	return ks;
+static inline struct ovpn_crypto_key_slot *
+ovpn_crypto_key_slot_primary_rcu(const struct ovpn_crypto_state *cs)
+{
+	struct ovpn_crypto_key_slots *slots;
+
+	slots = rcu_dereference(cs->slots);
+	if (unlikely(!slots))
+		return NULL;
+
+	return slots->primary;
 }
 
 static inline struct ovpn_crypto_key_slot *
-ovpn_crypto_key_slot_primary(const struct ovpn_crypto_state *cs)
+ovpn_crypto_key_slot_get(const struct ovpn_crypto_state *cs,
+			 enum ovpn_key_slot slot)
 {
-	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_crypto_key_slots *slots;
+	struct ovpn_crypto_key_slot *ks = NULL;
 
 	rcu_read_lock();
-	ks = rcu_dereference(cs->primary);
+	slots = rcu_dereference(cs->slots);
+	if (slots)
+		ks = slot == OVPN_KEY_SLOT_PRIMARY ? slots->primary :
+						     slots->secondary;
 	if (unlikely(ks && !ovpn_crypto_key_slot_hold(ks)))
 		ks = NULL;
 	rcu_read_unlock();
@@ -149,6 +204,39 @@ ovpn_crypto_key_slot_primary(const struct ovpn_crypto_state *cs)
 	return ks;
 }
 
+/* Encrypt the n packets in skbs with ks, at most OVPN_CRYPTO_BATCH. The
+ * result of each packet is stored in rets, see struct ovpn_crypto_ops
+ */
+static inline void ovpn_crypto_encrypt_batch(struct ovpn_crypto_key_slot *ks,
+					     struct sk_buff **skbs, int *rets,
+					     unsigned int n)
+{
+	unsigned int i;
+
+	if (ks->ops->encrypt_batch) {
+		ks->ops->encrypt_batch(ks, skbs, rets, n);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		rets[i] = ks->ops->encrypt(ks, skbs[i]);
+}
+
+/* Decrypt the n packets in skbs with ks, one by one. The result of each
+ * packet is stored in rets, with the same meaning as the value returned by
+ * decrypt
+ */
+static inline void ovpn_crypto_decrypt_batch(struct ovpn_crypto_key_slot *ks,
+					     struct sk_buff **skbs, int *rets,
+					     unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		rets[i] = ks->ops->decrypt(ks, skbs[i],
+					   ovpn_op32_from_skb(skbs[i], NULL));
+}
+
 void ovpn_crypto_key_slot_release(struct kref *kref);
 
 static inline void ovpn_crypto_key_slot_put(struct ovpn_crypto_key_slot *ks)
@@ -156,20 +244,23 @@ static inline void ovpn_crypto_key_slot_put(struct ovpn_crypto_key_slot *ks)
 	kref_put(&ks->refcount, ovpn_crypto_key_slot_release);
 }
 
-int ovpn_crypto_state_select_family(struct ovpn_crypto_state *cs,
-				    const struct ovpn_peer_key_reset *pkr);
-
 int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
-			    const struct ovpn_peer_key_reset *pkr);
+			    const struct ovpn_peer_key_reset *pkr,
+			    struct ovpn_tfm_cache *cache);
 
-void ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
-				 enum ovpn_key_slot slot);
+int ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
+				enum ovpn_key_slot slot);
 
 void ovpn_crypto_state_release(struct ovpn_crypto_state *cs);
 
 enum ovpn_crypto_families
 ovpn_keys_familiy_get(const struct ovpn_key_config *kc);
 
-void ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs);
+int ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs);
+
+void ovpn_crypto_state_shrink(struct ovpn_crypto_state *cs,
+			      unsigned long timeout);
+size_t ovpn_crypto_state_mem(struct ovpn_crypto_state *cs,
+			     unsigned int *slots);
 
 #endif /* _NET_OVPN_DCO_OVPNCRYPTO_H_ */
@@ -9,18 +9,306 @@
 
 #include "crypto_aead.h"
 #include "crypto.h"
+#include "ovpn.h"
 #include "pktid.h"
 #include "proto.h"
 #include "skb.h"
+#include "stats_counters.h"
 
 #include <crypto/aead.h>
+#include <linux/percpu.h>
+#include <linux/ptr_ring.h>
+#include <linux/rcupdate.h>
 #include <linux/skbuff.h>
 #include <linux/printk.h>
 
 #define AUTH_TAG_SIZE	16
 
+/* op + wire nonce (AD), payload fragments, auth tag */
+#define OVPN_AEAD_MAX_SG	(MAX_SKB_FRAGS + 2)
+
+/* bit set in ovpn_aead_req->flags while the request is in use */
+#define OVPN_AEAD_REQ_BUSY	0
+
+/* number of requests pre-allocated for each asynchronous tfm */
+#define OVPN_AEAD_ASYNC_POOL_SIZE	32
+
+/* number of tfms kept ready for each cipher in use, see ovpn_tfm_cache */
+#define OVPN_TFM_CACHE_SIZE	64
+
+enum ovpn_aead_req_source {
+	OVPN_AEAD_REQ_PERCPU,
+	OVPN_AEAD_REQ_RING,
+	OVPN_AEAD_REQ_HEAP,
+};
+
+/* State needed by a single AEAD operation. Objects are pre-allocated along
+ * with each key slot direction and reused for every packet, so that the hot
+ * path does not hit the allocator.
+ * req must be the last member, as it is followed by the tfm private context
+ */
+struct ovpn_aead_req {
+	unsigned long flags;
+	enum ovpn_aead_req_source source;
+	struct ovpn_aead_pool *pool;
+	struct scatterlist sg[OVPN_AEAD_MAX_SG];
+	u8 iv[NONCE_SIZE];
+	struct aead_request req;
+};
+
+/* Per-CPU requests of a synchronous tfm, replaced as a whole under RCU */
+struct ovpn_aead_percpu {
+	struct ovpn_aead_req __percpu *reqs;
+	size_t req_size;
+	struct rcu_head rcu;
+};
+
+/* Requests bound to a tfm. Synchronous tfms use one object per CPU, while
+ * asynchronous ones keep a small set of objects in a ring, because their
+ * requests stay busy until the engine completes them.
+ * The per-CPU objects, which take most of the memory of a key slot on large
+ * machines, are allocated only once the tfm handles more than one packet per
+ * jiffy, and released by ovpn_aead_pool_shrink() once unused. Slower flows
+ * make do with one-off allocations
+ */
+struct ovpn_aead_pool {
+	struct crypto_aead *tfm;
+	size_t req_size;
+	bool async;
+	struct ovpn_aead_percpu __rcu *percpu;
+	/* last time percpu was used (jiffies) */
+	unsigned long last_used;
+	/* last time a one-off request was allocated for want of percpu */
+	unsigned long last_heap;
+	struct ptr_ring ring;
+};
+
 const struct ovpn_crypto_ops ovpn_aead_ops;
 
+static bool ovpn_aead_is_async(struct crypto_aead *tfm)
+{
+	return crypto_aead_alg(tfm)->base.cra_flags & CRYPTO_ALG_ASYNC;
+}
+
+static void ovpn_aead_req_init(struct ovpn_aead_pool *pool,
+			       struct ovpn_aead_req *areq,
+			       enum ovpn_aead_req_source source)
+{
+	areq->flags = 0;
+	areq->source = source;
+	areq->pool = pool;
+	aead_request_set_tfm(&areq->req, pool->tfm);
+}
+
+static void ovpn_aead_req_free(void *ptr)
+{
+	kfree_sensitive(ptr);
+}
+
+static void ovpn_aead_percpu_free(struct ovpn_aead_percpu *percpu)
+{
+	int cpu;
+
+	if (!percpu)
+		return;
+
+	/* the tfm context may hold data derived from the key */
+	for_each_possible_cpu(cpu)
+		memzero_explicit(per_cpu_ptr(percpu->reqs, cpu),
+				 percpu->req_size);
+	free_percpu(percpu->reqs);
+	kfree(percpu);
+}
+
+static void ovpn_aead_percpu_free_rcu(struct rcu_head *head)
+{
+	ovpn_aead_percpu_free(container_of(head, struct ovpn_aead_percpu,
+					   rcu));
+}
+
+/* Give pool its per-CPU requests. Called from the datapath, in an RCU
+ * read-side critical section
+ */
+static void ovpn_aead_percpu_attach(struct ovpn_aead_pool *pool)
+{
+	struct ovpn_aead_percpu *percpu;
+	int cpu;
+
+	percpu = kmalloc(sizeof(*percpu), GFP_ATOMIC | __GFP_NOWARN);
+	if (!percpu)
+		return;
+
+	percpu->req_size = pool->req_size;
+	percpu->reqs = __alloc_percpu_gfp(pool->req_size,
+					  __alignof__(struct ovpn_aead_req),
+					  GFP_ATOMIC | __GFP_NOWARN);
+	if (!percpu->reqs) {
+		kfree(percpu);
+		return;
+	}
+
+	for_each_possible_cpu(cpu)
+		ovpn_aead_req_init(pool, per_cpu_ptr(percpu->reqs, cpu),
+				   OVPN_AEAD_REQ_PERCPU);
+
+	/* don't let the next scan release it right away */
+	WRITE_ONCE(pool->last_used, jiffies);
+
+	/* another CPU may have been faster */
+	if (cmpxchg((struct ovpn_aead_percpu __force **)&pool->percpu, NULL,
+		    percpu))
+		ovpn_aead_percpu_free(percpu);
+}
+
+/* Release the per-CPU requests of pool if unused for timeout jiffies. The
+ * requests of synchronous tfms are used within the RCU read-side critical
+ * section the key slot was found in, hence they are freed after a grace period
+ */
+static void ovpn_aead_pool_shrink(struct ovpn_aead_pool *pool,
+				  unsigned long timeout)
+{
+	struct ovpn_aead_percpu *percpu;
+
+	if (!rcu_access_pointer(pool->percpu) ||
+	    time_before(jiffies, READ_ONCE(pool->last_used) + timeout))
+		return;
+
+	percpu = xchg((struct ovpn_aead_percpu __force **)&pool->percpu, NULL);
+	if (percpu)
+		call_rcu(&percpu->rcu, ovpn_aead_percpu_free_rcu);
+}
+
+static size_t ovpn_aead_pool_mem(const struct ovpn_aead_pool *pool)
+{
+	struct ovpn_aead_percpu *percpu;
+	size_t bytes;
+
+	/* the tfm, with its context holding the expanded key */
+	bytes = sizeof(*pool) + sizeof(*pool->tfm) +
+		crypto_aead_alg(pool->tfm)->base.cra_ctxsize;
+
+	if (pool->async)
+		bytes += OVPN_AEAD_ASYNC_POOL_SIZE *
+			 (pool->req_size + sizeof(void *));
+
+	percpu = rcu_dereference(pool->percpu);
+	if (percpu)
+		bytes += sizeof(*percpu) +
+			 num_possible_cpus() * percpu->req_size;
+
+	return bytes;
+}
+
+static void ovpn_aead_pool_free(struct ovpn_aead_pool *pool)
+{
+	if (!pool)
+		return;
+
+	/* the key slot is released after a grace period already */
+	ovpn_aead_percpu_free(rcu_dereference_protected(pool->percpu, true));
+
+	if (pool->async)
+		ptr_ring_cleanup(&pool->ring, ovpn_aead_req_free);
+
+	kfree(pool);
+}
+
+static struct ovpn_aead_pool *ovpn_aead_pool_new(struct crypto_aead *tfm)
+{
+	struct ovpn_aead_pool *pool;
+	struct ovpn_aead_req *areq;
+	int i;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->tfm = tfm;
+	pool->req_size = sizeof(struct ovpn_aead_req) + crypto_aead_reqsize(tfm);
+
+	/* per-CPU requests are attached on demand */
+	if (!ovpn_aead_is_async(tfm))
+		return pool;
+
+	if (ptr_ring_init(&pool->ring, OVPN_AEAD_ASYNC_POOL_SIZE, GFP_KERNEL))
+		goto err;
+	pool->async = true;
+
+	for (i = 0; i < OVPN_AEAD_ASYNC_POOL_SIZE; i++) {
+		areq = kmalloc(pool->req_size, GFP_KERNEL);
+		if (!areq)
+			goto err;
+
+		ovpn_aead_req_init(pool, areq, OVPN_AEAD_REQ_RING);
+		__ptr_ring_produce(&pool->ring, areq);
+	}
+
+	return pool;
+err:
+	ovpn_aead_pool_free(pool);
+	return NULL;
+}
+
+/* Grab a pre-allocated request object. If none is available (i.e. the object
+ * of the current CPU is used by a context that was preempted, all the async
+ * requests are in flight, or the per-CPU objects are not attached), fall back
+ * to a one-off allocation.
+ * Called in the RCU read-side critical section the key slot was found in
+ */
+static struct ovpn_aead_req *ovpn_aead_req_get(struct ovpn_aead_pool *pool)
+{
+	struct ovpn_aead_percpu *percpu;
+	struct ovpn_aead_req *areq;
+	unsigned long now;
+
+	if (pool->async) {
+		areq = ptr_ring_consume_bh(&pool->ring);
+		if (likely(areq))
+			return areq;
+	} else {
+		now = jiffies;
+		percpu = rcu_dereference(pool->percpu);
+		if (likely(percpu)) {
+			if (READ_ONCE(pool->last_used) != now)
+				WRITE_ONCE(pool->last_used, now);
+
+			areq = raw_cpu_ptr(percpu->reqs);
+			if (likely(!test_and_set_bit_lock(OVPN_AEAD_REQ_BUSY,
+							  &areq->flags)))
+				return areq;
+		} else if (READ_ONCE(pool->last_heap) == now) {
+			/* ready for the next packets */
+			ovpn_aead_percpu_attach(pool);
+		} else {
+			WRITE_ONCE(pool->last_heap, now);
+		}
+	}
+
+	areq = kmalloc(pool->req_size, GFP_ATOMIC);
+	if (unlikely(!areq))
+		return NULL;
+
+	ovpn_aead_req_init(pool, areq, OVPN_AEAD_REQ_HEAP);
+
+	return areq;
+}
+
+static void ovpn_aead_req_put(struct ovpn_aead_req *areq)
+{
+	switch (areq->source) {
+	case OVPN_AEAD_REQ_PERCPU:
+		clear_bit_unlock(OVPN_AEAD_REQ_BUSY, &areq->flags);
+		break;
+	case OVPN_AEAD_REQ_RING:
+		/* can't fail: the ring is sized after the number of objects */
+		ptr_ring_produce_bh(&areq->pool->ring, areq);
+		break;
+	case OVPN_AEAD_REQ_HEAP:
+		kfree_sensitive(areq);
+		break;
+	}
+}
+
 static int ovpn_aead_encap_overhead(const struct ovpn_crypto_key_slot *ks)
 {
 	return  OVPN_OP_SIZE_V2 +			/* OP header size */
@@ -28,18 +316,58 @@ static int ovpn_aead_encap_overhead(const struct ovpn_crypto_key_slot *ks)
 		crypto_aead_authsize(ks->encrypt);	/* Auth Tag */
 }
 
-static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
-			     struct sk_buff *skb)
+/* Set the completion callback of a request. Only asynchronous tfms can
+ * complete a request after the submitting function has returned
+ */
+static void ovpn_aead_req_set_done(struct ovpn_aead_req *areq,
+				   crypto_completion_t done,
+				   struct sk_buff *skb)
+{
+	if (areq->pool->async)
+		aead_request_set_callback(&areq->req,
+					  CRYPTO_TFM_REQ_MAY_BACKLOG, done, skb);
+	else
+		aead_request_set_callback(&areq->req, 0, NULL, NULL);
+}
+
+static void ovpn_aead_encrypt_done(struct crypto_async_request *base, int err)
+{
+	struct ovpn_aead_req *areq;
+	struct sk_buff *skb;
+
+	/* a backlogged request has been accepted by the engine: the real
+	 * completion will follow
+	 */
+	if (err == -EINPROGRESS)
+		return;
+
+	areq = container_of(base, struct ovpn_aead_req, req.base);
+	skb = base->data;
+	ovpn_aead_req_put(areq);
+
+	if (unlikely(err < 0))
+		pr_err_ratelimited("%s: encrypt failed: %d\n", __func__, err);
+
+	ovpn_encrypt_post(skb, err);
+}
+
+/* Encrypt skb in place, using the packet ID reserved as seq_num.
+ * Return 0 on success, a negative error code on failure, or -EINPROGRESS if
+ * the operation was handed to an asynchronous engine. In the latter case
+ * ovpn_encrypt_post() will be invoked on completion
+ */
+static int __ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
+			       struct sk_buff *skb, u64 seq_num)
 {
 	const unsigned int tag_size = crypto_aead_authsize(ks->encrypt);
 	const unsigned int head_size = ovpn_aead_encap_overhead(ks);
-	struct scatterlist sg[MAX_SKB_FRAGS + 2];
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aead_request *req;
+	struct ovpn_aead_req *areq;
+	struct scatterlist *sg;
 	struct sk_buff *trailer;
-	u8 iv[NONCE_SIZE];
 	int nfrags, ret;
 	u32 pktid, op;
+	bool inplace;
+	u8 *iv;
 
 	/* Sample AEAD header format:
 	 * 48000001 00000005 7e7046bd 444a7e28 cc6387b1 64a4d6c1 380275a...
@@ -48,24 +376,46 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	 *          IV head]
 	 */
 
-	/* check that there's enough headroom in the skb for packet
-	 * encapsulation, after adding network header and encryption overhead
+	/* the auth tag is pushed in front of the payload, therefore a linear
+	 * skb we own the data of, with enough headroom for the encapsulation
+	 * and the network header, can be encrypted in place as it is. This is
+	 * the case for most packets, as the device asks the stack for that
+	 * headroom (see ovpn_setup())
 	 */
-	if (unlikely(skb_cow_head(skb, OVPN_HEAD_ROOM + head_size)))
-		return -ENOBUFS;
-
-	/* get number of skb frags and ensure that packet data is writable */
-	nfrags = skb_cow_data(skb, 0, &trailer);
-	if (unlikely(nfrags < 0))
-		return nfrags;
+	inplace = !skb_is_nonlinear(skb) && !skb_cloned(skb) &&
+		  skb_headroom(skb) >= OVPN_HEAD_ROOM + head_size;
+	if (likely(inplace)) {
+		nfrags = 1;
+	} else {
+		/* check that there's enough headroom in the skb for packet
+		 * encapsulation, after adding network header and encryption
+		 * overhead
+		 */
+		if (unlikely(skb_cow_head(skb, OVPN_HEAD_ROOM + head_size)))
+			return -ENOBUFS;
+
+		/* get number of skb frags and ensure that packet data is
+		 * writable
+		 */
+		nfrags = skb_cow_data(skb, 0, &trailer);
+		if (unlikely(nfrags < 0))
+			return nfrags;
+
+		if (unlikely(nfrags + 2 > OVPN_AEAD_MAX_SG))
+			return -EMSGSIZE;
+	}
 
-	if (unlikely(nfrags + 2 > ARRAY_SIZE(sg)))
-		return -ENOSPC;
+	ovpn_peer_stats_tx_path(OVPN_SKB_CB(skb)->peer,
+				inplace ? OVPN_PEER_TX_PATH_INPLACE :
+					  OVPN_PEER_TX_PATH_COW);
 
-	req = aead_request_alloc(ks->encrypt, GFP_KERNEL);
-	if (unlikely(!req))
+	areq = ovpn_aead_req_get(ks->encrypt_pool);
+	if (unlikely(!areq))
 		return -ENOMEM;
 
+	sg = areq->sg;
+	iv = areq->iv;
+
 	/* sg table:
 	 * 0: op, wire nonce (AD, len=OVPN_OP_SIZE_V2+NONCE_WIRE_SIZE),
 	 * 1, 2, 3, ..., n: payload,
@@ -74,10 +424,14 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	sg_init_table(sg, nfrags + 2);
 
 	/* build scatterlist to encrypt packet payload */
-	ret = skb_to_sgvec_nomark(skb, sg + 1, 0, skb->len);
-	if (unlikely(nfrags != ret)) {
-		ret = -EINVAL;
-		goto free_req;
+	if (likely(inplace)) {
+		sg_set_buf(sg + 1, skb->data, skb->len);
+	} else {
+		ret = skb_to_sgvec_nomark(skb, sg + 1, 0, skb->len);
+		if (unlikely(nfrags != ret)) {
+			ret = -EINVAL;
+			goto free_req;
+		}
 	}
 
 	/* append auth_tag onto scatterlist */
@@ -87,12 +441,13 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	/* obtain packet ID, which is used both as a first
 	 * 4 bytes of nonce and last 4 bytes of associated data.
 	 */
-	ret = ovpn_pktid_xmit_next(&ks->pid_xmit, &pktid);
+	ret = ovpn_pktid_xmit_check(seq_num, &pktid);
 	if (unlikely(ret < 0)) {
 		if (ret != -1)
 			goto free_req;
 		//ovpn_notify_pktid_wrap_pc(ks->peer, ks->key_id);
 	}
+	OVPN_SKB_CB(skb)->pktid = pktid;
 
 	/* concat 4 bytes packet id and 8 bytes nonce tail into 12 bytes nonce */
 	ovpn_pktid_aead_write(pktid, &ks->nonce_tail_xmit, iv);
@@ -110,37 +465,106 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	/* AEAD Additional data */
 	sg_set_buf(sg, skb->data, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
 
-	/* setup async crypto operation */
-	aead_request_set_tfm(req, ks->encrypt);
-	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-				       CRYPTO_TFM_REQ_MAY_SLEEP,
-				  crypto_req_done, &wait);
-	aead_request_set_crypt(req, sg, sg, skb->len - head_size, iv);
-	aead_request_set_ad(req, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
+	/* setup crypto operation */
+	ovpn_aead_req_set_done(areq, ovpn_aead_encrypt_done, skb);
+	aead_request_set_crypt(&areq->req, sg, sg, skb->len - head_size, iv);
+	aead_request_set_ad(&areq->req, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
 
 	/* encrypt it */
-	ret = crypto_wait_req(crypto_aead_encrypt(req), &wait);
+	ret = crypto_aead_encrypt(&areq->req);
+	if (ret == -EINPROGRESS || ret == -EBUSY)
+		/* the request now belongs to the engine */
+		return -EINPROGRESS;
+
 	if (ret < 0)
 		pr_err_ratelimited("%s: encrypt failed: %d\n", __func__, ret);
 
 free_req:
-	aead_request_free(req);
+	ovpn_aead_req_put(areq);
 	return ret;
 }
 
+static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
+			     struct sk_buff *skb)
+{
+	return __ovpn_aead_encrypt(ks, skb,
+				   ovpn_pktid_xmit_reserve(&ks->pid_xmit, 1));
+}
+
+/* Encrypt n packets, reserving their packet IDs at once: this way the
+ * counter shared by all the CPUs transmitting with ks is touched only once
+ * per batch. IDs of packets failing before encryption are lost, which the
+ * receiver can't tell from packet loss
+ */
+static void ovpn_aead_encrypt_batch(struct ovpn_crypto_key_slot *ks,
+				    struct sk_buff **skbs, int *rets,
+				    unsigned int n)
+{
+	u64 seq_num = ovpn_pktid_xmit_reserve(&ks->pid_xmit, n) - n;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		rets[i] = __ovpn_aead_encrypt(ks, skbs[i], ++seq_num);
+}
+
+/* check the packet ID of a successfully decrypted packet and point skb to
+ * the encapsulated IP packet
+ */
+static int ovpn_aead_decrypt_finish(struct ovpn_crypto_key_slot *ks,
+				    struct sk_buff *skb)
+{
+	const unsigned int tag_size = crypto_aead_authsize(ks->decrypt);
+	__be32 *pid;
+	int ret;
+
+	/* PID sits after the op */
+	pid = (__force __be32 *)(skb->data + OVPN_OP_SIZE_V2);
+	OVPN_SKB_CB(skb)->pktid = ntohl(*pid);
+	ret = ovpn_pktid_recv(&ks->pid_recv, OVPN_SKB_CB(skb)->pktid, 0);
+	if (unlikely(ret < 0))
+		return ret;
+
+	/* point to encapsulated IP packet */
+	__skb_pull(skb, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE + tag_size);
+
+	return 0;
+}
+
+static void ovpn_aead_decrypt_done(struct crypto_async_request *base, int err)
+{
+	struct ovpn_aead_req *areq;
+	struct sk_buff *skb;
+
+	if (err == -EINPROGRESS)
+		return;
+
+	areq = container_of(base, struct ovpn_aead_req, req.base);
+	skb = base->data;
+	ovpn_aead_req_put(areq);
+
+	if (unlikely(err < 0))
+		pr_err_ratelimited("%s: decrypt failed: %d\n", __func__, err);
+	else
+		err = ovpn_aead_decrypt_finish(OVPN_SKB_CB(skb)->ks, skb);
+
+	ovpn_decrypt_post(skb, err);
+}
+
+/* Decrypt skb in place.
+ * Return values follow the same semantic as ovpn_aead_encrypt(), with
+ * ovpn_decrypt_post() being invoked on asynchronous completion
+ */
 static int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
 			     struct sk_buff *skb, unsigned int op)
 {
 	const unsigned int tag_size = crypto_aead_authsize(ks->decrypt);
-	struct scatterlist sg[MAX_SKB_FRAGS + 2];
 	int ret, payload_len, nfrags;
-	u8 *sg_data, iv[NONCE_SIZE];
 	unsigned int payload_offset;
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aead_request *req;
+	struct ovpn_aead_req *areq;
+	struct scatterlist *sg;
 	struct sk_buff *trailer;
+	u8 *sg_data, *iv;
 	unsigned int sg_len;
-	__be32 *pid;
 
 	payload_offset = OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE + tag_size;
 	payload_len = skb->len - payload_offset;
@@ -154,13 +578,16 @@ static int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
 	if (unlikely(nfrags < 0))
 		return nfrags;
 
-	if (unlikely(nfrags + 2 > ARRAY_SIZE(sg)))
-		return -ENOSPC;
+	if (unlikely(nfrags + 2 > OVPN_AEAD_MAX_SG))
+		return -EMSGSIZE;
 
-	req = aead_request_alloc(ks->decrypt, GFP_KERNEL);
-	if (unlikely(!req))
+	areq = ovpn_aead_req_get(ks->decrypt_pool);
+	if (unlikely(!areq))
 		return -ENOMEM;
 
+	sg = areq->sg;
+	iv = areq->iv;
+
 	/* sg table:
 	 * 0: op, wire nonce (AD, len=OVPN_OP_SIZE_V2+NONCE_WIRE_SIZE),
 	 * 1, 2, 3, ..., n: payload,
@@ -188,41 +615,43 @@ static int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
 	memcpy(iv + NONCE_WIRE_SIZE, ks->nonce_tail_recv.u8,
 	       sizeof(struct ovpn_nonce_tail));
 
-	/* setup async crypto operation */
-	aead_request_set_tfm(req, ks->decrypt);
-	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-				       CRYPTO_TFM_REQ_MAY_SLEEP,
-				  crypto_req_done, &wait);
-	aead_request_set_crypt(req, sg, sg, payload_len + tag_size, iv);
+	/* setup crypto operation */
+	ovpn_aead_req_set_done(areq, ovpn_aead_decrypt_done, skb);
+	aead_request_set_crypt(&areq->req, sg, sg, payload_len + tag_size, iv);
 
-	aead_request_set_ad(req, NONCE_WIRE_SIZE + OVPN_OP_SIZE_V2);
+	aead_request_set_ad(&areq->req, NONCE_WIRE_SIZE + OVPN_OP_SIZE_V2);
 
 	/* decrypt it */
-	ret = crypto_wait_req(crypto_aead_decrypt(req), &wait);
+	ret = crypto_aead_decrypt(&areq->req);
+	if (ret == -EINPROGRESS || ret == -EBUSY)
+		return -EINPROGRESS;
+
 	if (ret < 0) {
 		pr_err_ratelimited("%s: decrypt failed: %d\n", __func__, ret);
 		goto free_req;
 	}
 
-	/* PID sits after the op */
-	pid = (__force __be32 *)(skb->data + OVPN_OP_SIZE_V2);
-	ret = ovpn_pktid_recv(&ks->pid_recv, ntohl(*pid), 0);
-	if (unlikely(ret < 0))
-		goto free_req;
-
-	/* point to encapsulated IP packet */
-	__skb_pull(skb, payload_offset);
+	ret = ovpn_aead_decrypt_finish(ks, skb);
 
 free_req:
-	aead_request_free(req);
+	ovpn_aead_req_put(areq);
 	return ret;
 }
 
-/* Initialize a struct crypto_aead object */
-static struct crypto_aead *ovpn_aead_init(const char *title,
-					  const char *alg_name,
-					  const unsigned char *key,
-					  unsigned int keylen)
+static const char *ovpn_aead_alg_name(enum ovpn_cipher_alg alg)
+{
+	switch (alg) {
+	case OVPN_CIPHER_ALG_AES_GCM:
+		return "gcm(aes)";
+	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+		return "rfc7539(chacha20,poly1305)";
+	default:
+		return NULL;
+	}
+}
+
+/* Allocate a struct crypto_aead object, ready for a key to be set */
+static struct crypto_aead *ovpn_aead_tfm_new(const char *alg_name)
 {
 	struct crypto_aead *aead;
 	int ret;
@@ -230,32 +659,69 @@ static struct crypto_aead *ovpn_aead_init(const char *title,
 	aead = crypto_alloc_aead(alg_name, 0, 0);
 	if (IS_ERR(aead)) {
 		ret = PTR_ERR(aead);
-		pr_err("%s crypto_alloc_aead failed, err=%d\n", title, ret);
-		aead = NULL;
-		goto error;
-	}
-
-	ret = crypto_aead_setkey(aead, key, keylen);
-	if (ret) {
-		pr_err("%s crypto_aead_setkey size=%u failed, err=%d\n", title,
-		       keylen, ret);
-		goto error;
+		pr_err("%s crypto_alloc_aead failed, err=%d\n", alg_name, ret);
+		return aead;
 	}
 
 	ret = crypto_aead_setauthsize(aead, AUTH_TAG_SIZE);
 	if (ret) {
-		pr_err("%s crypto_aead_setauthsize failed, err=%d\n", title,
+		pr_err("%s crypto_aead_setauthsize failed, err=%d\n", alg_name,
 		       ret);
 		goto error;
 	}
 
 	/* basic AEAD assumption */
 	if (crypto_aead_ivsize(aead) != NONCE_SIZE) {
-		pr_err("%s IV size must be %d\n", title, NONCE_SIZE);
+		pr_err("%s IV size must be %d\n", alg_name, NONCE_SIZE);
 		ret = -EINVAL;
 		goto error;
 	}
 
+	return aead;
+
+error:
+	crypto_free_aead(aead);
+	return ERR_PTR(ret);
+}
+
+static void ovpn_aead_tfm_free(void *ptr)
+{
+	crypto_free_aead(ptr);
+}
+
+/* Initialize a struct crypto_aead object, taking it from cache if possible */
+static struct crypto_aead *ovpn_aead_init(const char *title,
+					  struct ovpn_tfm_cache *cache,
+					  enum ovpn_cipher_alg alg,
+					  const unsigned char *key,
+					  unsigned int keylen)
+{
+	const char *alg_name = ovpn_aead_alg_name(alg);
+	struct crypto_aead *aead = NULL;
+	int ret;
+
+	if (cache) {
+		aead = ptr_ring_consume(&cache->tfms[alg]);
+
+		/* (re)stock this cipher in the background */
+		set_bit(alg, &cache->ciphers);
+		queue_work(cache->wq, &cache->refill_work);
+	}
+
+	if (!aead) {
+		aead = ovpn_aead_tfm_new(alg_name);
+		if (IS_ERR(aead))
+			return aead;
+	}
+
+	ret = crypto_aead_setkey(aead, key, keylen);
+	if (ret) {
+		pr_err("%s crypto_aead_setkey size=%u failed, err=%d\n", title,
+		       keylen, ret);
+		crypto_free_aead(aead);
+		return ERR_PTR(ret);
+	}
+
 	pr_debug("********* Cipher %s (%s)\n", alg_name, title);
 	pr_debug("*** IV size=%u\n", crypto_aead_ivsize(aead));
 	pr_debug("*** req size=%u\n", crypto_aead_reqsize(aead));
@@ -264,10 +730,60 @@ static struct crypto_aead *ovpn_aead_init(const char *title,
 	pr_debug("*** alignmask=0x%x\n", crypto_aead_alignmask(aead));
 
 	return aead;
+}
 
-error:
-	crypto_free_aead(aead);
-	return ERR_PTR(ret);
+static void ovpn_tfm_cache_refill(struct work_struct *work)
+{
+	struct ovpn_tfm_cache *cache;
+	struct crypto_aead *aead;
+	unsigned int alg;
+
+	cache = container_of(work, struct ovpn_tfm_cache, refill_work);
+
+	for_each_set_bit(alg, &cache->ciphers, OVPN_AEAD_CIPHERS) {
+		while (!ptr_ring_full(&cache->tfms[alg])) {
+			aead = ovpn_aead_tfm_new(ovpn_aead_alg_name(alg));
+			if (IS_ERR(aead))
+				break;
+
+			/* the work is the only producer, can't fail */
+			ptr_ring_produce(&cache->tfms[alg], aead);
+			cond_resched();
+		}
+	}
+}
+
+int ovpn_tfm_cache_init(struct ovpn_tfm_cache *cache,
+			struct workqueue_struct *wq)
+{
+	int i, ret;
+
+	cache->wq = wq;
+	cache->ciphers = 0;
+	INIT_WORK(&cache->refill_work, ovpn_tfm_cache_refill);
+
+	for (i = 0; i < OVPN_AEAD_CIPHERS; i++) {
+		ret = ptr_ring_init(&cache->tfms[i], OVPN_TFM_CACHE_SIZE,
+				    GFP_KERNEL);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	while (--i >= 0)
+		ptr_ring_cleanup(&cache->tfms[i], NULL);
+	return ret;
+}
+
+void ovpn_tfm_cache_release(struct ovpn_tfm_cache *cache)
+{
+	int i;
+
+	cancel_work_sync(&cache->refill_work);
+
+	for (i = 0; i < OVPN_AEAD_CIPHERS; i++)
+		ptr_ring_cleanup(&cache->tfms[i], ovpn_aead_tfm_free);
 }
 
 static void ovpn_aead_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks)
@@ -275,13 +791,32 @@ static void ovpn_aead_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks)
 	if (!ks)
 		return;
 
+	ovpn_aead_pool_free(ks->encrypt_pool);
+	ovpn_aead_pool_free(ks->decrypt_pool);
+	ovpn_pktid_recv_release(&ks->pid_recv);
 	crypto_free_aead(ks->encrypt);
 	crypto_free_aead(ks->decrypt);
 	kfree(ks);
 }
 
+static void ovpn_aead_crypto_key_slot_shrink(struct ovpn_crypto_key_slot *ks,
+					     unsigned long timeout)
+{
+	ovpn_aead_pool_shrink(ks->encrypt_pool, timeout);
+	ovpn_aead_pool_shrink(ks->decrypt_pool, timeout);
+}
+
+static size_t
+ovpn_aead_crypto_key_slot_mem(const struct ovpn_crypto_key_slot *ks)
+{
+	return sizeof(*ks) + ovpn_pktid_recv_mem(&ks->pid_recv) +
+	       ovpn_aead_pool_mem(ks->encrypt_pool) +
+	       ovpn_aead_pool_mem(ks->decrypt_pool);
+}
+
 static struct ovpn_crypto_key_slot *
-ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
+ovpn_aead_crypto_key_slot_init(struct ovpn_tfm_cache *cache,
+			       enum ovpn_cipher_alg alg,
 			       const unsigned char *encrypt_key,
 			       unsigned int encrypt_keylen,
 			       const unsigned char *decrypt_key,
@@ -290,23 +825,16 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 			       unsigned int encrypt_nonce_tail_len,
 			       const unsigned char *decrypt_nonce_tail,
 			       unsigned int decrypt_nonce_tail_len,
-			       u16 key_id)
+			       u16 key_id, u32 replay_window)
 {
 	struct ovpn_crypto_key_slot *ks = NULL;
 	const char *alg_name;
 	int ret;
 
 	/* validate crypto alg */
-	switch (alg) {
-	case OVPN_CIPHER_ALG_AES_GCM:
-		alg_name = "gcm(aes)";
-		break;
-	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
-		alg_name = "rfc7539(chacha20,poly1305)";
-		break;
-	default:
+	alg_name = ovpn_aead_alg_name(alg);
+	if (!alg_name)
 		return ERR_PTR(-EOPNOTSUPP);
-	}
 
 	/* build the key slot */
 	ks = kmalloc(sizeof(*ks), GFP_KERNEL);
@@ -316,10 +844,13 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 	ks->ops = &ovpn_aead_ops;
 	ks->encrypt = NULL;
 	ks->decrypt = NULL;
+	ks->encrypt_pool = NULL;
+	ks->decrypt_pool = NULL;
+	ks->pid_recv.history = NULL;
 	kref_init(&ks->refcount);
 	ks->key_id = key_id;
 
-	ks->encrypt = ovpn_aead_init("encrypt", alg_name, encrypt_key,
+	ks->encrypt = ovpn_aead_init("encrypt", cache, alg, encrypt_key,
 				     encrypt_keylen);
 	if (IS_ERR(ks->encrypt)) {
 		ret = PTR_ERR(ks->encrypt);
@@ -327,7 +858,7 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 		goto destroy_ks;
 	}
 
-	ks->decrypt = ovpn_aead_init("decrypt", alg_name, decrypt_key,
+	ks->decrypt = ovpn_aead_init("decrypt", cache, alg, decrypt_key,
 				     decrypt_keylen);
 	if (IS_ERR(ks->decrypt)) {
 		ret = PTR_ERR(ks->decrypt);
@@ -335,6 +866,20 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 		goto destroy_ks;
 	}
 
+	/* pre-allocate the requests used on the hot path */
+	ks->encrypt_pool = ovpn_aead_pool_new(ks->encrypt);
+	ks->decrypt_pool = ovpn_aead_pool_new(ks->decrypt);
+	if (!ks->encrypt_pool || !ks->decrypt_pool) {
+		ret = -ENOMEM;
+		goto destroy_ks;
+	}
+
+	/* packets handled by asynchronous engines may complete out of order */
+	ks->async = ks->encrypt_pool->async || ks->decrypt_pool->async;
+	if (ks->async)
+		pr_debug("using asynchronous crypto engine for %s\n",
+			 alg_name);
+
 	if (sizeof(struct ovpn_nonce_tail) != encrypt_nonce_tail_len ||
 	    sizeof(struct ovpn_nonce_tail) != decrypt_nonce_tail_len) {
 		ret = -EINVAL;
@@ -348,7 +893,9 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 
 	/* init packet ID generation/validation */
 	ovpn_pktid_xmit_init(&ks->pid_xmit);
-	ovpn_pktid_recv_init(&ks->pid_recv);
+	ret = ovpn_pktid_recv_init(&ks->pid_recv, replay_window);
+	if (ret < 0)
+		goto destroy_ks;
 
 	return ks;
 
@@ -358,9 +905,10 @@ destroy_ks:
 }
 
 static struct ovpn_crypto_key_slot *
-ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc)
+ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc,
+			      struct ovpn_tfm_cache *cache)
 {
-	return ovpn_aead_crypto_key_slot_init(kc->cipher_alg,
+	return ovpn_aead_crypto_key_slot_init(cache, kc->cipher_alg,
 					      kc->encrypt.cipher_key,
 					      kc->encrypt.cipher_key_size,
 					      kc->decrypt.cipher_key,
@@ -369,13 +917,16 @@ ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc)
 					      kc->encrypt.nonce_tail_size,
 					      kc->decrypt.nonce_tail,
 					      kc->decrypt.nonce_tail_size,
-					      kc->key_id);
+					      kc->key_id, kc->replay_window);
 }
 
 const struct ovpn_crypto_ops ovpn_aead_ops = {
 	.encrypt     = ovpn_aead_encrypt,
 	.decrypt     = ovpn_aead_decrypt,
+	.encrypt_batch = ovpn_aead_encrypt_batch,
 	.new         = ovpn_aead_crypto_key_slot_new,
 	.destroy     = ovpn_aead_crypto_key_slot_destroy,
 	.encap_overhead = ovpn_aead_encap_overhead,
+	.shrink      = ovpn_aead_crypto_key_slot_shrink,
+	.mem         = ovpn_aead_crypto_key_slot_mem,
 };
@@ -10,6 +10,33 @@
 #ifndef _NET_OVPN_DCO_OVPNAEAD_H_
 #define _NET_OVPN_DCO_OVPNAEAD_H_
 
+#include <uapi/linux/ovpn_dco.h>
+#include <linux/ptr_ring.h>
+#include <linux/workqueue.h>
+
 extern const struct ovpn_crypto_ops ovpn_aead_ops;
 
+#define OVPN_AEAD_CIPHERS (OVPN_CIPHER_ALG_CHACHA20_POLY1305 + 1)
+
+/* Per-interface stock of AEAD transforms allocated ahead of time, so that
+ * installing a key only needs to set it on a ready transform.
+ * Looking an algorithm up and instantiating its transform is the expensive
+ * part of a key install, and happens for two transforms per key.
+ * A cipher is stocked once a key using it has been installed, by refill_work
+ */
+struct ovpn_tfm_cache {
+	struct workqueue_struct *wq;
+	struct work_struct refill_work;
+
+	/* bitmap of the ciphers refill_work keeps stocked */
+	unsigned long ciphers;
+
+	/* transforms without a key, indexed by enum ovpn_cipher_alg */
+	struct ptr_ring tfms[OVPN_AEAD_CIPHERS];
+};
+
+int ovpn_tfm_cache_init(struct ovpn_tfm_cache *cache,
+			struct workqueue_struct *wq);
+void ovpn_tfm_cache_release(struct ovpn_tfm_cache *cache);
+
 #endif /* _NET_OVPN_DCO_OVPNAEAD_H_ */
@@ -47,6 +47,7 @@ static int ovpn_none_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *sk
 			return ret;
 		//ovpn_notify_pktid_wrap_pc(ks->peer, ks->key_id);
 	}
+	OVPN_SKB_CB(skb)->pktid = pktid;
 
 	/* place seq # at the beginning of the packet */
 	__skb_push(skb, sizeof(pktid));
@@ -75,7 +76,8 @@ static int ovpn_none_decrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *sk
 
 	/* PID sits after the op */
 	pid = (__force __be32 *)(skb->data + opsize);
-	ret = ovpn_pktid_recv(&ks->pid_recv, ntohl(*pid), 0);
+	OVPN_SKB_CB(skb)->pktid = ntohl(*pid);
+	ret = ovpn_pktid_recv(&ks->pid_recv, OVPN_SKB_CB(skb)->pktid, 0);
 	if (unlikely(ret < 0))
 		return ret;
 
@@ -90,12 +92,21 @@ static void ovpn_none_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks)
 	if (!ks)
 		return;
 
+	ovpn_pktid_recv_release(&ks->pid_recv);
 	kfree(ks);
 }
 
-static struct ovpn_crypto_key_slot *ovpn_none_crypto_key_slot_new(const struct ovpn_key_config *kc)
+static size_t ovpn_none_crypto_key_slot_mem(const struct ovpn_crypto_key_slot *ks)
+{
+	return sizeof(*ks) + ovpn_pktid_recv_mem(&ks->pid_recv);
+}
+
+static struct ovpn_crypto_key_slot *
+ovpn_none_crypto_key_slot_new(const struct ovpn_key_config *kc,
+			      struct ovpn_tfm_cache *cache)
 {
 	struct ovpn_crypto_key_slot *ks;
+	int ret;
 
 	/* validate crypto alg */
 	if (kc->cipher_alg != OVPN_CIPHER_ALG_NONE)
@@ -107,12 +118,17 @@ static struct ovpn_crypto_key_slot *ovpn_none_crypto_key_slot_new(const struct o
 		return ERR_PTR(-ENOMEM);
 
 	ks->ops = &ovpn_none_ops;
+	ks->async = false;
 	kref_init(&ks->refcount);
 	ks->key_id = kc->key_id;
 
 	/* init packet ID generation/validation */
 	ovpn_pktid_xmit_init(&ks->pid_xmit);
-	ovpn_pktid_recv_init(&ks->pid_recv);
+	ret = ovpn_pktid_recv_init(&ks->pid_recv, kc->replay_window);
+	if (ret < 0) {
+		kfree(ks);
+		return ERR_PTR(ret);
+	}
 
 	return ks;
 }
@@ -123,4 +139,5 @@ const struct ovpn_crypto_ops ovpn_none_ops = {
 	.new         = ovpn_none_crypto_key_slot_new,
 	.destroy     = ovpn_none_crypto_key_slot_destroy,
 	.encap_overhead = ovpn_none_encap_overhead,
+	.mem         = ovpn_none_crypto_key_slot_mem,
 };
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *  Copyright (C) 2015-2019 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ *
+ *  The trie is derived from drivers/net/wireguard/allowedips.c (GPL-2.0)
+ */
+
+#include "main.h"
+#include "addr.h"
+#include "iroute.h"
+#include "peer.h"
+
+#include <linux/bitops.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/slab.h>
+#include <net/ipv6.h>
+
+/* The trie is a path-compressed binary trie (the same layout used by
+ * WireGuard's allowedips, which it is derived from): each node stores a
+ * prefix and the index of the bit following it, which is used to pick the
+ * child to descend into.
+ *
+ * Readers walk the trie under RCU, while writers are serialized by the lock
+ * passed by the caller (i.e. the lock protecting the peer tables).
+ */
+
+#define OVPN_IROUTE_ROOT_BIT 2
+
+static void ovpn_iroute_swap_endian(u8 *dst, const u8 *src, u8 bits)
+{
+	if (bits == 32) {
+		*(u32 *)dst = be32_to_cpu(*(const __be32 *)src);
+	} else if (bits == 128) {
+		((u64 *)dst)[0] = be64_to_cpu(((const __be64 *)src)[0]);
+		((u64 *)dst)[1] = be64_to_cpu(((const __be64 *)src)[1]);
+	}
+}
+
+static void ovpn_iroute_copy_cidr(struct ovpn_iroute_node *node,
+				  const u8 *src, u8 cidr, u8 bits)
+{
+	node->cidr = cidr;
+	node->bit_at_a = cidr / 8U;
+#ifdef __LITTLE_ENDIAN
+	node->bit_at_a ^= (bits / 8U - 1U) % 8U;
+#endif
+	node->bit_at_b = 7U - (cidr % 8U);
+	node->bitlen = bits;
+	memcpy(node->bits, src, bits / 8U);
+}
+
+static u8 ovpn_iroute_choose(const struct ovpn_iroute_node *node,
+			     const u8 *key)
+{
+	return (key[node->bit_at_a] >> node->bit_at_b) & 1;
+}
+
+static unsigned int ovpn_fls128(u64 a, u64 b)
+{
+	return a ? fls64(a) + 64U : fls64(b);
+}
+
+static u8 ovpn_iroute_common_bits(const struct ovpn_iroute_node *node,
+				  const u8 *key, u8 bits)
+{
+	if (bits == 32)
+		return 32U - fls(*(const u32 *)node->bits ^ *(const u32 *)key);
+	else if (bits == 128)
+		return 128U - ovpn_fls128(*(const u64 *)&node->bits[0] ^
+					  *(const u64 *)&key[0],
+					  *(const u64 *)&node->bits[8] ^
+					  *(const u64 *)&key[8]);
+	return 0;
+}
+
+static bool ovpn_iroute_prefix_matches(const struct ovpn_iroute_node *node,
+				       const u8 *key, u8 bits)
+{
+	return ovpn_iroute_common_bits(node, key, bits) >= node->cidr;
+}
+
+/* find the most specific node with a peer attached matching key */
+static struct ovpn_iroute_node *
+ovpn_iroute_find(struct ovpn_iroute_node *trie, u8 bits, const u8 *key)
+{
+	struct ovpn_iroute_node *node = trie, *found = NULL;
+
+	while (node && ovpn_iroute_prefix_matches(node, key, bits)) {
+		if (rcu_access_pointer(node->peer))
+			found = node;
+		if (node->cidr == bits)
+			break;
+		node = rcu_dereference(node->bit[ovpn_iroute_choose(node, key)]);
+	}
+
+	return found;
+}
+
+static struct ovpn_peer *
+ovpn_iroute_lookup_key(struct ovpn_iroute_node __rcu **root, u8 bits,
+		       const void *be_ip)
+{
+	u8 ip[16] __aligned(__alignof__(u64));
+	struct ovpn_iroute_node *node;
+	struct ovpn_peer *peer = NULL;
+
+	ovpn_iroute_swap_endian(ip, be_ip, bits);
+
+	rcu_read_lock();
+	node = ovpn_iroute_find(rcu_dereference(*root), bits, ip);
+	if (node) {
+		peer = rcu_dereference(node->peer);
+		if (peer && !ovpn_peer_hold(peer))
+			peer = NULL;
+	}
+	rcu_read_unlock();
+
+	return peer;
+}
+
+/* Lookup the peer owning the most specific iroute matching the destination
+ * of an outgoing packet.
+ * Can be called in softirq context and returns the peer with a reference held.
+ */
+struct ovpn_peer *ovpn_iroute_lookup(struct ovpn_iroutes *iroutes,
+				     struct sk_buff *skb)
+{
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		return ovpn_iroute_lookup_key(&iroutes->root4, 32,
+					      &ip_hdr(skb)->daddr);
+#if IS_ENABLED(CONFIG_IPV6)
+	case htons(ETH_P_IPV6):
+		return ovpn_iroute_lookup_key(&iroutes->root6, 128,
+					      &ipv6_hdr(skb)->daddr);
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/* find the deepest node whose prefix includes key/cidr.
+ * Return true if the node found has exactly the prefix key/cidr
+ */
+static bool ovpn_iroute_placement(struct ovpn_iroute_node __rcu **trie,
+				  const u8 *key, u8 cidr, u8 bits,
+				  struct ovpn_iroute_node **rnode,
+				  spinlock_t *lock)
+{
+	struct ovpn_iroute_node *node, *parent = NULL;
+	bool exact = false;
+
+	node = rcu_dereference_protected(*trie, lockdep_is_held(lock));
+	while (node && node->cidr <= cidr &&
+	       ovpn_iroute_prefix_matches(node, key, bits)) {
+		parent = node;
+		if (parent->cidr == cidr) {
+			exact = true;
+			break;
+		}
+		node = rcu_dereference_protected(parent->bit[ovpn_iroute_choose(parent, key)],
+						 lockdep_is_held(lock));
+	}
+
+	*rnode = parent;
+	return exact;
+}
+
+static void ovpn_iroute_connect(struct ovpn_iroute_node __rcu **parent, u8 bit,
+				struct ovpn_iroute_node *node)
+{
+	node->parent_bit_packed = (unsigned long)parent | bit;
+	rcu_assign_pointer(*parent, node);
+}
+
+static void ovpn_iroute_choose_and_connect(struct ovpn_iroute_node *parent,
+					   struct ovpn_iroute_node *node)
+{
+	u8 bit = ovpn_iroute_choose(parent, node->bits);
+
+	ovpn_iroute_connect(&parent->bit[bit], bit, node);
+}
+
+static int ovpn_iroute_add(struct ovpn_iroute_node __rcu **trie, u8 bits,
+			   const u8 *key, u8 cidr, struct ovpn_peer *peer,
+			   spinlock_t *lock)
+{
+	struct ovpn_iroute_node *node, *parent, *down, *newnode, *mid;
+	int ret = 0;
+
+	/* the trie is modified with a spinlock held, therefore all the nodes
+	 * that may be needed are allocated upfront
+	 */
+	newnode = kzalloc(sizeof(*newnode), GFP_KERNEL);
+	mid = kzalloc(sizeof(*mid), GFP_KERNEL);
+	if (!newnode || !mid) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	spin_lock_bh(lock);
+	/* routes pointing to a peer being removed would never be released */
+	if (peer->halt) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	if (!rcu_access_pointer(*trie)) {
+		RCU_INIT_POINTER(newnode->peer, peer);
+		list_add_tail(&newnode->peer_list, &peer->iroutes);
+		ovpn_iroute_copy_cidr(newnode, key, cidr, bits);
+		ovpn_iroute_connect(trie, OVPN_IROUTE_ROOT_BIT, newnode);
+		newnode = NULL;
+		goto unlock;
+	}
+
+	/* same prefix already known: simply point it to the new peer */
+	if (ovpn_iroute_placement(trie, key, cidr, bits, &node, lock)) {
+		rcu_assign_pointer(node->peer, peer);
+		list_move_tail(&node->peer_list, &peer->iroutes);
+		goto unlock;
+	}
+
+	RCU_INIT_POINTER(newnode->peer, peer);
+	list_add_tail(&newnode->peer_list, &peer->iroutes);
+	ovpn_iroute_copy_cidr(newnode, key, cidr, bits);
+
+	if (!node) {
+		down = rcu_dereference_protected(*trie, lockdep_is_held(lock));
+	} else {
+		const u8 bit = ovpn_iroute_choose(node, key);
+
+		down = rcu_dereference_protected(node->bit[bit],
+						 lockdep_is_held(lock));
+		if (!down) {
+			ovpn_iroute_connect(&node->bit[bit], bit, newnode);
+			newnode = NULL;
+			goto unlock;
+		}
+	}
+	cidr = min(cidr, ovpn_iroute_common_bits(down, key, bits));
+	parent = node;
+
+	if (newnode->cidr == cidr) {
+		ovpn_iroute_choose_and_connect(newnode, down);
+		if (!parent)
+			ovpn_iroute_connect(trie, OVPN_IROUTE_ROOT_BIT, newnode);
+		else
+			ovpn_iroute_choose_and_connect(parent, newnode);
+		newnode = NULL;
+		goto unlock;
+	}
+
+	/* the new prefix and the existing subtree diverge: join them through
+	 * an intermediate node carrying their common prefix
+	 */
+	INIT_LIST_HEAD(&mid->peer_list);
+	ovpn_iroute_copy_cidr(mid, newnode->bits, cidr, bits);
+
+	ovpn_iroute_choose_and_connect(mid, down);
+	ovpn_iroute_choose_and_connect(mid, newnode);
+	if (!parent)
+		ovpn_iroute_connect(trie, OVPN_IROUTE_ROOT_BIT, mid);
+	else
+		ovpn_iroute_choose_and_connect(parent, mid);
+	newnode = NULL;
+	mid = NULL;
+unlock:
+	spin_unlock_bh(lock);
+out:
+	kfree(newnode);
+	kfree(mid);
+	return ret;
+}
+
+static void ovpn_iroute_remove_node(struct ovpn_iroute_node *node,
+				    spinlock_t *lock)
+{
+	struct ovpn_iroute_node __rcu **parent_bit;
+	struct ovpn_iroute_node *child, *parent;
+	bool free_parent;
+
+	list_del_init(&node->peer_list);
+	RCU_INIT_POINTER(node->peer, NULL);
+
+	/* nodes with two children are still needed to reach their subtree */
+	if (rcu_access_pointer(node->bit[0]) &&
+	    rcu_access_pointer(node->bit[1]))
+		return;
+
+	child = rcu_dereference_protected(node->bit[!rcu_access_pointer(node->bit[0])],
+					  lockdep_is_held(lock));
+	if (child)
+		child->parent_bit_packed = node->parent_bit_packed;
+	parent_bit = (struct ovpn_iroute_node __rcu **)(node->parent_bit_packed & ~3UL);
+	rcu_assign_pointer(*parent_bit, child);
+	parent = (void *)parent_bit -
+		 offsetof(struct ovpn_iroute_node,
+			  bit[node->parent_bit_packed & 1]);
+
+	/* a leaf node was removed: if its parent is a mere junction, it is
+	 * now left with only one child and can be removed as well
+	 */
+	free_parent = !rcu_access_pointer(node->bit[0]) &&
+		      !rcu_access_pointer(node->bit[1]) &&
+		      (node->parent_bit_packed & 3) < OVPN_IROUTE_ROOT_BIT &&
+		      !rcu_access_pointer(parent->peer);
+	if (free_parent)
+		child = rcu_dereference_protected(parent->bit[!(node->parent_bit_packed & 1)],
+						  lockdep_is_held(lock));
+	kfree_rcu(node, rcu);
+	if (!free_parent)
+		return;
+
+	if (child)
+		child->parent_bit_packed = parent->parent_bit_packed;
+	parent_bit = (struct ovpn_iroute_node __rcu **)(parent->parent_bit_packed & ~3UL);
+	rcu_assign_pointer(*parent_bit, child);
+	kfree_rcu(parent, rcu);
+}
+
+static int ovpn_iroute_del(struct ovpn_iroute_node __rcu **trie, u8 bits,
+			   const u8 *key, u8 cidr, struct ovpn_peer *peer,
+			   spinlock_t *lock)
+{
+	struct ovpn_iroute_node *node;
+	int ret = -ENOENT;
+
+	spin_lock_bh(lock);
+	if (ovpn_iroute_placement(trie, key, cidr, bits, &node, lock) &&
+	    rcu_access_pointer(node->peer) == peer) {
+		ovpn_iroute_remove_node(node, lock);
+		ret = 0;
+	}
+	spin_unlock_bh(lock);
+
+	return ret;
+}
+
+void ovpn_iroutes_init(struct ovpn_iroutes *iroutes)
+{
+	RCU_INIT_POINTER(iroutes->root4, NULL);
+	RCU_INIT_POINTER(iroutes->root6, NULL);
+}
+
+int ovpn_iroute_add_ipv4(struct ovpn_iroutes *iroutes, __be32 addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock)
+{
+	u8 key[4] __aligned(__alignof__(u32));
+
+	if (cidr > 32)
+		return -EINVAL;
+
+	addr = ovpn_ipv4_network_addr(addr, cidr);
+	ovpn_iroute_swap_endian(key, (const u8 *)&addr, 32);
+
+	return ovpn_iroute_add(&iroutes->root4, 32, key, cidr, peer, lock);
+}
+
+int ovpn_iroute_add_ipv6(struct ovpn_iroutes *iroutes,
+			 const struct in6_addr *addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock)
+{
+	u8 key[16] __aligned(__alignof__(u64));
+	struct in6_addr prefix;
+
+	if (cidr > 128)
+		return -EINVAL;
+
+	ipv6_addr_prefix(&prefix, addr, cidr);
+	ovpn_iroute_swap_endian(key, (const u8 *)&prefix, 128);
+
+	return ovpn_iroute_add(&iroutes->root6, 128, key, cidr, peer, lock);
+}
+
+int ovpn_iroute_del_ipv4(struct ovpn_iroutes *iroutes, __be32 addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock)
+{
+	u8 key[4] __aligned(__alignof__(u32));
+
+	if (cidr > 32)
+		return -EINVAL;
+
+	addr = ovpn_ipv4_network_addr(addr, cidr);
+	ovpn_iroute_swap_endian(key, (const u8 *)&addr, 32);
+
+	return ovpn_iroute_del(&iroutes->root4, 32, key, cidr, peer, lock);
+}
+
+int ovpn_iroute_del_ipv6(struct ovpn_iroutes *iroutes,
+			 const struct in6_addr *addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock)
+{
+	u8 key[16] __aligned(__alignof__(u64));
+	struct in6_addr prefix;
+
+	if (cidr > 128)
+		return -EINVAL;
+
+	ipv6_addr_prefix(&prefix, addr, cidr);
+	ovpn_iroute_swap_endian(key, (const u8 *)&prefix, 128);
+
+	return ovpn_iroute_del(&iroutes->root6, 128, key, cidr, peer, lock);
+}
+
+/* Remove all the iroutes pointing to a peer. Must be called with the lock
+ * serializing writers held
+ */
+void ovpn_iroute_del_by_peer(struct ovpn_peer *peer, spinlock_t *lock)
+	__must_hold(lock)
+{
+	struct ovpn_iroute_node *node, *tmp;
+
+	list_for_each_entry_safe(node, tmp, &peer->iroutes, peer_list)
+		ovpn_iroute_remove_node(node, lock);
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNIROUTE_H_
+#define _NET_OVPN_DCO_OVPNIROUTE_H_
+
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct ovpn_peer;
+
+/* Node of the path-compressed binary trie used to map VPN destinations to
+ * peers. Lookups only touch the first cache line of each node, therefore
+ * rarely used members are kept at the bottom.
+ */
+struct ovpn_iroute_node {
+	struct ovpn_peer __rcu *peer;
+	struct ovpn_iroute_node __rcu *bit[2];
+	u8 cidr, bit_at_a, bit_at_b, bitlen;
+	/* address in host byte order, so that it can be passed to fls/fls64 */
+	u8 bits[16] __aligned(__alignof__(u64));
+
+	/* pointer to the parent slot pointing to this node. Its lowest two
+	 * bits store the index of the slot (0 or 1) or 2 for the root
+	 */
+	unsigned long parent_bit_packed;
+	union {
+		/* entry in the peer->iroutes list */
+		struct list_head peer_list;
+		struct rcu_head rcu;
+	};
+};
+
+/* iroute (i.e. networks reachable via a specific peer) tables */
+struct ovpn_iroutes {
+	struct ovpn_iroute_node __rcu *root4;
+	struct ovpn_iroute_node __rcu *root6;
+};
+
+void ovpn_iroutes_init(struct ovpn_iroutes *iroutes);
+
+int ovpn_iroute_add_ipv4(struct ovpn_iroutes *iroutes, __be32 addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock);
+int ovpn_iroute_add_ipv6(struct ovpn_iroutes *iroutes,
+			 const struct in6_addr *addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock);
+int ovpn_iroute_del_ipv4(struct ovpn_iroutes *iroutes, __be32 addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock);
+int ovpn_iroute_del_ipv6(struct ovpn_iroutes *iroutes,
+			 const struct in6_addr *addr, u8 cidr,
+			 struct ovpn_peer *peer, spinlock_t *lock);
+void ovpn_iroute_del_by_peer(struct ovpn_peer *peer, spinlock_t *lock)
+	__must_hold(lock);
+
+struct ovpn_peer *ovpn_iroute_lookup(struct ovpn_iroutes *iroutes,
+				     struct sk_buff *skb);
+
+#endif /* _NET_OVPN_DCO_OVPNIROUTE_H_ */
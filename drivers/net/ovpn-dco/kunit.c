@@ -0,0 +1,805 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+/* KUnit tests of the per-packet primitives. Besides checking correctness,
+ * each primitive can be benchmarked on 1, 2, 4, ... up to all online CPUs at
+ * once, working on shared state as the datapath does, and the time per
+ * operation and aggregated rate are reported with kunit_info().
+ * The benchmarks keep every CPU busy for a while, so they only run when the
+ * kunit_bench module parameter is set
+ */
+
+#include "main.h"
+#include "bind.h"
+#include "crypto.h"
+#include "crypto_aead.h"
+#include "peer.h"
+#include "pktid.h"
+#include "proto.h"
+#include "skb.h"
+#include "stats_counters.h"
+
+#include <kunit/test.h>
+#include <linux/cpu.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/skbuff.h>
+#include <linux/workqueue.h>
+
+/* operations timed by each worker of a benchmark run */
+#define OVPN_KUNIT_ITERS 100000
+
+/* payload of the packets used by the AEAD tests */
+#define OVPN_KUNIT_PAYLOAD 1400
+
+struct ovpn_kunit_bench;
+
+struct ovpn_kunit_worker {
+	struct work_struct work;
+	struct ovpn_kunit_bench *bench;
+	/* index of the worker within the run */
+	unsigned int idx;
+	/* per-worker state, set up by bench->init */
+	void *priv;
+	/* time taken by the OVPN_KUNIT_ITERS operations */
+	u64 ns;
+};
+
+struct ovpn_kunit_bench {
+	const char *name;
+	/* run one operation, iter counting from 0 on each worker */
+	void (*op)(struct ovpn_kunit_worker *w, unsigned int iter);
+	/* optional: set up and release the per-worker state */
+	int (*init)(struct kunit *test, struct ovpn_kunit_worker *w);
+	void (*exit)(struct ovpn_kunit_worker *w);
+	/* state shared by the workers */
+	void *data;
+
+	/* number of workers of the current run, and of the run itself */
+	unsigned int workers;
+	unsigned int run;
+	atomic_t ready;
+};
+
+static void ovpn_kunit_bench_work(struct work_struct *work)
+{
+	struct ovpn_kunit_worker *w = container_of(work,
+						   struct ovpn_kunit_worker,
+						   work);
+	struct ovpn_kunit_bench *b = w->bench;
+	unsigned int i;
+	u64 start;
+
+	/* start together with the other workers, so that they contend */
+	atomic_inc(&b->ready);
+	while (atomic_read(&b->ready) < b->workers)
+		cpu_relax();
+
+	start = ktime_get_ns();
+	for (i = 0; i < OVPN_KUNIT_ITERS; i++) {
+		b->op(w, i);
+
+		if (!(i % 1024))
+			cond_resched();
+	}
+	w->ns = ktime_get_ns() - start;
+}
+
+/* Run b on 1, 2, 4, ... and finally all online CPUs, one worker per CPU */
+static void ovpn_kunit_bench(struct kunit *test, struct ovpn_kunit_bench *b)
+{
+	unsigned int cpu, i, n, max = num_online_cpus();
+	struct ovpn_kunit_worker *w;
+	u64 ns, kops;
+
+	w = kunit_kcalloc(test, max, sizeof(*w), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, w);
+
+	for (i = 0; i < max; i++) {
+		w[i].bench = b;
+		w[i].idx = i;
+		INIT_WORK(&w[i].work, ovpn_kunit_bench_work);
+
+		if (b->init && b->init(test, &w[i]) < 0) {
+			KUNIT_FAIL(test, "%s: cannot set up worker %u\n",
+				   b->name, i);
+			max = i;
+			goto out;
+		}
+	}
+
+	cpus_read_lock();
+	for (n = 1, b->run = 1; ; n = min(n * 2, max), b->run++) {
+		b->workers = n;
+		atomic_set(&b->ready, 0);
+
+		i = 0;
+		for_each_online_cpu(cpu) {
+			if (i == n)
+				break;
+			queue_work_on(cpu, system_highpri_wq, &w[i++].work);
+		}
+
+		ns = 0;
+		for (i = 0; i < n; i++) {
+			flush_work(&w[i].work);
+			ns += w[i].ns;
+		}
+
+		/* all the workers run in parallel: the aggregated rate is
+		 * n * OVPN_KUNIT_ITERS operations over the average worker time
+		 */
+		ns = max_t(u64, ns, 1);
+		kops = div64_u64((u64)n * n * OVPN_KUNIT_ITERS * USEC_PER_SEC,
+				 ns);
+		kunit_info(test, "%s: %u CPUs, %llu ns/op, %llu kops/s\n",
+			   b->name, n,
+			   div64_u64(ns, (u64)n * OVPN_KUNIT_ITERS), kops);
+
+		if (n == max)
+			break;
+	}
+	cpus_read_unlock();
+
+out:
+	for (i = 0; b->exit && i < max; i++)
+		b->exit(&w[i]);
+}
+
+/* packet IDs */
+
+static void ovpn_kunit_pktid_xmit(struct kunit *test)
+{
+	struct ovpn_pktid_xmit pid;
+	u32 pktid;
+
+	ovpn_pktid_xmit_init(&pid);
+
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_xmit_next(&pid, &pktid));
+	KUNIT_EXPECT_EQ(test, 1U, pktid);
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_xmit_next(&pid, &pktid));
+	KUNIT_EXPECT_EQ(test, 2U, pktid);
+
+	/* a batch reservation returns its last ID */
+	KUNIT_EXPECT_EQ(test, 18ULL, ovpn_pktid_xmit_reserve(&pid, 16));
+
+	/* userspace is warned exactly once before the IDs run out */
+	atomic64_set(&pid.seq_num, PKTID_WRAP_WARN - 1);
+	KUNIT_EXPECT_EQ(test, -1, ovpn_pktid_xmit_next(&pid, &pktid));
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_xmit_next(&pid, &pktid));
+
+	atomic64_set(&pid.seq_num, 0xffffffffULL - 1);
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_xmit_next(&pid, &pktid));
+	KUNIT_EXPECT_EQ(test, 0xffffffffU, pktid);
+	KUNIT_EXPECT_EQ(test, -E2BIG, ovpn_pktid_xmit_next(&pid, &pktid));
+}
+
+static void ovpn_kunit_pktid_recv(struct kunit *test)
+{
+	struct ovpn_pktid_recv pr;
+	u32 id;
+
+	KUNIT_ASSERT_EQ(test, 0, ovpn_pktid_recv_init(&pr, 64));
+
+	KUNIT_EXPECT_EQ(test, -EINVAL, ovpn_pktid_recv(&pr, 0, 0));
+
+	for (id = 1; id <= 100; id++)
+		KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, id, 0));
+
+	/* replays */
+	KUNIT_EXPECT_EQ(test, -ESTALE, ovpn_pktid_recv(&pr, 100, 0));
+	KUNIT_EXPECT_EQ(test, -ESTALE, ovpn_pktid_recv(&pr, 50, 0));
+
+	/* gaps can be filled once, within the window only */
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, 200, 0));
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, 137, 0));
+	KUNIT_EXPECT_EQ(test, -ESTALE, ovpn_pktid_recv(&pr, 137, 0));
+	KUNIT_EXPECT_EQ(test, -ESTALE, ovpn_pktid_recv(&pr, 136, 0));
+
+	/* slots recycled for newer IDs keep tracking the ones in the window */
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, 263, 0));
+	KUNIT_EXPECT_EQ(test, -ESTALE, ovpn_pktid_recv(&pr, 200, 0));
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, 201, 0));
+
+	/* a new time stamp resets the state, an older one is rejected */
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, 1, 1));
+	KUNIT_EXPECT_EQ(test, -ETIME, ovpn_pktid_recv(&pr, 2, 0));
+	KUNIT_EXPECT_EQ(test, 0, ovpn_pktid_recv(&pr, 2, 1));
+
+	KUNIT_EXPECT_EQ(test, 7LL, atomic64_read(&pr.drops));
+
+	ovpn_pktid_recv_release(&pr);
+
+	KUNIT_EXPECT_EQ(test, -EINVAL,
+			ovpn_pktid_recv_init(&pr, REPLAY_WINDOW_MAX + 1));
+}
+
+static void ovpn_kunit_pktid_xmit_op(struct ovpn_kunit_worker *w,
+				     unsigned int iter)
+{
+	u32 pktid;
+
+	ovpn_pktid_xmit_next(w->bench->data, &pktid);
+}
+
+static void ovpn_kunit_pktid_recv_op(struct ovpn_kunit_worker *w,
+				     unsigned int iter)
+{
+	struct ovpn_kunit_bench *b = w->bench;
+
+	/* interleave the IDs of the workers, as when the packets of a peer
+	 * are spread across CPUs. A new time stamp per run resets the window
+	 */
+	ovpn_pktid_recv(b->data, iter * b->workers + w->idx + 1, b->run);
+}
+
+static void ovpn_kunit_pktid_bench(struct kunit *test)
+{
+	struct ovpn_kunit_bench b = {
+		.name = "ovpn_pktid_xmit_next",
+		.op = ovpn_kunit_pktid_xmit_op,
+	};
+	struct ovpn_pktid_xmit pid;
+	struct ovpn_pktid_recv pr;
+
+	ovpn_pktid_xmit_init(&pid);
+	b.data = &pid;
+	ovpn_kunit_bench(test, &b);
+
+	KUNIT_ASSERT_EQ(test, 0, ovpn_pktid_recv_init(&pr, 0));
+	b.name = "ovpn_pktid_recv";
+	b.op = ovpn_kunit_pktid_recv_op;
+	b.data = &pr;
+	ovpn_kunit_bench(test, &b);
+	ovpn_pktid_recv_release(&pr);
+}
+
+/* stats counters */
+
+static void ovpn_kunit_stats(struct kunit *test)
+{
+	struct ovpn_peer_stat rx, tx;
+	struct ovpn_peer_stats ps;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, 0, ovpn_peer_stats_init(&ps));
+
+	for (i = 0; i < 3; i++)
+		KUNIT_EXPECT_FALSE(test, ovpn_peer_stats_increment(&ps, true,
+								    100));
+	KUNIT_EXPECT_FALSE(test, ovpn_peer_stats_increment(&ps, false, 50));
+
+	ovpn_peer_stats_fold(&ps, &rx, &tx);
+	KUNIT_EXPECT_EQ(test, 3ULL, rx.packets);
+	KUNIT_EXPECT_EQ(test, 300ULL, rx.bytes);
+	KUNIT_EXPECT_EQ(test, 1ULL, tx.packets);
+	KUNIT_EXPECT_EQ(test, 50ULL, tx.bytes);
+
+	ovpn_peer_stats_release(&ps);
+}
+
+static void ovpn_kunit_stats_op(struct ovpn_kunit_worker *w,
+				unsigned int iter)
+{
+	ovpn_peer_stats_increment(w->bench->data, iter & 1, 1000);
+}
+
+static void ovpn_kunit_stats_bench(struct kunit *test)
+{
+	struct ovpn_kunit_bench b = {
+		.name = "ovpn_peer_stats_increment",
+		.op = ovpn_kunit_stats_op,
+	};
+	struct ovpn_peer_stats ps;
+
+	KUNIT_ASSERT_EQ(test, 0, ovpn_peer_stats_init(&ps));
+	b.data = &ps;
+	ovpn_kunit_bench(test, &b);
+	ovpn_peer_stats_release(&ps);
+}
+
+/* transport bindings */
+
+#define OVPN_KUNIT_LOCAL	htonl(0x0a000001)
+#define OVPN_KUNIT_REMOTE	htonl(0x0a000002)
+#define OVPN_KUNIT_LPORT	htons(1194)
+#define OVPN_KUNIT_RPORT	htons(50000)
+
+/* UDP/IPv4 packet received by OVPN_KUNIT_LOCAL from OVPN_KUNIT_REMOTE */
+static struct sk_buff *ovpn_kunit_udp4_skb(void)
+{
+	struct sk_buff *skb;
+	struct udphdr *uh;
+	struct iphdr *iph;
+
+	skb = alloc_skb(sizeof(*iph) + sizeof(*uh), GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb->protocol = htons(ETH_P_IP);
+	skb_reset_network_header(skb);
+	iph = skb_put_zero(skb, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) >> 2;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = OVPN_KUNIT_REMOTE;
+	iph->daddr = OVPN_KUNIT_LOCAL;
+
+	skb_set_transport_header(skb, sizeof(*iph));
+	uh = skb_put_zero(skb, sizeof(*uh));
+	uh->source = OVPN_KUNIT_RPORT;
+	uh->dest = OVPN_KUNIT_LPORT;
+
+	return skb;
+}
+
+static struct ovpn_bind *ovpn_kunit_bind4(void)
+{
+	struct ovpn_sockaddr_pair sapair = {
+		.local = {
+			.family = AF_INET,
+			.u.in4 = {
+				.sin_family = AF_INET,
+				.sin_addr.s_addr = OVPN_KUNIT_LOCAL,
+				.sin_port = OVPN_KUNIT_LPORT,
+			},
+		},
+		.remote = {
+			.family = AF_INET,
+			.u.in4 = {
+				.sin_family = AF_INET,
+				.sin_addr.s_addr = OVPN_KUNIT_REMOTE,
+				.sin_port = OVPN_KUNIT_RPORT,
+			},
+		},
+	};
+
+	return ovpn_bind_from_sockaddr_pair(&sapair);
+}
+
+static void ovpn_kunit_bind(struct kunit *test)
+{
+	struct ovpn_bind *bind;
+	struct sk_buff *skb;
+
+	bind = ovpn_kunit_bind4();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bind);
+	skb = ovpn_kunit_udp4_skb();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+
+	KUNIT_EXPECT_TRUE(test, ovpn_bind_skb_match(bind, skb));
+	KUNIT_EXPECT_FALSE(test, ovpn_bind_skb_match(NULL, skb));
+
+	udp_hdr(skb)->source = htons(50001);
+	KUNIT_EXPECT_FALSE(test, ovpn_bind_skb_match(bind, skb));
+	udp_hdr(skb)->source = OVPN_KUNIT_RPORT;
+
+	ip_hdr(skb)->daddr = htonl(0x0a000003);
+	KUNIT_EXPECT_FALSE(test, ovpn_bind_skb_match(bind, skb));
+	ip_hdr(skb)->daddr = OVPN_KUNIT_LOCAL;
+
+	skb->protocol = htons(ETH_P_IPV6);
+	KUNIT_EXPECT_FALSE(test, ovpn_bind_skb_match(bind, skb));
+
+	kfree_skb(skb);
+	dst_cache_destroy(&bind->dst_cache);
+	kfree(bind);
+}
+
+struct ovpn_kunit_bind_data {
+	struct ovpn_bind *bind;
+	struct sk_buff *skb;
+};
+
+static void ovpn_kunit_bind_op(struct ovpn_kunit_worker *w, unsigned int iter)
+{
+	struct ovpn_kunit_bind_data *data = w->bench->data;
+
+	ovpn_bind_skb_match(data->bind, data->skb);
+}
+
+static void ovpn_kunit_bind_bench(struct kunit *test)
+{
+	struct ovpn_kunit_bench b = {
+		.name = "ovpn_bind_skb_match",
+		.op = ovpn_kunit_bind_op,
+	};
+	struct ovpn_kunit_bind_data data;
+
+	data.bind = ovpn_kunit_bind4();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data.bind);
+	data.skb = ovpn_kunit_udp4_skb();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data.skb);
+
+	b.data = &data;
+	ovpn_kunit_bench(test, &b);
+
+	kfree_skb(data.skb);
+	dst_cache_destroy(&data.bind->dst_cache);
+	kfree(data.bind);
+}
+
+/* AEAD key slots */
+
+static const u8 ovpn_kunit_key[32] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+};
+
+static const u8 ovpn_kunit_nonce_tail[NONCE_TAIL_SIZE] = {
+	0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+};
+
+/* Key slot encrypting and decrypting with the same key, so that it can
+ * decrypt its own packets. NULL if alg is not available or is handled by an
+ * asynchronous engine, whose completion would need a real peer
+ */
+static struct ovpn_crypto_key_slot *ovpn_kunit_ks_new(struct kunit *test,
+						      enum ovpn_cipher_alg alg)
+{
+	const struct ovpn_key_direction dir = {
+		.cipher_key = ovpn_kunit_key,
+		.cipher_key_size = sizeof(ovpn_kunit_key),
+		.nonce_tail = ovpn_kunit_nonce_tail,
+		.nonce_tail_size = sizeof(ovpn_kunit_nonce_tail),
+	};
+	const struct ovpn_key_config kc = {
+		.cipher_alg = alg,
+		.key_id = 3,
+		.encrypt = dir,
+		.decrypt = dir,
+	};
+	struct ovpn_crypto_key_slot *ks;
+
+	ks = ovpn_aead_ops.new(&kc, NULL);
+	if (IS_ERR(ks)) {
+		kunit_info(test, "cipher %d not available: %ld\n", alg,
+			   PTR_ERR(ks));
+		return NULL;
+	}
+
+	if (ks->async) {
+		kunit_info(test, "cipher %d is asynchronous, skipped\n", alg);
+		ovpn_crypto_key_slot_put(ks);
+		return NULL;
+	}
+
+	ks->remote_peer_id = 42;
+
+	return ks;
+}
+
+/* the datapath uses key slots in an RCU read-side critical section, with
+ * bottom halves disabled
+ */
+static int ovpn_kunit_encrypt(struct ovpn_crypto_key_slot *ks,
+			      struct sk_buff *skb)
+{
+	int ret;
+
+	rcu_read_lock_bh();
+	ret = ks->ops->encrypt(ks, skb);
+	rcu_read_unlock_bh();
+
+	return ret;
+}
+
+static int ovpn_kunit_decrypt(struct ovpn_crypto_key_slot *ks,
+			      struct sk_buff *skb)
+{
+	int ret;
+
+	rcu_read_lock_bh();
+	ret = ks->ops->decrypt(ks, skb, ovpn_op32_from_skb(skb, NULL));
+	rcu_read_unlock_bh();
+
+	return ret;
+}
+
+/* peer the packets are accounted to */
+static struct ovpn_peer *ovpn_kunit_peer_new(struct kunit *test)
+{
+	struct ovpn_peer *peer;
+
+	peer = kunit_kzalloc(test, sizeof(*peer), GFP_KERNEL);
+	if (!peer || ovpn_peer_stats_init(&peer->stats) < 0)
+		return NULL;
+
+	return peer;
+}
+
+static struct sk_buff *ovpn_kunit_skb_linear(struct ovpn_peer *peer,
+					     const u8 *payload, unsigned int len)
+{
+	struct sk_buff *skb;
+
+	skb = alloc_skb(OVPN_HEAD_ROOM + 64 + len, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, OVPN_HEAD_ROOM + 64);
+	skb_put_data(skb, payload, len);
+	OVPN_SKB_CB(skb)->peer = peer;
+
+	return skb;
+}
+
+/* skb carrying all but the first 64 bytes of payload in a page fragment */
+static struct sk_buff *ovpn_kunit_skb_fragged(struct ovpn_peer *peer,
+					      const u8 *payload,
+					      unsigned int len)
+{
+	struct sk_buff *skb;
+	struct page *page;
+
+	skb = ovpn_kunit_skb_linear(peer, payload, 64);
+	if (!skb)
+		return NULL;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		kfree_skb(skb);
+		return NULL;
+	}
+
+	memcpy(page_address(page), payload + 64, len - 64);
+	skb_fill_page_desc(skb, 0, page, 0, len - 64);
+	skb->len += len - 64;
+	skb->data_len += len - 64;
+	skb->truesize += PAGE_SIZE;
+
+	return skb;
+}
+
+/* encrypt skb with ks and decrypt it back, checking the result at each step */
+static void ovpn_kunit_aead_roundtrip(struct kunit *test,
+				      struct ovpn_crypto_key_slot *ks,
+				      struct sk_buff *skb, const u8 *payload,
+				      unsigned int len)
+{
+	const unsigned int overhead = ks->ops->encap_overhead(ks);
+	u8 *buf;
+
+	buf = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	KUNIT_ASSERT_EQ(test, 0, ovpn_kunit_encrypt(ks, skb));
+	KUNIT_EXPECT_EQ(test, len + overhead, skb->len);
+	KUNIT_EXPECT_EQ(test, ovpn_op32_compose(OVPN_DATA_V2, ks->key_id,
+						ks->remote_peer_id),
+			ovpn_op32_from_skb(skb, NULL));
+
+	KUNIT_ASSERT_EQ(test, 0, skb_copy_bits(skb, overhead, buf, len));
+	KUNIT_EXPECT_NE(test, 0, memcmp(buf, payload, len));
+
+	KUNIT_ASSERT_EQ(test, 0, ovpn_kunit_decrypt(ks, skb));
+	KUNIT_EXPECT_EQ(test, len, skb->len);
+
+	KUNIT_ASSERT_EQ(test, 0, skb_copy_bits(skb, 0, buf, len));
+	KUNIT_EXPECT_EQ(test, 0, memcmp(buf, payload, len));
+}
+
+static u8 *ovpn_kunit_payload(struct kunit *test)
+{
+	u8 *payload;
+	int i;
+
+	payload = kunit_kmalloc(test, OVPN_KUNIT_PAYLOAD, GFP_KERNEL);
+	if (payload)
+		for (i = 0; i < OVPN_KUNIT_PAYLOAD; i++)
+			payload[i] = i;
+
+	return payload;
+}
+
+static void ovpn_kunit_aead(struct kunit *test)
+{
+	static const enum ovpn_cipher_alg algs[] = {
+		OVPN_CIPHER_ALG_AES_GCM,
+		OVPN_CIPHER_ALG_CHACHA20_POLY1305,
+	};
+	struct ovpn_crypto_key_slot *ks;
+	struct sk_buff *skb, *clone;
+	struct ovpn_peer *peer;
+	unsigned int i;
+	u8 *payload;
+	u32 pktid;
+
+	payload = ovpn_kunit_payload(test);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, payload);
+	peer = ovpn_kunit_peer_new(test);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, peer);
+
+	for (i = 0; i < ARRAY_SIZE(algs); i++) {
+		ks = ovpn_kunit_ks_new(test, algs[i]);
+		if (!ks)
+			continue;
+
+		/* linear: encrypted in place */
+		skb = ovpn_kunit_skb_linear(peer, payload, OVPN_KUNIT_PAYLOAD);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+		ovpn_kunit_aead_roundtrip(test, ks, skb, payload,
+					  OVPN_KUNIT_PAYLOAD);
+		kfree_skb(skb);
+
+		/* fragged */
+		skb = ovpn_kunit_skb_fragged(peer, payload, OVPN_KUNIT_PAYLOAD);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+		ovpn_kunit_aead_roundtrip(test, ks, skb, payload,
+					  OVPN_KUNIT_PAYLOAD);
+		kfree_skb(skb);
+
+		/* cloned: the data shared with the original must be left
+		 * untouched
+		 */
+		skb = ovpn_kunit_skb_linear(peer, payload, OVPN_KUNIT_PAYLOAD);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+		clone = skb_clone(skb, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, clone);
+		ovpn_kunit_aead_roundtrip(test, ks, clone, payload,
+					  OVPN_KUNIT_PAYLOAD);
+		KUNIT_EXPECT_EQ(test, 0, memcmp(skb->data, payload,
+						OVPN_KUNIT_PAYLOAD));
+		kfree_skb(clone);
+		kfree_skb(skb);
+
+		/* tampered packets and replays are rejected */
+		skb = ovpn_kunit_skb_linear(peer, payload, OVPN_KUNIT_PAYLOAD);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+		KUNIT_ASSERT_EQ(test, 0, ovpn_kunit_encrypt(ks, skb));
+		skb->data[skb->len - 1] ^= 1;
+		KUNIT_EXPECT_EQ(test, -EBADMSG, ovpn_kunit_decrypt(ks, skb));
+		kfree_skb(skb);
+
+		pktid = atomic64_read(&ks->pid_xmit.seq_num);
+		KUNIT_EXPECT_EQ(test, -ESTALE,
+				ovpn_pktid_recv(&ks->pid_recv, pktid - 1, 0));
+
+		ovpn_crypto_key_slot_put(ks);
+	}
+
+	ovpn_peer_stats_release(&peer->stats);
+}
+
+struct ovpn_kunit_aead_data {
+	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_peer *peer;
+	const u8 *payload;
+	/* a packet encrypted by ks, replayed by the decrypt benchmark */
+	u8 *ciphertext;
+	unsigned int ciphertext_len;
+};
+
+static int ovpn_kunit_aead_init(struct kunit *test,
+				struct ovpn_kunit_worker *w)
+{
+	struct ovpn_kunit_aead_data *data = w->bench->data;
+
+	w->priv = ovpn_kunit_skb_linear(data->peer, data->payload,
+					OVPN_KUNIT_PAYLOAD);
+
+	return w->priv ? 0 : -ENOMEM;
+}
+
+static void ovpn_kunit_aead_exit(struct ovpn_kunit_worker *w)
+{
+	kfree_skb(w->priv);
+}
+
+static void ovpn_kunit_encrypt_op(struct ovpn_kunit_worker *w,
+				  unsigned int iter)
+{
+	struct ovpn_kunit_aead_data *data = w->bench->data;
+	struct sk_buff *skb = w->priv;
+
+	/* encrypt the payload left by the previous iteration again */
+	if (!ovpn_kunit_encrypt(data->ks, skb))
+		__skb_pull(skb, data->ks->ops->encap_overhead(data->ks));
+}
+
+static void ovpn_kunit_decrypt_op(struct ovpn_kunit_worker *w,
+				  unsigned int iter)
+{
+	struct ovpn_kunit_aead_data *data = w->bench->data;
+	struct sk_buff *skb = w->priv;
+
+	/* restore the packet: the copy is part of the measured time. After
+	 * the first iteration the packet is rejected as a replay, which is
+	 * checked only once it has been authenticated
+	 */
+	skb_push(skb, data->ciphertext_len - skb->len);
+	memcpy(skb->data, data->ciphertext, data->ciphertext_len);
+
+	ovpn_kunit_decrypt(data->ks, skb);
+}
+
+static void ovpn_kunit_aead_bench(struct kunit *test)
+{
+	struct ovpn_kunit_bench b = {
+		.init = ovpn_kunit_aead_init,
+		.exit = ovpn_kunit_aead_exit,
+	};
+	struct ovpn_kunit_aead_data data;
+	struct sk_buff *skb;
+
+	data.payload = ovpn_kunit_payload(test);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data.payload);
+	data.peer = ovpn_kunit_peer_new(test);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data.peer);
+	data.ks = ovpn_kunit_ks_new(test, OVPN_CIPHER_ALG_AES_GCM);
+	if (!data.ks)
+		goto out;
+
+	skb = ovpn_kunit_skb_linear(data.peer, data.payload,
+				    OVPN_KUNIT_PAYLOAD);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+	KUNIT_ASSERT_EQ(test, 0, ovpn_kunit_encrypt(data.ks, skb));
+	data.ciphertext = kunit_kmalloc(test, skb->len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data.ciphertext);
+	memcpy(data.ciphertext, skb->data, skb->len);
+	data.ciphertext_len = skb->len;
+	kfree_skb(skb);
+
+	b.data = &data;
+
+	b.name = "ovpn_aead_encrypt (aes-gcm, 1400 bytes)";
+	b.op = ovpn_kunit_encrypt_op;
+	ovpn_kunit_bench(test, &b);
+
+	b.name = "ovpn_aead_decrypt (aes-gcm, 1400 bytes)";
+	b.op = ovpn_kunit_decrypt_op;
+	ovpn_kunit_bench(test, &b);
+
+	ovpn_crypto_key_slot_put(data.ks);
+out:
+	ovpn_peer_stats_release(&data.peer->stats);
+}
+
+static struct kunit_case ovpn_kunit_cases[] = {
+	KUNIT_CASE(ovpn_kunit_pktid_xmit),
+	KUNIT_CASE(ovpn_kunit_pktid_recv),
+	KUNIT_CASE(ovpn_kunit_stats),
+	KUNIT_CASE(ovpn_kunit_bind),
+	KUNIT_CASE(ovpn_kunit_aead),
+	{}
+};
+
+static struct kunit_suite ovpn_kunit_suite = {
+	.name = "ovpn-dco",
+	.test_cases = ovpn_kunit_cases,
+};
+
+static struct kunit_case ovpn_kunit_bench_cases[] = {
+	KUNIT_CASE(ovpn_kunit_pktid_bench),
+	KUNIT_CASE(ovpn_kunit_stats_bench),
+	KUNIT_CASE(ovpn_kunit_bind_bench),
+	KUNIT_CASE(ovpn_kunit_aead_bench),
+	{}
+};
+
+static struct kunit_suite ovpn_kunit_bench_suite = {
+	.name = "ovpn-dco-bench",
+	.test_cases = ovpn_kunit_bench_cases,
+};
+
+static bool kunit_bench;
+module_param(kunit_bench, bool, 0444);
+MODULE_PARM_DESC(kunit_bench, "Run the KUnit benchmarks when loaded");
+
+/* The suites are run when the module is loaded. kunit_test_suite() can't be
+ * used as, in a module, it would define a second module_init()
+ */
+void ovpn_kunit_run(void)
+{
+	kunit_run_tests(&ovpn_kunit_suite);
+
+	if (kunit_bench)
+		kunit_run_tests(&ovpn_kunit_bench_suite);
+}
@@ -12,6 +12,7 @@
 #include "ovpn.h"
 #include "ovpnstruct.h"
 #include "netlink.h"
+#include "udp.h"
 
 #include <linux/ethtool.h>
 #include <linux/genetlink.h>
@@ -37,14 +38,30 @@ static void ovpn_struct_free(struct net_device *net)
 {
 	struct ovpn_struct *ovpn = netdev_priv(net);
 
+	/* the keepalive and idle scans use the peers, the socket and the
+	 * counters: stop them before tearing any of those down
+	 */
+	cancel_delayed_work_sync(&ovpn->keepalive_work);
+	cancel_delayed_work_sync(&ovpn->idle_work);
+	ovpn_udp_filter_release(ovpn);
+	ovpn_sock_release_reuseport(ovpn);
 	ovpn_sock_detach(ovpn->sock);
 	security_tun_dev_free_security(ovpn->security);
 	free_percpu(net->tstats);
+	cancel_work_sync(&ovpn->ctrl_work);
+	skb_queue_purge(&ovpn->ctrl_queue);
+	ovpn_tfm_cache_release(&ovpn->tfm_cache);
 	flush_workqueue(ovpn->crypto_wq);
 	flush_workqueue(ovpn->events_wq);
 	destroy_workqueue(ovpn->crypto_wq);
 	destroy_workqueue(ovpn->events_wq);
+	ovpn_crypto_parallel_release(ovpn);
+	ovpn_tx_multiqueue_release(ovpn);
+	ovpn_rxqs_release(ovpn);
+	ovpn_udp_ctrl_ratelimit_release(ovpn);
+	free_percpu(ovpn->dp_stats);
 	rcu_barrier();
+	kvfree(ovpn->peers);
 }
 
 static int ovpn_net_init(struct net_device *dev)
@@ -74,8 +91,10 @@ static int ovpn_net_stop(struct net_device *dev)
 
 static int ovpn_net_change_mtu(struct net_device *dev, int new_mtu)
 {
+	/* encapsulated packets must still fit the largest IP packet */
 	if (new_mtu < IPV4_MIN_MTU ||
-	    new_mtu + dev->hard_header_len > IP_MAX_MTU)
+	    new_mtu + dev->hard_header_len + OVPN_MAX_ENCAP_OVERHEAD >
+	    IP_MAX_MTU)
 		return -EINVAL;
 
 	dev->mtu = new_mtu;
@@ -110,6 +129,117 @@ static void ovpn_get_drvinfo(struct net_device *dev,
 	strscpy(info->bus_info, "ovpn", sizeof(info->bus_info));
 }
 
+static const char ovpn_dp_stat_names[OVPN_DP_STATS][ETH_GSTRING_LEN] = {
+	[OVPN_DP_STAT_ENCRYPTED] = "encrypted",
+	[OVPN_DP_STAT_DECRYPTED] = "decrypted",
+	[OVPN_DP_STAT_ENCRYPT_ERRORS] = "encrypt_errors",
+	[OVPN_DP_STAT_DECRYPT_ERRORS] = "decrypt_errors",
+	[OVPN_DP_STAT_RING_FULL] = "ring_full",
+	[OVPN_DP_STAT_GSO_SEGS] = "gso_segs",
+	[OVPN_DP_STAT_NAPI_POLLS] = "napi_polls",
+	[OVPN_DP_STAT_NAPI_PACKETS] = "napi_packets",
+	[OVPN_DP_STAT_WORK_QUEUED] = "work_queued",
+	[OVPN_DP_STAT_WORK_RESCHED] = "work_resched",
+};
+
+static const char
+ovpn_filter_stat_names[OVPN_FILTER_DROP_REASONS][ETH_GSTRING_LEN] = {
+	[OVPN_FILTER_DROP_OPCODE] = "filter_drops_opcode",
+	[OVPN_FILTER_DROP_PEER_ID] = "filter_drops_peer_id",
+	[OVPN_FILTER_DROP_KEY_ID] = "filter_drops_key_id",
+	[OVPN_FILTER_DROP_REPLAY] = "filter_drops_replay",
+};
+
+/* Layout of the ethtool -S counters: totals of the datapath counters, drops
+ * of the early filter, two counters per RX and per TX queue and finally the
+ * datapath counters of each CPU
+ */
+static int ovpn_get_sset_count(struct net_device *dev, int sset)
+{
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+
+	return OVPN_DP_STATS + OVPN_FILTER_DROP_REASONS +
+	       2 * (dev->num_rx_queues + dev->num_tx_queues) +
+	       OVPN_DP_STATS * num_possible_cpus();
+}
+
+static void ovpn_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	unsigned int i;
+	int cpu, j;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	memcpy(data, ovpn_dp_stat_names, sizeof(ovpn_dp_stat_names));
+	data += sizeof(ovpn_dp_stat_names);
+	memcpy(data, ovpn_filter_stat_names, sizeof(ovpn_filter_stat_names));
+	data += sizeof(ovpn_filter_stat_names);
+
+	for (i = 0; i < dev->num_rx_queues; i++) {
+		snprintf(data, ETH_GSTRING_LEN, "rx_queue_%u_napi_polls", i);
+		data += ETH_GSTRING_LEN;
+		snprintf(data, ETH_GSTRING_LEN, "rx_queue_%u_packets", i);
+		data += ETH_GSTRING_LEN;
+	}
+
+	for (i = 0; i < dev->num_tx_queues; i++) {
+		snprintf(data, ETH_GSTRING_LEN, "tx_queue_%u_works", i);
+		data += ETH_GSTRING_LEN;
+		snprintf(data, ETH_GSTRING_LEN, "tx_queue_%u_packets", i);
+		data += ETH_GSTRING_LEN;
+	}
+
+	for_each_possible_cpu(cpu) {
+		for (j = 0; j < OVPN_DP_STATS; j++) {
+			snprintf(data, ETH_GSTRING_LEN, "cpu%d_%s", cpu,
+				 ovpn_dp_stat_names[j]);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+}
+
+static void ovpn_get_ethtool_stats(struct net_device *dev,
+				   struct ethtool_stats *stats, u64 *data)
+{
+	struct ovpn_struct *ovpn = netdev_priv(dev);
+	u64 *totals = data;
+	unsigned int i;
+	int cpu, j;
+
+	memset(totals, 0, sizeof(*totals) * OVPN_DP_STATS);
+	data += OVPN_DP_STATS;
+
+	ovpn_udp_filter_drops(ovpn, data);
+	data += OVPN_FILTER_DROP_REASONS;
+
+	for (i = 0; i < dev->num_rx_queues; i++) {
+		ovpn_queue_stats_fetch(&ovpn->rxqs[i].stats, &data[0],
+				       &data[1]);
+		data += 2;
+	}
+
+	/* TX queue contexts exist only once TX multiqueue was first enabled.
+	 * Pairs with smp_store_release() in ovpn_tx_multiqueue_set()
+	 */
+	for (i = 0; i < dev->num_tx_queues; i++) {
+		if (smp_load_acquire(&ovpn->tx_multiqueue))
+			ovpn_queue_stats_fetch(&ovpn->txqs[i].stats, &data[0],
+					       &data[1]);
+		else
+			data[0] = data[1] = 0;
+		data += 2;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ovpn_dp_stats_fold_cpu(ovpn->dp_stats, cpu, data);
+		for (j = 0; j < OVPN_DP_STATS; j++)
+			totals[j] += data[j];
+		data += OVPN_DP_STATS;
+	}
+}
+
 bool ovpn_dev_is_valid(const struct net_device *dev)
 {
 	return dev->netdev_ops->ndo_start_xmit == ovpn_net_xmit;
@@ -133,6 +263,9 @@ static const struct ethtool_ops ovpn_ethtool_ops = {
 	.get_drvinfo		= ovpn_get_drvinfo,
 	.get_link		= ethtool_op_get_link,
 	.get_ts_info		= ethtool_op_get_ts_info,
+	.get_sset_count		= ovpn_get_sset_count,
+	.get_strings		= ovpn_get_strings,
+	.get_ethtool_stats	= ovpn_get_ethtool_stats,
 };
 
 static void ovpn_setup(struct net_device *dev)
@@ -168,16 +301,8 @@ static void ovpn_setup(struct net_device *dev)
 static void ovpn_dellink(struct net_device *dev, struct list_head *head)
 {
 	struct ovpn_struct *ovpn = netdev_priv(dev);
-	struct ovpn_peer *peer;
-
-	spin_lock_bh(&ovpn->lock);
-	peer = ovpn_peer_get(ovpn);
-	if (peer) {
-		RCU_INIT_POINTER(ovpn->peer, NULL);
-		ovpn_peer_delete(peer, OVPN_DEL_PEER_REASON_TEARDOWN);
-		ovpn_peer_put(peer);
-	}
-	spin_unlock_bh(&ovpn->lock);
+
+	ovpn_peers_free(ovpn);
 
 	unregister_netdevice_queue(dev, head); /* calls ovpn_net_uninit */
 }
@@ -226,6 +351,8 @@ static int __init ovpn_init(void)
 		goto err_rtnl_unregister;
 	}
 
+	ovpn_kunit_run();
+
 	return 0;
 
 err_rtnl_unregister:
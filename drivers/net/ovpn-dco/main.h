@@ -45,15 +45,69 @@ bool ovpn_dev_is_valid(const struct net_device *dev);
 
 void ovpn_release_lock(struct kref *kref);
 
+#ifdef CONFIG_OVPN_DCO_KUNIT_TEST
+void ovpn_kunit_run(void);
+#else
+static inline void ovpn_kunit_run(void)
+{
+}
+#endif
+
 #define SKB_HEADER_LEN                                       \
 	(max(sizeof(struct iphdr), sizeof(struct ipv6hdr)) + \
 	 sizeof(struct udphdr) + NET_SKB_PAD)
 
 #define OVPN_HEAD_ROOM ALIGN(16 + SKB_HEADER_LEN, 4)
+
+/* largest overhead of the encapsulation: outer IPv6 and UDP headers,
+ * opcode/peer-id, packet ID and AEAD tag
+ */
+#define OVPN_MAX_ENCAP_OVERHEAD \
+	(sizeof(struct ipv6hdr) + sizeof(struct udphdr) + 4 + 4 + 16)
 #define OVPN_MAX_PADDING 16
 
+/* default size of the per-peer and per-cpu packet rings */
 #define OVPN_QUEUE_LEN 1024
 
+/* max number of packets dequeued at once by the NAPI poll */
+#define OVPN_NAPI_BATCH 16
+
+/* max number of packets handed to the crypto engine at once */
+#define OVPN_CRYPTO_BATCH 16
+
+/* max number of control packets waiting for delivery to userspace */
+#define OVPN_CTRL_QUEUE_LEN 1024
+
+/* max number of control packets delivered in a single netlink datagram */
+#define OVPN_CTRL_BATCH 16
+
+/* control packets per second accepted by default from a source address */
+#define OVPN_CTRL_RATE 1000
+#define OVPN_MAX_CTRL_RATE 1000000
+
+/* number of token buckets used to rate-limit control packets, as a power of 2 */
+#define OVPN_CTRL_RATELIMIT_BITS 10
+
+/* min time between two changes of the transport address of a peer (jiffies) */
+#define OVPN_FLOAT_INTERVAL HZ
+
+/* how often peers are checked for keepalive pings and expiration (jiffies) */
+#define OVPN_KEEPALIVE_SCAN_PERIOD HZ
+
+/* seconds after which a peer releases the rings and crypto request objects it
+ * hasn't used, by default
+ */
+#define OVPN_IDLE_TIMEOUT 30
+
+/* how often peers are checked for unused rings and request objects (jiffies) */
+#define OVPN_IDLE_SCAN_PERIOD (10 * HZ)
+
+/* max size of the UDP payload of a transport GSO packet, so that the IP
+ * packet length fits 16 bits
+ */
+#define OVPN_GSO_MAX_SIZE \
+	(IP_MAX_MTU - sizeof(struct ipv6hdr) - sizeof(struct udphdr))
+
 /* max allowed parameter values */
 #define OVPN_MAX_PEERS                1000000
 #define OVPN_MAX_DEV_QUEUES           0x1000
@@ -61,6 +115,15 @@ void ovpn_release_lock(struct kref *kref);
 #define OVPN_MAX_TUN_QUEUE_LEN        0x10000
 #define OVPN_MAX_TCP_SEND_QUEUE_LEN   0x10000
 #define OVPN_MAX_THROTTLE_PERIOD_MS   10000
+#define OVPN_MIN_QUEUE_LEN            16
+#define OVPN_MAX_QUEUE_LEN            0x10000
+#define OVPN_MAX_IDLE_TIMEOUT         86400
+#define OVPN_MAX_REUSEPORT_SOCKS      64
+
+/* size of the peer lookup tables used in server mode: with OVPN_MAX_PEERS
+ * configured, each bucket holds about 15 entries on average
+ */
+#define OVPN_PEER_HASH_BITS           16
 
 #ifdef DEBUG
 #define ovpn_print_hex_debug(_buf, _len)				\
@@ -9,8 +9,12 @@
 #include "main.h"
 #include "ovpn.h"
 #include "peer.h"
+#include "pmtu.h"
 #include "netlink.h"
 #include "ovpnstruct.h"
+#include "skb.h"
+#include "stats.h"
+#include "stats_counters.h"
 #include "udp.h"
 
 #include <uapi/linux/ovpn_dco.h>
@@ -22,6 +26,7 @@
 #include <linux/types.h>
 #include <linux/spinlock.h>
 #include <net/genetlink.h>
+#include <net/ipv6.h>
 #include <uapi/linux/in.h>
 #include <uapi/linux/in6.h>
 
@@ -46,6 +51,13 @@ ovpn_netlink_policy_sockaddr[OVPN_SOCKADDR_ATTR_MAX + 1] = {
 	[OVPN_SOCKADDR_ATTR_PORT] = { .type = NLA_U16 },
 };
 
+static const struct nla_policy
+ovpn_netlink_policy_iroute[OVPN_IROUTE_ATTR_MAX + 1] = {
+	[OVPN_IROUTE_ATTR_ADDRESS] = { .type = NLA_BINARY,
+				       .len = sizeof(struct in6_addr) },
+	[OVPN_IROUTE_ATTR_PREFIX_LEN] = NLA_POLICY_MAX(NLA_U8, 128),
+};
+
 static const struct nla_policy ovpn_netlink_policy[OVPN_ATTR_MAX + 1] = {
 	[OVPN_ATTR_IFINDEX] = { .type = NLA_U32 },
 	[OVPN_ATTR_MODE] = { .type = NLA_U8 },
@@ -69,8 +81,27 @@ static const struct nla_policy ovpn_netlink_policy[OVPN_ATTR_MAX + 1] = {
 		NLA_POLICY_NESTED(ovpn_netlink_policy_sockaddr),
 	[OVPN_ATTR_SOCKADDR_LOCAL] =
 		NLA_POLICY_NESTED(ovpn_netlink_policy_sockaddr),
+	[OVPN_ATTR_PEER_ID] = { .type = NLA_U32 },
+	[OVPN_ATTR_VPN_IPV4] = { .type = NLA_U32 },
+	[OVPN_ATTR_VPN_IPV6] = NLA_POLICY_MIN_LEN(sizeof(struct in6_addr)),
+	[OVPN_ATTR_IROUTE] = NLA_POLICY_NESTED(ovpn_netlink_policy_iroute),
+	[OVPN_ATTR_CRYPTO_PARALLEL] = NLA_POLICY_MAX(NLA_U8, 1),
+	[OVPN_ATTR_RX_MODE] = NLA_POLICY_MAX(NLA_U8, OVPN_RX_MODE_MAX),
+	[OVPN_ATTR_REPLAY_WINDOW] = { .type = NLA_U32 },
+	[OVPN_ATTR_QUEUE_LEN] = NLA_POLICY_RANGE(NLA_U32, OVPN_MIN_QUEUE_LEN,
+						 OVPN_MAX_QUEUE_LEN),
+	[OVPN_ATTR_TX_MULTIQUEUE] = NLA_POLICY_MAX(NLA_U8, 1),
+	[OVPN_ATTR_CTRL_RATE] = NLA_POLICY_MAX(NLA_U32, OVPN_MAX_CTRL_RATE),
+	[OVPN_ATTR_KEYS] = { .type = NLA_NESTED },
+	[OVPN_ATTR_IDLE_TIMEOUT] = NLA_POLICY_MAX(NLA_U32,
+						  OVPN_MAX_IDLE_TIMEOUT),
+	[OVPN_ATTR_EARLY_FILTER] = NLA_POLICY_MAX(NLA_U8, 1),
+	[OVPN_ATTR_PMTU_DISCOVERY] = NLA_POLICY_MAX(NLA_U8, 1),
+	[OVPN_ATTR_MSS_CLAMP] = NLA_POLICY_MAX(NLA_U8, 1),
 };
 
+static struct genl_family ovpn_netlink_family;
+
 static struct net_device *
 ovpn_get_dev_from_info(struct net *net, struct genl_info *info)
 {
@@ -145,6 +176,34 @@ static void ovpn_post_doit(const struct genl_ops *ops, struct sk_buff *skb,
 	dev_put(ovpn->dev);
 }
 
+/* Retrieve the peer a request refers to.
+ * In client mode the only existing peer is returned, while in server mode the
+ * peer is looked up using the OVPN_ATTR_PEER_ID attribute.
+ *
+ * Return the peer with a reference held, or NULL if none was found.
+ */
+static struct ovpn_peer *ovpn_netlink_peer_get_attrs(struct ovpn_struct *ovpn,
+						     struct nlattr **attrs)
+{
+	u32 peer_id;
+
+	if (ovpn->mode != OVPN_MODE_SERVER)
+		return ovpn_peer_get(ovpn);
+
+	if (!attrs[OVPN_ATTR_PEER_ID])
+		return NULL;
+
+	peer_id = nla_get_u32(attrs[OVPN_ATTR_PEER_ID]);
+
+	return ovpn_peer_lookup_id(ovpn, peer_id);
+}
+
+static struct ovpn_peer *ovpn_netlink_peer_get(struct ovpn_struct *ovpn,
+					       struct genl_info *info)
+{
+	return ovpn_netlink_peer_get_attrs(ovpn, info->attrs);
+}
+
 static int ovpn_netlink_get_key_dir(struct genl_info *info, struct nlattr *key,
 				    enum ovpn_cipher_alg cipher,
 				    struct ovpn_key_direction *dir)
@@ -187,92 +246,591 @@ static int ovpn_netlink_get_key_dir(struct genl_info *info, struct nlattr *key,
 	return 0;
 }
 
-static int ovpn_netlink_new_key(struct sk_buff *skb, struct genl_info *info)
+/* Install the key described by attrs, which hold the attributes of an
+ * OVPN_CMD_NEW_KEY request
+ */
+static int __ovpn_netlink_new_key(struct ovpn_struct *ovpn,
+				  struct genl_info *info, struct nlattr **attrs)
 {
-	struct ovpn_struct *ovpn = info->user_ptr[0];
 	struct ovpn_peer_key_reset pkr;
 	struct ovpn_peer *peer;
 	int ret;
 
-	if (!info->attrs[OVPN_ATTR_REMOTE_PEER_ID] ||
-	    !info->attrs[OVPN_ATTR_KEY_SLOT] ||
-	    !info->attrs[OVPN_ATTR_KEY_ID] ||
-	    !info->attrs[OVPN_ATTR_CIPHER_ALG] ||
-	    !info->attrs[OVPN_ATTR_ENCRYPT_KEY] ||
-	    !info->attrs[OVPN_ATTR_DECRYPT_KEY])
+	if (!attrs[OVPN_ATTR_REMOTE_PEER_ID] ||
+	    !attrs[OVPN_ATTR_KEY_SLOT] ||
+	    !attrs[OVPN_ATTR_KEY_ID] ||
+	    !attrs[OVPN_ATTR_CIPHER_ALG] ||
+	    !attrs[OVPN_ATTR_ENCRYPT_KEY] ||
+	    !attrs[OVPN_ATTR_DECRYPT_KEY])
 		return -EINVAL;
 
-	pkr.remote_peer_id = nla_get_u32(info->attrs[OVPN_ATTR_REMOTE_PEER_ID]);
-	pkr.slot = nla_get_u8(info->attrs[OVPN_ATTR_KEY_SLOT]);
-	pkr.key.key_id = nla_get_u16(info->attrs[OVPN_ATTR_KEY_ID]);
+	pkr.remote_peer_id = nla_get_u32(attrs[OVPN_ATTR_REMOTE_PEER_ID]);
+	pkr.slot = nla_get_u8(attrs[OVPN_ATTR_KEY_SLOT]);
+	pkr.key.key_id = nla_get_u16(attrs[OVPN_ATTR_KEY_ID]);
 
-	pkr.key.cipher_alg = nla_get_u16(info->attrs[OVPN_ATTR_CIPHER_ALG]);
+	pkr.key.cipher_alg = nla_get_u16(attrs[OVPN_ATTR_CIPHER_ALG]);
 
-	ret = ovpn_netlink_get_key_dir(info, info->attrs[OVPN_ATTR_ENCRYPT_KEY],
+	pkr.key.replay_window = 0;
+	if (attrs[OVPN_ATTR_REPLAY_WINDOW]) {
+		pkr.key.replay_window =
+			nla_get_u32(attrs[OVPN_ATTR_REPLAY_WINDOW]);
+		if (pkr.key.replay_window > REPLAY_WINDOW_MAX) {
+			NL_SET_ERR_MSG_MOD(info->extack,
+					   "replay window too large");
+			return -EINVAL;
+		}
+	}
+
+	ret = ovpn_netlink_get_key_dir(info, attrs[OVPN_ATTR_ENCRYPT_KEY],
 				       pkr.key.cipher_alg, &pkr.key.encrypt);
 	if (ret < 0)
 		return ret;
 
-	ret = ovpn_netlink_get_key_dir(info, info->attrs[OVPN_ATTR_DECRYPT_KEY],
+	ret = ovpn_netlink_get_key_dir(info, attrs[OVPN_ATTR_DECRYPT_KEY],
 				       pkr.key.cipher_alg, &pkr.key.decrypt);
 	if (ret < 0)
 		return ret;
 
 	pkr.crypto_family = ovpn_keys_familiy_get(&pkr.key);
 
-	peer = ovpn_peer_get(ovpn);
+	peer = ovpn_netlink_peer_get_attrs(ovpn, attrs);
 	if (!peer)
 		return -ENOENT;
 
-	mutex_lock(&peer->crypto.mutex);
-	/* get crypto family and check for consistency */
-	ret = ovpn_crypto_state_select_family(&peer->crypto, &pkr);
-	if (ret < 0) {
-		pr_debug("cannot select crypto family for peer\n");
-		goto unlock;
+	ret = ovpn_crypto_state_reset(&peer->crypto, &pkr, &ovpn->tfm_cache);
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+static int ovpn_netlink_new_key(struct sk_buff *skb, struct genl_info *info)
+{
+	return __ovpn_netlink_new_key(info->user_ptr[0], info, info->attrs);
+}
+
+/**
+ * ovpn_netlink_new_keys() - Install keys for several peers
+ * @skb: Netlink message with request data
+ * @info: receiver information
+ *
+ * Entries of OVPN_ATTR_KEYS are processed in order. On failure, the keys
+ * installed by the preceding entries are kept and the failing entry is
+ * reported via extack.
+ *
+ * Return: 0 on success or negative error number in case of failure
+ */
+static int ovpn_netlink_new_keys(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	struct nlattr *entry;
+	int rem, ret;
+
+	if (!info->attrs[OVPN_ATTR_KEYS])
+		return -EINVAL;
+
+	nla_for_each_nested(entry, info->attrs[OVPN_ATTR_KEYS], rem) {
+		ret = nla_parse_nested(attrs, OVPN_ATTR_MAX, entry,
+				       ovpn_netlink_policy, info->extack);
+		if (!ret)
+			ret = __ovpn_netlink_new_key(ovpn, info, attrs);
+		if (ret < 0) {
+			NL_SET_ERR_MSG_ATTR(info->extack, entry,
+					    "cannot install key");
+			return ret;
+		}
+
+		cond_resched();
 	}
 
-	ret = ovpn_crypto_state_reset(&peer->crypto, &pkr);
-unlock:
-	mutex_unlock(&peer->crypto.mutex);
+	return 0;
+}
+
+static int ovpn_netlink_del_key(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	enum ovpn_key_slot slot;
+	struct ovpn_peer *peer;
+	int ret;
+
+	if (!info->attrs[OVPN_ATTR_KEY_SLOT])
+		return -EINVAL;
+
+	slot = nla_get_u8(info->attrs[OVPN_ATTR_KEY_SLOT]);
+
+	peer = ovpn_netlink_peer_get(ovpn, info);
+	if (!peer)
+		return -ENOENT;
+
+	ret = ovpn_crypto_key_slot_delete(&peer->crypto, slot);
 	ovpn_peer_put(peer);
+
 	return ret;
 }
 
-static int ovpn_netlink_del_key(struct sk_buff *skb, struct genl_info *info)
+/**
+ * ovpn_netlink_get_key() - Report the state of the key installed in a slot
+ * @skb: Netlink message with request data
+ * @info: receiver information
+ *
+ * Return: 0 on success or negative error number in case of failure
+ */
+static int ovpn_netlink_get_key(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_crypto_key_slot *ks;
 	enum ovpn_key_slot slot;
 	struct ovpn_peer *peer;
+	struct sk_buff *msg;
+	void *hdr;
+	int ret;
 
 	if (!info->attrs[OVPN_ATTR_KEY_SLOT])
 		return -EINVAL;
 
 	slot = nla_get_u8(info->attrs[OVPN_ATTR_KEY_SLOT]);
 
-	peer = ovpn_peer_get(ovpn);
+	peer = ovpn_netlink_peer_get(ovpn, info);
 	if (!peer)
 		return -ENOENT;
 
-	ovpn_crypto_key_slot_delete(&peer->crypto, slot);
+	ks = ovpn_crypto_key_slot_get(&peer->crypto, slot);
+	if (!ks) {
+		ret = -ENOENT;
+		goto err_put_peer;
+	}
+
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto err_put_ks;
+	}
+
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+			  &ovpn_netlink_family, 0, OVPN_CMD_GET_KEY);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u32(msg, OVPN_ATTR_PEER_ID, peer->id) ||
+	    nla_put_u8(msg, OVPN_ATTR_KEY_SLOT, slot) ||
+	    nla_put_u16(msg, OVPN_ATTR_KEY_ID, ks->key_id) ||
+	    nla_put_u32(msg, OVPN_ATTR_REPLAY_WINDOW, ks->pid_recv.window) ||
+	    nla_put_u32(msg, OVPN_ATTR_REPLAY_MAX_BACKTRACK,
+			READ_ONCE(ks->pid_recv.max_backtrack)) ||
+	    nla_put_u64_64bit(msg, OVPN_ATTR_REPLAY_DROPS,
+			      atomic64_read(&ks->pid_recv.drops),
+			      OVPN_ATTR_PAD)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	genlmsg_end(msg, hdr);
+
+	ovpn_crypto_key_slot_put(ks);
 	ovpn_peer_put(peer);
 
+	return genlmsg_reply(msg, info);
+
+err_free_msg:
+	nlmsg_free(msg);
+err_put_ks:
+	ovpn_crypto_key_slot_put(ks);
+err_put_peer:
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+/**
+ * ovpn_netlink_get_mem() - Report the memory used by the interface
+ * @skb: Netlink message with request data
+ * @info: receiver information
+ *
+ * Return: 0 on success or negative error number in case of failure
+ */
+static int ovpn_netlink_get_mem(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_mem_info mem;
+	struct sk_buff *msg;
+	struct nlattr *attr;
+	void *hdr;
+	int ret;
+
+	ovpn_mem(ovpn, &mem);
+
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+			  &ovpn_netlink_family, 0, OVPN_CMD_GET_MEM);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u32(msg, OVPN_ATTR_IFINDEX, ovpn->dev->ifindex) ||
+	    nla_put_u32(msg, OVPN_ATTR_IDLE_TIMEOUT,
+			READ_ONCE(ovpn->idle_timeout))) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	attr = nla_nest_start(msg, OVPN_ATTR_MEM);
+	if (!attr) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u64_64bit(msg, OVPN_MEM_ATTR_IFACE_BYTES, mem.iface_bytes,
+			      OVPN_MEM_ATTR_PAD) ||
+	    nla_put_u32(msg, OVPN_MEM_ATTR_PEERS, mem.peers) ||
+	    nla_put_u64_64bit(msg, OVPN_MEM_ATTR_PEER_BYTES, mem.peer_bytes,
+			      OVPN_MEM_ATTR_PAD) ||
+	    nla_put_u32(msg, OVPN_MEM_ATTR_RINGS, mem.rings) ||
+	    nla_put_u64_64bit(msg, OVPN_MEM_ATTR_RING_BYTES, mem.ring_bytes,
+			      OVPN_MEM_ATTR_PAD) ||
+	    nla_put_u32(msg, OVPN_MEM_ATTR_KEY_SLOTS, mem.key_slots) ||
+	    nla_put_u64_64bit(msg, OVPN_MEM_ATTR_KEY_BYTES, mem.key_bytes,
+			      OVPN_MEM_ATTR_PAD)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	nla_nest_end(msg, attr);
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+
+err_free_msg:
+	nlmsg_free(msg);
+	return ret;
+}
+
+/**
+ * ovpn_netlink_get_filter() - Report the state of the early filter
+ * @skb: Netlink message with request data
+ * @info: receiver information
+ *
+ * Return: 0 on success or negative error number in case of failure
+ */
+static int ovpn_netlink_get_filter(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	u64 drops[OVPN_FILTER_DROP_REASONS];
+	struct sk_buff *msg;
+	struct nlattr *attr;
+	void *hdr;
+	int ret, i;
+
+	BUILD_BUG_ON(OVPN_FILTER_STATS_ATTR_DROPS_REPLAY !=
+		     OVPN_FILTER_STATS_ATTR_DROPS_OPCODE +
+		     OVPN_FILTER_DROP_REASONS - 1);
+
+	ovpn_udp_filter_drops(ovpn, drops);
+
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+			  &ovpn_netlink_family, 0, OVPN_CMD_GET_FILTER);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u32(msg, OVPN_ATTR_IFINDEX, ovpn->dev->ifindex) ||
+	    nla_put_u8(msg, OVPN_ATTR_EARLY_FILTER, ovpn->early_filter)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	attr = nla_nest_start(msg, OVPN_ATTR_FILTER_STATS);
+	if (!attr) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	for (i = 0; i < OVPN_FILTER_DROP_REASONS; i++) {
+		if (nla_put_u64_64bit(msg,
+				      OVPN_FILTER_STATS_ATTR_DROPS_OPCODE + i,
+				      drops[i], OVPN_FILTER_STATS_ATTR_PAD)) {
+			ret = -EMSGSIZE;
+			goto err_free_msg;
+		}
+	}
+
+	nla_nest_end(msg, attr);
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+
+err_free_msg:
+	nlmsg_free(msg);
+	return ret;
+}
+
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+static int ovpn_netlink_put_latency(struct sk_buff *skb,
+				    const struct ovpn_peer_stats *ps)
+{
+	u64 hist[OVPN_PEER_LAT_BUCKETS];
+	struct nlattr *attr;
+	int stage;
+
+	BUILD_BUG_ON(OVPN_PEER_LATENCY_ATTR_MAX != OVPN_PEER_LAT_STAGES);
+
+	attr = nla_nest_start(skb, OVPN_ATTR_PEER_LATENCY);
+	if (!attr)
+		return -EMSGSIZE;
+
+	for (stage = 0; stage < OVPN_PEER_LAT_STAGES; stage++) {
+		ovpn_peer_stats_fold_latency(ps, stage, hist);
+
+		/* attributes follow the order of enum ovpn_peer_lat_stage */
+		if (nla_put(skb, OVPN_PEER_LATENCY_ATTR_TX_QUEUE + stage,
+			    sizeof(hist), hist)) {
+			nla_nest_cancel(skb, attr);
+			return -EMSGSIZE;
+		}
+	}
+
+	nla_nest_end(skb, attr);
+
 	return 0;
 }
+#endif
+
+/* Fill a OVPN_CMD_GET_PEER message with the state and the counters of peer.
+ *
+ * Return 0 on success or -EMSGSIZE if skb has no room left for the peer.
+ */
+static int ovpn_netlink_fill_peer(struct sk_buff *skb, struct ovpn_peer *peer,
+				  u32 portid, u32 seq, int flags)
+{
+	u64 drops[OVPN_PEER_DROP_REASONS], paths[OVPN_PEER_TX_PATHS];
+	struct ovpn_peer_stat rx, tx;
+	struct nlattr *attr;
+	unsigned int mtu;
+	void *hdr;
+	int i;
+
+	/* drop counters are exported in the order of enum ovpn_peer_drop_reason */
+	BUILD_BUG_ON(OVPN_PEER_STATS_ATTR_DROPS_CTRL -
+		     OVPN_PEER_STATS_ATTR_DROPS_REPLAY + 1 != OVPN_PEER_DROP_REASONS);
+	BUILD_BUG_ON(OVPN_PEER_STATS_ATTR_TX_COW -
+		     OVPN_PEER_STATS_ATTR_TX_INPLACE + 1 != OVPN_PEER_TX_PATHS);
+
+	hdr = genlmsg_put(skb, portid, seq, &ovpn_netlink_family, flags,
+			  OVPN_CMD_GET_PEER);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, OVPN_ATTR_IFINDEX, peer->ovpn->dev->ifindex) ||
+	    nla_put_u32(skb, OVPN_ATTR_PEER_ID, peer->id) ||
+	    nla_put_u32(skb, OVPN_ATTR_KEEPALIVE_INTERVAL,
+			peer->keepalive_interval) ||
+	    nla_put_u32(skb, OVPN_ATTR_KEEPALIVE_TIMEOUT,
+			peer->keepalive_timeout) ||
+	    nla_put_u32(skb, OVPN_ATTR_QUEUE_LEN, peer->queue_len))
+		goto err;
+
+	if (peer->vpn_addrs.ipv4.s_addr != htonl(INADDR_ANY) &&
+	    nla_put_in_addr(skb, OVPN_ATTR_VPN_IPV4,
+			    peer->vpn_addrs.ipv4.s_addr))
+		goto err;
+
+	if (!ipv6_addr_any(&peer->vpn_addrs.ipv6) &&
+	    nla_put_in6_addr(skb, OVPN_ATTR_VPN_IPV6, &peer->vpn_addrs.ipv6))
+		goto err;
+
+	rcu_read_lock();
+	mtu = ovpn_peer_pmtu(peer);
+	rcu_read_unlock();
+
+	if (mtu && nla_put_u32(skb, OVPN_ATTR_PEER_MTU, mtu))
+		goto err;
+
+	ovpn_peer_stats_fold(&peer->stats, &rx, &tx);
+	ovpn_peer_stats_fold_drops(&peer->stats, drops);
+	ovpn_peer_stats_fold_tx_paths(&peer->stats, paths);
+
+	attr = nla_nest_start(skb, OVPN_ATTR_PEER_STATS);
+	if (!attr)
+		goto err;
+
+	if (nla_put_u64_64bit(skb, OVPN_PEER_STATS_ATTR_RX_BYTES, rx.bytes,
+			      OVPN_PEER_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_PEER_STATS_ATTR_RX_PACKETS, rx.packets,
+			      OVPN_PEER_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_PEER_STATS_ATTR_TX_BYTES, tx.bytes,
+			      OVPN_PEER_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_PEER_STATS_ATTR_TX_PACKETS, tx.packets,
+			      OVPN_PEER_STATS_ATTR_PAD))
+		goto err;
+
+	for (i = 0; i < OVPN_PEER_DROP_REASONS; i++) {
+		if (nla_put_u64_64bit(skb, OVPN_PEER_STATS_ATTR_DROPS_REPLAY + i,
+				      drops[i], OVPN_PEER_STATS_ATTR_PAD))
+			goto err;
+	}
+
+	for (i = 0; i < OVPN_PEER_TX_PATHS; i++) {
+		if (nla_put_u64_64bit(skb, OVPN_PEER_STATS_ATTR_TX_INPLACE + i,
+				      paths[i], OVPN_PEER_STATS_ATTR_PAD))
+			goto err;
+	}
+
+	nla_nest_end(skb, attr);
+
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+	if (ovpn_netlink_put_latency(skb, &peer->stats) < 0)
+		goto err;
+#endif
+
+	genlmsg_end(skb, hdr);
+
+	return 0;
+err:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+static int ovpn_netlink_get_peer(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
+	struct sk_buff *msg;
+	int ret;
+
+	peer = ovpn_netlink_peer_get(ovpn, info);
+	if (!peer)
+		return -ENOENT;
+
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto err_put_peer;
+	}
+
+	ret = ovpn_netlink_fill_peer(msg, peer, info->snd_portid,
+				     info->snd_seq, 0);
+	if (ret < 0) {
+		nlmsg_free(msg);
+		goto err_put_peer;
+	}
+
+	ovpn_peer_put(peer);
+
+	return genlmsg_reply(msg, info);
+
+err_put_peer:
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+/**
+ * ovpn_netlink_dump_peers() - Dump the state of all peers of an interface
+ * @skb: message to fill
+ * @cb: dump state
+ *
+ * pre_doit is not invoked for dumps, therefore the interface is looked up
+ * again at each round. The position reached in the peer table is kept in
+ * cb->args[1] (hash bucket) and cb->args[2] (index within the bucket), so
+ * that each round resumes where the previous one stopped instead of walking
+ * the table from the start.
+ *
+ * Return: length of the filled message or negative error number
+ */
+static int ovpn_netlink_dump_peers(struct sk_buff *skb,
+				   struct netlink_callback *cb)
+{
+	u32 portid = NETLINK_CB(cb->skb).portid, seq = cb->nlh->nlmsg_seq;
+	unsigned long bkt = cb->args[1], skip = cb->args[2], idx;
+	struct net *net = sock_net(cb->skb->sk);
+	struct ovpn_struct *ovpn;
+	struct net_device *dev;
+	struct ovpn_peer *peer;
+	int ret;
+
+	if (!cb->args[0]) {
+		struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+
+		ret = nlmsg_parse_deprecated(cb->nlh, GENL_HDRLEN, attrs,
+					     OVPN_ATTR_MAX, ovpn_netlink_policy,
+					     cb->extack);
+		if (ret < 0)
+			return ret;
+
+		if (!attrs[OVPN_ATTR_IFINDEX])
+			return -EINVAL;
+
+		cb->args[0] = nla_get_u32(attrs[OVPN_ATTR_IFINDEX]);
+	}
+
+	dev = dev_get_by_index(net, cb->args[0]);
+	if (!dev)
+		return -ENODEV;
+
+	if (!ovpn_dev_is_valid(dev)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ovpn = netdev_priv(dev);
+
+	rcu_read_lock();
+	if (ovpn->mode == OVPN_MODE_SERVER) {
+		for (; bkt < HASH_SIZE(ovpn->peers->by_id); bkt++, skip = 0) {
+			idx = 0;
+			hlist_for_each_entry_rcu(peer, &ovpn->peers->by_id[bkt],
+						 hash_entry_id) {
+				if (idx++ < skip)
+					continue;
+
+				if (ovpn_netlink_fill_peer(skb, peer, portid,
+							   seq, NLM_F_MULTI) < 0) {
+					/* resume from this peer next round */
+					skip = idx - 1;
+					goto out_unlock;
+				}
+			}
+		}
+	} else if (!bkt) {
+		/* client mode: the only peer is dumped in the first round */
+		peer = rcu_dereference(ovpn->peer);
+		if (!peer ||
+		    ovpn_netlink_fill_peer(skb, peer, portid, seq,
+					   NLM_F_MULTI) == 0)
+			bkt = 1;
+	}
+out_unlock:
+	rcu_read_unlock();
+
+	cb->args[1] = bkt;
+	cb->args[2] = skip;
+	ret = skb->len;
+out:
+	dev_put(dev);
+	return ret;
+}
 
 static int ovpn_netlink_swap_keys(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
 	struct ovpn_peer *peer;
+	int ret;
 
-	peer = ovpn_peer_get(ovpn);
+	peer = ovpn_netlink_peer_get(ovpn, info);
 	if (!peer)
 		return -ENOENT;
 
-	ovpn_crypto_key_slots_swap(&peer->crypto);
+	ret = ovpn_crypto_key_slots_swap(&peer->crypto);
 	ovpn_peer_put(peer);
 
-	return 0;
+	return ret;
 }
 
 static void ovpn_netlink_parse_sockaddr4(struct genl_info *info,
@@ -341,7 +899,8 @@ static int ovpn_netlink_new_peer(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
 	struct ovpn_sockaddr_pair pair;
-	struct ovpn_peer *old, *new;
+	struct ovpn_peer *new, *tmp;
+	u32 peer_id = 0, queue_len = 0;
 	struct nlattr *attr;
 	int ret;
 
@@ -349,6 +908,27 @@ static int ovpn_netlink_new_peer(struct sk_buff *skb, struct genl_info *info)
 	    !info->attrs[OVPN_ATTR_SOCKADDR_LOCAL])
 		return -EINVAL;
 
+	/* in server mode each peer is identified by its peer-id */
+	if (info->attrs[OVPN_ATTR_PEER_ID])
+		peer_id = nla_get_u32(info->attrs[OVPN_ATTR_PEER_ID]);
+	else if (ovpn->mode == OVPN_MODE_SERVER)
+		return -EINVAL;
+
+	if (peer_id >= OVPN_OP_PEER_ID_UNDEF)
+		return -EINVAL;
+
+	if (info->attrs[OVPN_ATTR_VPN_IPV6] &&
+	    nla_len(info->attrs[OVPN_ATTR_VPN_IPV6]) != sizeof(struct in6_addr))
+		return -EINVAL;
+
+	if (ovpn->mode == OVPN_MODE_SERVER) {
+		tmp = ovpn_peer_lookup_id(ovpn, peer_id);
+		if (tmp) {
+			ovpn_peer_put(tmp);
+			return -EEXIST;
+		}
+	}
+
 	memset(&pair, 0, sizeof(pair));
 
 	attr = info->attrs[OVPN_ATTR_SOCKADDR_REMOTE];
@@ -365,27 +945,62 @@ static int ovpn_netlink_new_peer(struct sk_buff *skb, struct genl_info *info)
 	if (pair.remote.family != pair.local.family)
 		return -EINVAL;
 
-	new = ovpn_peer_new_with_sockaddr(ovpn, &pair);
+	/* by default the peer rings get the size configured on the interface */
+	if (info->attrs[OVPN_ATTR_QUEUE_LEN])
+		queue_len = nla_get_u32(info->attrs[OVPN_ATTR_QUEUE_LEN]);
+
+	new = ovpn_peer_new_with_sockaddr(ovpn, &pair, queue_len);
 	if (IS_ERR(new)) {
 		pr_err("cannot create new peer object for %pIScp\n",
 		       &pair.remote.u);
 		return PTR_ERR(new);
 	}
 
-	spin_lock_bh(&ovpn->lock);
+	new->id = peer_id;
 	new->sock = ovpn->sock;
-	old = rcu_replace_pointer(ovpn->peer, new,
-				  lockdep_is_held(&ovpn->lock));
-	if (old)
-		ovpn_peer_put(old);
-	spin_unlock_bh(&ovpn->lock);
 
-	pr_debug("%s: added peer %pIScp <-> %pIScp\n", __func__,
+	if (info->attrs[OVPN_ATTR_VPN_IPV4])
+		new->vpn_addrs.ipv4.s_addr =
+			nla_get_in_addr(info->attrs[OVPN_ATTR_VPN_IPV4]);
+
+	if (info->attrs[OVPN_ATTR_VPN_IPV6])
+		new->vpn_addrs.ipv6 =
+			nla_get_in6_addr(info->attrs[OVPN_ATTR_VPN_IPV6]);
+
+	ret = ovpn_peer_add(ovpn, new);
+	if (ret < 0) {
+		pr_err("cannot add new peer %u to interface: %d\n", peer_id,
+		       ret);
+		/* the peer was never visible: release it without notifying
+		 * userspace of its deletion
+		 */
+		ovpn_peer_release(new);
+		return ret;
+	}
+
+	pr_debug("%s: added peer %u %pIScp <-> %pIScp\n", __func__, peer_id,
 		 &pair.local.u, &pair.remote.u);
 
 	return 0;
 }
 
+static int ovpn_netlink_del_peer(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
+
+	peer = ovpn_netlink_peer_get(ovpn, info);
+	if (!peer)
+		return -ENOENT;
+
+	pr_debug("%s: deleting peer %u\n", __func__, peer->id);
+
+	ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_USERSPACE);
+	ovpn_peer_put(peer);
+
+	return 0;
+}
+
 static int ovpn_netlink_set_peer(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
@@ -393,23 +1008,105 @@ static int ovpn_netlink_set_peer(struct sk_buff *skb, struct genl_info *info)
 	u32 interv, timeout;
 	struct ovpn_peer *peer;
 
-	peer = ovpn_peer_get(ovpn);
+	peer = ovpn_netlink_peer_get(ovpn, info);
+	if (!peer)
+		return -ENOENT;
+
+	/* when setting the keepalive, both parameters have to be configured */
+	if (info->attrs[OVPN_ATTR_KEEPALIVE_INTERVAL] &&
+	    info->attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT]) {
+		keepalive_set = true;
+		interv = nla_get_u32(info->attrs[OVPN_ATTR_KEEPALIVE_INTERVAL]);
+		timeout = nla_get_u32(info->attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT]);
+	}
+
+	if (keepalive_set)
+		ovpn_peer_keepalive_set(peer, interv, timeout);
+
+	ovpn_peer_put(peer);
+	return 0;
+}
+
+/* Add or remove the iroute carried by OVPN_ATTR_IROUTE for the selected peer */
+static int ovpn_netlink_iroute(struct genl_info *info, bool add)
+{
+	struct nlattr *attrs[OVPN_IROUTE_ATTR_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peers *peers = ovpn->peers;
+	struct ovpn_peer *peer;
+	struct nlattr *addr;
+	__be32 addr4;
+	u8 cidr;
+#if IS_ENABLED(CONFIG_IPV6)
+	struct in6_addr addr6;
+#endif
+	int ret;
+
+	if (ovpn->mode != OVPN_MODE_SERVER)
+		return -EOPNOTSUPP;
+
+	if (!info->attrs[OVPN_ATTR_IROUTE])
+		return -EINVAL;
+
+	ret = nla_parse_nested(attrs, OVPN_IROUTE_ATTR_MAX,
+			       info->attrs[OVPN_ATTR_IROUTE],
+			       ovpn_netlink_policy_iroute, info->extack);
+	if (ret)
+		return ret;
+
+	if (!attrs[OVPN_IROUTE_ATTR_ADDRESS] ||
+	    !attrs[OVPN_IROUTE_ATTR_PREFIX_LEN])
+		return -EINVAL;
+
+	addr = attrs[OVPN_IROUTE_ATTR_ADDRESS];
+	cidr = nla_get_u8(attrs[OVPN_IROUTE_ATTR_PREFIX_LEN]);
+
+	peer = ovpn_netlink_peer_get(ovpn, info);
 	if (!peer)
 		return -ENOENT;
 
-	/* when setting the keepalive, both parameters have to be configured */
-	if (info->attrs[OVPN_ATTR_KEEPALIVE_INTERVAL] &&
-	    info->attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT]) {
-		keepalive_set = true;
-		interv = nla_get_u32(info->attrs[OVPN_ATTR_KEEPALIVE_INTERVAL]);
-		timeout = nla_get_u32(info->attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT]);
+	/* decide address family based on address length */
+	switch (nla_len(addr)) {
+	case sizeof(struct in_addr):
+		addr4 = nla_get_in_addr(addr);
+		if (add)
+			ret = ovpn_iroute_add_ipv4(&peers->iroutes, addr4, cidr,
+						   peer, &peers->lock);
+		else
+			ret = ovpn_iroute_del_ipv4(&peers->iroutes, addr4, cidr,
+						   peer, &peers->lock);
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case sizeof(struct in6_addr):
+		addr6 = nla_get_in6_addr(addr);
+		if (add)
+			ret = ovpn_iroute_add_ipv6(&peers->iroutes, &addr6, cidr,
+						   peer, &peers->lock);
+		else
+			ret = ovpn_iroute_del_ipv6(&peers->iroutes, &addr6, cidr,
+						   peer, &peers->lock);
+		break;
+#endif
+	default:
+		ret = -EAFNOSUPPORT;
+		break;
 	}
 
-	if (keepalive_set)
-		ovpn_peer_keepalive_set(peer, interv, timeout);
+	pr_debug("%s: %s iroute /%u for peer %u: %d\n", __func__,
+		 add ? "adding" : "deleting", cidr, peer->id, ret);
 
 	ovpn_peer_put(peer);
-	return 0;
+	return ret;
+}
+
+static int ovpn_netlink_new_iroute(struct sk_buff *skb, struct genl_info *info)
+{
+	return ovpn_netlink_iroute(info, true);
+}
+
+static int ovpn_netlink_del_iroute(struct sk_buff *skb, struct genl_info *info)
+{
+	return ovpn_netlink_iroute(info, false);
 }
 
 /**
@@ -437,20 +1134,40 @@ static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 		return -EBUSY;
 
 	mode = nla_get_u8(info->attrs[OVPN_ATTR_MODE]);
-	if (mode != OVPN_MODE_CLIENT)
+	if (mode != OVPN_MODE_CLIENT && mode != OVPN_MODE_SERVER)
 		return -EOPNOTSUPP;
 
 	proto = nla_get_u8(info->attrs[OVPN_ATTR_PROTO]);
 	switch (proto) {
 	case OVPN_PROTO_UDP4:
 	case OVPN_PROTO_UDP6:
+		break;
 	case OVPN_PROTO_TCP4:
 	case OVPN_PROTO_TCP6:
+		/* a TCP server would need one socket per peer */
+		if (mode == OVPN_MODE_SERVER)
+			return -EOPNOTSUPP;
 		break;
 	default:
 		return -EOPNOTSUPP;
 	}
 
+	/* the peer tables are allocated the first time the interface is
+	 * started in server mode and released only along with the interface
+	 */
+	if (mode == OVPN_MODE_SERVER && !ovpn->peers) {
+		ovpn->peers = kvzalloc(sizeof(*ovpn->peers), GFP_KERNEL);
+		if (!ovpn->peers)
+			return -ENOMEM;
+
+		hash_init(ovpn->peers->by_id);
+		hash_init(ovpn->peers->by_transp_addr);
+		hash_init(ovpn->peers->by_vpn_addr4);
+		hash_init(ovpn->peers->by_vpn_addr6);
+		ovpn_iroutes_init(&ovpn->peers->iroutes);
+		spin_lock_init(&ovpn->peers->lock);
+	}
+
 	/* lookup the fd in the kernel table and extract the socket object */
 	sockfd = nla_get_u32(info->attrs[OVPN_ATTR_SOCKET]);
 	/* sockfd_lookup() increases sock's refcounter */
@@ -491,6 +1208,15 @@ static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 	ovpn->proto = proto;
 	ovpn->sock = sock;
 
+	ret = ovpn_udp_filter_start(ovpn);
+	if (ret < 0) {
+		ovpn->sock = NULL;
+		ovpn->mode = OVPN_MODE_UNDEF;
+		/* releases sock too */
+		ovpn_sock_detach(sock);
+		return ret;
+	}
+
 	pr_debug("%s: mode %u proto %u\n", __func__, ovpn->mode, ovpn->proto);
 
 	return 0;
@@ -504,20 +1230,17 @@ static int ovpn_netlink_stop_vpn(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
 	struct socket *sock = ovpn->sock;
-	struct ovpn_peer *peer;
 
 	if (!sock)
 		return -EINVAL;
 
+	ovpn_udp_filter_stop(ovpn);
+	ovpn_sock_release_reuseport(ovpn);
+
 	ovpn->sock = NULL;
 	ovpn_sock_detach(sock);
 
-	spin_lock_bh(&ovpn->lock);
-	peer = rcu_replace_pointer(ovpn->peer, NULL,
-				   lockdep_is_held(&ovpn->lock));
-	if (peer)
-		ovpn_peer_delete(peer, OVPN_DEL_PEER_REASON_TEARDOWN);
-	spin_unlock_bh(&ovpn->lock);
+	ovpn_peers_free(ovpn);
 
 	ovpn->registered_nl_portid_set = false;
 
@@ -526,6 +1249,144 @@ static int ovpn_netlink_stop_vpn(struct sk_buff *skb, struct genl_info *info)
 	return 0;
 }
 
+/**
+ * ovpn_netlink_add_socket() - Attach another socket of the reuseport group of
+ * the UDP transport socket
+ * @skb: Netlink message with request data
+ * @info: receiver information
+ *
+ * Return: 0 on success or negative error number in case of failure
+ */
+static int ovpn_netlink_add_socket(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct socket *sock;
+	u32 sockfd;
+	int ret;
+
+	if (!info->attrs[OVPN_ATTR_SOCKET])
+		return -EINVAL;
+
+	if (!ovpn->sock)
+		return -EINVAL;
+
+	sockfd = nla_get_u32(info->attrs[OVPN_ATTR_SOCKET]);
+	/* sockfd_lookup() increases sock's refcounter */
+	sock = sockfd_lookup(sockfd, &ret);
+	if (!sock) {
+		pr_debug("%s: cannot lookup socket passed from userspace: %d\n", __func__, ret);
+		return -ENOTSOCK;
+	}
+
+	ret = ovpn_sock_add_reuseport(ovpn, sock);
+	if (ret < 0) {
+		sockfd_put(sock);
+		return ret;
+	}
+
+	pr_debug("%s: %u reuseport sockets attached\n", ovpn->dev->name,
+		 ovpn->num_reuseport_socks + 1);
+
+	return 0;
+}
+
+/**
+ * ovpn_netlink_set_vpn() - Tweak parameters of a running VPN session
+ * @skb: Netlink message with request data
+ * @info: receiver information
+ *
+ * Return: 0 on success or negative error number in case of failure
+ */
+static int ovpn_netlink_set_vpn(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	bool parallel, multiqueue, filter;
+	int ret;
+
+	/* applies to the peers created from now on. The rings of the per-cpu
+	 * crypto workers are sized when parallelization is first enabled
+	 */
+	if (info->attrs[OVPN_ATTR_QUEUE_LEN]) {
+		WRITE_ONCE(ovpn->queue_len,
+			   nla_get_u32(info->attrs[OVPN_ATTR_QUEUE_LEN]));
+		pr_debug("%s: queue length %u\n", ovpn->dev->name,
+			 ovpn->queue_len);
+	}
+
+	if (info->attrs[OVPN_ATTR_CRYPTO_PARALLEL]) {
+		parallel = !!nla_get_u8(info->attrs[OVPN_ATTR_CRYPTO_PARALLEL]);
+
+		ret = ovpn_crypto_parallel_set(ovpn, parallel);
+		if (ret < 0)
+			return ret;
+
+		pr_debug("%s: crypto parallelization %s\n", ovpn->dev->name,
+			 parallel ? "enabled" : "disabled");
+	}
+
+	if (info->attrs[OVPN_ATTR_TX_MULTIQUEUE]) {
+		multiqueue = !!nla_get_u8(info->attrs[OVPN_ATTR_TX_MULTIQUEUE]);
+
+		ret = ovpn_tx_multiqueue_set(ovpn, multiqueue);
+		if (ret < 0)
+			return ret;
+
+		pr_debug("%s: TX multiqueue %s\n", ovpn->dev->name,
+			 multiqueue ? "enabled" : "disabled");
+	}
+
+	if (info->attrs[OVPN_ATTR_CTRL_RATE]) {
+		WRITE_ONCE(ovpn->ctrl_rate,
+			   nla_get_u32(info->attrs[OVPN_ATTR_CTRL_RATE]));
+		pr_debug("%s: control packet rate %u/s\n", ovpn->dev->name,
+			 ovpn->ctrl_rate);
+	}
+
+	if (info->attrs[OVPN_ATTR_RX_MODE]) {
+		WRITE_ONCE(ovpn->rx_mode,
+			   nla_get_u8(info->attrs[OVPN_ATTR_RX_MODE]));
+		pr_debug("%s: RX mode %u\n", ovpn->dev->name, ovpn->rx_mode);
+	}
+
+	if (info->attrs[OVPN_ATTR_IDLE_TIMEOUT]) {
+		WRITE_ONCE(ovpn->idle_timeout,
+			   nla_get_u32(info->attrs[OVPN_ATTR_IDLE_TIMEOUT]));
+		pr_debug("%s: idle timeout %us\n", ovpn->dev->name,
+			 ovpn->idle_timeout);
+
+		/* the scan stopped if disabled before */
+		queue_delayed_work(ovpn->events_wq, &ovpn->idle_work,
+				   OVPN_IDLE_SCAN_PERIOD);
+	}
+
+	if (info->attrs[OVPN_ATTR_EARLY_FILTER]) {
+		filter = !!nla_get_u8(info->attrs[OVPN_ATTR_EARLY_FILTER]);
+
+		ret = ovpn_udp_filter_set(ovpn, filter);
+		if (ret < 0)
+			return ret;
+
+		pr_debug("%s: early filter %s\n", ovpn->dev->name,
+			 filter ? "enabled" : "disabled");
+	}
+
+	if (info->attrs[OVPN_ATTR_PMTU_DISCOVERY]) {
+		WRITE_ONCE(ovpn->pmtu_discovery,
+			   !!nla_get_u8(info->attrs[OVPN_ATTR_PMTU_DISCOVERY]));
+		pr_debug("%s: PMTU discovery %s\n", ovpn->dev->name,
+			 ovpn->pmtu_discovery ? "enabled" : "disabled");
+	}
+
+	if (info->attrs[OVPN_ATTR_MSS_CLAMP]) {
+		WRITE_ONCE(ovpn->mss_clamp,
+			   !!nla_get_u8(info->attrs[OVPN_ATTR_MSS_CLAMP]));
+		pr_debug("%s: MSS clamping %s\n", ovpn->dev->name,
+			 ovpn->mss_clamp ? "enabled" : "disabled");
+	}
+
+	return 0;
+}
+
 static int ovpn_netlink_register_packet(struct sk_buff *skb,
 					struct genl_info *info)
 {
@@ -550,8 +1411,10 @@ static int ovpn_netlink_register_packet(struct sk_buff *skb,
 static int ovpn_netlink_packet(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
 	const u8 *packet;
 	size_t len;
+	int ret;
 
 	if (!info->attrs[OVPN_ATTR_PACKET]) {
 		pr_debug("received netlink packet with no payload\n");
@@ -566,9 +1429,19 @@ static int ovpn_netlink_packet(struct sk_buff *skb, struct genl_info *info)
 
 	packet = nla_data(info->attrs[OVPN_ATTR_PACKET]);
 
-	pr_debug("%s: sending userspace packet to peer...\n", __func__);
+	peer = ovpn_netlink_peer_get(ovpn, info);
+	if (!peer) {
+		pr_debug("%s: no peer to send data to\n", __func__);
+		return -EHOSTUNREACH;
+	}
+
+	pr_debug("%s: sending userspace packet to peer %u...\n", __func__,
+		 peer->id);
 
-	return ovpn_send_data(ovpn, packet, len);
+	ret = ovpn_send_data(ovpn, peer, packet, len);
+	ovpn_peer_put(peer);
+
+	return ret;
 }
 
 static const struct genl_ops ovpn_netlink_ops[] = {
@@ -596,6 +1469,12 @@ static const struct genl_ops ovpn_netlink_ops[] = {
 		.flags = GENL_ADMIN_PERM,
 		.doit = ovpn_netlink_set_peer,
 	},
+	{
+		.cmd = OVPN_CMD_DEL_PEER,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_del_peer,
+	},
 	{
 		.cmd = OVPN_CMD_NEW_KEY,
 		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
@@ -626,6 +1505,61 @@ static const struct genl_ops ovpn_netlink_ops[] = {
 		.flags = GENL_ADMIN_PERM,
 		.doit = ovpn_netlink_packet,
 	},
+	{
+		.cmd = OVPN_CMD_NEW_IROUTE,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_new_iroute,
+	},
+	{
+		.cmd = OVPN_CMD_DEL_IROUTE,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_del_iroute,
+	},
+	{
+		.cmd = OVPN_CMD_SET_VPN,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_set_vpn,
+	},
+	{
+		.cmd = OVPN_CMD_GET_KEY,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_get_key,
+	},
+	{
+		.cmd = OVPN_CMD_GET_PEER,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_get_peer,
+		.dumpit = ovpn_netlink_dump_peers,
+	},
+	{
+		.cmd = OVPN_CMD_NEW_KEYS,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_new_keys,
+	},
+	{
+		.cmd = OVPN_CMD_GET_MEM,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_get_mem,
+	},
+	{
+		.cmd = OVPN_CMD_GET_FILTER,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_get_filter,
+	},
+	{
+		.cmd = OVPN_CMD_ADD_SOCKET,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_add_socket,
+	},
 };
 
 static struct genl_family ovpn_netlink_family __ro_after_init = {
@@ -669,6 +1603,11 @@ int ovpn_netlink_notify_del_peer(struct ovpn_peer *peer)
 		goto err_free_msg;
 	}
 
+	if (nla_put_u32(msg, OVPN_ATTR_PEER_ID, peer->id)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
 	if (nla_put_u8(msg, OVPN_ATTR_DEL_PEER_REASON, peer->delete_reason)) {
 		ret = -EMSGSIZE;
 		goto err_free_msg;
@@ -686,45 +1625,314 @@ err_free_msg:
 	return ret;
 }
 
-int ovpn_netlink_send_packet(struct ovpn_struct *ovpn, const uint8_t *buf,
-			     size_t len)
+/* Queue a control packet received from peer for delivery to userspace by
+ * ovpn_netlink_ctrl_work(). The queue is bounded, so that a slow userspace
+ * daemon cannot pin an unlimited amount of memory nor stall the crypto workers.
+ *
+ * Return 0 on success, in which case skb is consumed, or -ENOSPC if the queue
+ * is full.
+ */
+int ovpn_netlink_queue_packet(struct ovpn_struct *ovpn,
+			      const struct ovpn_peer *peer, struct sk_buff *skb)
 {
-	struct sk_buff *msg;
-	void *hdr;
-	int ret;
+	struct sk_buff_head *queue = &ovpn->ctrl_queue;
 
-	if (!ovpn->registered_nl_portid_set) {
+	if (!READ_ONCE(ovpn->registered_nl_portid_set)) {
 		pr_warn_ratelimited("%s: no userspace listener\n", __func__);
+		consume_skb(skb);
+		return 0;
+	}
+
+	pr_debug("%s: queueing packet for userspace, len: %u\n", __func__,
+		 skb->len);
+
+	/* the packet may wait in the queue for a while: don't hold the receive
+	 * buffer of the transport socket meanwhile
+	 */
+	skb_orphan(skb);
+	OVPN_SKB_CB(skb)->peer_id = peer->id;
+
+	spin_lock_bh(&queue->lock);
+	if (skb_queue_len(queue) >= OVPN_CTRL_QUEUE_LEN) {
+		spin_unlock_bh(&queue->lock);
+		return -ENOSPC;
+	}
+	__skb_queue_tail(queue, skb);
+	spin_unlock_bh(&queue->lock);
+
+	queue_work(ovpn->events_wq, &ovpn->ctrl_work);
+
+	return 0;
+}
+
+/* size of the headers of an OVPN_CMD_PACKET message, up to the payload */
+#define OVPN_PACKET_MSG_HDRLEN (NLMSG_HDRLEN + GENL_HDRLEN +		\
+				nla_total_size(sizeof(u32)) + NLA_HDRLEN)
+
+/* Several OVPN_CMD_PACKET messages delivered in a single netlink datagram.
+ * The headers of the first message live in the linear part of msg, while all
+ * the following data is attached as page fragments: the headers of the other
+ * messages are written to hdr_page and payloads are either referenced from
+ * the original skb (zero-copy) or copied along with the headers
+ */
+struct ovpn_netlink_batch {
+	struct sk_buff *msg;
+
+	struct page *hdr_page;
+	unsigned int hdr_off;
+
+	/* length of the last message, needed to align the next one */
+	unsigned int last_len;
+
+	/* senders of the packets in msg, to account for delivery failures */
+	unsigned int count;
+	u32 peer_ids[OVPN_CTRL_BATCH];
+};
+
+static void ovpn_netlink_put_packet_hdr(void *buf, u32 peer_id,
+					unsigned int len)
+{
+	struct genlmsghdr *genlh;
+	struct nlmsghdr *nlh;
+	struct nlattr *nla;
+
+	nlh = buf;
+	nlh->nlmsg_len = OVPN_PACKET_MSG_HDRLEN + len;
+	nlh->nlmsg_type = ovpn_netlink_family.id;
+	nlh->nlmsg_flags = 0;
+	nlh->nlmsg_seq = 0;
+	nlh->nlmsg_pid = 0;
+
+	genlh = nlmsg_data(nlh);
+	genlh->cmd = OVPN_CMD_PACKET;
+	genlh->version = ovpn_netlink_family.version;
+	genlh->reserved = 0;
+
+	nla = (struct nlattr *)((u8 *)genlh + GENL_HDRLEN);
+	nla->nla_type = OVPN_ATTR_PEER_ID;
+	nla->nla_len = nla_attr_size(sizeof(u32));
+	*(u32 *)nla_data(nla) = peer_id;
+
+	nla = (struct nlattr *)((u8 *)nla + nla_total_size(sizeof(u32)));
+	nla->nla_type = OVPN_ATTR_PACKET;
+	nla->nla_len = nla_attr_size(len);
+}
+
+/* Number of fragments needed to reference the payload of skb without copying
+ * it, or 0 if skb doesn't allow that
+ */
+static unsigned int ovpn_netlink_zerocopy_frags(struct sk_buff *skb)
+{
+	if (!skb->head_frag || skb_has_frag_list(skb) ||
+	    skb_orphan_frags(skb, GFP_KERNEL))
 		return 0;
+
+	return skb_shinfo(skb)->nr_frags + !!skb_headlen(skb);
+}
+
+static void ovpn_netlink_add_frag(struct sk_buff *msg, struct page *page,
+				  unsigned int off, unsigned int len)
+{
+	get_page(page);
+	skb_fill_page_desc(msg, skb_shinfo(msg)->nr_frags, page, off, len);
+	msg->len += len;
+	msg->data_len += len;
+	msg->truesize += len;
+}
+
+/* Attach the payload of skb to msg by taking a reference to its pages, the
+ * same way skb_zerocopy() does. The caller ensures that msg has enough free
+ * fragment slots (see ovpn_netlink_zerocopy_frags())
+ */
+static void ovpn_netlink_add_payload(struct sk_buff *msg, struct sk_buff *skb)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(msg);
+	unsigned int headlen = skb_headlen(skb);
+	struct page *page;
+	int i;
+
+	if (headlen) {
+		page = virt_to_head_page(skb->head);
+		ovpn_netlink_add_frag(msg, page,
+				      skb->data - (u8 *)page_address(page),
+				      headlen);
 	}
 
-	pr_debug("%s: sending packet to userspace, len: %zd\n", __func__, len);
-	ovpn_print_hex_debug(buf, len);
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		shinfo->frags[shinfo->nr_frags] = skb_shinfo(skb)->frags[i];
+		__skb_frag_ref(&shinfo->frags[shinfo->nr_frags]);
+		shinfo->nr_frags++;
+	}
+
+	msg->len += skb->data_len;
+	msg->data_len += skb->data_len;
+	msg->truesize += skb->data_len;
+}
+
+/* Start a new datagram with skb as its first message */
+static int ovpn_netlink_batch_start(struct ovpn_netlink_batch *b,
+				    struct sk_buff *skb)
+{
+	unsigned int frags = ovpn_netlink_zerocopy_frags(skb);
+	bool zerocopy = frags && frags <= MAX_SKB_FRAGS;
+	struct sk_buff *msg;
+	int ret;
 
-	msg = nlmsg_new(100 + len, GFP_ATOMIC);
+	msg = alloc_skb(OVPN_PACKET_MSG_HDRLEN + (zerocopy ? 0 : skb->len),
+			GFP_KERNEL);
 	if (!msg)
 		return -ENOMEM;
 
-	hdr = genlmsg_put(msg, 0, 0, &ovpn_netlink_family, 0,
-			  OVPN_CMD_PACKET);
-	if (!hdr) {
-		ret = -ENOBUFS;
-		goto err_free_msg;
+	ovpn_netlink_put_packet_hdr(skb_put(msg, OVPN_PACKET_MSG_HDRLEN),
+				    OVPN_SKB_CB(skb)->peer_id, skb->len);
+
+	if (zerocopy) {
+		ovpn_netlink_add_payload(msg, skb);
+	} else {
+		ret = skb_copy_bits(skb, 0, skb_put(msg, skb->len), skb->len);
+		if (ret < 0) {
+			kfree_skb(msg);
+			return ret;
+		}
 	}
 
-	if (nla_put(msg, OVPN_ATTR_PACKET, len, buf)) {
-		ret = -EMSGSIZE;
-		goto err_free_msg;
+	b->msg = msg;
+	b->last_len = OVPN_PACKET_MSG_HDRLEN + skb->len;
+	b->peer_ids[0] = OVPN_SKB_CB(skb)->peer_id;
+	b->count = 1;
+
+	return 0;
+}
+
+/* Append skb to the datagram being built as a new message.
+ * Return 0 on success or -ENOSPC if the datagram can't take it
+ */
+static int ovpn_netlink_batch_add(struct ovpn_netlink_batch *b,
+				  struct sk_buff *skb)
+{
+	unsigned int pad, hdrlen, frags, off;
+	u8 *buf;
+
+	/* keep datagrams within the size any netlink reader is prepared for */
+	pad = NLMSG_ALIGN(b->last_len) - b->last_len;
+	if (b->count == OVPN_CTRL_BATCH ||
+	    b->msg->len + pad + OVPN_PACKET_MSG_HDRLEN + skb->len >
+	    NLMSG_GOODSIZE)
+		return -ENOSPC;
+
+	frags = ovpn_netlink_zerocopy_frags(skb);
+	hdrlen = pad + OVPN_PACKET_MSG_HDRLEN + (frags ? 0 : skb->len);
+	if (skb_shinfo(b->msg)->nr_frags + 1 + frags > MAX_SKB_FRAGS)
+		return -ENOSPC;
+
+	/* headers are written at an aligned address, past the padding */
+	off = ALIGN(b->hdr_off + pad, 4) - pad;
+	if (!b->hdr_page || off + hdrlen > PAGE_SIZE) {
+		if (b->hdr_page)
+			put_page(b->hdr_page);
+
+		b->hdr_page = alloc_page(GFP_KERNEL);
+		if (!b->hdr_page)
+			return -ENOSPC;
+		off = ALIGN(pad, 4) - pad;
 	}
 
-	genlmsg_end(msg, hdr);
+	buf = (u8 *)page_address(b->hdr_page) + off;
+	memset(buf, 0, pad);
+	ovpn_netlink_put_packet_hdr(buf + pad, OVPN_SKB_CB(skb)->peer_id,
+				    skb->len);
+	if (!frags &&
+	    skb_copy_bits(skb, 0, buf + pad + OVPN_PACKET_MSG_HDRLEN, skb->len))
+		return -ENOSPC;
 
-	return genlmsg_unicast(dev_net(ovpn->dev), msg,
-			       ovpn->registered_nl_portid);
+	ovpn_netlink_add_frag(b->msg, b->hdr_page, off, hdrlen);
+	b->hdr_off = off + hdrlen;
 
-err_free_msg:
-	nlmsg_free(msg);
-	return ret;
+	if (frags)
+		ovpn_netlink_add_payload(b->msg, skb);
+
+	b->last_len = OVPN_PACKET_MSG_HDRLEN + skb->len;
+	b->peer_ids[b->count++] = OVPN_SKB_CB(skb)->peer_id;
+
+	return 0;
+}
+
+static void ovpn_netlink_ctrl_drop(struct ovpn_struct *ovpn, u32 peer_id)
+{
+	struct ovpn_peer *peer;
+
+	if (ovpn->peers)
+		peer = ovpn_peer_lookup_id(ovpn, peer_id);
+	else
+		peer = ovpn_peer_get(ovpn);
+
+	if (!peer)
+		return;
+
+	ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_CTRL);
+	ovpn_peer_put(peer);
+}
+
+static void ovpn_netlink_batch_flush(struct ovpn_struct *ovpn,
+				     struct ovpn_netlink_batch *b)
+{
+	unsigned int i;
+	int ret;
+
+	if (b->hdr_page) {
+		put_page(b->hdr_page);
+		b->hdr_page = NULL;
+	}
+	b->hdr_off = 0;
+
+	if (!b->msg)
+		return;
+
+	pr_debug("%s: sending %u packets to userspace, len: %u\n", __func__,
+		 b->count, b->msg->len);
+
+	ret = genlmsg_unicast(dev_net(ovpn->dev), b->msg,
+			      READ_ONCE(ovpn->registered_nl_portid));
+	if (ret < 0) {
+		net_dbg_ratelimited("%s: cannot deliver %u packets to userspace: %d\n",
+				    ovpn->dev->name, b->count, ret);
+		for (i = 0; i < b->count; i++)
+			ovpn_netlink_ctrl_drop(ovpn, b->peer_ids[i]);
+	}
+
+	b->msg = NULL;
+	b->count = 0;
+}
+
+/* Deliver the queued control packets to userspace, batching as many as
+ * possible in each netlink datagram
+ */
+void ovpn_netlink_ctrl_work(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn = container_of(work, struct ovpn_struct,
+						ctrl_work);
+	struct ovpn_netlink_batch b = {};
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&ovpn->ctrl_queue))) {
+		if (b.msg && ovpn_netlink_batch_add(&b, skb) == 0) {
+			consume_skb(skb);
+			continue;
+		}
+
+		ovpn_netlink_batch_flush(ovpn, &b);
+
+		if (ovpn_netlink_batch_start(&b, skb) < 0) {
+			ovpn_netlink_ctrl_drop(ovpn, OVPN_SKB_CB(skb)->peer_id);
+			kfree_skb(skb);
+			continue;
+		}
+		consume_skb(skb);
+
+		cond_resched();
+	}
+
+	ovpn_netlink_batch_flush(ovpn, &b);
 }
 
 static int ovpn_netlink_notify(struct notifier_block *nb, unsigned long state,
@@ -12,8 +12,9 @@
 int ovpn_netlink_init(struct ovpn_struct *ovpn);
 int ovpn_netlink_register(void);
 void ovpn_netlink_unregister(void);
-int ovpn_netlink_send_packet(struct ovpn_struct *ovpn, const uint8_t *buf,
-			     size_t len);
+int ovpn_netlink_queue_packet(struct ovpn_struct *ovpn,
+			      const struct ovpn_peer *peer, struct sk_buff *skb);
+void ovpn_netlink_ctrl_work(struct work_struct *work);
 int ovpn_netlink_notify_del_peer(struct ovpn_peer *peer);
 
 #endif /* _NET_OVPN_DCO_NETLINK_H_ */
@@ -12,11 +12,13 @@
 #include "netlink.h"
 #include "sock.h"
 #include "peer.h"
+#include "pmtu.h"
 #include "stats_counters.h"
 #include "proto.h"
 #include "crypto.h"
 #include "skb.h"
 #include "tcp.h"
+#include "trace.h"
 #include "udp.h"
 
 #include <linux/workqueue.h>
@@ -63,6 +65,10 @@ int ovpn_struct_init(struct net_device *dev)
 
 	spin_lock_init(&ovpn->lock);
 	RCU_INIT_POINTER(ovpn->peer, NULL);
+	INIT_DELAYED_WORK(&ovpn->keepalive_work, ovpn_peer_keepalive_work);
+	INIT_DELAYED_WORK(&ovpn->idle_work, ovpn_peer_idle_work);
+	skb_queue_head_init(&ovpn->ctrl_queue);
+	INIT_WORK(&ovpn->ctrl_work, ovpn_netlink_ctrl_work);
 
 	ovpn->crypto_wq = alloc_workqueue("ovpn-crypto-wq-%s",
 					  WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 0,
@@ -74,344 +80,1504 @@ int ovpn_struct_init(struct net_device *dev)
 	if (!ovpn->events_wq)
 		return -ENOMEM;
 
+	err = ovpn_tfm_cache_init(&ovpn->tfm_cache, ovpn->events_wq);
+	if (err < 0)
+		return err;
+
+	ovpn->dp_stats = ovpn_dp_stats_alloc();
+	if (!ovpn->dp_stats)
+		return -ENOMEM;
+
+	err = ovpn_rxqs_init(ovpn);
+	if (err < 0)
+		return err;
+
 	dev->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
 	if (!dev->tstats)
 		return -ENOMEM;
 
-	err = security_tun_dev_alloc_security(&ovpn->security);
-	if (err < 0)
-		return err;
+	err = security_tun_dev_alloc_security(&ovpn->security);
+	if (err < 0)
+		return err;
+
+	/* kernel -> userspace tun queue length */
+	ovpn->max_tun_queue_len = OVPN_MAX_TUN_QUEUE_LEN;
+	ovpn->queue_len = OVPN_QUEUE_LEN;
+	ovpn->idle_timeout = OVPN_IDLE_TIMEOUT;
+
+	return ovpn_udp_ctrl_ratelimit_init(ovpn);
+}
+
+/* Give the CPU up if needed, from a crypto work processing a long backlog */
+static void ovpn_crypto_work_yield(struct ovpn_struct *ovpn)
+{
+	if (need_resched()) {
+		ovpn_dp_stats_inc(ovpn, OVPN_DP_STAT_WORK_RESCHED);
+		cond_resched();
+	}
+}
+
+/* RX queue context of the current CPU */
+static struct ovpn_rxq *ovpn_rxq_local(struct ovpn_struct *ovpn)
+{
+	return &ovpn->rxqs[raw_smp_processor_id() % ovpn->dev->num_rx_queues];
+}
+
+/* Called after decrypt to write IP packet to tun netdev, from the NAPI poll
+ * of rxq. This method is expected to manage/free skb.
+ */
+static void tun_netdev_write(struct ovpn_rxq *rxq, struct sk_buff *skb)
+{
+	struct net_device *dev = rxq->ovpn->dev;
+
+	/* packet integrity was verified on the VPN layer - no need to perform
+	 * any additional check along the stack
+	 */
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	skb->csum_level = ~0;
+
+	/* skb hash for transport packet no longer valid after decapsulation */
+	skb_clear_hash(skb);
+
+	/* post-decrypt scrub -- prepare to inject encapsulated packet onto tun
+	 * interface, based on __skb_tunnel_rx() in dst.h
+	 */
+	skb->dev = dev;
+	skb_scrub_packet(skb, true);
+
+	/* let RPS/RFS steer the packet based on the queue it arrived on */
+	skb_record_rx_queue(skb, rxq->index);
+
+	/* set transport header */
+	skb->transport_header = 0;
+	skb_probe_transport_header(skb);
+
+	/* update per-cpu RX stats with the stored size of encrypted packet */
+
+	/* we are in softirq context - hence no locking nor disable preemption needed */
+	dev_sw_netstats_rx_add(dev, OVPN_SKB_CB(skb)->rx_stats_size);
+
+	/* cause packet to be "received" by tun interface */
+	napi_gro_receive(&rxq->napi, skb);
+}
+
+static void ovpn_decrypt_batch(struct ovpn_peer *peer, struct sk_buff **skbs,
+			       unsigned int n);
+
+/* Find the peer a packet queued on an RX queue for decryption was received
+ * from. Must be called in an RCU read-side critical section
+ */
+static struct ovpn_peer *ovpn_rxq_peer_rcu(struct ovpn_struct *ovpn,
+					   u32 peer_id)
+{
+	if (ovpn->mode == OVPN_MODE_SERVER)
+		return ovpn_peer_lookup_id_rcu(ovpn, peer_id);
+
+	return rcu_dereference(ovpn->peer);
+}
+
+/* Decrypt up to budget packets from the decrypt ring of rxq (NAPI RX mode).
+ * Consecutive packets of the same peer are decrypted as a batch. Packets
+ * decrypted synchronously are delivered to the tun interface right away,
+ * while those handled by an asynchronous engine reach an RX queue netif_ring
+ * upon completion.
+ *
+ * Return the number of packets consumed from the decrypt ring
+ */
+static int ovpn_rxq_decrypt(struct ovpn_rxq *rxq, int budget)
+{
+	struct sk_buff *batch[OVPN_NAPI_BATCH];
+	int i, j, k, n, done = 0;
+	struct ovpn_peer *peer;
+	u32 peer_id;
+
+	BUILD_BUG_ON(OVPN_NAPI_BATCH > OVPN_CRYPTO_BATCH);
+
+	while (done < budget) {
+		/* the NAPI poll is the only consumer */
+		n = __ptr_ring_consume_batched(&rxq->decrypt_ring,
+					       (void **)batch,
+					       min(budget - done,
+						   OVPN_NAPI_BATCH));
+		if (!n)
+			break;
+
+		rcu_read_lock();
+		for (i = 0; i < n; i = j) {
+			peer_id = OVPN_SKB_CB(batch[i])->peer_id;
+			for (j = i + 1; j < n; j++)
+				if (OVPN_SKB_CB(batch[j])->peer_id != peer_id)
+					break;
+
+			/* the peer is gone since the packets were queued */
+			peer = ovpn_rxq_peer_rcu(rxq->ovpn, peer_id);
+			if (unlikely(!peer)) {
+				for (k = i; k < j; k++)
+					kfree_skb(batch[k]);
+				continue;
+			}
+
+			for (k = i; k < j; k++) {
+				OVPN_SKB_CB(batch[k])->ordered = false;
+				OVPN_SKB_CB(batch[k])->napi = true;
+			}
+			ovpn_decrypt_batch(peer, batch + i, j - i);
+		}
+		rcu_read_unlock();
+
+		done += n;
+	}
+
+	return done;
+}
+
+static int ovpn_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct ovpn_rxq *rxq = container_of(napi, struct ovpn_rxq, napi);
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	if (unlikely(budget <= 0))
+		return 0;
+	/* this function should schedule at most 'budget' number of
+	 * packets for delivery to the tun interface.
+	 * If in the queue we have more packets than what allowed by the
+	 * budget, the next polling will take care of those
+	 */
+	while ((work_done < budget) &&
+	       (skb = __ptr_ring_consume(&rxq->netif_ring))) {
+		tun_netdev_write(rxq, skb);
+		work_done++;
+	}
+
+	/* the decrypt ring is drained even after leaving NAPI RX mode */
+	work_done += ovpn_rxq_decrypt(rxq, budget - work_done);
+
+	ovpn_queue_stats_add(&rxq->stats, work_done);
+	ovpn_dp_stats_inc(rxq->ovpn, OVPN_DP_STAT_NAPI_POLLS);
+	ovpn_dp_stats_add(rxq->ovpn, OVPN_DP_STAT_NAPI_PACKETS, work_done);
+
+	if (work_done < budget) {
+		napi_complete_done(napi, work_done);
+
+		if (!__ptr_ring_empty(&rxq->netif_ring) ||
+		    !__ptr_ring_empty(&rxq->decrypt_ring))
+			napi_schedule(napi);
+	}
+
+	return work_done;
+}
+
+/* Allocate and start the RX queue contexts. Their rings get the default
+ * size, as they are shared by all peers
+ */
+int ovpn_rxqs_init(struct ovpn_struct *ovpn)
+{
+	struct net_device *dev = ovpn->dev;
+	struct ovpn_rxq *rxq;
+	unsigned int i;
+	int ret;
+
+	ovpn->rxqs = kvcalloc(dev->num_rx_queues, sizeof(*ovpn->rxqs),
+			      GFP_KERNEL);
+	if (!ovpn->rxqs)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->num_rx_queues; i++) {
+		rxq = &ovpn->rxqs[i];
+		rxq->ovpn = ovpn;
+		rxq->index = i;
+		u64_stats_init(&rxq->stats.syncp);
+
+		ret = ptr_ring_init(&rxq->decrypt_ring, OVPN_QUEUE_LEN,
+				    GFP_KERNEL);
+		if (ret < 0)
+			goto err;
+
+		ret = ptr_ring_init(&rxq->netif_ring, OVPN_QUEUE_LEN,
+				    GFP_KERNEL);
+		if (ret < 0) {
+			ptr_ring_cleanup(&rxq->decrypt_ring, NULL);
+			goto err;
+		}
+
+		netif_napi_add(dev, &rxq->napi, ovpn_napi_poll,
+			       NAPI_POLL_WEIGHT);
+		napi_enable(&rxq->napi);
+	}
+
+	return 0;
+err:
+	while (i-- > 0) {
+		rxq = &ovpn->rxqs[i];
+		napi_disable(&rxq->napi);
+		netif_napi_del(&rxq->napi);
+		ptr_ring_cleanup(&rxq->netif_ring, NULL);
+		ptr_ring_cleanup(&rxq->decrypt_ring, NULL);
+	}
+	kvfree(ovpn->rxqs);
+	ovpn->rxqs = NULL;
+	return ret;
+}
+
+static void ovpn_rxq_skb_free(void *ptr)
+{
+	kfree_skb(ptr);
+}
+
+/* Stop and release the RX queue contexts. Invoked when the interface is
+ * destroyed, once all peers are gone
+ */
+void ovpn_rxqs_release(struct ovpn_struct *ovpn)
+{
+	struct ovpn_rxq *rxq;
+	unsigned int i;
+
+	if (!ovpn->rxqs)
+		return;
+
+	for (i = 0; i < ovpn->dev->num_rx_queues; i++) {
+		rxq = &ovpn->rxqs[i];
+		napi_disable(&rxq->napi);
+		netif_napi_del(&rxq->napi);
+		ptr_ring_cleanup(&rxq->netif_ring, ovpn_rxq_skb_free);
+		ptr_ring_cleanup(&rxq->decrypt_ring, ovpn_rxq_skb_free);
+	}
+
+	kvfree(ovpn->rxqs);
+	ovpn->rxqs = NULL;
+}
+
+/* Hand a control packet over to userspace. skb is consumed on success */
+static int ovpn_transport_to_userspace(struct ovpn_peer *peer,
+				       struct sk_buff *skb)
+{
+	int ret;
+
+	ret = ovpn_netlink_queue_packet(peer->ovpn, peer, skb);
+	if (ret < 0)
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_CTRL);
+
+	return ret;
+}
+
+/* Pick the CPU the next packet of a peer should be processed on when crypto
+ * is parallelized. CPUs are used in a round-robin fashion
+ */
+static int ovpn_crypto_cpu_next(struct ovpn_peer *peer)
+{
+	int cpu;
+
+	cpu = cpumask_next(READ_ONCE(peer->crypto_cpu), cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	WRITE_ONCE(peer->crypto_cpu, cpu);
+
+	return cpu;
+}
+
+/* Hand a packet over to the crypto worker of the next CPU.
+ * The packet gets a sequence number in the peer reorder queue, so that it is
+ * delivered in order once processed, and holds a reference to the peer.
+ *
+ * Return 0 on success or a negative error code if the packet could not be
+ * tracked. In that case skb is not consumed.
+ */
+static int ovpn_crypto_cpu_queue(struct ovpn_struct *ovpn,
+				 struct ovpn_peer *peer, struct sk_buff *skb,
+				 bool tx)
+{
+	struct ovpn_reorder *reorder;
+	struct ovpn_crypto_cpu *cc;
+	int cpu, ret;
+
+	reorder = tx ? &peer->tx_reorder : &peer->rx_reorder;
+
+	if (unlikely(!ovpn_peer_hold(peer)))
+		return -ENOENT;
+
+	ret = ovpn_reorder_reserve(reorder, &OVPN_SKB_CB(skb)->seq);
+	if (unlikely(ret < 0)) {
+		ovpn_peer_put(peer);
+		return ret;
+	}
+
+	OVPN_SKB_CB(skb)->peer = peer;
+	OVPN_SKB_CB(skb)->ks = NULL;
+	OVPN_SKB_CB(skb)->ordered = true;
+	OVPN_SKB_CB(skb)->napi = false;
+	OVPN_SKB_CB(skb)->batch = NULL;
+
+	cpu = ovpn_crypto_cpu_next(peer);
+	cc = per_cpu_ptr(ovpn->crypto_cpus, cpu);
+
+	if (tx)
+		trace_ovpn_tx_queue(peer, skb, &cc->tx_ring);
+	else
+		trace_ovpn_rx_queue(peer, skb, &cc->rx_ring);
+
+	ret = ptr_ring_produce_bh(tx ? &cc->tx_ring : &cc->rx_ring, skb);
+	if (unlikely(ret < 0)) {
+		/* the sequence number is already taken: release it by
+		 * completing the packet as failed
+		 */
+		if (tx)
+			ovpn_encrypt_post(skb, ret);
+		else
+			ovpn_decrypt_post(skb, ret);
+		return 0;
+	}
+
+	if (queue_work_on(cpu, ovpn->crypto_wq,
+			  tx ? &cc->tx_work : &cc->rx_work))
+		ovpn_dp_stats_inc(ovpn, OVPN_DP_STAT_WORK_QUEUED);
+
+	return 0;
+}
+
+/* Enqueue a decrypted packet for delivery to the tun interface on the RX
+ * queue of the current CPU and schedule NAPI. This method is expected to
+ * manage/free skb.
+ */
+static void ovpn_netif_rx(struct sk_buff *skb)
+{
+	struct ovpn_peer *peer = OVPN_SKB_CB(skb)->peer;
+	struct ovpn_rxq *rxq = ovpn_rxq_local(peer->ovpn);
+
+	trace_ovpn_rx_deliver(peer, skb);
+
+	/* we are running in the NAPI poll of this CPU: no need to queue */
+	if (OVPN_SKB_CB(skb)->napi) {
+		tun_netdev_write(rxq, skb);
+		return;
+	}
+
+	trace_ovpn_netif_queue(peer, skb, &rxq->netif_ring);
+
+	/* the peer is not needed anymore and may go away while queued */
+	OVPN_SKB_CB(skb)->peer = NULL;
+
+	if (unlikely(ptr_ring_produce_bh(&rxq->netif_ring, skb) < 0)) {
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_RING_FULL);
+		kfree_skb(skb);
+		return;
+	}
+
+	/* signal packet availability to the networking stack */
+	local_bh_disable();
+	napi_schedule(&rxq->napi);
+	local_bh_enable();
+}
+
+/* Complete processing of a packet once decryption is done. Invoked either
+ * by ovpn_decrypt_batch() or by the crypto engine completion callback
+ */
+void ovpn_decrypt_post(struct sk_buff *skb, int ret)
+{
+	struct ovpn_peer *peer = OVPN_SKB_CB(skb)->peer;
+	bool ordered = OVPN_SKB_CB(skb)->ordered;
+	u32 seq = OVPN_SKB_CB(skb)->seq;
+	__be16 proto;
+
+	trace_ovpn_decrypt_done(peer, skb, ret);
+
+	if (likely(OVPN_SKB_CB(skb)->ks))
+		ovpn_crypto_key_slot_put(OVPN_SKB_CB(skb)->ks);
+
+	if (unlikely(ret < 0)) {
+		net_dbg_ratelimited("%s: error during decryption for peer %u: %d\n",
+				    peer->ovpn->dev->name, peer->id, ret);
+		ovpn_peer_stats_drop_err(peer, ret);
+		ovpn_dp_stats_inc(peer->ovpn, OVPN_DP_STAT_DECRYPT_ERRORS);
+		goto drop;
+	}
+
+	ovpn_dp_stats_inc(peer->ovpn, OVPN_DP_STAT_DECRYPTED);
+
+	ovpn_peer_lat_record(peer, skb, OVPN_PEER_LAT_RX_CRYPTO);
+
+	/* note event of authenticated packet received for keepalive */
+	ovpn_peer_keepalive_recv_reset(peer);
+
+	/* the packet is authentic, follow the peer if it changed address */
+	ovpn_peer_float(peer, skb);
+
+	/* increment RX stats */
+	ovpn_peer_stats_increment_rx(peer, OVPN_SKB_CB(skb)->rx_stats_size);
+
+	/* check if this is a valid datapacket that has to be delivered to the
+	 * tun interface
+	 */
+	skb_reset_network_header(skb);
+	proto = ovpn_ip_check_protocol(skb);
+	if (unlikely(!proto)) {
+		/* check if null packet */
+		if (unlikely(!pskb_may_pull(skb, 1)))
+			goto malformed;
+
+		/* check if special OpenVPN message */
+		if (ovpn_is_keepalive(skb)) {
+			pr_debug("ping received\n");
+			/* not an error */
+			consume_skb(skb);
+			/* nothing to deliver to the tun interface */
+			skb = NULL;
+			goto out;
+		}
+
+		goto malformed;
+	}
+	skb->protocol = proto;
+
+	if (READ_ONCE(peer->ovpn->mss_clamp))
+		ovpn_mss_clamp(peer, skb);
+	goto out;
+malformed:
+	ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_MALFORMED);
+drop:
+	kfree_skb(skb);
+	skb = NULL;
+out:
+	if (ordered) {
+		/* a dropped packet must be marked as completed too, otherwise
+		 * the packets following it would wait forever
+		 */
+		ovpn_reorder_complete(&peer->rx_reorder, seq, skb,
+				      ovpn_netif_rx);
+		ovpn_peer_put(peer);
+	} else if (skb) {
+		ovpn_netif_rx(skb);
+	}
+}
+
+/* Prepare a DATA_V2 packet for decryption with the key slot ks.
+ * Must be called in an RCU read-side critical section, which protects ks.
+ * Return 0 if skb can be handed to the crypto engine, or an error code to
+ * complete it with
+ */
+static int ovpn_decrypt_prepare(struct ovpn_peer *peer,
+				struct ovpn_crypto_key_slot *ks,
+				struct sk_buff *skb)
+{
+	int ret;
+
+	OVPN_SKB_CB(skb)->ks = NULL;
+	OVPN_SKB_CB(skb)->key_id = ks->key_id;
+
+	if (ks->async) {
+		/* completion may happen outside of the RCU critical section:
+		 * pin the key slot until ovpn_decrypt_post()
+		 */
+		if (unlikely(!ovpn_crypto_key_slot_hold(ks)))
+			return -ENOKEY;
+		OVPN_SKB_CB(skb)->ks = ks;
+
+		/* and outside of the NAPI poll */
+		OVPN_SKB_CB(skb)->napi = false;
+	}
+
+	/* an asynchronous engine may complete packets in any order: track
+	 * them so that they can be delivered in the order they were received.
+	 * Each of these packets holds a reference to the peer, because
+	 * completion may happen after the decrypt work has returned
+	 */
+	if (ks->async && !OVPN_SKB_CB(skb)->ordered) {
+		if (unlikely(!ovpn_peer_hold(peer)))
+			return -ENOENT;
+
+		ret = ovpn_reorder_reserve(&peer->rx_reorder,
+					   &OVPN_SKB_CB(skb)->seq);
+		if (unlikely(ret < 0)) {
+			ovpn_peer_put(peer);
+			return ret;
+		}
+		OVPN_SKB_CB(skb)->ordered = true;
+	}
+
+	ovpn_peer_lat_record(peer, skb, OVPN_PEER_LAT_RX_QUEUE);
+	trace_ovpn_decrypt_start(peer, skb);
+
+	return 0;
+}
+
+/* Decrypt n prepared packets with ks and complete the processing of those
+ * not handed to an asynchronous engine
+ */
+static void ovpn_decrypt_submit(struct ovpn_crypto_key_slot *ks,
+				struct sk_buff **skbs, unsigned int n)
+{
+	int rets[OVPN_CRYPTO_BATCH];
+	unsigned int i;
+
+	ovpn_crypto_decrypt_batch(ks, skbs, rets, n);
+
+	for (i = 0; i < n; i++)
+		if (rets[i] != -EINPROGRESS)
+			ovpn_decrypt_post(skbs[i], rets[i]);
+}
+
+/* Decrypt a DATA_V2 packet with the key slot ks and complete its processing.
+ * Must be called in an RCU read-side critical section, which protects ks
+ */
+static void ovpn_decrypt_data(struct ovpn_peer *peer,
+			      struct ovpn_crypto_key_slot *ks,
+			      struct sk_buff *skb)
+{
+	int ret;
+
+	ret = ovpn_decrypt_prepare(peer, ks, skb);
+	if (likely(!ret))
+		ovpn_decrypt_submit(ks, &skb, 1);
+	else
+		ovpn_decrypt_post(skb, ret);
+}
+
+/* Decrypt n packets of peer, at most OVPN_CRYPTO_BATCH, and complete their
+ * processing. Consecutive packets using the same key slot are handed to the
+ * crypto engine at once.
+ * If OVPN_SKB_CB(skb)->ordered is set, the caller has already assigned the
+ * packet a position in the peer reorder queue
+ */
+static void ovpn_decrypt_batch(struct ovpn_peer *peer, struct sk_buff **skbs,
+			       unsigned int n)
+{
+	struct ovpn_crypto_key_slot *ks = NULL;
+	struct sk_buff *ready[OVPN_CRYPTO_BATCH];
+	unsigned int i, count = 0;
+	struct sk_buff *skb;
+	int key_id, ret;
+	u32 op;
+
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		skb = skbs[i];
+
+		/* get opcode */
+		op = ovpn_op32_from_skb(skb, NULL);
+
+		/* save original packet size for stats accounting */
+		OVPN_SKB_CB(skb)->rx_stats_size = skb->len;
+		OVPN_SKB_CB(skb)->peer = peer;
+		OVPN_SKB_CB(skb)->ks = NULL;
+		OVPN_SKB_CB(skb)->key_id = 0;
+		OVPN_SKB_CB(skb)->pktid = 0;
+
+		/* we only handle OVPN_DATA_V2 packets from known peers here,
+		 * all the other packets were sent to userspace by ovpn_recv()
+		 */
+		if (unlikely(!ovpn_opcode_is_data_v2(op))) {
+			ret = -EPROTO;
+			goto post;
+		}
+
+		/* get the key slot matching the key Id in the received
+		 * packet. Packets are submitted one key slot at a time, in
+		 * the order they were received
+		 */
+		key_id = ovpn_key_id_extract(op);
+		if (!ks || ks->key_id != key_id) {
+			if (count)
+				ovpn_decrypt_submit(ks, ready, count);
+			count = 0;
+
+			ks = ovpn_crypto_key_id_to_slot_rcu(&peer->crypto,
+							    key_id);
+			if (unlikely(!ks)) {
+				ret = -ENOKEY;
+				goto post;
+			}
+		}
+
+		ret = ovpn_decrypt_prepare(peer, ks, skb);
+		if (likely(!ret)) {
+			ready[count++] = skb;
+			continue;
+		}
+post:
+		ovpn_decrypt_post(skb, ret);
+	}
+
+	if (count)
+		ovpn_decrypt_submit(ks, ready, count);
+	rcu_read_unlock();
+}
+
+static void ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	ovpn_decrypt_batch(peer, &skb, 1);
+}
+
+/* pick packets from RX queue, decrypt and forward them to the tun device */
+void ovpn_decrypt_work(struct work_struct *work)
+{
+	struct sk_buff *batch[OVPN_CRYPTO_BATCH];
+	struct ovpn_peer *peer;
+	int n;
+
+	peer = container_of(work, struct ovpn_peer, decrypt_work);
+	while ((n = ptr_ring_consume_batched_bh(&peer->rx_ring, (void **)batch,
+						OVPN_CRYPTO_BATCH))) {
+		ovpn_decrypt_batch(peer, batch, n);
+
+		ovpn_crypto_work_yield(peer->ovpn);
+	}
+	ovpn_peer_put(peer);
+}
+
+/* Decrypt a packet received over UDP directly in softirq context, rather
+ * than deferring it to the crypto workqueue.
+ *
+ * This is possible only for DATA_V2 packets whose key slot never completes
+ * asynchronously, as synchronous tfms do not sleep. Packets are deferred
+ * anyway while others of the same peer are queued for the decrypt work, so
+ * that they don't overtake them.
+ *
+ * Called in an RCU read-side critical section. Return true if skb was consumed
+ */
+static bool ovpn_decrypt_inline(struct ovpn_struct *ovpn,
+				struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_crypto_key_slot *ks;
+	u32 op;
+
+	/* TCP packets are extracted from the stream in process context */
+	if (ovpn->proto != OVPN_PROTO_UDP4 && ovpn->proto != OVPN_PROTO_UDP6)
+		return false;
+
+	/* locked, as the slots of the ring may be released meanwhile */
+	if (!ptr_ring_empty(&peer->rx_ring))
+		return false;
+
+	op = ovpn_op32_from_skb(skb, NULL);
+	if (unlikely(!ovpn_opcode_is_data_v2(op)))
+		return false;
+
+	ks = ovpn_crypto_key_id_to_slot_rcu(&peer->crypto,
+					    ovpn_key_id_extract(op));
+	if (unlikely(!ks) || ks->async)
+		return false;
+
+	OVPN_SKB_CB(skb)->rx_stats_size = skb->len;
+	OVPN_SKB_CB(skb)->peer = peer;
+	OVPN_SKB_CB(skb)->pktid = 0;
+	OVPN_SKB_CB(skb)->ordered = false;
+	OVPN_SKB_CB(skb)->napi = false;
+
+	ovpn_decrypt_data(peer, ks, skb);
+
+	return true;
+}
+
+/* Enqueue the packet and schedule RX consumer.
+ * The caller must either hold a reference to peer or be in an RCU read-side
+ * critical section: paths processing the packet later take their own
+ * reference
+ */
+bool ovpn_recv(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+	       struct sk_buff *skb)
+{
+	int ret;
+
+	/* control packets need no decryption: they go straight to userspace,
+	 * without competing with data packets for the crypto pipeline
+	 */
+	if (unlikely(!ovpn_opcode_is_data_v2(ovpn_op32_from_skb(skb, NULL)))) {
+		ret = ovpn_transport_to_userspace(peer, skb);
+		return ret == 0;
+	}
+
+	ovpn_peer_lat_stamp(skb);
+
+	if (smp_load_acquire(&ovpn->crypto_parallel)) {
+		ret = ovpn_crypto_cpu_queue(ovpn, peer, skb, false);
+		if (unlikely(ret < 0))
+			ovpn_peer_stats_drop_err(peer, ret);
+		return ret == 0;
+	}
+
+	/* let the NAPI poll of this CPU decrypt and deliver packets in
+	 * batches, along with those of the other peers
+	 */
+	if (READ_ONCE(ovpn->rx_mode) == OVPN_RX_MODE_NAPI) {
+		struct ovpn_rxq *rxq = ovpn_rxq_local(ovpn);
+
+		OVPN_SKB_CB(skb)->peer_id = peer->id;
+
+		trace_ovpn_rx_queue(peer, skb, &rxq->decrypt_ring);
+		ret = ptr_ring_produce_bh(&rxq->decrypt_ring, skb);
+		if (likely(ret == 0)) {
+			local_bh_disable();
+			napi_schedule(&rxq->napi);
+			local_bh_enable();
+		} else {
+			ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_RING_FULL);
+		}
+		return ret == 0;
+	}
+
+	if (ovpn_decrypt_inline(ovpn, peer, skb))
+		return true;
+
+	OVPN_SKB_CB(skb)->ordered = false;
+	OVPN_SKB_CB(skb)->napi = false;
+
+	trace_ovpn_rx_queue(peer, skb, &peer->rx_ring);
+	ovpn_peer_rings_used(peer);
+	ret = ovpn_peer_ring_produce(peer, &peer->rx_ring, skb, NULL);
+	if (ret < 0) {
+		/* full, or without slots and none could be allocated */
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_RING_FULL);
+		return false;
+	}
+
+	/* the decrypt work holds a reference to the peer while queued. If the
+	 * peer is going away, skb is freed along with rx_ring
+	 */
+	if (ovpn_peer_hold(peer)) {
+		if (queue_work(ovpn->crypto_wq, &peer->decrypt_work))
+			ovpn_dp_stats_inc(ovpn, OVPN_DP_STAT_WORK_QUEUED);
+		else
+			ovpn_peer_put(peer);
+	}
+
+	return true;
+}
+
+/* Send an encrypted packet across the tunnel.
+ * This method is expected to manage/free skb.
+ */
+static void ovpn_transport_xmit(struct sk_buff *skb)
+{
+	struct ovpn_peer *peer = OVPN_SKB_CB(skb)->peer;
+
+	trace_ovpn_tx_xmit(peer, skb);
+
+	switch (peer->ovpn->proto) {
+	case OVPN_PROTO_UDP4:
+	case OVPN_PROTO_UDP6:
+		ovpn_udp_send_skb(peer->ovpn, peer, skb);
+		break;
+	case OVPN_PROTO_TCP4:
+	case OVPN_PROTO_TCP6:
+		ovpn_tcp_send_skb(peer, skb);
+		break;
+	default:
+		/* no transport configured yet */
+		kfree_skb(skb);
+		break;
+	}
+}
+
+/* Complete processing of a packet once encryption is done. Invoked either
+ * by ovpn_encrypt_batch() or by the crypto engine completion callback
+ */
+void ovpn_encrypt_post(struct sk_buff *skb, int ret)
+{
+	struct ovpn_peer *peer = OVPN_SKB_CB(skb)->peer;
+	bool ordered = OVPN_SKB_CB(skb)->ordered;
+	u32 seq = OVPN_SKB_CB(skb)->seq;
+
+	trace_ovpn_encrypt_done(peer, skb, ret);
+
+	if (likely(OVPN_SKB_CB(skb)->ks))
+		ovpn_crypto_key_slot_put(OVPN_SKB_CB(skb)->ks);
+
+	if (unlikely(ret < 0)) {
+		net_dbg_ratelimited("%s: error during encryption for peer %u: %d\n",
+				    peer->ovpn->dev->name, peer->id, ret);
+		ovpn_peer_stats_drop_err(peer, ret);
+		ovpn_dp_stats_inc(peer->ovpn, OVPN_DP_STAT_ENCRYPT_ERRORS);
+		kfree_skb(skb);
+		skb = NULL;
+	} else {
+		ovpn_dp_stats_inc(peer->ovpn, OVPN_DP_STAT_ENCRYPTED);
+	}
+
+	/* increment TX stats */
+	if (likely(skb)) {
+		ovpn_peer_lat_record(peer, skb, OVPN_PEER_LAT_TX_CRYPTO);
+		ovpn_peer_stats_increment_tx(peer, skb->len);
+	}
+
+	if (ordered) {
+		ovpn_reorder_complete(&peer->tx_reorder, seq, skb,
+				      ovpn_transport_xmit);
+		ovpn_peer_put(peer);
+	} else if (skb && OVPN_SKB_CB(skb)->batch) {
+		/* sent along with the other segments by ovpn_encrypt_work() */
+		__skb_queue_tail(OVPN_SKB_CB(skb)->batch, skb);
+	} else if (skb) {
+		ovpn_transport_xmit(skb);
+	}
+}
+
+/* Prepare a packet for encryption with the key slot ks, which may be NULL if
+ * no key is installed. Must be called in an RCU read-side critical section,
+ * which protects ks. Return values follow ovpn_decrypt_prepare()
+ */
+static int ovpn_encrypt_prepare(struct ovpn_peer *peer,
+				struct ovpn_crypto_key_slot *ks,
+				struct sk_buff *skb)
+{
+	int ret;
+
+	/* init packet ID to undef in case we err before setting real value */
+	OVPN_SKB_CB(skb)->pktid = 0;
+	OVPN_SKB_CB(skb)->key_id = 0;
+	OVPN_SKB_CB(skb)->peer = peer;
+	OVPN_SKB_CB(skb)->ks = NULL;
+
+	if (unlikely(!ks)) {
+		net_dbg_ratelimited("%s: no primary key slot for peer %u\n",
+				    peer->ovpn->dev->name, peer->id);
+		return -ENOKEY;
+	}
+	OVPN_SKB_CB(skb)->key_id = ks->key_id;
+
+	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL)) {
+		ret = skb_checksum_help(skb);
+		if (unlikely(ret < 0))
+			return ret;
+	}
+
+	if (ks->async) {
+		/* see ovpn_decrypt_prepare() */
+		if (unlikely(!ovpn_crypto_key_slot_hold(ks)))
+			return -ENOKEY;
+		OVPN_SKB_CB(skb)->ks = ks;
+
+		/* completion may happen after ovpn_encrypt_work() has
+		 * returned
+		 */
+		OVPN_SKB_CB(skb)->batch = NULL;
+	}
+
+	/* see ovpn_decrypt_prepare() */
+	if (ks->async && !OVPN_SKB_CB(skb)->ordered) {
+		if (unlikely(!ovpn_peer_hold(peer)))
+			return -ENOENT;
+
+		ret = ovpn_reorder_reserve(&peer->tx_reorder,
+					   &OVPN_SKB_CB(skb)->seq);
+		if (unlikely(ret < 0)) {
+			ovpn_peer_put(peer);
+			return ret;
+		}
+		OVPN_SKB_CB(skb)->ordered = true;
+	}
+
+	ovpn_peer_lat_record(peer, skb, OVPN_PEER_LAT_TX_QUEUE);
+	trace_ovpn_encrypt_start(peer, skb);
+
+	return 0;
+}
+
+/* Encrypt n packets of peer, at most OVPN_CRYPTO_BATCH, with its primary key
+ * and complete their processing.
+ * See ovpn_decrypt_batch() for the meaning of OVPN_SKB_CB(skb)->ordered
+ */
+static void ovpn_encrypt_batch(struct ovpn_peer *peer, struct sk_buff **skbs,
+			       unsigned int n)
+{
+	struct sk_buff *ready[OVPN_CRYPTO_BATCH];
+	struct ovpn_crypto_key_slot *ks;
+	int rets[OVPN_CRYPTO_BATCH];
+	unsigned int i, count = 0;
+	int ret;
+
+	/* ks is protected by RCU, unless ovpn_encrypt_prepare() takes a
+	 * reference
+	 */
+	rcu_read_lock();
+
+	/* get primary key to be used for encrypting data */
+	ks = ovpn_crypto_key_slot_primary_rcu(&peer->crypto);
+
+	for (i = 0; i < n; i++) {
+		ret = ovpn_encrypt_prepare(peer, ks, skbs[i]);
+		if (likely(!ret))
+			ready[count++] = skbs[i];
+		else
+			ovpn_encrypt_post(skbs[i], ret);
+	}
+
+	if (count) {
+		ovpn_crypto_encrypt_batch(ks, ready, rets, count);
+
+		for (i = 0; i < count; i++)
+			if (rets[i] != -EINPROGRESS)
+				ovpn_encrypt_post(ready[i], rets[i]);
+	}
+
+	rcu_read_unlock();
+}
+
+static void ovpn_encrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	ovpn_encrypt_batch(peer, &skb, 1);
+}
+
+/* Encrypt a packet dequeued from a TX ring, which may be a list of GSO
+ * segments, and send it across the tunnel (UDP) or put it into the TCP TX
+ * queue of the peer (TCP)
+ */
+static void ovpn_encrypt_list(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct sk_buff *skbs[OVPN_CRYPTO_BATCH];
+	struct sk_buff_head batch, *gso_batch;
+	struct sk_buff *curr, *next;
+	unsigned int n = 0;
+	bool udp;
+
+	udp = peer->ovpn->proto == OVPN_PROTO_UDP4 ||
+	      peer->ovpn->proto == OVPN_PROTO_UDP6;
+
+	/* segments of a GSO packet that are encrypted synchronously are
+	 * collected and sent as UDP GSO packets
+	 */
+	__skb_queue_head_init(&batch);
+	gso_batch = udp && skb->next ? &batch : NULL;
+
+	/* this might be a GSO-segmented skb list: each skb is processed
+	 * independently, as segments may be completed asynchronously
+	 */
+	skb_list_walk_safe(skb, curr, next) {
+		skb_mark_not_on_list(curr);
+		OVPN_SKB_CB(curr)->ordered = false;
+		OVPN_SKB_CB(curr)->batch = gso_batch;
+
+		skbs[n++] = curr;
+		if (n == OVPN_CRYPTO_BATCH) {
+			ovpn_encrypt_batch(peer, skbs, n);
+			n = 0;
+		}
+	}
+
+	if (n)
+		ovpn_encrypt_batch(peer, skbs, n);
+
+	if (!skb_queue_empty(&batch)) {
+		if (trace_ovpn_tx_xmit_enabled())
+			skb_queue_walk(&batch, curr)
+				trace_ovpn_tx_xmit(peer, curr);
+
+		ovpn_udp_send_skb_list(peer->ovpn, peer, &batch);
+	}
+}
+
+/* Encrypt n packets dequeued from the TX ring of peer. Packets made of a
+ * single skb, i.e. all of them but GSO segment lists, are encrypted together
+ */
+static void ovpn_encrypt_ring_batch(struct ovpn_peer *peer,
+				    struct sk_buff **skbs, unsigned int n)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (skbs[i]->next) {
+			/* don't let segments overtake the packets before */
+			if (count)
+				ovpn_encrypt_batch(peer, skbs, count);
+			count = 0;
+
+			ovpn_encrypt_list(peer, skbs[i]);
+			continue;
+		}
+
+		OVPN_SKB_CB(skbs[i])->ordered = false;
+		OVPN_SKB_CB(skbs[i])->batch = NULL;
+		/* count <= i: pending packets are compacted in place */
+		skbs[count++] = skbs[i];
+	}
+
+	if (count)
+		ovpn_encrypt_batch(peer, skbs, count);
+}
+
+/* Process packets in TX queue in a transport-specific way.
+ *
+ * UDP transport - encrypt and send across the tunnel.
+ * TCP transport - encrypt and put into TCP TX queue.
+ */
+void ovpn_encrypt_work(struct work_struct *work)
+{
+	struct sk_buff *skbs[OVPN_CRYPTO_BATCH];
+	unsigned int consumed = 0;
+	struct ovpn_peer *peer;
+	int n;
+
+	peer = container_of(work, struct ovpn_peer, encrypt_work);
 
-	/* kernel -> userspace tun queue length */
-	ovpn->max_tun_queue_len = OVPN_MAX_TUN_QUEUE_LEN;
+	/* locked, as the slots of the ring may be released meanwhile */
+	while ((n = ptr_ring_consume_batched_bh(&peer->tx_ring, (void **)skbs,
+						OVPN_CRYPTO_BATCH))) {
+		/* let stopped device queues in again once a quarter of the
+		 * ring is free, rather than at each slot freed up
+		 */
+		consumed += n;
+		if (consumed >= peer->queue_len / 4) {
+			consumed = 0;
+			smp_mb();
+			ovpn_peer_tx_wake(peer);
+		}
 
-	return 0;
+		ovpn_encrypt_ring_batch(peer, skbs, n);
+
+		ovpn_crypto_work_yield(peer->ovpn);
+	}
+
+	/* pairs with smp_mb__after_atomic() in ovpn_peer_tx_stop() */
+	smp_mb();
+	ovpn_peer_tx_wake(peer);
+
+	ovpn_peer_put(peer);
 }
 
-/* Called after decrypt to write IP packet to tun netdev.
- * This method is expected to manage/free skb.
+/* Encrypt the packets transmitted on a device TX queue (see
+ * ovpn_tx_multiqueue_set()). Packets of all peers are processed in the order
+ * they were transmitted, each holding a reference to its peer
  */
-static void tun_netdev_write(struct ovpn_peer *peer, struct sk_buff *skb)
+static void ovpn_txq_work(struct work_struct *work)
 {
-	/* packet integrity was verified on the VPN layer - no need to perform
-	 * any additional check along the stack
-	 */
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
-	skb->csum_level = ~0;
+	struct ovpn_txq *txq = container_of(work, struct ovpn_txq, work);
+	unsigned int consumed = 0, packets = 0;
+	struct netdev_queue *dev_txq;
+	struct ovpn_peer *peer;
+	struct sk_buff *skb;
 
-	/* skb hash for transport packet no longer valid after decapsulation */
-	skb_clear_hash(skb);
+	dev_txq = netdev_get_tx_queue(txq->ovpn->dev, txq->index);
 
-	/* post-decrypt scrub -- prepare to inject encapsulated packet onto tun
-	 * interface, based on __skb_tunnel_rx() in dst.h
-	 */
-	skb->dev = peer->ovpn->dev;
-	skb_set_queue_mapping(skb, 0);
-	skb_scrub_packet(skb, true);
+	while ((skb = __ptr_ring_consume(&txq->ring))) {
+		/* see ovpn_encrypt_work() */
+		if (++consumed >= txq->ring.size / 4) {
+			consumed = 0;
+			smp_mb();
+			if (netif_tx_queue_stopped(dev_txq))
+				netif_tx_wake_queue(dev_txq);
+		}
 
-	/* set transport header */
-	skb->transport_header = 0;
-	skb_probe_transport_header(skb);
+		peer = OVPN_SKB_CB(skb)->peer;
+		ovpn_encrypt_list(peer, skb);
+		ovpn_peer_put(peer);
+		packets++;
 
-	/* update per-cpu RX stats with the stored size of encrypted packet */
+		ovpn_crypto_work_yield(txq->ovpn);
+	}
 
-	/* we are in softirq context - hence no locking nor disable preemption needed */
-	dev_sw_netstats_rx_add(peer->ovpn->dev, OVPN_SKB_CB(skb)->rx_stats_size);
+	ovpn_queue_stats_add(&txq->stats, packets);
 
-	/* cause packet to be "received" by tun interface */
-	napi_gro_receive(&peer->napi, skb);
+	/* pairs with smp_mb__after_atomic() in ovpn_txq_queue() */
+	smp_mb();
+	if (netif_tx_queue_stopped(dev_txq))
+		netif_tx_wake_queue(dev_txq);
 }
 
-int ovpn_napi_poll(struct napi_struct *napi, int budget)
+/* Queue skb on the encryption context of the device TX queue it was
+ * transmitted on. The reference to peer held by the caller is consumed.
+ *
+ * With XPS each TX queue is fed by its own CPU(s), therefore the ring is
+ * hardly shared with other CPUs. The encryption work is queued on the local
+ * CPU as well, so that packets are encrypted where they were produced.
+ */
+static void ovpn_txq_queue(struct ovpn_struct *ovpn, struct sk_buff *skb,
+			   struct ovpn_peer *peer, unsigned int queue)
 {
-	struct ovpn_peer *peer = container_of(napi, struct ovpn_peer, napi);
-	struct sk_buff *skb;
-	int work_done = 0;
+	struct ovpn_txq *txq = &ovpn->txqs[queue];
+	struct netdev_queue *dev_txq;
+	bool full;
+	int ret;
 
-	if (unlikely(budget <= 0))
-		return 0;
-	/* this function should schedule at most 'budget' number of
-	 * packets for delivery to the tun interface.
-	 * If in the queue we have more packets than what allowed by the
-	 * budget, the next polling will take care of those
-	 */
-	while ((work_done < budget) &&
-	       (skb = __ptr_ring_consume(&peer->netif_rx_ring))) {
-		tun_netdev_write(peer, skb);
-		work_done++;
-	}
+	OVPN_SKB_CB(skb)->peer = peer;
+	trace_ovpn_tx_queue(peer, skb, &txq->ring);
 
-	if (work_done < budget) {
-		napi_complete_done(napi, work_done);
+	spin_lock_bh(&txq->ring.producer_lock);
+	ret = __ptr_ring_produce(&txq->ring, skb);
+	full = __ptr_ring_full(&txq->ring);
+	spin_unlock_bh(&txq->ring.producer_lock);
 
-		if (!__ptr_ring_empty(&peer->netif_rx_ring))
-			napi_schedule(&peer->napi);
+	if (unlikely(full)) {
+		dev_txq = netdev_get_tx_queue(ovpn->dev, queue);
+		netif_tx_stop_queue(dev_txq);
+
+		/* pairs with the barrier in ovpn_txq_work() */
+		smp_mb__after_atomic();
+		if (unlikely(!ptr_ring_full_bh(&txq->ring)))
+			netif_tx_wake_queue(dev_txq);
 	}
 
-	return work_done;
+	if (unlikely(ret < 0)) {
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_RING_FULL);
+		ovpn_peer_put(peer);
+		kfree_skb_list(skb);
+		return;
+	}
+
+	if (queue_work(ovpn->crypto_wq, &txq->work))
+		ovpn_dp_stats_inc(ovpn, OVPN_DP_STAT_WORK_QUEUED);
 }
 
-static int ovpn_transport_to_userspace(struct ovpn_struct *ovpn,
-				       struct sk_buff *skb)
+static void ovpn_txqs_free(struct ovpn_struct *ovpn)
 {
-	int ret;
+	unsigned int i;
 
-	ret = skb_linearize(skb);
-	if (ret < 0)
-		return ret;
+	if (!ovpn->txqs)
+		return;
 
-	ret = ovpn_netlink_send_packet(ovpn, skb->data, skb->len);
-	if (ret < 0)
-		return ret;
+	for (i = 0; i < ovpn->dev->num_tx_queues; i++) {
+		/* queued packets are processed before the workqueue is
+		 * destroyed
+		 */
+		WARN_ON(!__ptr_ring_empty(&ovpn->txqs[i].ring));
+		ptr_ring_cleanup(&ovpn->txqs[i].ring, NULL);
+	}
 
-	consume_skb(skb);
-	return 0;
+	kvfree(ovpn->txqs);
+	ovpn->txqs = NULL;
 }
 
-/* enqueue the packet and schedule RX consumer */
-bool ovpn_recv(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
-	       struct sk_buff *skb)
+static int ovpn_txqs_alloc(struct ovpn_struct *ovpn)
 {
+	struct ovpn_txq *txq;
+	unsigned int i;
 	int ret;
 
-	ret = __ptr_ring_produce(&peer->rx_ring, skb);
-	if (ret < 0) {
-		ovpn_peer_put(peer);
-		return false;
-	}
+	ovpn->txqs = kvcalloc(ovpn->dev->num_tx_queues, sizeof(*ovpn->txqs),
+			      GFP_KERNEL);
+	if (!ovpn->txqs)
+		return -ENOMEM;
 
-	if (!queue_work(ovpn->crypto_wq, &peer->decrypt_work))
-		ovpn_peer_put(peer);
+	for (i = 0; i < ovpn->dev->num_tx_queues; i++) {
+		txq = &ovpn->txqs[i];
+		txq->ovpn = ovpn;
+		txq->index = i;
+		INIT_WORK(&txq->work, ovpn_txq_work);
+		u64_stats_init(&txq->stats.syncp);
 
-	return true;
+		ret = ptr_ring_init(&txq->ring, ovpn->queue_len, GFP_KERNEL);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	/* rings of queues that were not initialized yet are still zeroed */
+	ovpn_txqs_free(ovpn);
+	return ret;
 }
 
-static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+/* Bind each TX queue of the device to one CPU, so that packets transmitted
+ * by a CPU are always queued on the same encryption context
+ */
+static void ovpn_txqs_set_xps(struct ovpn_struct *ovpn)
 {
-	struct ovpn_crypto_key_slot *ks;
-	unsigned int rx_stats_size;
-	int key_id, ret = -1;
-	__be16 proto;
-	u32 op;
+#ifdef CONFIG_XPS
+	unsigned int i;
+	int ret;
 
-	/* get opcode */
-	op = ovpn_op32_from_skb(skb, NULL);
+	for (i = 0; i < ovpn->dev->real_num_tx_queues; i++) {
+		ret = netif_set_xps_queue(ovpn->dev,
+					  cpumask_of(cpumask_local_spread(i, NUMA_NO_NODE)),
+					  i);
+		if (ret < 0)
+			netdev_warn(ovpn->dev,
+				    "cannot set XPS map of TX queue %u: %d\n",
+				    i, ret);
+	}
+#endif
+}
 
-	/* save original packet size for stats accounting */
-	OVPN_SKB_CB(skb)->rx_stats_size = skb->len;
+/* Enable or disable encrypting packets in the context of the device TX queue
+ * they were transmitted on, rather than in the per-peer encrypt work. When
+ * enabled, CPUs transmitting packets to the same peer don't contend on the
+ * peer TX ring, while packets of a single flow still keep their order.
+ *
+ * Serialized by the netlink command handlers.
+ */
+int ovpn_tx_multiqueue_set(struct ovpn_struct *ovpn, bool enable)
+{
+	int ret;
 
-	/* we only handle OVPN_DATA_V2 packets from known peers here.
-	 *
-	 * all other packets are sent to userspace via netlink
-	 */
-	if (unlikely(!ovpn_opcode_is_data_v2(op))) {
-		ret = ovpn_transport_to_userspace(peer->ovpn, skb);
+	if (enable && !ovpn->txqs) {
+		ret = ovpn_txqs_alloc(ovpn);
 		if (ret < 0)
-			goto drop;
+			return ret;
 
-		/* even though the packet handling was successful, return -1 to
-		 * tell the caller that no packet was enqueued for delivery to
-		 * the tun interface, therefore NAPI should not be scheduled
-		 */
-		return -1;
+		ovpn_txqs_set_xps(ovpn);
 	}
 
-	/* get the key slot matching the key Id in the received packet */
-	key_id = ovpn_key_id_extract(op);
-	ks = ovpn_crypto_key_id_to_slot(&peer->crypto, key_id);
-	if (unlikely(!ks))
-		goto drop;
+	/* pairs with smp_load_acquire() on the data path */
+	smp_store_release(&ovpn->tx_multiqueue, enable);
 
-	/* decrypt */
-	ret = ks->ops->decrypt(ks, skb, op);
+	return 0;
+}
 
-	ovpn_crypto_key_slot_put(ks);
+/* Release the TX queue contexts. Invoked when the interface is destroyed
+ * after the crypto workqueue has been flushed
+ */
+void ovpn_tx_multiqueue_release(struct ovpn_struct *ovpn)
+{
+	ovpn->tx_multiqueue = false;
+	ovpn_txqs_free(ovpn);
+}
 
-	if (unlikely(ret < 0)) {
-		pr_err("error during decryption: %d\n", ret);
-		goto drop;
-	}
+/* per-cpu crypto workers, used when crypto is parallelized. Packets are
+ * processed in the order they were queued on each CPU and are reordered
+ * across CPUs by the peer reorder queues
+ */
+static void ovpn_crypto_cpu_encrypt_work(struct work_struct *work)
+{
+	struct ovpn_crypto_cpu *cc;
+	struct sk_buff *skb;
 
-	/* note event of authenticated packet received for keepalive */
-	ovpn_peer_keepalive_recv_reset(peer);
+	cc = container_of(work, struct ovpn_crypto_cpu, tx_work);
+	while ((skb = __ptr_ring_consume(&cc->tx_ring))) {
+		ovpn_encrypt_one(OVPN_SKB_CB(skb)->peer, skb);
 
-	/* increment RX stats */
-	rx_stats_size = OVPN_SKB_CB(skb)->rx_stats_size;
-	ovpn_peer_stats_increment_rx(peer, rx_stats_size);
+		ovpn_crypto_work_yield(cc->ovpn);
+	}
+}
 
-	/* check if this is a valid datapacket that has to be delivered to the
-	 * tun interface
-	 */
-	skb_reset_network_header(skb);
-	proto = ovpn_ip_check_protocol(skb);
-	if (unlikely(!proto)) {
-		/* check if null packet */
-		if (unlikely(!pskb_may_pull(skb, 1))) {
-			ret = -EINVAL;
-			goto drop;
-		}
+static void ovpn_crypto_cpu_decrypt_work(struct work_struct *work)
+{
+	struct ovpn_crypto_cpu *cc;
+	struct sk_buff *skb;
 
-		/* check if special OpenVPN message */
-		if (ovpn_is_keepalive(skb)) {
-			pr_debug("ping received\n");
-			/* not an error */
-			consume_skb(skb);
-			/* inform the caller that NAPI should not be scheduled
-			 * for this packet
-			 */
-			return -1;
-		}
+	cc = container_of(work, struct ovpn_crypto_cpu, rx_work);
+	while ((skb = __ptr_ring_consume(&cc->rx_ring))) {
+		ovpn_decrypt_one(OVPN_SKB_CB(skb)->peer, skb);
 
-		ret = -EPROTONOSUPPORT;
-		goto drop;
+		ovpn_crypto_work_yield(cc->ovpn);
 	}
-	skb->protocol = proto;
+}
 
-	ret = __ptr_ring_produce(&peer->netif_rx_ring, skb);
-drop:
-	if (unlikely(ret < 0))
-		kfree_skb(skb);
+static void ovpn_crypto_cpus_free(struct ovpn_struct *ovpn)
+{
+	struct ovpn_crypto_cpu *cc;
+	int cpu;
 
-	return ret;
+	if (!ovpn->crypto_cpus)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		cc = per_cpu_ptr(ovpn->crypto_cpus, cpu);
+		/* queued packets are processed before the workqueue is
+		 * destroyed
+		 */
+		WARN_ON(!__ptr_ring_empty(&cc->tx_ring));
+		ptr_ring_cleanup(&cc->tx_ring, NULL);
+		WARN_ON(!__ptr_ring_empty(&cc->rx_ring));
+		ptr_ring_cleanup(&cc->rx_ring, NULL);
+	}
+
+	free_percpu(ovpn->crypto_cpus);
+	ovpn->crypto_cpus = NULL;
 }
 
-/* pick packet from RX queue, decrypt and forward it to the tun device */
-void ovpn_decrypt_work(struct work_struct *work)
+static int ovpn_crypto_cpus_alloc(struct ovpn_struct *ovpn)
 {
-	struct ovpn_peer *peer;
-	struct sk_buff *skb;
+	struct ovpn_crypto_cpu *cc;
+	int cpu, ret;
 
-	peer = container_of(work, struct ovpn_peer, decrypt_work);
-	while ((skb = __ptr_ring_consume(&peer->rx_ring))) {
-		if (ovpn_decrypt_one(peer, skb) == 0) {
-			/* if a packet has been enqueued for NAPI, signal
-			 * availability to the networking stack
-			 */
-			local_bh_disable();
-			napi_schedule(&peer->napi);
-			local_bh_enable();
-		}
+	ovpn->crypto_cpus = alloc_percpu(struct ovpn_crypto_cpu);
+	if (!ovpn->crypto_cpus)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		cc = per_cpu_ptr(ovpn->crypto_cpus, cpu);
+		cc->ovpn = ovpn;
+		INIT_WORK(&cc->tx_work, ovpn_crypto_cpu_encrypt_work);
+		INIT_WORK(&cc->rx_work, ovpn_crypto_cpu_decrypt_work);
+
+		ret = ptr_ring_init(&cc->tx_ring, ovpn->queue_len, GFP_KERNEL);
+		if (ret < 0)
+			goto err;
 
-		/* give a chance to be rescheduled if needed */
-		if (need_resched())
-			cond_resched();
+		ret = ptr_ring_init(&cc->rx_ring, ovpn->queue_len, GFP_KERNEL);
+		if (ret < 0)
+			goto err;
 	}
-	ovpn_peer_put(peer);
+
+	return 0;
+err:
+	/* rings of CPUs that were not initialized yet are still zeroed */
+	ovpn_crypto_cpus_free(ovpn);
+	return ret;
 }
 
-static bool ovpn_encrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+/* Enable or disable spreading the packets of each peer across all CPUs for
+ * encryption/decryption. When disabled, a single worker per peer and
+ * direction is used.
+ *
+ * Packets already queued on the per-cpu workers when disabling are still
+ * processed and delivered in order among themselves.
+ *
+ * Serialized by the netlink command handlers.
+ */
+int ovpn_crypto_parallel_set(struct ovpn_struct *ovpn, bool enable)
 {
-	struct ovpn_crypto_key_slot *ks;
-	bool success = false;
 	int ret;
 
-	/* get primary key to be used for encrypting data */
-	ks = ovpn_crypto_key_slot_primary(&peer->crypto);
-	if (unlikely(!ks)) {
-		pr_err("error while retrieving primary key slot\n");
-		return false;
+	if (enable && !ovpn->crypto_cpus) {
+		ret = ovpn_crypto_cpus_alloc(ovpn);
+		if (ret < 0)
+			return ret;
 	}
 
-	/* init packet ID to undef in case we err before setting real value */
-	OVPN_SKB_CB(skb)->pktid = 0;
+	/* pairs with smp_load_acquire() on the data path, so that crypto_cpus is
+	 * visible when crypto_parallel is
+	 */
+	smp_store_release(&ovpn->crypto_parallel, enable);
 
-	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL &&
-		     skb_checksum_help(skb)))
-		goto err;
+	return 0;
+}
 
-	/* encrypt */
-	ret = ks->ops->encrypt(ks, skb);
-	if (unlikely(ret < 0)) {
-		pr_err("error during encryption: %d\n", ret);
-		goto err;
-	}
+/* Release the per-cpu crypto workers. Invoked when the interface is destroyed
+ * after the crypto workqueue has been flushed
+ */
+void ovpn_crypto_parallel_release(struct ovpn_struct *ovpn)
+{
+	ovpn->crypto_parallel = false;
+	ovpn_crypto_cpus_free(ovpn);
+}
 
-	success = true;
-err:
-	ovpn_crypto_key_slot_put(ks);
-	return success;
+/* Report the memory used by the interface and its peers into mem.
+ * Serialized by the netlink command handlers, like the allocation of the
+ * per-cpu and per-queue contexts
+ */
+void ovpn_mem(struct ovpn_struct *ovpn, struct ovpn_mem_info *mem)
+{
+	struct net_device *dev = ovpn->dev;
+	struct ovpn_crypto_cpu *cc;
+	unsigned int i;
+	int cpu;
+
+	memset(mem, 0, sizeof(*mem));
+
+	mem->iface_bytes = sizeof(*ovpn) +
+			   (1 << OVPN_CTRL_RATELIMIT_BITS) *
+			   sizeof(*ovpn->ctrl_buckets);
+
+	if (ovpn->peers)
+		mem->iface_bytes += sizeof(*ovpn->peers);
+
+	for (i = 0; i < dev->num_rx_queues; i++)
+		mem->iface_bytes += sizeof(ovpn->rxqs[i]) +
+				    (ovpn->rxqs[i].decrypt_ring.size +
+				     ovpn->rxqs[i].netif_ring.size) *
+				    sizeof(void *);
+
+	if (ovpn->txqs)
+		for (i = 0; i < dev->num_tx_queues; i++)
+			mem->iface_bytes += sizeof(ovpn->txqs[i]) +
+					    ovpn->txqs[i].ring.size *
+					    sizeof(void *);
+
+	if (ovpn->crypto_cpus)
+		for_each_possible_cpu(cpu) {
+			cc = per_cpu_ptr(ovpn->crypto_cpus, cpu);
+			mem->iface_bytes += sizeof(*cc) +
+					    (cc->tx_ring.size +
+					     cc->rx_ring.size) *
+					    sizeof(void *);
+		}
+
+	ovpn_peers_mem(ovpn, mem);
 }
 
-/* Process packets in TX queue in a transport-specific way.
+/* Put skb into TX queue and schedule a consumer.
+ * The reference to peer held by the caller is consumed.
  *
- * UDP transport - encrypt and send across the tunnel.
- * TCP transport - encrypt and put into TCP TX queue.
+ * queue is the device TX queue skb comes from, which is stopped when the TX
+ * queue of the peer fills up, or -1 if skb was generated internally.
  */
-void ovpn_encrypt_work(struct work_struct *work)
+static void ovpn_queue_skb(struct ovpn_struct *ovpn, struct sk_buff *skb,
+			   struct ovpn_peer *peer, int queue)
 {
-	struct sk_buff *skb, *curr, *next;
-	struct ovpn_peer *peer;
+	struct sk_buff *curr, *next;
+	bool full;
+	int ret;
 
-	peer = container_of(work, struct ovpn_peer, encrypt_work);
-	while ((skb = __ptr_ring_consume(&peer->tx_ring))) {
-		/* this might be a GSO-segmented skb list: process each skb
-		 * independently
-		 */
+	if (smp_load_acquire(&ovpn->crypto_parallel)) {
+		/* each segment of a GSO packet is dispatched on its own */
 		skb_list_walk_safe(skb, curr, next) {
-			/* if one segment fails encryption, we drop the entire
-			 * packet, because it does not really make sense to send
-			 * only part of it at this point
-			 */
-			if (!ovpn_encrypt_one(peer, curr)) {
-				kfree_skb_list(skb);
-				skb = NULL;
-				break;
+			skb_mark_not_on_list(curr);
+			ovpn_peer_lat_stamp(curr);
+			ret = ovpn_crypto_cpu_queue(ovpn, peer, curr, true);
+			if (unlikely(ret < 0)) {
+				ovpn_peer_stats_drop_err(peer, ret);
+				kfree_skb(curr);
 			}
 		}
+		ovpn_peer_put(peer);
+		return;
+	}
 
-		/* successful encryption */
-		if (skb) {
-			skb_list_walk_safe(skb, curr, next) {
-				skb_mark_not_on_list(curr);
+	/* the ring may be consumed as soon as skb is queued */
+	if (IS_ENABLED(CONFIG_OVPN_DCO_LATENCY_HIST))
+		for (curr = skb; curr; curr = curr->next)
+			ovpn_peer_lat_stamp(curr);
 
-				switch (peer->ovpn->proto) {
-				case OVPN_PROTO_UDP4:
-				case OVPN_PROTO_UDP6:
-					ovpn_udp_send_skb(peer->ovpn, peer, curr);
-					break;
-				case OVPN_PROTO_TCP4:
-				case OVPN_PROTO_TCP6:
-					ovpn_tcp_send_skb(peer, curr);
-					break;
-				default:
-					/* no transport configured yet */
-					consume_skb(skb);
-					break;
-				}
-			}
-		}
+	if (queue >= 0 && smp_load_acquire(&ovpn->tx_multiqueue)) {
+		ovpn_txq_queue(ovpn, skb, peer, queue);
+		return;
+	}
 
-		/* give a chance to be rescheduled if needed */
-		if (need_resched())
-			cond_resched();
+	/* keepalive pings and the like don't bring an idle peer back: they are
+	 * encrypted right away, rather than giving slots to its ring. Their
+	 * caller runs in process context, like the encrypt work
+	 */
+	if (queue < 0 && !READ_ONCE(peer->tx_ring.size)) {
+		ovpn_encrypt_list(peer, skb);
+		ovpn_peer_put(peer);
+		return;
 	}
-	ovpn_peer_put(peer);
-}
 
-/* Put skb into TX queue and schedule a consumer */
-static void ovpn_queue_skb(struct ovpn_struct *ovpn, struct sk_buff *skb)
-{
-	struct ovpn_peer *peer;
-	int ret;
+	trace_ovpn_tx_queue(peer, skb, &peer->tx_ring);
 
-	peer = ovpn_peer_get(ovpn);
-	if (unlikely(!peer))
-		goto drop;
+	if (queue >= 0)
+		ovpn_peer_rings_used(peer);
+	ret = ovpn_peer_ring_produce(peer, &peer->tx_ring, skb, &full);
 
-	ret = __ptr_ring_produce(&peer->tx_ring, skb);
-	if (ret < 0)
+	/* push back on the qdisc as soon as the ring is full, so that next
+	 * packets are not tail-dropped. Device queues are shared by all peers:
+	 * in server mode a slow peer would hold back the others, so its ring
+	 * is its own limit and packets over it are dropped instead
+	 */
+	if (unlikely(full) && queue >= 0 && ovpn->mode != OVPN_MODE_SERVER)
+		ovpn_peer_tx_stop(peer, queue);
+
+	if (ret < 0) {
+		/* full, or without slots and none could be allocated */
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_RING_FULL);
 		goto drop;
+	}
 
-	if (!queue_work(ovpn->crypto_wq, &peer->encrypt_work))
+	if (queue_work(ovpn->crypto_wq, &peer->encrypt_work))
+		ovpn_dp_stats_inc(ovpn, OVPN_DP_STAT_WORK_QUEUED);
+	else
 		ovpn_peer_put(peer);
 
 	return;
 drop:
-	if (peer)
-		ovpn_peer_put(peer);
+	ovpn_peer_put(peer);
 	kfree_skb_list(skb);
 }
 
+/* Retrieve the peer an outgoing packet has to be sent to.
+ * Return the peer with a reference held or NULL if none was found.
+ */
+static struct ovpn_peer *ovpn_peer_xmit_lookup(struct ovpn_struct *ovpn,
+					       struct sk_buff *skb)
+{
+	/* in server mode the peer is selected using the destination
+	 * address of the packet, while in client mode we have only one peer
+	 */
+	if (ovpn->mode == OVPN_MODE_SERVER)
+		return ovpn_peer_lookup_vpn_addr(ovpn, skb);
+
+	return ovpn_peer_get(ovpn);
+}
+
 /* Net device start xmit
  */
 netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
@@ -419,6 +1585,8 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	struct ovpn_struct *ovpn = netdev_priv(dev);
 	struct sk_buff *segments, *tmp, *curr, *next;
 	struct sk_buff_head skb_list;
+	u16 queue = skb_get_queue_mapping(skb);
+	struct ovpn_peer *peer;
 	__be16 proto;
 	int ret;
 
@@ -433,13 +1601,28 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
 		goto drop;
 	}
 
+	peer = ovpn_peer_xmit_lookup(ovpn, skb);
+	if (unlikely(!peer)) {
+		net_dbg_ratelimited("%s: no peer to send data to\n",
+				    dev->name);
+		goto drop;
+	}
+
+	/* the sender is told to send smaller packets rather than having the
+	 * encapsulation fragmented
+	 */
+	if (READ_ONCE(ovpn->pmtu_discovery) && !ovpn_pmtu_check(peer, skb))
+		goto drop_peer;
+
 	if (skb_is_gso(skb)) {
 		segments = skb_gso_segment(skb, 0);
 		if (IS_ERR(segments)) {
 			ret = PTR_ERR(segments);
-			goto drop;
+			goto drop_peer;
 		}
 
+		ovpn_dp_stats_add(ovpn, OVPN_DP_STAT_GSO_SEGS,
+				  skb_shinfo(skb)->gso_segs);
 		consume_skb(skb);
 		skb = segments;
 	}
@@ -456,17 +1639,25 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
 			goto drop_list;
 		}
 
+		if (READ_ONCE(ovpn->mss_clamp))
+			ovpn_mss_clamp(peer, tmp);
+
 		__skb_queue_tail(&skb_list, tmp);
 	}
 	skb_list.prev->next = NULL;
 
-	ovpn_queue_skb(ovpn, skb_list.next);
+	ovpn_queue_skb(ovpn, skb_list.next, peer, queue);
 
 	return NETDEV_TX_OK;
 
 drop_list:
+	/* the original skb is part of the list: don't free it twice */
 	skb_queue_walk_safe(&skb_list, curr, next)
 		kfree_skb(curr);
+	ovpn_peer_put(peer);
+	return NET_XMIT_DROP;
+drop_peer:
+	ovpn_peer_put(peer);
 drop:
 	skb_tx_error(skb);
 	kfree_skb_list(skb);
@@ -495,7 +1686,13 @@ static void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
 	skb->priority = TC_PRIO_BESTEFFORT;
 	memcpy(__skb_put(skb, len), data, len);
 
-	ovpn_queue_skb(ovpn, skb);
+	/* the TX queue consumes one reference to the peer */
+	if (unlikely(!ovpn_peer_hold(peer))) {
+		kfree_skb(skb);
+		return;
+	}
+
+	ovpn_queue_skb(ovpn, skb, peer, -1);
 }
 
 void ovpn_keepalive_xmit(struct ovpn_peer *peer)
@@ -514,17 +1711,17 @@ void ovpn_explicit_exit_notify_xmit(struct ovpn_peer *peer)
 }
 
 /* Copy buffer into skb and send it across the tunnel.
+ * Assumes that caller holds a reference to peer.
  *
  * For UDP transport: just sent the skb to peer
  * For TCP transport: put skb into TX queue
  */
-int ovpn_send_data(struct ovpn_struct *ovpn, const u8 *data, size_t len)
+int ovpn_send_data(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+		   const u8 *data, size_t len)
 {
 	u16 skb_len = SKB_HEADER_LEN + len;
-	struct ovpn_peer *peer;
 	struct sk_buff *skb;
 	bool tcp = false;
-	int ret = 0;
 
 	switch (ovpn->proto) {
 	case OVPN_PROTO_TCP4:
@@ -536,17 +1733,9 @@ int ovpn_send_data(struct ovpn_struct *ovpn, const u8 *data, size_t len)
 		break;
 	}
 
-	peer = ovpn_peer_get(ovpn);
-	if (!peer) {
-		pr_debug("no peer to send data to\n");
-		return -EHOSTUNREACH;
-	}
-
 	skb = alloc_skb(skb_len, GFP_ATOMIC);
-	if (unlikely(!skb)) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	if (unlikely(!skb))
+		return -ENOMEM;
 
 	skb_reserve(skb, SKB_HEADER_LEN);
 	skb_put_data(skb, data, len);
@@ -558,7 +1747,6 @@ int ovpn_send_data(struct ovpn_struct *ovpn, const u8 *data, size_t len)
 	} else {
 		ovpn_udp_send_skb(ovpn, peer, skb);
 	}
-out:
-	ovpn_peer_put(peer);
-	return ret;
+
+	return 0;
 }
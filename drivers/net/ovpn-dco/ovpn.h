@@ -36,8 +36,20 @@ bool ovpn_recv(struct ovpn_struct *ovpn, struct ovpn_peer *peer, struct sk_buff
 
 void ovpn_encrypt_work(struct work_struct *work);
 void ovpn_decrypt_work(struct work_struct *work);
-int ovpn_napi_poll(struct napi_struct *napi, int budget);
+void ovpn_encrypt_post(struct sk_buff *skb, int ret);
+void ovpn_decrypt_post(struct sk_buff *skb, int ret);
+int ovpn_rxqs_init(struct ovpn_struct *ovpn);
+void ovpn_rxqs_release(struct ovpn_struct *ovpn);
 
-int ovpn_send_data(struct ovpn_struct *ovpn, const u8 *data, size_t len);
+int ovpn_crypto_parallel_set(struct ovpn_struct *ovpn, bool enable);
+void ovpn_crypto_parallel_release(struct ovpn_struct *ovpn);
+
+int ovpn_tx_multiqueue_set(struct ovpn_struct *ovpn, bool enable);
+void ovpn_tx_multiqueue_release(struct ovpn_struct *ovpn);
+
+void ovpn_mem(struct ovpn_struct *ovpn, struct ovpn_mem_info *mem);
+
+int ovpn_send_data(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+		   const u8 *data, size_t len);
 
 #endif /* _NET_OVPN_DCO_OVPN_H_ */
@@ -10,12 +10,123 @@
 #ifndef _NET_OVPN_DCO_OVPNSTRUCT_H_
 #define _NET_OVPN_DCO_OVPNSTRUCT_H_
 
+#include "main.h"
+#include "crypto_aead.h"
+#include "iroute.h"
 #include "peer.h"
 
 #include <uapi/linux/ovpn_dco.h>
+#include <linux/hashtable.h>
+#include <linux/netfilter.h>
+#include <linux/ptr_ring.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
 
+/* Peer lookup tables used in server mode. Lookups are performed locklessly
+ * under RCU, while any write access is serialized by the lock below
+ */
+struct ovpn_peers {
+	/* peers indexed by the peer-id carried by DATA_V2 packets */
+	DECLARE_HASHTABLE(by_id, OVPN_PEER_HASH_BITS);
+	/* peers indexed by remote transport address and port */
+	DECLARE_HASHTABLE(by_transp_addr, OVPN_PEER_HASH_BITS);
+	/* peers indexed by their IPv4 and IPv6 address within the VPN. The
+	 * families use separate tables, as each is linked through its own node
+	 * of struct ovpn_peer
+	 */
+	DECLARE_HASHTABLE(by_vpn_addr4, OVPN_PEER_HASH_BITS);
+	DECLARE_HASHTABLE(by_vpn_addr6, OVPN_PEER_HASH_BITS);
+	/* networks routed via specific peers, looked up when no peer owns
+	 * the destination address of an outgoing packet
+	 */
+	struct ovpn_iroutes iroutes;
+
+	/* number of peers currently stored in the tables */
+	unsigned int count;
+
+	/* protects write access to the tables above */
+	spinlock_t lock;
+};
+
+/* Per-cpu crypto workers, used when the packets of a peer are spread across
+ * all CPUs for encryption/decryption
+ */
+struct ovpn_crypto_cpu {
+	struct ovpn_struct *ovpn;
+
+	/* packets to be encrypted/decrypted on this CPU */
+	struct ptr_ring tx_ring;
+	struct ptr_ring rx_ring;
+
+	struct work_struct tx_work;
+	struct work_struct rx_work;
+};
+
+/* Encryption context of a device TX queue, used when packets are encrypted
+ * on the queue they were transmitted on
+ */
+struct ovpn_txq {
+	struct ovpn_struct *ovpn;
+	/* index of the device TX queue */
+	unsigned int index;
+
+	/* packets transmitted on this queue, each holding a peer reference */
+	struct ptr_ring ring;
+	struct work_struct work;
+	/* runs of work and packets they encrypted */
+	struct ovpn_queue_stats stats;
+} ____cacheline_aligned_in_smp;
+
+/* Receive context of a device RX queue. Packets of any peer are decrypted
+ * (in NAPI RX mode) and delivered to the tun interface by the NAPI context of
+ * the CPU they were received or decrypted on, each CPU using the RX queue
+ * returned by ovpn_rxq_local().
+ * Queued packets don't reference their peer, which may go away meanwhile
+ */
+struct ovpn_rxq {
+	struct ovpn_struct *ovpn;
+	/* index of the device RX queue, recorded in delivered packets */
+	unsigned int index;
+
+	struct napi_struct napi;
+
+	/* packets waiting for decryption in NAPI RX mode. The peer is looked
+	 * up again by OVPN_SKB_CB(skb)->peer_id when they are dequeued
+	 */
+	struct ptr_ring decrypt_ring;
+	/* decrypted packets waiting for delivery */
+	struct ptr_ring netif_ring;
+	/* NAPI polls and packets they processed */
+	struct ovpn_queue_stats stats;
+} ____cacheline_aligned_in_smp;
+
+/* Token bucket limiting the control packets accepted from the source
+ * addresses hashed to it (see ovpn_udp_ctrl_ratelimit())
+ */
+struct ovpn_ctrl_bucket {
+	spinlock_t lock;
+	/* available tokens, in 1/HZ of a packet */
+	u64 tokens;
+	/* last refill (jiffies) */
+	unsigned long last;
+};
+
+/* reasons the early filter may drop a packet for. Exported over netlink as
+ * OVPN_FILTER_STATS_ATTR_DROPS_* in the same order
+ */
+enum ovpn_filter_drop_reason {
+	OVPN_FILTER_DROP_OPCODE,
+	OVPN_FILTER_DROP_PEER_ID,
+	OVPN_FILTER_DROP_KEY_ID,
+	OVPN_FILTER_DROP_REPLAY,
+	OVPN_FILTER_DROP_REASONS,
+};
+
+/* packets dropped by the early filter on one CPU */
+struct ovpn_filter_stats {
+	unsigned long drops[OVPN_FILTER_DROP_REASONS];
+};
+
 /* Our state per ovpn interface */
 struct ovpn_struct {
 	/* read-mostly objects in this section */
@@ -31,16 +142,88 @@ struct ovpn_struct {
 	 */
 	struct workqueue_struct *events_wq;
 
-	/* associated peer. in client mode we need only one peer. will be
-	 * extended with a table later
+	/* crypto transforms ready to be keyed, refilled on events_wq */
+	struct ovpn_tfm_cache tfm_cache;
+
+	/* periodic keepalive scan of all peers, queued on events_wq */
+	struct delayed_work keepalive_work;
+
+	/* periodic scan releasing the memory unused by the peers, queued on
+	 * events_wq, and the seconds after which it does so (0 for never)
+	 */
+	struct delayed_work idle_work;
+	u32 idle_timeout;
+
+	/* control packets waiting to be delivered to userspace by ctrl_work,
+	 * queued on events_wq. At most OVPN_CTRL_QUEUE_LEN packets are queued
+	 */
+	struct sk_buff_head ctrl_queue;
+	struct work_struct ctrl_work;
+
+	/* max control packets per second accepted from a source address, 0 if
+	 * unlimited
 	 */
+	u32 ctrl_rate;
+	u32 ctrl_seed;
+	struct ovpn_ctrl_bucket *ctrl_buckets;
+
+	/* true if invalid packets sent to the UDP socket are dropped by
+	 * netfilter hooks, registered in the namespace of the socket while a
+	 * VPN is running (see ovpn_udp_filter_set())
+	 */
+	bool early_filter;
+	unsigned int filter_hooks;
+	struct nf_hook_ops filter_ops[2];
+	/* allocated when the filter is enabled for the first time */
+	struct ovpn_filter_stats __percpu *filter_stats;
+
+	/* refuse packets not fitting the path MTU to their peer once
+	 * encapsulated, and set DF on the outer IPv4 header (see pmtu.c)
+	 */
+	bool pmtu_discovery;
+	/* clamp the MSS of TCP SYNs to the MTU of the tunnel to their peer */
+	bool mss_clamp;
+
+	/* true if crypto is parallelized across CPUs (see crypto_cpus) */
+	bool crypto_parallel;
+	/* allocated when crypto parallelization is enabled for the first time */
+	struct ovpn_crypto_cpu __percpu *crypto_cpus;
+
+	/* true if packets are encrypted in the context of the TX queue they
+	 * were transmitted on (see txqs)
+	 */
+	bool tx_multiqueue;
+	/* one per device TX queue, allocated when first enabled */
+	struct ovpn_txq *txqs;
+
+	/* how received packets are scheduled for decryption */
+	enum ovpn_rx_mode rx_mode;
+	/* one per device RX queue, allocated with the interface */
+	struct ovpn_rxq *rxqs;
+
+	/* datapath counters, reported by ethtool -S */
+	struct ovpn_dp_pcpu_stats __percpu *dp_stats;
+
+	/* associated peer. in client mode we need only one peer */
 	struct ovpn_peer __rcu *peer;
+	/* peer tables used in server mode, allocated when the VPN is started */
+	struct ovpn_peers *peers;
 	struct socket *sock;
+	/* other UDP sockets of the SO_REUSEPORT group of sock, added with
+	 * OVPN_CMD_ADD_SOCKET. Packets are received by any of them, as
+	 * selected by the group, and sent through the one picked by the
+	 * current CPU (see ovpn_udp_sock_tx())
+	 */
+	struct socket *reuseport_socks[OVPN_MAX_REUSEPORT_SOCKS];
+	unsigned int num_reuseport_socks;
 	enum ovpn_mode mode;
 	enum ovpn_proto proto;
 
 	unsigned int max_tun_queue_len;
 
+	/* size of the rings of newly created peers and per-cpu crypto workers */
+	unsigned int queue_len;
+
 	netdev_features_t set_features;
 
 	void *security;
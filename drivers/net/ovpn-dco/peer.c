@@ -10,11 +10,15 @@
 #include "ovpn.h"
 #include "bind.h"
 #include "crypto.h"
+#include "iroute.h"
 #include "peer.h"
 #include "netlink.h"
 #include "tcp.h"
 
-#include <linux/timer.h>
+#include <linux/bitmap.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
 #include <linux/workqueue.h>
 
 struct ovpn_peer *ovpn_peer_get(struct ovpn_struct *ovpn)
@@ -30,10 +34,132 @@ struct ovpn_peer *ovpn_peer_get(struct ovpn_struct *ovpn)
 	return peer;
 }
 
-static void ovpn_peer_ping(struct timer_list *t)
+/* Lookup a peer by the peer-id carried in DATA_V2 packets, without taking a
+ * reference: the peer can be used until the end of the RCU read-side critical
+ * section the caller is in, as peers are freed only after a grace period.
+ */
+struct ovpn_peer *ovpn_peer_lookup_id_rcu(struct ovpn_struct *ovpn,
+					  u32 peer_id)
+{
+	struct ovpn_peer *peer;
+
+	hash_for_each_possible_rcu(ovpn->peers->by_id, peer, hash_entry_id,
+				   peer_id) {
+		if (peer->id == peer_id)
+			return peer;
+	}
+
+	return NULL;
+}
+
+/* Lookup a peer by the peer-id carried in DATA_V2 packets.
+ * Can be called in softirq context and returns the peer with a reference held.
+ */
+struct ovpn_peer *ovpn_peer_lookup_id(struct ovpn_struct *ovpn, u32 peer_id)
+{
+	struct ovpn_peer *peer;
+
+	rcu_read_lock();
+	peer = ovpn_peer_lookup_id_rcu(ovpn, peer_id);
+	if (peer && !ovpn_peer_hold(peer))
+		peer = NULL;
+	rcu_read_unlock();
+
+	return peer;
+}
+
+/* Lookup a peer by the transport endpoint an incoming packet was sent from.
+ * Must be called in an RCU read-side critical section, see
+ * ovpn_peer_lookup_id_rcu().
+ */
+struct ovpn_peer *ovpn_peer_lookup_transp_addr_rcu(struct ovpn_struct *ovpn,
+						   struct sk_buff *skb)
 {
-	struct ovpn_peer *peer = from_timer(peer, t, keepalive_xmit);
+	struct ovpn_peer *peer;
+	struct ovpn_bind *bind;
+	u32 index;
+
+	switch (skb_protocol_to_family(skb)) {
+	case AF_INET:
+		index = ovpn_transp_ipv4_hash(ip_hdr(skb)->saddr,
+					      udp_hdr(skb)->source);
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case AF_INET6:
+		index = ovpn_transp_ipv6_hash(&ipv6_hdr(skb)->saddr,
+					      udp_hdr(skb)->source);
+		break;
+#endif
+	default:
+		return NULL;
+	}
+
+	hash_for_each_possible_rcu(ovpn->peers->by_transp_addr, peer,
+				   hash_entry_transp_addr, index) {
+		bind = rcu_dereference(peer->bind);
+		if (bind && ovpn_bind_skb_match(bind, skb))
+			return peer;
+	}
+
+	return NULL;
+}
+
+/* Lookup a peer by the destination address of an outgoing packet.
+ * Addresses assigned to peers are matched first with a single hash lookup,
+ * then the iroute trie is searched for the most specific network matching.
+ * Can be called in softirq context and returns the peer with a reference held.
+ */
+struct ovpn_peer *ovpn_peer_lookup_vpn_addr(struct ovpn_struct *ovpn,
+					    struct sk_buff *skb)
+{
+	struct ovpn_peer *tmp, *peer = NULL;
+	__be32 addr4;
+	u32 index;
+#if IS_ENABLED(CONFIG_IPV6)
+	struct in6_addr *addr6;
+#endif
 
+	rcu_read_lock();
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		addr4 = ip_hdr(skb)->daddr;
+		index = ovpn_ipv4_hash(addr4, 32);
+		hash_for_each_possible_rcu(ovpn->peers->by_vpn_addr4, tmp,
+					   hash_entry_addr4, index) {
+			if (tmp->vpn_addrs.ipv4.s_addr != addr4)
+				continue;
+
+			if (ovpn_peer_hold(tmp))
+				peer = tmp;
+			break;
+		}
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case htons(ETH_P_IPV6):
+		addr6 = &ipv6_hdr(skb)->daddr;
+		index = ovpn_ipv6_hash(addr6, 128);
+		hash_for_each_possible_rcu(ovpn->peers->by_vpn_addr6, tmp,
+					   hash_entry_addr6, index) {
+			if (!ipv6_addr_equal(&tmp->vpn_addrs.ipv6, addr6))
+				continue;
+
+			if (ovpn_peer_hold(tmp))
+				peer = tmp;
+			break;
+		}
+		break;
+#endif
+	}
+	rcu_read_unlock();
+
+	if (!peer)
+		peer = ovpn_iroute_lookup(&ovpn->peers->iroutes, skb);
+
+	return peer;
+}
+
+static void ovpn_peer_ping(struct ovpn_peer *peer)
+{
 	rcu_read_lock();
 	pr_debug("sending ping to peer %pIScp\n",
 		 &rcu_dereference(peer->bind)->sapair.remote.u);
@@ -42,15 +168,47 @@ static void ovpn_peer_ping(struct timer_list *t)
 	ovpn_keepalive_xmit(peer);
 }
 
+/* Remove a peer from the server-mode lookup tables.
+ * Return true if the peer was hashed and has now been removed, false otherwise
+ */
+static bool ovpn_peer_unhash(struct ovpn_peer *peer)
+	__must_hold(&peer->ovpn->peers->lock)
+{
+	if (hlist_unhashed(&peer->hash_entry_id))
+		return false;
+
+	hash_del_rcu(&peer->hash_entry_id);
+	hash_del_rcu(&peer->hash_entry_transp_addr);
+	hash_del_rcu(&peer->hash_entry_addr4);
+	hash_del_rcu(&peer->hash_entry_addr6);
+	ovpn_iroute_del_by_peer(peer, &peer->ovpn->peers->lock);
+	peer->ovpn->peers->count--;
+
+	return true;
+}
+
 /* remove peer if it is currenly attached to ovpn_struct */
 void ovpn_peer_evict(struct ovpn_peer *peer, int del_reason)
 {
 	struct ovpn_struct *ovpn = peer->ovpn;
 	struct ovpn_peer *tmp;
+	bool removed;
 
 	if (!ovpn)
 		return;
 
+	/* server mode: the peer is detached from the lookup tables */
+	if (ovpn->peers) {
+		spin_lock_bh(&ovpn->peers->lock);
+		removed = ovpn_peer_unhash(peer);
+		if (removed)
+			ovpn_peer_delete(peer, del_reason);
+		spin_unlock_bh(&ovpn->peers->lock);
+
+		if (removed)
+			return;
+	}
+
 	/* check if peer in ovpn_struct is the same one we got */
 	spin_lock_bh(&ovpn->lock);
 	tmp = rcu_dereference_protected(ovpn->peer,
@@ -63,10 +221,123 @@ void ovpn_peer_evict(struct ovpn_peer *peer, int del_reason)
 	spin_unlock_bh(&ovpn->lock);
 }
 
-static void ovpn_peer_expire(struct timer_list *t)
+/* Add a peer to the lookup tables of a server-mode interface */
+static int ovpn_peer_add_mp(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
 {
-	struct ovpn_peer *peer = from_timer(peer, t, keepalive_recv);
+	struct ovpn_peers *peers = ovpn->peers;
+	struct ovpn_bind *bind;
+	struct ovpn_peer *tmp;
+	int ret = 0;
+
+	spin_lock_bh(&peers->lock);
+	if (peers->count >= OVPN_MAX_PEERS) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	hash_for_each_possible(peers->by_id, tmp, hash_entry_id, peer->id) {
+		if (tmp->id == peer->id) {
+			ret = -EEXIST;
+			goto unlock;
+		}
+	}
 
+	hash_add_rcu(peers->by_id, &peer->hash_entry_id, peer->id);
+
+	bind = rcu_dereference_protected(peer->bind, true);
+	if (bind)
+		hash_add_rcu(peers->by_transp_addr,
+			     &peer->hash_entry_transp_addr,
+			     ovpn_sockaddr_hash(&bind->sapair.remote));
+
+	if (peer->vpn_addrs.ipv4.s_addr != htonl(INADDR_ANY))
+		hash_add_rcu(peers->by_vpn_addr4, &peer->hash_entry_addr4,
+			     ovpn_ipv4_hash(peer->vpn_addrs.ipv4.s_addr, 32));
+
+#if IS_ENABLED(CONFIG_IPV6)
+	if (!ipv6_addr_any(&peer->vpn_addrs.ipv6))
+		hash_add_rcu(peers->by_vpn_addr6, &peer->hash_entry_addr6,
+			     ovpn_ipv6_hash(&peer->vpn_addrs.ipv6, 128));
+#endif
+
+	peers->count++;
+unlock:
+	spin_unlock_bh(&peers->lock);
+
+	return ret;
+}
+
+/* Set the only peer of a client-mode interface, replacing any existing one */
+static int ovpn_peer_add_p2p(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
+{
+	struct ovpn_peer *old;
+
+	spin_lock_bh(&ovpn->lock);
+	old = rcu_replace_pointer(ovpn->peer, peer,
+				  lockdep_is_held(&ovpn->lock));
+	if (old)
+		ovpn_peer_delete(old, OVPN_DEL_PEER_REASON_TEARDOWN);
+	spin_unlock_bh(&ovpn->lock);
+
+	return 0;
+}
+
+/* Attach a newly created peer to the interface, making it reachable by the
+ * datapath. On success the original +1 refcount of the peer is owned by the
+ * interface.
+ */
+int ovpn_peer_add(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
+{
+	int ret;
+
+	switch (ovpn->mode) {
+	case OVPN_MODE_SERVER:
+		ret = ovpn_peer_add_mp(ovpn, peer);
+		break;
+	case OVPN_MODE_CLIENT:
+		ret = ovpn_peer_add_p2p(ovpn, peer);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (ret < 0)
+		return ret;
+
+	/* the scan stops by itself once no peer is left */
+	queue_delayed_work(ovpn->events_wq, &ovpn->idle_work,
+			   OVPN_IDLE_SCAN_PERIOD);
+
+	return 0;
+}
+
+/* Detach and delete all peers attached to the interface */
+void ovpn_peers_free(struct ovpn_struct *ovpn)
+{
+	struct hlist_node *tmp;
+	struct ovpn_peer *peer;
+	int bkt;
+
+	spin_lock_bh(&ovpn->lock);
+	peer = rcu_replace_pointer(ovpn->peer, NULL,
+				   lockdep_is_held(&ovpn->lock));
+	if (peer)
+		ovpn_peer_delete(peer, OVPN_DEL_PEER_REASON_TEARDOWN);
+	spin_unlock_bh(&ovpn->lock);
+
+	if (!ovpn->peers)
+		return;
+
+	spin_lock_bh(&ovpn->peers->lock);
+	hash_for_each_safe(ovpn->peers->by_id, bkt, tmp, peer, hash_entry_id) {
+		ovpn_peer_unhash(peer);
+		ovpn_peer_delete(peer, OVPN_DEL_PEER_REASON_TEARDOWN);
+	}
+	spin_unlock_bh(&ovpn->peers->lock);
+}
+
+static void ovpn_peer_expire(struct ovpn_peer *peer)
+{
 	rcu_read_lock();
 	pr_debug("peer expired: %pIScp\n",
 		 &rcu_dereference(peer->bind)->sapair.remote.u);
@@ -75,12 +346,111 @@ static void ovpn_peer_expire(struct timer_list *t)
 	ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_EXPIRED);
 }
 
-/* Construct a new peer */
-static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
+static void ovpn_peer_float_work(struct work_struct *work)
+{
+	struct ovpn_peer *peer = container_of(work, struct ovpn_peer,
+					      float_work);
+	struct ovpn_sockaddr_pair sapair;
+	int ret;
+
+	spin_lock_bh(&peer->lock);
+	sapair = peer->float_sapair;
+	spin_unlock_bh(&peer->lock);
+
+	ret = ovpn_bind_record_peer(peer->ovpn, peer, &sapair);
+	if (ret < 0)
+		pr_debug("%s: cannot float peer %u: %d\n",
+			 peer->ovpn->dev->name, peer->id, ret);
+	else
+		pr_debug("%s: peer %u floated to %pIScp\n",
+			 peer->ovpn->dev->name, peer->id, &sapair.remote.u);
+
+	ovpn_peer_put(peer);
+}
+
+/* Follow a peer moving to a new transport address, i.e. because of NAT
+ * rebinding or because a mobile client changed network. skb must be an
+ * authenticated and not replayed packet of peer, with its outer headers still
+ * in place.
+ *
+ * The new binding is installed asynchronously, as it has to be allocated.
+ */
+void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	struct ovpn_sockaddr_pair sapair;
+	struct ovpn_bind *bind;
+	bool match;
+
+	/* a TCP peer is bound to its connection */
+	if (ovpn->proto != OVPN_PROTO_UDP4 && ovpn->proto != OVPN_PROTO_UDP6)
+		return;
+
+	rcu_read_lock();
+	bind = rcu_dereference(peer->bind);
+	match = bind && ovpn_bind_skb_match(bind, skb);
+	rcu_read_unlock();
+
+	if (likely(match))
+		return;
+
+	if (time_before(jiffies, READ_ONCE(peer->float_next)))
+		return;
+	WRITE_ONCE(peer->float_next, jiffies + OVPN_FLOAT_INTERVAL);
+
+	if (ovpn_sockaddr_pair_from_skb(&sapair, skb) < 0)
+		return;
+
+	spin_lock_bh(&peer->lock);
+	peer->float_sapair = sapair;
+	spin_unlock_bh(&peer->lock);
+
+	if (!ovpn_peer_hold(peer))
+		return;
+
+	if (!queue_work(ovpn->events_wq, &peer->float_work))
+		ovpn_peer_put(peer);
+}
+
+/* Verify the grouping of the fields of struct ovpn_peer, which can be
+ * inspected with "pahole -C ovpn_peer ovpn-dco.ko". Lock debugging inflates
+ * most of the embedded objects, hence sizes are only checked without it
+ */
+static void ovpn_peer_layout_check(void)
+{
+#if defined(CONFIG_SMP) && !defined(CONFIG_DEBUG_SPINLOCK) && \
+	!defined(CONFIG_DEBUG_LOCK_ALLOC) && !defined(CONFIG_DEBUG_MUTEXES)
+	/* state read by every packet spans at most two cache lines */
+	BUILD_BUG_ON(offsetof(struct ovpn_peer, refcount) >
+		     2 * SMP_CACHE_BYTES);
+
+	/* the refcount line is not shared with anything else */
+	BUILD_BUG_ON(offsetof(struct ovpn_peer, encrypt_work) -
+		     offsetof(struct ovpn_peer, refcount) != SMP_CACHE_BYTES);
+
+	/* TX state re-written by every packet, ahead of tx_ring */
+	BUILD_BUG_ON(offsetof(struct ovpn_peer, tx_ring) -
+		     offsetof(struct ovpn_peer, encrypt_work) >
+		     2 * SMP_CACHE_BYTES);
+
+	/* same for RX, ahead of rx_ring */
+	BUILD_BUG_ON(offsetof(struct ovpn_peer, rx_ring) -
+		     offsetof(struct ovpn_peer, decrypt_work) >
+		     2 * SMP_CACHE_BYTES);
+#endif
+}
+
+/* Construct a new peer. Its rings get queue_len slots, or the size configured
+ * on the interface if 0
+ */
+static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn,
+				       unsigned int queue_len)
 {
 	struct ovpn_peer *peer;
 	int ret;
 
+	ovpn_peer_layout_check();
+
 	/* alloc and init peer object */
 	peer = kzalloc(sizeof(*peer), GFP_KERNEL);
 	if (!peer)
@@ -91,84 +461,86 @@ static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
 	RCU_INIT_POINTER(peer->bind, NULL);
 	ovpn_crypto_state_init(&peer->crypto);
 	spin_lock_init(&peer->lock);
+	INIT_LIST_HEAD(&peer->iroutes);
 	kref_init(&peer->refcount);
-	ovpn_peer_stats_init(&peer->stats);
+
+	ret = ovpn_peer_stats_init(&peer->stats);
+	if (ret < 0) {
+		kfree(peer);
+		return ERR_PTR(ret);
+	}
 
 	INIT_WORK(&peer->encrypt_work, ovpn_encrypt_work);
 	INIT_WORK(&peer->decrypt_work, ovpn_decrypt_work);
+	INIT_WORK(&peer->float_work, ovpn_peer_float_work);
+	ovpn_reorder_init(&peer->tx_reorder);
+	ovpn_reorder_init(&peer->rx_reorder);
 
-	/* configure and start NAPI */
-	netif_tx_napi_add(ovpn->dev, &peer->napi, ovpn_napi_poll,
-			  NAPI_POLL_WEIGHT);
-	napi_enable(&peer->napi);
-
-	ret = dst_cache_init(&peer->dst_cache, GFP_KERNEL);
-	if (ret < 0) {
-		pr_err("cannot initialize dst cache\n");
+	peer->tx_stopped = bitmap_zalloc(ovpn->dev->num_tx_queues, GFP_KERNEL);
+	if (!peer->tx_stopped) {
+		ret = -ENOMEM;
 		goto err;
 	}
 
-	ret = ptr_ring_init(&peer->tx_ring, OVPN_QUEUE_LEN, GFP_KERNEL);
+	if (!queue_len)
+		queue_len = READ_ONCE(ovpn->queue_len);
+	peer->queue_len = queue_len;
+
+	/* slots are attached on demand, see ovpn_peer_ring_produce() */
+	ret = ptr_ring_init(&peer->tx_ring, 0, GFP_KERNEL);
 	if (ret < 0) {
 		pr_err("cannot allocate TX ring\n");
-		goto err_dst_cache;
+		goto err_tx_stopped;
 	}
 
-	ret = ptr_ring_init(&peer->rx_ring, OVPN_QUEUE_LEN, GFP_KERNEL);
+	ret = ptr_ring_init(&peer->rx_ring, 0, GFP_KERNEL);
 	if (ret < 0) {
 		pr_err("cannot allocate RX ring\n");
 		goto err_tx_ring;
 	}
 
-	ret = ptr_ring_init(&peer->netif_rx_ring, OVPN_QUEUE_LEN, GFP_KERNEL);
-	if (ret < 0) {
-		pr_err("cannot allocate NETIF RX ring\n");
-		goto err_rx_ring;
-	}
-
 	if (ovpn->proto == OVPN_PROTO_TCP4 || ovpn->proto == OVPN_PROTO_TCP6) {
-		INIT_WORK(&peer->tcp.tx_work, ovpn_tcp_tx_work);
-		INIT_WORK(&peer->tcp.rx_work, ovpn_tcp_rx_work);
+		peer->tcp = kzalloc(sizeof(*peer->tcp), GFP_KERNEL);
+		if (!peer->tcp) {
+			ret = -ENOMEM;
+			goto err_rx_ring;
+		}
+
+		peer->tcp->peer = peer;
+		INIT_WORK(&peer->tcp->tx_work, ovpn_tcp_tx_work);
 
-		ret = ptr_ring_init(&peer->tcp.tx_ring, OVPN_QUEUE_LEN, GFP_KERNEL);
+		ret = ptr_ring_init(&peer->tcp->tx_ring, queue_len, GFP_KERNEL);
 		if (ret < 0) {
 			pr_err("cannot allocate TCP TX ring\n");
-			goto err_netif_rx_ring;
+			goto err_tcp;
 		}
 
-		peer->tcp.skb = NULL;
-		peer->tcp.offset = 0;
-		peer->tcp.data_len = 0;
-
 		ret = ovpn_tcp_sock_attach(ovpn->sock, peer);
 		if (ret < 0) {
 			pr_err("cannot prepare socket for peer connection: %d\n", ret);
 			goto err_tcp_tx_ring;
 		}
-
-		/* schedule initial RX work */
-		queue_work(peer->ovpn->events_wq, &peer->tcp.rx_work);
 	}
 
 	dev_hold(ovpn->dev);
 
-	timer_setup(&peer->keepalive_xmit, ovpn_peer_ping, 0);
-	timer_setup(&peer->keepalive_recv, ovpn_peer_expire, 0);
+	peer->last_sent = jiffies;
+	peer->last_recv = jiffies;
+	peer->last_used = jiffies;
 
 	return peer;
 err_tcp_tx_ring:
-	ptr_ring_cleanup(&peer->tcp.tx_ring, NULL);
-err_netif_rx_ring:
-	ptr_ring_cleanup(&peer->netif_rx_ring, NULL);
+	ptr_ring_cleanup(&peer->tcp->tx_ring, NULL);
+err_tcp:
+	kfree(peer->tcp);
 err_rx_ring:
 	ptr_ring_cleanup(&peer->rx_ring, NULL);
 err_tx_ring:
 	ptr_ring_cleanup(&peer->tx_ring, NULL);
-err_dst_cache:
-	dst_cache_destroy(&peer->dst_cache);
+err_tx_stopped:
+	bitmap_free(peer->tx_stopped);
 err:
-	napi_disable(&peer->napi);
-	netif_napi_del(&peer->napi);
+	ovpn_peer_stats_release(&peer->stats);
 	kfree(peer);
 	return ERR_PTR(ret);
 }
@@ -190,25 +562,51 @@ int ovpn_peer_reset_sockaddr(struct ovpn_peer *peer,
 	return 0;
 }
 
-static void ovpn_peer_timer_delete_all(struct ovpn_peer *peer)
+static void ovpn_peer_skb_free(void *ptr)
 {
-	del_timer_sync(&peer->keepalive_xmit);
-	del_timer_sync(&peer->keepalive_recv);
+	kfree_skb(ptr);
+}
+
+static void ovpn_peer_skb_list_free(void *ptr)
+{
+	kfree_skb_list(ptr);
+}
+
+static void ovpn_peer_tcp_free(struct ovpn_peer *peer)
+{
+	if (!peer->tcp)
+		return;
+
+	/* encrypted packets don't hold a reference to the peer while waiting
+	 * for the socket to accept them
+	 */
+	ptr_ring_cleanup(&peer->tcp->tx_ring, ovpn_peer_skb_list_free);
+	kfree(peer->tcp);
+	peer->tcp = NULL;
 }
 
 void ovpn_peer_release(struct ovpn_peer *peer)
 {
 	ovpn_bind_reset(peer, NULL);
-	ovpn_peer_timer_delete_all(peer);
 
 	WARN_ON(!__ptr_ring_empty(&peer->tx_ring));
 	ptr_ring_cleanup(&peer->tx_ring, NULL);
-	WARN_ON(!__ptr_ring_empty(&peer->rx_ring));
-	ptr_ring_cleanup(&peer->rx_ring, NULL);
-	WARN_ON(!__ptr_ring_empty(&peer->netif_rx_ring));
-	ptr_ring_cleanup(&peer->netif_rx_ring, NULL);
-
-	dst_cache_destroy(&peer->dst_cache);
+	/* don't leave the device queues stopped on behalf of a dead peer */
+	ovpn_peer_tx_wake(peer);
+	bitmap_free(peer->tx_stopped);
+	/* packets may still be queued, as they don't hold a reference to the
+	 * peer (see ovpn_recv())
+	 */
+	ptr_ring_cleanup(&peer->rx_ring, ovpn_peer_skb_free);
+	ovpn_peer_tcp_free(peer);
+
+	/* packets in flight hold a reference to the peer, therefore nothing
+	 * can be pending at this point
+	 */
+	ovpn_reorder_free(&peer->tx_reorder);
+	ovpn_reorder_free(&peer->rx_reorder);
+
+	ovpn_peer_stats_release(&peer->stats);
 
 	dev_put(peer->ovpn->dev);
 
@@ -228,8 +626,6 @@ static void ovpn_peer_delete_work(struct work_struct *work)
 	struct ovpn_peer *peer = container_of(work, struct ovpn_peer,
 					      delete_work);
 
-	napi_disable(&peer->napi);
-	netif_napi_del(&peer->napi);
 	ovpn_netlink_notify_del_peer(peer);
 
 	call_rcu(&peer->rcu, ovpn_peer_release_rcu);
@@ -264,13 +660,14 @@ void ovpn_peer_delete(struct ovpn_peer *peer, enum ovpn_del_peer_reason reason)
 
 struct ovpn_peer *
 ovpn_peer_new_with_sockaddr(struct ovpn_struct *ovpn,
-			    const struct ovpn_sockaddr_pair *sapair)
+			    const struct ovpn_sockaddr_pair *sapair,
+			    unsigned int queue_len)
 {
 	struct ovpn_peer *peer;
 	int ret;
 
 	/* create new peer */
-	peer = ovpn_peer_new(ovpn);
+	peer = ovpn_peer_new(ovpn, queue_len);
 	if (IS_ERR(peer))
 		return peer;
 
@@ -284,10 +681,119 @@ ovpn_peer_new_with_sockaddr(struct ovpn_struct *ovpn,
 	return peer;
 }
 
+/* The rings of a peer get their slots only when a packet has to wait in them,
+ * and give them back once unused for a while (see ovpn_peer_idle_work()). This
+ * way idle peers, and those whose packets don't need the rings (i.e. decrypted
+ * inline, or handled by the per-cpu workers or by the device queue contexts),
+ * don't hold them.
+ * Slots are allocated atomically, thus never vmalloc'ed, which allows
+ * ptr_ring_resize() to release them in an RCU read-side critical section
+ */
+static int ovpn_peer_ring_attach(struct ovpn_peer *peer, struct ptr_ring *ring)
+{
+	int ret;
+
+	/* no packet can be lost while the ring grows */
+	ret = ptr_ring_resize(ring, peer->queue_len, GFP_ATOMIC | __GFP_NOWARN,
+			      NULL);
+	if (ret < 0)
+		return ret;
+
+	ovpn_peer_rings_used(peer);
+
+	return 0;
+}
+
+/* Release the slots of ring if it is empty. A packet queued meanwhile is
+ * passed to destroy, as if it had found the ring full
+ */
+static void ovpn_peer_ring_release(struct ptr_ring *ring,
+				   void (*destroy)(void *))
+{
+	if (!READ_ONCE(ring->size) || !ptr_ring_empty_bh(ring))
+		return;
+
+	ptr_ring_resize(ring, 0, GFP_ATOMIC, destroy);
+}
+
+/* ptr_ring_full_bh() for a ring that may have no slots */
+static bool ovpn_peer_ring_full_bh(struct ptr_ring *ring)
+{
+	bool full;
+
+	spin_lock_bh(&ring->producer_lock);
+	full = ring->size && __ptr_ring_full(ring);
+	spin_unlock_bh(&ring->producer_lock);
+
+	return full;
+}
+
+/* Queue ptr into ring, either tx_ring or rx_ring of peer, attaching the slots
+ * of the ring first if needed. If full is not NULL, it tells whether the ring
+ * is full after queueing ptr.
+ * Return 0 on success or a negative error code
+ */
+int ovpn_peer_ring_produce(struct ovpn_peer *peer, struct ptr_ring *ring,
+			   void *ptr, bool *full)
+{
+	int ret;
+
+	if (full)
+		*full = false;
+
+	if (unlikely(!READ_ONCE(ring->size))) {
+		ret = ovpn_peer_ring_attach(peer, ring);
+		if (ret < 0)
+			return ret;
+	}
+
+	spin_lock_bh(&ring->producer_lock);
+	/* fails if the slots have been released again meanwhile */
+	ret = __ptr_ring_produce(ring, ptr);
+	if (full)
+		*full = ring->size && __ptr_ring_full(ring);
+	spin_unlock_bh(&ring->producer_lock);
+
+	return ret;
+}
+
+/* Stop the device TX queue the packets of a peer are coming from, because its
+ * tx_ring is full. This way packets are held back by the qdisc, rather than
+ * being dropped, until the encrypt work has caught up.
+ * The queue also carries the packets of any other peer, which would be held
+ * back as well: only use for the single peer of a client.
+ * Invoked from ndo_start_xmit
+ */
+void ovpn_peer_tx_stop(struct ovpn_peer *peer, unsigned int queue)
+{
+	netif_tx_stop_queue(netdev_get_tx_queue(peer->ovpn->dev, queue));
+	set_bit(queue, peer->tx_stopped);
+
+	/* pairs with the barrier in ovpn_encrypt_work(): either the encrypt
+	 * work sees the queue stopped or we see the room it made in the ring
+	 */
+	smp_mb__after_atomic();
+
+	if (unlikely(!ovpn_peer_ring_full_bh(&peer->tx_ring)))
+		ovpn_peer_tx_wake(peer);
+}
+
+/* Wake up the device TX queues stopped by ovpn_peer_tx_stop() */
+void ovpn_peer_tx_wake(struct ovpn_peer *peer)
+{
+	struct net_device *dev = peer->ovpn->dev;
+	unsigned int queue;
+
+	for_each_set_bit(queue, peer->tx_stopped, dev->num_tx_queues) {
+		if (test_and_clear_bit(queue, peer->tx_stopped))
+			netif_tx_wake_queue(netdev_get_tx_queue(dev, queue));
+	}
+}
+
 /* Configure keepalive parameters */
 void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout)
 {
-	u32 delta;
+	struct ovpn_struct *ovpn = peer->ovpn;
 
 	rcu_read_lock();
 	pr_debug("scheduling keepalive for %pIScp: interval=%u timeout=%u\n",
@@ -295,11 +801,221 @@ void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout)
 		 timeout);
 	rcu_read_unlock();
 
-	peer->keepalive_interval = interval;
-	delta = msecs_to_jiffies(interval * MSEC_PER_SEC);
-	mod_timer(&peer->keepalive_xmit, jiffies + delta);
+	/* both periods start now */
+	WRITE_ONCE(peer->last_sent, jiffies);
+	WRITE_ONCE(peer->last_recv, jiffies);
+	WRITE_ONCE(peer->keepalive_interval, interval);
+	WRITE_ONCE(peer->keepalive_timeout, timeout);
+
+	queue_delayed_work(ovpn->events_wq, &ovpn->keepalive_work,
+			   OVPN_KEEPALIVE_SCAN_PERIOD);
+}
+
+/* Send a ping to peer or expire it, according to its keepalive configuration.
+ * Return true if keepalive is enabled on peer
+ */
+static bool ovpn_peer_keepalive_check(struct ovpn_peer *peer,
+				      unsigned long now)
+{
+	unsigned long interval, timeout;
+
+	interval = msecs_to_jiffies(READ_ONCE(peer->keepalive_interval) *
+				    MSEC_PER_SEC);
+	timeout = msecs_to_jiffies(READ_ONCE(peer->keepalive_timeout) *
+				   MSEC_PER_SEC);
+	if ((!interval && !timeout) || READ_ONCE(peer->halt))
+		return false;
+
+	if (timeout &&
+	    time_after_eq(now, READ_ONCE(peer->last_recv) + timeout)) {
+		ovpn_peer_expire(peer);
+		return false;
+	}
+
+	if (interval &&
+	    time_after_eq(now, READ_ONCE(peer->last_sent) + interval)) {
+		/* wait for another interval even if the ping is dropped */
+		WRITE_ONCE(peer->last_sent, now);
+		ovpn_peer_ping(peer);
+	}
+
+	return true;
+}
+
+/* Periodic scan of all the peers of an interface, sending pings and
+ * expiring peers. It replaces per-peer timers, which would have to be re-armed
+ * by every packet. The scan stops when no peer has keepalive enabled and is
+ * restarted by ovpn_peer_keepalive_set()
+ */
+void ovpn_peer_keepalive_work(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn = container_of(work, struct ovpn_struct,
+						keepalive_work.work);
+	unsigned long now = jiffies;
+	struct ovpn_peer *peer;
+	bool active = false;
+	int bkt;
+
+	rcu_read_lock();
+	peer = rcu_dereference(ovpn->peer);
+	if (peer)
+		active |= ovpn_peer_keepalive_check(peer, now);
+	rcu_read_unlock();
+
+	if (ovpn->peers) {
+		/* leave the RCU section between buckets, as the tables may
+		 * hold many peers
+		 */
+		for (bkt = 0; bkt < HASH_SIZE(ovpn->peers->by_id); bkt++) {
+			rcu_read_lock();
+			hlist_for_each_entry_rcu(peer, &ovpn->peers->by_id[bkt],
+						 hash_entry_id)
+				active |= ovpn_peer_keepalive_check(peer, now);
+			rcu_read_unlock();
+
+			cond_resched();
+		}
+	}
+
+	if (active)
+		queue_delayed_work(ovpn->events_wq, &ovpn->keepalive_work,
+				   OVPN_KEEPALIVE_SCAN_PERIOD);
+}
+
+/* Release the rings and reorder buffers of peer if they haven't been used for
+ * timeout jiffies, as well as the crypto resources its key slots can do
+ * without. Called in an RCU read-side critical section
+ */
+static void ovpn_peer_idle_check(struct ovpn_peer *peer, unsigned long now,
+				 unsigned long timeout)
+{
+	if (time_after_eq(now, READ_ONCE(peer->last_used) + timeout)) {
+		ovpn_peer_ring_release(&peer->tx_ring, ovpn_peer_skb_list_free);
+		ovpn_peer_ring_release(&peer->rx_ring, ovpn_peer_skb_free);
+		ovpn_reorder_shrink(&peer->tx_reorder);
+		ovpn_reorder_shrink(&peer->rx_reorder);
+	}
+
+	ovpn_crypto_state_shrink(&peer->crypto, timeout);
+}
+
+/* Periodic scan of all the peers of an interface, releasing the memory they
+ * haven't needed for ovpn->idle_timeout seconds. Anything released is
+ * allocated again on demand by the datapath. The scan is started when a peer
+ * is added and stops when no peer is left or idle_timeout is 0
+ */
+void ovpn_peer_idle_work(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn = container_of(work, struct ovpn_struct,
+						idle_work.work);
+	unsigned long timeout, now = jiffies;
+	struct ovpn_peer *peer;
+	bool found = false;
+	int bkt;
+
+	timeout = msecs_to_jiffies(READ_ONCE(ovpn->idle_timeout) *
+				   MSEC_PER_SEC);
+	if (!timeout)
+		return;
+
+	rcu_read_lock();
+	peer = rcu_dereference(ovpn->peer);
+	if (peer) {
+		ovpn_peer_idle_check(peer, now, timeout);
+		found = true;
+	}
+	rcu_read_unlock();
+
+	if (ovpn->peers) {
+		/* see ovpn_peer_keepalive_work() */
+		for (bkt = 0; bkt < HASH_SIZE(ovpn->peers->by_id); bkt++) {
+			rcu_read_lock();
+			hlist_for_each_entry_rcu(peer, &ovpn->peers->by_id[bkt],
+						 hash_entry_id) {
+				ovpn_peer_idle_check(peer, now, timeout);
+				found = true;
+			}
+			rcu_read_unlock();
+
+			cond_resched();
+		}
+	}
+
+	if (found)
+		queue_delayed_work(ovpn->events_wq, &ovpn->idle_work,
+				   OVPN_IDLE_SCAN_PERIOD);
+}
+
+/* Account the memory used by peer into mem.
+ * Called in an RCU read-side critical section
+ */
+static void ovpn_peer_mem(struct ovpn_peer *peer, struct ovpn_mem_info *mem)
+{
+	struct ptr_ring *rings[] = {
+		&peer->tx_ring,
+		&peer->rx_ring,
+		peer->tcp ? &peer->tcp->tx_ring : NULL,
+	};
+	const struct ovpn_reorder *reorders[] = {
+		&peer->tx_reorder,
+		&peer->rx_reorder,
+	};
+	unsigned int i, size;
+	size_t bytes;
+
+	mem->peers++;
+	mem->peer_bytes += sizeof(*peer) +
+			   num_possible_cpus() *
+			   sizeof(struct ovpn_peer_pcpu_stats) +
+			   BITS_TO_LONGS(peer->ovpn->dev->num_tx_queues) *
+			   sizeof(long);
+	if (peer->tcp)
+		mem->peer_bytes += sizeof(*peer->tcp);
+
+	for (i = 0; i < ARRAY_SIZE(rings); i++) {
+		size = rings[i] ? READ_ONCE(rings[i]->size) : 0;
+		if (!size)
+			continue;
+
+		mem->rings++;
+		mem->ring_bytes += size * sizeof(void *);
+	}
 
-	peer->keepalive_timeout = timeout;
-	delta = msecs_to_jiffies(timeout * MSEC_PER_SEC);
-	mod_timer(&peer->keepalive_recv, jiffies + delta);
+	for (i = 0; i < ARRAY_SIZE(reorders); i++) {
+		bytes = ovpn_reorder_mem(reorders[i]);
+		if (!bytes)
+			continue;
+
+		mem->rings++;
+		mem->ring_bytes += bytes;
+	}
+
+	mem->key_bytes += ovpn_crypto_state_mem(&peer->crypto,
+						&mem->key_slots);
+}
+
+/* Add up the memory used by all the peers of an interface into mem */
+void ovpn_peers_mem(struct ovpn_struct *ovpn, struct ovpn_mem_info *mem)
+{
+	struct ovpn_peer *peer;
+	int bkt;
+
+	rcu_read_lock();
+	peer = rcu_dereference(ovpn->peer);
+	if (peer)
+		ovpn_peer_mem(peer, mem);
+	rcu_read_unlock();
+
+	if (!ovpn->peers)
+		return;
+
+	for (bkt = 0; bkt < HASH_SIZE(ovpn->peers->by_id); bkt++) {
+		rcu_read_lock();
+		hlist_for_each_entry_rcu(peer, &ovpn->peers->by_id[bkt],
+					 hash_entry_id)
+			ovpn_peer_mem(peer, mem);
+		rcu_read_unlock();
+
+		cond_resched();
+	}
 }
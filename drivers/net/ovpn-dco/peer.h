@@ -12,93 +12,185 @@
 
 #include "addr.h"
 #include "bind.h"
+#include "reorder.h"
 #include "sock.h"
 #include "stats.h"
 
-#include <linux/timer.h>
 #include <linux/ptr_ring.h>
-#include <net/dst_cache.h>
+#include <linux/workqueue.h>
+#include <net/strparser.h>
 
+/* TCP transport state, allocated only for peers of TCP instances */
+struct ovpn_peer_tcp {
+	struct ovpn_peer *peer;
+
+	struct ptr_ring tx_ring;
+	struct work_struct tx_work;
+
+	/* amount of the skb at the head of tx_ring already sent */
+	unsigned int tx_offset;
+
+	/* splits the received stream into OpenVPN packets */
+	struct strparser strp;
+
+	struct {
+		void (*sk_state_change)(struct sock *sk);
+		void (*sk_data_ready)(struct sock *sk);
+		void (*sk_write_space)(struct sock *sk);
+	} sk_cb;
+};
+
+/* Fields are grouped by the path accessing them, so that the TX and RX paths
+ * running on different CPUs don't bounce each other's cache lines:
+ * - read-mostly state needed by every packet
+ * - shared state written by every packet in both directions
+ * - TX path
+ * - RX path
+ * - control path
+ * ovpn_peer_layout_check() verifies the grouping at build time.
+ */
 struct ovpn_peer {
+	/* read-mostly */
+
 	struct ovpn_struct *ovpn;
 
-	/* work objects to handle encryption/decryption of packets.
-	 * these works are queued on the ovpn->crypt_wq workqueue.
-	 */
-	struct work_struct encrypt_work;
-	struct work_struct decrypt_work;
+	/* peer-id assigned by userspace and carried by DATA_V2 packets */
+	u32 id;
 
-	struct ptr_ring tx_ring;
-	struct ptr_ring rx_ring;
-	struct ptr_ring netif_rx_ring;
+	/* number of packets tx_ring and rx_ring can hold */
+	unsigned int queue_len;
 
-	struct napi_struct napi;
+	/* true if ovpn_peer_mark_delete was called */
+	bool halt;
 
 	struct socket *sock;
 
-	/* state of the TCP reading. Needed to keep track of how much of a single packet has already
-	 * been read from the stream and how much is missing
-	 */
-	struct {
-		struct ptr_ring tx_ring;
-		struct work_struct tx_work;
-		struct work_struct rx_work;
-
-		u8 raw_len[sizeof(u16)];
-		struct sk_buff *skb;
-		u16 offset;
-		u16 data_len;
-		struct {
-			void (*sk_state_change)(struct sock *sk);
-			void (*sk_data_ready)(struct sock *sk);
-			void (*sk_write_space)(struct sock *sk);
-		} sk_cb;
-	} tcp;
-
-	struct dst_cache dst_cache;
+	/* our binding to peer, protected by spinlock */
+	struct ovpn_bind __rcu *bind;
 
 	/* our crypto state */
 	struct ovpn_crypto_state crypto;
 
-	/* our binding to peer, protected by spinlock */
-	struct ovpn_bind __rcu *bind;
+	/* TCP transport state, NULL for UDP peers */
+	struct ovpn_peer_tcp *tcp;
 
-	/* timer used to send periodic ping messages to the other peer, if no
-	 * other data was sent within the past keepalive_interval seconds
-	 */
-	struct timer_list keepalive_xmit;
 	/* keepalive interval in seconds */
 	unsigned long keepalive_interval;
+	/* keepalive timeout in seconds */
+	unsigned long keepalive_timeout;
+
+	/* shared, written by both directions */
+
+	/* needed because crypto methods can go async */
+	struct kref refcount ____cacheline_aligned_in_smp;
 
-	/* timer used to mark a peer as expired when no data is received for
+	/* CPU the last packet was queued on when crypto is parallelized */
+	int crypto_cpu;
+
+	/* time data packets last went through tx_ring or rx_ring (jiffies).
+	 * Rings unused for ovpn->idle_timeout seconds are released by
+	 * ovpn_peer_idle_work()
+	 */
+	unsigned long last_used;
+
+	/* TX path */
+
+	/* work objects to handle encryption/decryption of packets.
+	 * these works are queued on the ovpn->crypt_wq workqueue.
+	 */
+	struct work_struct encrypt_work ____cacheline_aligned_in_smp;
+
+	/* TX queues of the device stopped because tx_ring was full. They are
+	 * woken up once the encrypt work has made room in the ring
+	 */
+	unsigned long *tx_stopped;
+
+	/* restore packet order after asynchronous encryption/decryption */
+	struct ovpn_reorder tx_reorder;
+
+	/* time the last packet was sent to peer (jiffies). A ping is sent by
+	 * ovpn_peer_keepalive_work() if nothing else was sent within the past
+	 * keepalive_interval seconds
+	 */
+	unsigned long last_sent;
+
+	/* producer and consumer sides are aligned by ptr_ring itself.
+	 * Starts without slots, see ovpn_peer_ring_produce()
+	 */
+	struct ptr_ring tx_ring;
+
+	/* RX path */
+
+	struct work_struct decrypt_work ____cacheline_aligned_in_smp;
+
+	struct ovpn_reorder rx_reorder;
+
+	/* time the last authenticated packet was received from peer
+	 * (jiffies). The peer expires when nothing is received for
 	 * keepalive_timeout seconds
 	 */
-	struct timer_list keepalive_recv;
-	/* keepalive timeout in seconds */
-	unsigned long keepalive_timeout;
+	unsigned long last_recv;
 
-	/* true if ovpn_peer_mark_delete was called */
-	bool halt;
+	/* starts without slots, like tx_ring */
+	struct ptr_ring rx_ring;
 
-	/* per-peer rx/tx stats */
-	struct ovpn_peer_stats stats;
+	/* per-peer rx/tx stats, counters are per-cpu */
+	struct ovpn_peer_stats stats ____cacheline_aligned_in_smp;
+
+	/* control path */
+
+	/* addresses assigned to this peer within the VPN, used to pick the
+	 * peer an outgoing packet should be sent to (server mode only)
+	 */
+	struct {
+		struct in_addr ipv4;
+		struct in6_addr ipv6;
+	} vpn_addrs ____cacheline_aligned_in_smp;
+
+	/* entries in the ovpn->peers lookup tables (server mode only) */
+	struct hlist_node hash_entry_id;
+	struct hlist_node hash_entry_transp_addr;
+	struct hlist_node hash_entry_addr4;
+	struct hlist_node hash_entry_addr6;
+
+	/* iroutes pointing to this peer, protected by ovpn->peers->lock */
+	struct list_head iroutes;
 
 	/* why peer was deleted - keepalive timeout, module removed etc */
 	enum ovpn_del_peer_reason delete_reason;
 
-	/* protects binding to peer (bind) and timers
-	 * (keepalive_xmit, keepalive_expire)
-	 */
+	/* protects binding to peer (bind) and float_sapair */
 	spinlock_t lock;
 
-	/* needed because crypto methods can go async */
-	struct kref refcount;
-
 	/* needed to free a peer in an RCU safe way */
 	struct rcu_head rcu;
 
 	/* needed to notify userspace about deletion */
 	struct work_struct delete_work;
+
+	/* rebinds the peer to the address it floated to, which is stored in
+	 * float_sapair (protected by lock). Floating is allowed at most once
+	 * per OVPN_FLOAT_INTERVAL, float_next being the earliest time
+	 * (jiffies) for the next one
+	 */
+	struct work_struct float_work;
+	struct ovpn_sockaddr_pair float_sapair;
+	unsigned long float_next;
+};
+
+/* memory used by an interface, reported by OVPN_CMD_GET_MEM */
+struct ovpn_mem_info {
+	/* structures shared by all the peers */
+	u64 iface_bytes;
+	/* peer objects, without their rings and keys */
+	u32 peers;
+	u64 peer_bytes;
+	/* rings and reorder buffers currently allocated */
+	u32 rings;
+	u64 ring_bytes;
+	/* key slots, with their tfms and request objects */
+	u32 key_slots;
+	u64 key_bytes;
 };
 
 int ovpn_update_peer_by_sockaddr_pc(struct ovpn_peer *peer);
@@ -106,6 +198,13 @@ void ovpn_peer_release_kref(struct kref *kref);
 void ovpn_peer_release(struct ovpn_peer *peer);
 
 struct ovpn_peer *ovpn_peer_get(struct ovpn_struct *ovpn);
+struct ovpn_peer *ovpn_peer_lookup_id_rcu(struct ovpn_struct *ovpn,
+					  u32 peer_id);
+struct ovpn_peer *ovpn_peer_lookup_id(struct ovpn_struct *ovpn, u32 peer_id);
+struct ovpn_peer *ovpn_peer_lookup_transp_addr_rcu(struct ovpn_struct *ovpn,
+						   struct sk_buff *skb);
+struct ovpn_peer *ovpn_peer_lookup_vpn_addr(struct ovpn_struct *ovpn,
+					    struct sk_buff *skb);
 
 static inline bool ovpn_peer_hold(struct ovpn_peer *peer)
 {
@@ -117,29 +216,43 @@ static inline void ovpn_peer_put(struct ovpn_peer *peer)
 	kref_put(&peer->refcount, ovpn_peer_release_kref);
 }
 
+/* Take note of the time of the last packet received from or sent to peer.
+ * The keepalive logic runs in ovpn_peer_keepalive_work(), therefore the
+ * datapath only stores the current time, and does so at most once per tick
+ * so that the cache line is not dirtied by every packet
+ */
 static inline void ovpn_peer_keepalive_recv_reset(struct ovpn_peer *peer)
 {
-	u32 delta = msecs_to_jiffies(peer->keepalive_timeout * MSEC_PER_SEC);
-
-	if (unlikely(!delta))
-		return;
+	unsigned long now = jiffies;
 
-	mod_timer(&peer->keepalive_recv, jiffies + delta);
+	if (READ_ONCE(peer->last_recv) != now)
+		WRITE_ONCE(peer->last_recv, now);
 }
 
 static inline void ovpn_peer_keepalive_xmit_reset(struct ovpn_peer *peer)
 {
-	u32 delta = msecs_to_jiffies(peer->keepalive_interval * MSEC_PER_SEC);
+	unsigned long now = jiffies;
 
-	if (unlikely(!delta))
-		return;
+	if (READ_ONCE(peer->last_sent) != now)
+		WRITE_ONCE(peer->last_sent, now);
+}
+
+/* Take note that the rings of peer are in use, as above */
+static inline void ovpn_peer_rings_used(struct ovpn_peer *peer)
+{
+	unsigned long now = jiffies;
 
-	mod_timer(&peer->keepalive_xmit, jiffies + delta);
+	if (READ_ONCE(peer->last_used) != now)
+		WRITE_ONCE(peer->last_used, now);
 }
 
+int ovpn_peer_ring_produce(struct ovpn_peer *peer, struct ptr_ring *ring,
+			   void *ptr, bool *full);
+
 struct ovpn_peer *
 ovpn_peer_new_with_sockaddr(struct ovpn_struct *ovpn,
-			    const struct ovpn_sockaddr_pair *sapair);
+			    const struct ovpn_sockaddr_pair *sapair,
+			    unsigned int queue_len);
 
 void ovpn_peer_delete(struct ovpn_peer *peer, enum ovpn_del_peer_reason reason);
 
@@ -150,7 +263,18 @@ int ovpn_peer_xmit_explicit_exit_notify(struct ovpn_peer *peer)
 	__must_hold(ovpn_config_mutex);
 
 void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout);
+void ovpn_peer_keepalive_work(struct work_struct *work);
+
+void ovpn_peer_idle_work(struct work_struct *work);
+void ovpn_peers_mem(struct ovpn_struct *ovpn, struct ovpn_mem_info *mem);
+
+void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb);
+
+void ovpn_peer_tx_stop(struct ovpn_peer *peer, unsigned int queue);
+void ovpn_peer_tx_wake(struct ovpn_peer *peer);
 
+int ovpn_peer_add(struct ovpn_struct *ovpn, struct ovpn_peer *peer);
 void ovpn_peer_evict(struct ovpn_peer *peer, int del_reason);
+void ovpn_peers_free(struct ovpn_struct *ovpn);
 
 #endif /* _NET_OVPN_DCO_OVPNPEER_H_ */
@@ -11,6 +11,8 @@
 
 #include <linux/atomic.h>
 #include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 
 void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid)
 {
@@ -18,114 +20,168 @@ void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid)
 	pid->tcp_linear = NULL;
 }
 
-void ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr)
+/* Initialize the receive state with a window accepting backtracks of up to
+ * window - 1 packets. A window of 0 selects REPLAY_WINDOW_SIZE
+ */
+int ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr, u32 window)
 {
+	unsigned int slots;
+
+	if (!window)
+		window = REPLAY_WINDOW_SIZE;
+
+	if (window > REPLAY_WINDOW_MAX)
+		return -EINVAL;
+
 	memset(pr, 0, sizeof(*pr));
+
+	slots = roundup_pow_of_two(DIV_ROUND_UP(window, REPLAY_SLOT_BITS) + 1);
+	pr->history = kvcalloc(slots, sizeof(*pr->history), GFP_KERNEL);
+	if (!pr->history)
+		return -ENOMEM;
+
+	pr->slots_mask = slots - 1;
+	pr->window = window;
+	atomic64_set(&pr->drops, 0);
 	spin_lock_init(&pr->lock);
+
+	return 0;
+}
+
+void ovpn_pktid_recv_release(struct ovpn_pktid_recv *pr)
+{
+	kvfree(pr->history);
+	pr->history = NULL;
 }
 
 #if ENABLE_REPLAY_PROTECTION
 
+/* A new time stamp invalidates all the IDs received so far */
+static int ovpn_pktid_recv_time(struct ovpn_pktid_recv *pr, u32 pkt_time)
+{
+	unsigned int i;
+	int ret = 0;
+
+	spin_lock_bh(&pr->lock);
+	if (pkt_time > pr->time) {
+		/* time moved forward, accept */
+		for (i = 0; i <= pr->slots_mask; i++)
+			atomic64_set(&pr->history[i], 0);
+		WRITE_ONCE(pr->id, 0);
+		WRITE_ONCE(pr->id_floor, 0);
+		WRITE_ONCE(pr->time, pkt_time);
+	} else if (pkt_time < pr->time) {
+		/* time moved backward, reject */
+		ret = -ETIME;
+	}
+	spin_unlock_bh(&pr->lock);
+
+	return ret;
+}
+
+/* Mark pkt_id as received in its slot. Return -ESTALE if it was already seen
+ * or if the slot was recycled for more recent IDs in the meantime.
+ *
+ * The block index stored in a slot only moves forward, therefore an ID whose
+ * block does not match the slot was never accepted before
+ */
+static int ovpn_pktid_recv_mark(struct ovpn_pktid_recv *pr, u32 pkt_id)
+{
+	const u64 block = pkt_id / REPLAY_SLOT_BITS;
+	const u64 mask = BIT_ULL(pkt_id % REPLAY_SLOT_BITS);
+	atomic64_t *slot = &pr->history[block & pr->slots_mask];
+	s64 old, new;
+
+	old = atomic64_read(slot);
+	do {
+		const u64 slot_block = (u64)old >> REPLAY_SLOT_BITS;
+
+		if (likely(slot_block == block)) {
+			if (old & mask)
+				return -ESTALE;
+			new = old | mask;
+		} else if (slot_block < block) {
+			/* slot still holds an older block: recycle it */
+			new = (block << REPLAY_SLOT_BITS) | mask;
+		} else {
+			return -ESTALE;
+		}
+	} while (!atomic64_try_cmpxchg(slot, &old, new));
+
+	return 0;
+}
+
 /* Packet replay detection.
- * Allows ID backtrack of up to REPLAY_WINDOW_SIZE - 1.
+ * Allows ID backtrack of up to pr->window - 1.
+ *
+ * Lockless: can be invoked concurrently for the same key from multiple CPUs.
  */
-static int ovpn_pktid_recv_locked(struct ovpn_pktid_recv *pr, u32 pkt_id,
+static int ovpn_pktid_recv_window(struct ovpn_pktid_recv *pr, u32 pkt_id,
 				  u32 pkt_time)
 {
 	const unsigned long now = jiffies;
-
-	/* expire backtracks at or below pr->id after PKTID_RECV_EXPIRE time */
-	if (unlikely(time_after_eq(now, pr->expire)))
-		pr->id_floor = pr->id;
+	u32 id, delta;
+	int ret;
 
 	/* ID must not be zero */
 	if (unlikely(pkt_id == 0))
 		return -EINVAL;
 
 	/* time changed? */
-	if (unlikely(pkt_time != pr->time)) {
-		if (pkt_time > pr->time) {
-			/* time moved forward, accept */
-			pr->base = 0;
-			pr->extent = 0;
-			pr->id = 0;
-			pr->time = pkt_time;
-			pr->id_floor = 0;
-		} else {
-			/* time moved backward, reject */
-			return -ETIME;
-		}
+	if (unlikely(pkt_time != READ_ONCE(pr->time))) {
+		ret = ovpn_pktid_recv_time(pr, pkt_time);
+		if (ret < 0)
+			return ret;
 	}
 
-	if (likely(pkt_id == pr->id + 1)) {
-		/* well-formed ID sequence (incremented by 1) */
-		pr->base = REPLAY_INDEX(pr->base, -1);
-		pr->history[pr->base / 8] |= (1 << (pr->base % 8));
-		if (pr->extent < REPLAY_WINDOW_SIZE)
-			++pr->extent;
-		pr->id = pkt_id;
-	} else if (pkt_id > pr->id) {
-		/* ID jumped forward by more than one */
-		const unsigned int delta = pkt_id - pr->id;
-
-		if (delta < REPLAY_WINDOW_SIZE) {
-			unsigned int i;
-
-			pr->base = REPLAY_INDEX(pr->base, -delta);
-			pr->history[pr->base / 8] |= (1 << (pr->base % 8));
-			pr->extent += delta;
-			if (pr->extent > REPLAY_WINDOW_SIZE)
-				pr->extent = REPLAY_WINDOW_SIZE;
-			for (i = 1; i < delta; ++i) {
-				unsigned int newb = REPLAY_INDEX(pr->base, i);
-
-				pr->history[newb / 8] &= ~BIT(newb % 8);
-			}
-		} else {
-			pr->base = 0;
-			pr->extent = REPLAY_WINDOW_SIZE;
-			memset(pr->history, 0, sizeof(pr->history));
-			pr->history[0] = 1;
-		}
-		pr->id = pkt_id;
-	} else {
+	id = READ_ONCE(pr->id);
+
+	/* expire backtracks at or below pr->id after PKTID_RECV_EXPIRE time */
+	if (unlikely(time_after_eq(now, READ_ONCE(pr->expire))))
+		WRITE_ONCE(pr->id_floor, id);
+
+	if (unlikely(pkt_id <= id)) {
 		/* ID backtrack */
-		const unsigned int delta = pr->id - pkt_id;
-
-		if (delta > pr->max_backtrack)
-			pr->max_backtrack = delta;
-		if (delta < pr->extent) {
-			if (pkt_id > pr->id_floor) {
-				const unsigned int ri = REPLAY_INDEX(pr->base,
-								     delta);
-				u8 *p = &pr->history[ri / 8];
-				const u8 mask = (1 << (ri % 8));
-
-				if (*p & mask)
-					return -EINVAL;
-				*p |= mask;
-			} else {
-				return -EINVAL;
-			}
-		} else {
-			return -EINVAL;
-		}
+		delta = id - pkt_id;
+		if (delta > READ_ONCE(pr->max_backtrack))
+			WRITE_ONCE(pr->max_backtrack, delta);
+		if (delta >= pr->window ||
+		    pkt_id <= READ_ONCE(pr->id_floor))
+			return -ESTALE;
 	}
 
-	pr->expire = now + PKTID_RECV_EXPIRE;
+	ret = ovpn_pktid_recv_mark(pr, pkt_id);
+	if (ret < 0)
+		return ret;
+
+	/* move the head of the window forward, unless another CPU already
+	 * pushed it further
+	 */
+	while (pkt_id > id) {
+		u32 old = cmpxchg(&pr->id, id, pkt_id);
+
+		if (old == id)
+			break;
+		id = old;
+	}
+
+	/* avoid dirtying the cache line more than once per jiffy */
+	if (READ_ONCE(pr->expire) != now + PKTID_RECV_EXPIRE)
+		WRITE_ONCE(pr->expire, now + PKTID_RECV_EXPIRE);
+
 	return 0;
 }
 #endif
 
-/* Packet replay detection with locking  */
+/* Packet replay detection */
 int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u32 pkt_id, u32 pkt_time)
 {
 	int ret = 0;
 
 #if ENABLE_REPLAY_PROTECTION
-	spin_lock(&pr->lock);
-	ret = ovpn_pktid_recv_locked(pr, pkt_id, pkt_time);
-	spin_unlock(&pr->lock);
+	ret = ovpn_pktid_recv_window(pr, pkt_id, pkt_time);
+	if (unlikely(ret < 0))
+		atomic64_inc(&pr->drops);
 #endif
 
 	return ret;
@@ -12,6 +12,7 @@
 
 #include "main.h"
 
+#include <linux/atomic.h>
 #include <linux/spinlock.h>
 
 /* When the OpenVPN protocol is run in AEAD mode, use
@@ -61,23 +62,32 @@ struct ovpn_pktid_xmit {
 	struct ovpn_tcp_linear *tcp_linear;
 };
 
-/* replay window sizing in bytes = 2^REPLAY_WINDOW_ORDER */
+/* default replay window sizing in bytes = 2^REPLAY_WINDOW_ORDER */
 #define REPLAY_WINDOW_ORDER 8
 
 #define REPLAY_WINDOW_BYTES BIT(REPLAY_WINDOW_ORDER)
 #define REPLAY_WINDOW_SIZE  (REPLAY_WINDOW_BYTES * 8)
-#define REPLAY_INDEX(base, i) (((base) + (i)) & (REPLAY_WINDOW_SIZE - 1))
 
-/* Packet-ID state for receiver.
- * Other than lock member, can be zeroed to initialize.
+/* largest replay window userspace can configure, in packets */
+#define REPLAY_WINDOW_MAX BIT(20)
+
+/* The replay window is a ring of slots, each tracking 32 consecutive packet
+ * IDs. A slot packs the bitmap (low 32 bits) together with the index of the
+ * block of IDs it currently represents (high 32 bits), so that it can be
+ * tested, recycled and updated with a single cmpxchg. The ring has at least
+ * one slot more than needed to cover the window, so that a full backtrack
+ * fits whatever the alignment of the highest ID is
  */
+#define REPLAY_SLOT_BITS 32
+
+/* Packet-ID state for receiver */
 struct ovpn_pktid_recv {
-	/* "sliding window" bitmask of recent packet IDs received */
-	u8 history[REPLAY_WINDOW_BYTES];
-	/* bit position of deque base in history */
-	unsigned int base;
-	/* extent (in bits) of deque in history */
-	unsigned int extent;
+	/* "sliding window" of recent packet IDs received */
+	atomic64_t *history;
+	/* number of slots in history - 1 (slots are a power of 2) */
+	unsigned int slots_mask;
+	/* largest backtrack accepted, in packets */
+	u32 window;
 	/* expiration of history in jiffies */
 	unsigned long expire;
 	/* highest sequence number received */
@@ -87,15 +97,27 @@ struct ovpn_pktid_recv {
 	/* we will only accept backtrack IDs > id_floor */
 	u32 id_floor;
 	unsigned int max_backtrack;
-	/* protects entire pktd ID state */
+	/* packets rejected as replayed or too old */
+	atomic64_t drops;
+	/* serializes time stamp changes, which reset the whole state. The
+	 * per-packet path does not take it
+	 */
 	spinlock_t lock;
 };
 
-/* Get the next packet ID for xmit */
-static inline int ovpn_pktid_xmit_next(struct ovpn_pktid_xmit *pid, u32 *pktid)
+/* Reserve n consecutive packet IDs for xmit with a single atomic operation.
+ * Return the last sequence number, each of them being checked with
+ * ovpn_pktid_xmit_check()
+ */
+static inline u64 ovpn_pktid_xmit_reserve(struct ovpn_pktid_xmit *pid,
+					  unsigned int n)
 {
-	const u64 seq_num = atomic64_inc_return(&pid->seq_num);
+	return atomic64_add_return(n, &pid->seq_num);
+}
 
+/* Turn a reserved sequence number into a packet ID */
+static inline int ovpn_pktid_xmit_check(const u64 seq_num, u32 *pktid)
+{
 	BUILD_BUG_ON(PKTID_WRAP_WARN >= 0x100000000ULL);
 	*pktid = (u32)seq_num;
 	if (unlikely(seq_num >= PKTID_WRAP_WARN)) {
@@ -107,6 +129,12 @@ static inline int ovpn_pktid_xmit_next(struct ovpn_pktid_xmit *pid, u32 *pktid)
 	return 0;
 }
 
+/* Get the next packet ID for xmit */
+static inline int ovpn_pktid_xmit_next(struct ovpn_pktid_xmit *pid, u32 *pktid)
+{
+	return ovpn_pktid_xmit_check(ovpn_pktid_xmit_reserve(pid, 1), pktid);
+}
+
 /* Write 12-byte AEAD IV to dest */
 static inline void ovpn_pktid_aead_write(const u32 pktid,
 					 const struct ovpn_nonce_tail *nt,
@@ -124,8 +152,47 @@ static inline void ovpn_pktid_chm_write(const u32 pktid, unsigned char *dest)
 }
 
 void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid);
-void ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr);
+int ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr, u32 window);
+void ovpn_pktid_recv_release(struct ovpn_pktid_recv *pr);
+
+/* memory used by the replay window history */
+static inline size_t ovpn_pktid_recv_mem(const struct ovpn_pktid_recv *pr)
+{
+	return (pr->slots_mask + 1) * sizeof(*pr->history);
+}
 
 int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u32 pkt_id, u32 pkt_time);
 
+/* Check whether ovpn_pktid_recv() would reject pkt_id, without marking it as
+ * received. Lockless: the window may move meanwhile, but only forward, so a
+ * packet reported as stale would be rejected later anyway
+ */
+static inline bool ovpn_pktid_recv_stale(struct ovpn_pktid_recv *pr,
+					 u32 pkt_id)
+{
+#if ENABLE_REPLAY_PROTECTION
+	const u64 block = pkt_id / REPLAY_SLOT_BITS;
+	u64 slot_block;
+	s64 slot;
+	u32 id;
+
+	if (unlikely(pkt_id == 0))
+		return true;
+
+	id = READ_ONCE(pr->id);
+	if (pkt_id <= id && (id - pkt_id >= pr->window ||
+			     pkt_id <= READ_ONCE(pr->id_floor)))
+		return true;
+
+	slot = atomic64_read(&pr->history[block & pr->slots_mask]);
+	slot_block = (u64)slot >> REPLAY_SLOT_BITS;
+
+	return slot_block > block ||
+	       (slot_block == block &&
+		(slot & BIT_ULL(pkt_id % REPLAY_SLOT_BITS)));
+#else
+	return false;
+#endif
+}
+
 #endif /* _NET_OVPN_DCO_OVPNPKTID_H_ */
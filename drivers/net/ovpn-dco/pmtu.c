@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "bind.h"
+#include "crypto.h"
+#include "ovpnstruct.h"
+#include "peer.h"
+#include "pmtu.h"
+
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <asm/unaligned.h>
+#include <net/icmp.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+
+/* The path MTU to a peer is learnt from the route to its remote endpoint,
+ * which the kernel updates when the transport socket receives ICMP
+ * "fragmentation needed"/"packet too big" messages. Subtracting the outer
+ * headers and the data channel overhead of the primary key gives the largest
+ * packet that can be sent through the tunnel without fragmenting its
+ * encapsulation.
+ */
+
+/* Return the MTU of the packets sent to peer, or 0 if not known yet.
+ * Must be called in an RCU read-side critical section
+ */
+unsigned int ovpn_peer_pmtu(struct ovpn_peer *peer)
+{
+	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_bind *bind;
+	unsigned int pmtu;
+	int overhead;
+
+	bind = rcu_dereference(peer->bind);
+	if (unlikely(!bind))
+		return 0;
+
+	pmtu = READ_ONCE(bind->pmtu);
+	if (!pmtu)
+		return 0;
+
+	ks = ovpn_crypto_key_slot_primary_rcu(&peer->crypto);
+	if (unlikely(!ks))
+		return 0;
+
+	overhead = ks->ops->encap_overhead(ks);
+	if (unlikely(overhead < 0 || pmtu <= overhead))
+		return 0;
+
+	return pmtu - overhead;
+}
+
+/* Return true if skb can be sent to peer, false if it does not fit the path
+ * MTU to peer once encapsulated. In the latter case the sender was told the
+ * MTU to use and the caller should drop skb.
+ * Packets that cannot be refused (IPv4 without DF, IPv6 over a path below the
+ * IPv6 minimum MTU) are marked so that their encapsulation may fragment.
+ * skb must be an IP packet with its network header set
+ */
+bool ovpn_pmtu_check(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	unsigned int mtu;
+
+	rcu_read_lock();
+	mtu = ovpn_peer_pmtu(peer);
+	rcu_read_unlock();
+
+	if (!mtu)
+		return true;
+
+	if (skb_is_gso(skb) ? skb_gso_validate_network_len(skb, mtu) :
+			      skb->len <= mtu)
+		return true;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (!(ip_hdr(skb)->frag_off & htons(IP_DF)))
+			break;
+
+		/* the control block holds no IP options in this context */
+		memset(IPCB(skb), 0, sizeof(*IPCB(skb)));
+		icmp_ndo_send(skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED,
+			      htonl(mtu));
+		return false;
+#if IS_ENABLED(CONFIG_IPV6)
+	case htons(ETH_P_IPV6):
+		if (mtu < IPV6_MIN_MTU)
+			break;
+
+		memset(IP6CB(skb), 0, sizeof(*IP6CB(skb)));
+		icmpv6_ndo_send(skb, ICMPV6_PKT_TOOBIG, 0, mtu);
+		return false;
+#endif
+	}
+
+	skb->ignore_df = 1;
+	return true;
+}
+
+/* Return the offset in skb of the MSS option of the TCP SYN whose header
+ * starts at offset thoff, or 0 if skb is not a SYN or carries no MSS
+ */
+static unsigned int ovpn_tcp_mss_offset(struct sk_buff *skb,
+					unsigned int thoff)
+{
+	unsigned int optlen, i;
+	const struct tcphdr *th;
+	const u8 *opt;
+
+	if (!pskb_may_pull(skb, thoff + sizeof(*th)))
+		return 0;
+
+	th = (const struct tcphdr *)(skb->data + thoff);
+	if (!th->syn || th->doff * 4 <= sizeof(*th))
+		return 0;
+
+	optlen = th->doff * 4;
+	if (!pskb_may_pull(skb, thoff + optlen))
+		return 0;
+
+	/* pskb_may_pull() may have moved the headers */
+	opt = skb->data + thoff;
+
+	for (i = sizeof(*th); i < optlen; ) {
+		if (opt[i] == TCPOPT_EOL)
+			return 0;
+
+		if (opt[i] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+
+		if (i + 1 >= optlen || opt[i + 1] < 2 ||
+		    i + opt[i + 1] > optlen)
+			return 0;
+
+		if (opt[i] == TCPOPT_MSS && opt[i + 1] == TCPOLEN_MSS)
+			return thoff + i;
+
+		i += opt[i + 1];
+	}
+
+	return 0;
+}
+
+/* Clamp the MSS announced by a TCP SYN exchanged with peer, so that the
+ * segments of the connection fit the MTU of the tunnel to peer.
+ * Invoked on every packet: the headers are parsed first, so that packets
+ * other than SYNs carrying an MSS return before looking at the MTU.
+ * skb must be an IP packet with its network header set
+ */
+void ovpn_mss_clamp(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	unsigned int thoff, hlen, mtu, pmtu, off;
+	const struct ipv6hdr *ip6h;
+	const struct iphdr *iph;
+	u16 oldmss, mss;
+	struct tcphdr *th;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (!pskb_network_may_pull(skb, sizeof(*iph)))
+			return;
+
+		iph = ip_hdr(skb);
+		if (iph->protocol != IPPROTO_TCP ||
+		    iph->frag_off & htons(IP_OFFSET))
+			return;
+
+		thoff = skb_network_offset(skb) + iph->ihl * 4;
+		hlen = sizeof(struct iphdr) + sizeof(struct tcphdr);
+		break;
+	case htons(ETH_P_IPV6):
+		/* extension headers are not walked: SYNs hardly carry any */
+		if (!pskb_network_may_pull(skb, sizeof(*ip6h)))
+			return;
+
+		ip6h = ipv6_hdr(skb);
+		if (ip6h->nexthdr != IPPROTO_TCP)
+			return;
+
+		thoff = skb_network_offset(skb) + sizeof(*ip6h);
+		hlen = sizeof(struct ipv6hdr) + sizeof(struct tcphdr);
+		break;
+	default:
+		return;
+	}
+
+	off = ovpn_tcp_mss_offset(skb, thoff);
+	if (likely(!off))
+		return;
+
+	mtu = READ_ONCE(peer->ovpn->dev->mtu);
+
+	rcu_read_lock();
+	pmtu = ovpn_peer_pmtu(peer);
+	rcu_read_unlock();
+
+	if (pmtu && pmtu < mtu)
+		mtu = pmtu;
+
+	/* the MSS excludes the IP and TCP headers without options */
+	if (mtu <= hlen)
+		return;
+
+	mss = min_t(unsigned int, mtu - hlen, U16_MAX);
+	oldmss = get_unaligned_be16(skb->data + off + 2);
+	if (oldmss <= mss)
+		return;
+
+	if (skb_ensure_writable(skb, off + TCPOLEN_MSS))
+		return;
+
+	/* skb_ensure_writable() may have moved the headers */
+	th = (struct tcphdr *)(skb->data + thoff);
+	put_unaligned_be16(mss, skb->data + off + 2);
+	inet_proto_csum_replace2(&th->check, skb, htons(oldmss), htons(mss),
+				 false);
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNPMTU_H_
+#define _NET_OVPN_DCO_OVPNPMTU_H_
+
+#include <linux/skbuff.h>
+#include <linux/types.h>
+
+struct ovpn_peer;
+
+unsigned int ovpn_peer_pmtu(struct ovpn_peer *peer);
+bool ovpn_pmtu_check(struct ovpn_peer *peer, struct sk_buff *skb);
+void ovpn_mss_clamp(struct ovpn_peer *peer, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_DCO_OVPNPMTU_H_ */
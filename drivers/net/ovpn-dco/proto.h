@@ -34,6 +34,12 @@ enum {
 	OVPN_DATA_V1 = 6, /* data channel V1 packet */
 	OVPN_DATA_V2 = 9, /* data channel V2 packet */
 
+	/* range of the opcodes defined by the protocol, from
+	 * P_CONTROL_HARD_RESET_CLIENT_V1 to P_CONTROL_WKC_V1
+	 */
+	OVPN_OPCODE_FIRST = 1,
+	OVPN_OPCODE_LAST = 11,
+
 	/* size of initial packet opcode */
 	OVPN_OP_SIZE_V1 = 1,
 	OVPN_OP_SIZE_V2 = 4,
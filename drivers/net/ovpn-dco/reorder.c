@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "reorder.h"
+
+#include <linux/slab.h>
+
+/* marks the slot of a packet that was dropped while being processed */
+#define OVPN_REORDER_DROPPED ((struct sk_buff *)1UL)
+
+void ovpn_reorder_init(struct ovpn_reorder *r)
+{
+	spin_lock_init(&r->lock);
+	r->head = 0;
+	r->tail = 0;
+	r->draining = false;
+	r->slots = NULL;
+}
+
+/* can only be invoked once no packet is in flight anymore */
+void ovpn_reorder_free(struct ovpn_reorder *r)
+{
+	unsigned int i;
+
+	if (!r->slots)
+		return;
+
+	for (i = 0; i < OVPN_REORDER_SLOTS; i++) {
+		if (r->slots[i] && r->slots[i] != OVPN_REORDER_DROPPED)
+			kfree_skb(r->slots[i]);
+	}
+
+	kfree(r->slots);
+	r->slots = NULL;
+}
+
+/* Release the slots if no packet is in flight. They are allocated again by
+ * the next call to ovpn_reorder_reserve()
+ */
+void ovpn_reorder_shrink(struct ovpn_reorder *r)
+{
+	struct sk_buff **slots = NULL;
+
+	spin_lock_bh(&r->lock);
+	if (r->slots && r->head == r->tail && !r->draining) {
+		slots = r->slots;
+		WRITE_ONCE(r->slots, NULL);
+	}
+	spin_unlock_bh(&r->lock);
+
+	kfree(slots);
+}
+
+/* Assign a sequence number to a packet about to be processed.
+ * Return 0 on success or a negative error code if the packet can't be
+ * tracked, i.e. because too many packets are already in flight
+ */
+int ovpn_reorder_reserve(struct ovpn_reorder *r, u32 *seq)
+{
+	int ret = 0;
+
+	spin_lock_bh(&r->lock);
+	if (unlikely(!r->slots)) {
+		r->slots = kcalloc(OVPN_REORDER_SLOTS, sizeof(*r->slots),
+				   GFP_ATOMIC);
+		if (!r->slots) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+	}
+
+	if (unlikely(r->head - r->tail >= OVPN_REORDER_SLOTS)) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	*seq = r->head++;
+unlock:
+	spin_unlock_bh(&r->lock);
+
+	return ret;
+}
+
+/* Mark the packet with sequence number seq as completed. skb is NULL if the
+ * packet was dropped.
+ *
+ * All the packets that are now in order are passed to deliver(), which is
+ * invoked without the lock held and by one context at a time, so that packets
+ * are delivered in the same order they were submitted
+ */
+void ovpn_reorder_complete(struct ovpn_reorder *r, u32 seq,
+			   struct sk_buff *skb,
+			   void (*deliver)(struct sk_buff *skb))
+{
+	struct sk_buff *next;
+	unsigned int idx;
+
+	spin_lock_bh(&r->lock);
+	r->slots[seq % OVPN_REORDER_SLOTS] = skb ?: OVPN_REORDER_DROPPED;
+
+	/* the context already delivering will pick this packet up as well */
+	if (r->draining)
+		goto unlock;
+
+	r->draining = true;
+	for (;;) {
+		idx = r->tail % OVPN_REORDER_SLOTS;
+		next = r->slots[idx];
+		if (!next)
+			break;
+
+		r->slots[idx] = NULL;
+		r->tail++;
+
+		if (next == OVPN_REORDER_DROPPED)
+			continue;
+
+		spin_unlock_bh(&r->lock);
+		deliver(next);
+		spin_lock_bh(&r->lock);
+	}
+	r->draining = false;
+unlock:
+	spin_unlock_bh(&r->lock);
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNREORDER_H_
+#define _NET_OVPN_DCO_OVPNREORDER_H_
+
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* max number of packets that can be in flight at the same time, must be a
+ * power of 2
+ */
+#define OVPN_REORDER_SLOTS 256
+
+/* Restore the original order of packets whose processing may complete out of
+ * order (i.e. when handled by an asynchronous crypto engine).
+ * Each packet is assigned a sequence number before being processed and, once
+ * done, it is delivered only after all the packets submitted before it.
+ */
+struct ovpn_reorder {
+	/* protects all the members below */
+	spinlock_t lock;
+	/* sequence number assigned to the next packet being submitted */
+	u32 head;
+	/* sequence number of the next packet to be delivered */
+	u32 tail;
+	/* true while a context is delivering packets */
+	bool draining;
+	/* completed packets waiting for delivery, indexed by sequence number.
+	 * Allocated when first needed
+	 */
+	struct sk_buff **slots;
+};
+
+void ovpn_reorder_init(struct ovpn_reorder *r);
+void ovpn_reorder_free(struct ovpn_reorder *r);
+void ovpn_reorder_shrink(struct ovpn_reorder *r);
+
+/* memory used by the slots of r, if allocated */
+static inline size_t ovpn_reorder_mem(const struct ovpn_reorder *r)
+{
+	return READ_ONCE(r->slots) ? OVPN_REORDER_SLOTS * sizeof(*r->slots) : 0;
+}
+
+int ovpn_reorder_reserve(struct ovpn_reorder *r, u32 *seq);
+void ovpn_reorder_complete(struct ovpn_reorder *r, u32 seq,
+			   struct sk_buff *skb,
+			   void (*deliver)(struct sk_buff *skb));
+
+#endif /* _NET_OVPN_DCO_OVPNREORDER_H_ */
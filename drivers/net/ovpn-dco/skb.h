@@ -15,12 +15,51 @@
 
 #define OVPN_SKB_CB(skb) ((struct ovpn_skb_cb *)&((skb)->cb))
 
+struct ovpn_peer;
+struct ovpn_crypto_key_slot;
+struct sk_buff_head;
+
 struct ovpn_skb_cb {
 	/* original recv packet size for stats accounting */
 	unsigned int rx_stats_size;
 
-	/* OpenVPN packet ID */
-	u32 pktid;
+	union {
+		/* OpenVPN packet ID */
+		u32 pktid;
+		/* sender of a control packet queued for userspace, or of a
+		 * packet queued for decryption on an RX queue
+		 */
+		u32 peer_id;
+	};
+
+	/* state needed to finish processing a packet after asynchronous
+	 * crypto completion. A reference is held to both peer and ks. ks is
+	 * NULL for synchronous engines, that use the key slot under RCU only
+	 */
+	struct ovpn_peer *peer;
+	struct ovpn_crypto_key_slot *ks;
+
+	/* position in the peer reorder queue, valid only if ordered is true */
+	u32 seq;
+	bool ordered;
+
+	/* true if the packet is being decrypted by the NAPI poll of an RX
+	 * queue
+	 */
+	bool napi;
+
+	/* key-id of the key slot used to encrypt/decrypt the packet */
+	u8 key_id;
+
+	/* list collecting the encrypted segments of a GSO packet, so that
+	 * they can be sent at once. NULL if the packet is sent on its own
+	 */
+	struct sk_buff_head *batch;
+
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+	/* time the packet entered the current stage of the pipeline, in ns */
+	u64 tstamp;
+#endif
 };
 
 /* READ_ONCE version of skb_queue_len()
@@ -15,14 +15,28 @@
 #include "tcp.h"
 #include "udp.h"
 
+#include <net/ipv6.h>
 #include <net/udp.h>
 #include <net/udp_tunnel.h>
 
+/* Toggle UDP GRO on the transport socket. When enabled, the UDP GRO engine
+ * coalesces same-sized datagrams belonging to the same 4-tuple into a single
+ * GSO train which is then passed to the encap_rcv handler in one go
+ */
+static void ovpn_sock_set_udp_gro(struct socket *sock, bool enable)
+{
+	lock_sock(sock->sk);
+	udp_sk(sock->sk)->gro_enabled = enable;
+	release_sock(sock->sk);
+}
+
 /* Detach socket from encapsulation handler and/or other callbacks */
 static void ovpn_sock_unset_udp_cb(struct socket *sock)
 {
 	struct udp_tunnel_sock_cfg cfg = { };
 
+	/* userspace may not expect GRO trains on its socket */
+	ovpn_sock_set_udp_gro(sock, false);
 	setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
 	sockfd_put(sock);
 }
@@ -64,6 +78,7 @@ int ovpn_sock_attach_udp(struct socket *sock, struct ovpn_struct *ovpn)
 	}
 
 	setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+	ovpn_sock_set_udp_gro(sock, true);
 
 	return 0;
 }
@@ -82,7 +97,7 @@ int ovpn_sock_holder_encap_overhead(struct socket *sock)
 struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk)
 {
 	struct ovpn_struct *ovpn;
-	struct ovpn_peer *peer;
+	struct socket *sock;
 
 	ovpn_rcu_lockdep_assert_held();
 
@@ -93,13 +108,92 @@ struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk)
 	if (unlikely(!ovpn))
 		return NULL;
 
-	peer = rcu_dereference(ovpn->peer);
-	if (unlikely(!peer))
+	/* make sure that sk matches our stored transport socket. This check
+	 * does not depend on any peer, because in server mode packets coming
+	 * from unknown sources have to be accepted as well.
+	 * Only sockets attached by us point to ovpn, therefore any other
+	 * socket is a member of the reuseport group, unless the group is
+	 * being released
+	 */
+	sock = READ_ONCE(ovpn->sock);
+	if (unlikely(!sock))
 		return NULL;
 
-	/* make sure that sk matches our stored transport socket */
-	if (unlikely(!peer->sock || sk != peer->sock->sk))
+	if (unlikely(sk != sock->sk && !READ_ONCE(ovpn->num_reuseport_socks)))
 		return NULL;
 
 	return ovpn;
 }
+
+/* Check whether sock belongs to the SO_REUSEPORT group of the transport
+ * socket, i.e. it is bound to the same address and port in the same namespace
+ */
+static bool ovpn_sock_reuseport_match(const struct sock *sk,
+				      const struct sock *group)
+{
+	if (sk->sk_protocol != IPPROTO_UDP || sk->sk_family != group->sk_family ||
+	    !sk->sk_reuseport || !group->sk_reuseport ||
+	    !net_eq(sock_net(sk), sock_net(group)) ||
+	    inet_sk(sk)->inet_sport != inet_sk(group)->inet_sport ||
+	    sk->sk_rcv_saddr != group->sk_rcv_saddr)
+		return false;
+
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6 &&
+	    !ipv6_addr_equal(&sk->sk_v6_rcv_saddr, &group->sk_v6_rcv_saddr))
+		return false;
+#endif
+
+	return true;
+}
+
+/* Attach sock as another transport socket of ovpn. The reference to sock
+ * taken by sockfd_lookup() is released when the VPN is stopped.
+ * Serialized by the netlink command handlers
+ */
+int ovpn_sock_add_reuseport(struct ovpn_struct *ovpn, struct socket *sock)
+{
+	unsigned int n = ovpn->num_reuseport_socks;
+	int ret;
+
+	if (!ovpn->sock || ovpn->sock->sk->sk_protocol != IPPROTO_UDP)
+		return -EOPNOTSUPP;
+
+	if (n == OVPN_MAX_REUSEPORT_SOCKS)
+		return -ENOSPC;
+
+	if (!ovpn_sock_reuseport_match(sock->sk, ovpn->sock->sk)) {
+		pr_debug("%s: socket is not in the SO_REUSEPORT group of the transport socket\n",
+			 ovpn->dev->name);
+		return -EINVAL;
+	}
+
+	ret = ovpn_sock_attach_udp(sock, ovpn);
+	if (ret < 0)
+		return ret;
+
+	ovpn->reuseport_socks[n] = sock;
+	/* pairs with smp_load_acquire() in ovpn_udp_sock_tx() */
+	smp_store_release(&ovpn->num_reuseport_socks, n + 1);
+
+	return 0;
+}
+
+/* Detach and release the sockets added by ovpn_sock_add_reuseport(), once no
+ * CPU can be sending through them anymore. Invoked from process context
+ */
+void ovpn_sock_release_reuseport(struct ovpn_struct *ovpn)
+{
+	unsigned int i, n = ovpn->num_reuseport_socks;
+
+	if (!n)
+		return;
+
+	WRITE_ONCE(ovpn->num_reuseport_socks, 0);
+	synchronize_net();
+
+	for (i = 0; i < n; i++) {
+		ovpn_sock_detach(ovpn->reuseport_socks[i]);
+		ovpn->reuseport_socks[i] = NULL;
+	}
+}
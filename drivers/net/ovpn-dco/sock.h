@@ -18,6 +18,8 @@ int ovpn_sock_attach_udp(struct socket *sock, struct ovpn_struct *ovpn);
 void ovpn_sock_detach(struct socket *sock);
 int ovpn_sock_holder_encap_overhead(struct socket *sock);
 struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk);
+int ovpn_sock_add_reuseport(struct ovpn_struct *ovpn, struct socket *sock);
+void ovpn_sock_release_reuseport(struct ovpn_struct *ovpn);
 
 static inline int ovpn_sock_encap_overhead(const struct sock *sk)
 {
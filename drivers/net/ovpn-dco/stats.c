@@ -10,14 +10,235 @@
 #include "main.h"
 #include "stats.h"
 
-void ovpn_peer_stats_init(struct ovpn_peer_stats *ps)
+#include <linux/percpu.h>
+
+int ovpn_peer_stats_init(struct ovpn_peer_stats *ps)
 {
-	atomic64_set(&ps->rx.bytes, 0);
-	ps->rx.notify = 0;
-	atomic64_set(&ps->tx.bytes, 0);
-	ps->tx.notify = 0;
+	int cpu;
+
+	ps->pcpu = alloc_percpu(struct ovpn_peer_pcpu_stats);
+	if (!ps->pcpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(ps->pcpu, cpu)->syncp);
+
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+	ps->lat = alloc_percpu(struct ovpn_peer_latency);
+	if (!ps->lat) {
+		free_percpu(ps->pcpu);
+		ps->pcpu = NULL;
+		return -ENOMEM;
+	}
+#endif
+
+	ps->rx_notify = 0;
+	ps->tx_notify = 0;
 	ps->notify_per = 0;
 	ps->period = 0 * HZ;
 	ps->revisit = jiffies + ps->period;
 	spin_lock_init(&ps->lock);
+
+	return 0;
+}
+
+void ovpn_peer_stats_release(struct ovpn_peer_stats *ps)
+{
+	free_percpu(ps->pcpu);
+	ps->pcpu = NULL;
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+	free_percpu(ps->lat);
+	ps->lat = NULL;
+#endif
+}
+
+/* Sum the per-cpu counters into rx and tx */
+void ovpn_peer_stats_fold(const struct ovpn_peer_stats *ps,
+			  struct ovpn_peer_stat *rx, struct ovpn_peer_stat *tx)
+{
+	int cpu;
+
+	memset(rx, 0, sizeof(*rx));
+	memset(tx, 0, sizeof(*tx));
+
+	for_each_possible_cpu(cpu) {
+		const struct ovpn_peer_pcpu_stats *s = per_cpu_ptr(ps->pcpu, cpu);
+		struct ovpn_peer_stat srx, stx;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			srx = s->rx;
+			stx = s->tx;
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		rx->bytes += srx.bytes;
+		rx->packets += srx.packets;
+		tx->bytes += stx.bytes;
+		tx->packets += stx.packets;
+	}
+}
+
+/* Sum the per-cpu drop counters into drops */
+void ovpn_peer_stats_fold_drops(const struct ovpn_peer_stats *ps,
+				u64 drops[OVPN_PEER_DROP_REASONS])
+{
+	int cpu, i;
+
+	memset(drops, 0, sizeof(u64) * OVPN_PEER_DROP_REASONS);
+
+	for_each_possible_cpu(cpu) {
+		const struct ovpn_peer_pcpu_stats *s = per_cpu_ptr(ps->pcpu, cpu);
+		u64 sdrops[OVPN_PEER_DROP_REASONS];
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			memcpy(sdrops, s->drops, sizeof(sdrops));
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		for (i = 0; i < OVPN_PEER_DROP_REASONS; i++)
+			drops[i] += sdrops[i];
+	}
+}
+
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+/* Sum the per-cpu latency histograms of stage into hist */
+void ovpn_peer_stats_fold_latency(const struct ovpn_peer_stats *ps,
+				  enum ovpn_peer_lat_stage stage,
+				  u64 hist[OVPN_PEER_LAT_BUCKETS])
+{
+	const struct ovpn_peer_latency *lat;
+	int cpu, i;
+
+	memset(hist, 0, sizeof(u64) * OVPN_PEER_LAT_BUCKETS);
+
+	for_each_possible_cpu(cpu) {
+		lat = per_cpu_ptr(ps->lat, cpu);
+		for (i = 0; i < OVPN_PEER_LAT_BUCKETS; i++)
+			hist[i] += READ_ONCE(lat->hist[stage][i]);
+	}
+}
+#endif
+
+void ovpn_peer_stats_fold_tx_paths(const struct ovpn_peer_stats *ps,
+				   u64 paths[OVPN_PEER_TX_PATHS])
+{
+	int cpu, i;
+
+	memset(paths, 0, sizeof(u64) * OVPN_PEER_TX_PATHS);
+
+	for_each_possible_cpu(cpu) {
+		const struct ovpn_peer_pcpu_stats *s = per_cpu_ptr(ps->pcpu, cpu);
+		u64 spaths[OVPN_PEER_TX_PATHS];
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			memcpy(spaths, s->tx_paths, sizeof(spaths));
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		for (i = 0; i < OVPN_PEER_TX_PATHS; i++)
+			paths[i] += spaths[i];
+	}
+}
+
+struct ovpn_dp_pcpu_stats __percpu *ovpn_dp_stats_alloc(void)
+{
+	struct ovpn_dp_pcpu_stats __percpu *dp;
+	int cpu;
+
+	dp = alloc_percpu(struct ovpn_dp_pcpu_stats);
+	if (!dp)
+		return NULL;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(dp, cpu)->syncp);
+
+	return dp;
+}
+
+/* Read the datapath counters of one CPU into counters */
+void ovpn_dp_stats_fold_cpu(const struct ovpn_dp_pcpu_stats __percpu *dp,
+			    int cpu, u64 counters[OVPN_DP_STATS])
+{
+	const struct ovpn_dp_pcpu_stats *s = per_cpu_ptr(dp, cpu);
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin_irq(&s->syncp);
+		memcpy(counters, s->counters, sizeof(u64) * OVPN_DP_STATS);
+	} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+}
+
+void ovpn_queue_stats_fetch(const struct ovpn_queue_stats *qs, u64 *runs,
+			    u64 *packets)
+{
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin_irq(&qs->syncp);
+		*runs = qs->runs;
+		*packets = qs->packets;
+	} while (u64_stats_fetch_retry_irq(&qs->syncp, start));
+}
+
+/* Map the error returned by the crypto/transport layers to a drop reason */
+enum ovpn_peer_drop_reason ovpn_peer_drop_reason_from_err(int err)
+{
+	switch (err) {
+	case -ESTALE:
+	case -ETIME:
+		return OVPN_PEER_DROP_REPLAY;
+	case -EBADMSG:
+		return OVPN_PEER_DROP_AUTH;
+	case -ENOSPC:
+		return OVPN_PEER_DROP_RING_FULL;
+	case -ENOKEY:
+		return OVPN_PEER_DROP_NO_KEY;
+	default:
+		return OVPN_PEER_DROP_MALFORMED;
+	}
+}
+
+/* Fold the counters and check whether a notification has to be sent to
+ * userspace. Invoked at most once every ps->revisit
+ */
+bool ovpn_peer_stats_check_notify(struct ovpn_peer_stats *ps)
+{
+	const unsigned long now = jiffies;
+	struct ovpn_peer_stat rx, tx;
+	bool notify_trigger = false;
+
+	spin_lock_bh(&ps->lock);
+
+	/* somebody else already did the job */
+	if (time_before(now, ps->revisit))
+		goto unlock;
+
+	ovpn_peer_stats_fold(ps, &rx, &tx);
+
+	/* did stats cross notification threshold? */
+	if (ps->notify_per &&
+	    (rx.bytes >= ps->rx_notify || tx.bytes >= ps->tx_notify)) {
+		notify_trigger = true;
+		while (ps->rx_notify <= rx.bytes)
+			ps->rx_notify += ps->notify_per;
+		while (ps->tx_notify <= tx.bytes)
+			ps->tx_notify += ps->notify_per;
+	}
+	/* did notification time period elapse? */
+	else if (ps->period) {
+		notify_trigger = true;
+	}
+
+	if (ps->period)
+		WRITE_ONCE(ps->revisit, now + ps->period);
+	else
+		WRITE_ONCE(ps->revisit, now + OVPN_STATS_NOTIFY_INTERVAL);
+
+unlock:
+	spin_unlock_bh(&ps->lock);
+
+	return notify_trigger;
 }
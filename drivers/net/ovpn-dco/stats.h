@@ -11,6 +11,7 @@
 #ifndef _NET_OVPN_DCO_OVPNSTATS_H_
 #define _NET_OVPN_DCO_OVPNSTATS_H_
 
+#include <linux/atomic.h>
 #include <linux/jiffies.h>
 #include <linux/u64_stats_sync.h>
 
@@ -18,25 +19,137 @@ struct ovpn_struct;
 
 /* per-peer stats, measured on transport layer */
 
+/* interval between two checks of the bandwidth-triggered notification when
+ * no time-triggered notification is configured
+ */
+#define OVPN_STATS_NOTIFY_INTERVAL HZ
+
+/* reasons a packet of a peer may be dropped for. Exported over netlink as
+ * OVPN_PEER_STATS_ATTR_DROPS_* in the same order
+ */
+enum ovpn_peer_drop_reason {
+	OVPN_PEER_DROP_REPLAY,
+	OVPN_PEER_DROP_AUTH,
+	OVPN_PEER_DROP_RING_FULL,
+	OVPN_PEER_DROP_NO_KEY,
+	OVPN_PEER_DROP_MALFORMED,
+	OVPN_PEER_DROP_CTRL,
+	OVPN_PEER_DROP_REASONS,
+};
+
+/* ways a packet may be prepared for encryption. Exported over netlink as
+ * OVPN_PEER_STATS_ATTR_TX_* in the same order
+ */
+enum ovpn_peer_tx_path {
+	/* linear and private: encrypted in place */
+	OVPN_PEER_TX_PATH_INPLACE,
+	/* made private and writable first (skb_cow_data) */
+	OVPN_PEER_TX_PATH_COW,
+	OVPN_PEER_TX_PATHS,
+};
+
 /* one stat */
 struct ovpn_peer_stat {
-	atomic64_t bytes;
-	/* notify userspace when bytes exceeds this value */
-	u64 notify;
+	u64 bytes;
+	u64 packets;
 };
 
-/* rx and tx stats, enabled by notify_per != 0 or period != 0 */
-struct ovpn_peer_stats {
+/* counters updated by one CPU */
+struct ovpn_peer_pcpu_stats {
 	struct ovpn_peer_stat rx;
 	struct ovpn_peer_stat tx;
+	u64 drops[OVPN_PEER_DROP_REASONS];
+	u64 tx_paths[OVPN_PEER_TX_PATHS];
+	struct u64_stats_sync syncp;
+};
+
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+/* stages of the pipeline whose latency is measured */
+enum ovpn_peer_lat_stage {
+	/* from ovpn_net_xmit() to the start of encryption */
+	OVPN_PEER_LAT_TX_QUEUE,
+	/* encryption, including asynchronous completion */
+	OVPN_PEER_LAT_TX_CRYPTO,
+	/* from reception on the transport socket to the start of decryption */
+	OVPN_PEER_LAT_RX_QUEUE,
+	/* decryption, including asynchronous completion */
+	OVPN_PEER_LAT_RX_CRYPTO,
+	OVPN_PEER_LAT_STAGES,
+};
+
+/* bucket 0 counts samples below 1024ns, bucket i >= 1 the samples in
+ * [2^(9 + i), 2^(10 + i)) ns. The last bucket also collects anything slower
+ */
+#define OVPN_PEER_LAT_BUCKETS 24
+
+/* log2 latency histograms. Every packet is accounted once per stage, by
+ * whichever CPU processes it: the histograms are per-cpu so that a peer
+ * handled by several CPUs doesn't bounce a shared cache line, and are folded
+ * when dumped
+ */
+struct ovpn_peer_latency {
+	unsigned long hist[OVPN_PEER_LAT_STAGES][OVPN_PEER_LAT_BUCKETS];
+};
+#endif
+
+/* rx and tx stats. Notifications are enabled by notify_per != 0 or
+ * period != 0
+ */
+struct ovpn_peer_stats {
+	struct ovpn_peer_pcpu_stats __percpu *pcpu;
+	/* notify userspace when rx/tx bytes exceed these values */
+	u64 rx_notify;
+	u64 tx_notify;
 	/* configured bandwidth-triggered notification */
 	u64 notify_per;
 	/* configured time-triggered notification (relative jiffies) */
 	unsigned long period;
-	/* next timed notification (absolute jiffies) */
+	/* next time counters are folded and notifications are checked
+	 * (absolute jiffies)
+	 */
 	unsigned long revisit;
-	/* protects the ovpn_peer_stats object */
+	/* protects the notification state */
 	spinlock_t lock;
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+	struct ovpn_peer_latency __percpu *lat;
+#endif
+};
+
+/* datapath counters of an interface, kept per-cpu so that imbalances between
+ * CPUs can be spotted. Exported by ethtool -S in the same order
+ */
+enum ovpn_dp_stat {
+	/* packets encrypted/decrypted, successfully or not */
+	OVPN_DP_STAT_ENCRYPTED,
+	OVPN_DP_STAT_DECRYPTED,
+	OVPN_DP_STAT_ENCRYPT_ERRORS,
+	OVPN_DP_STAT_DECRYPT_ERRORS,
+	/* packets dropped because a ring was full */
+	OVPN_DP_STAT_RING_FULL,
+	/* segments produced by segmenting GSO packets on transmission */
+	OVPN_DP_STAT_GSO_SEGS,
+	/* NAPI polls of the RX queues and packets they processed */
+	OVPN_DP_STAT_NAPI_POLLS,
+	OVPN_DP_STAT_NAPI_PACKETS,
+	/* crypto works queued, and times they gave the CPU up while running */
+	OVPN_DP_STAT_WORK_QUEUED,
+	OVPN_DP_STAT_WORK_RESCHED,
+	OVPN_DP_STATS,
+};
+
+struct ovpn_dp_pcpu_stats {
+	u64 counters[OVPN_DP_STATS];
+	struct u64_stats_sync syncp;
+};
+
+/* counters of a device queue context, updated by its NAPI poll (RX) or by
+ * its encryption work (TX) only
+ */
+struct ovpn_queue_stats {
+	/* NAPI polls or work runs */
+	u64 runs;
+	u64 packets;
+	struct u64_stats_sync syncp;
 };
 
 /* struct for OVPN_ERR_STATS */
@@ -55,6 +168,26 @@ struct ovpn_err_stats {
 	struct ovpn_err_stat stats[];
 };
 
-void ovpn_peer_stats_init(struct ovpn_peer_stats *ps);
+int ovpn_peer_stats_init(struct ovpn_peer_stats *ps);
+void ovpn_peer_stats_release(struct ovpn_peer_stats *ps);
+void ovpn_peer_stats_fold(const struct ovpn_peer_stats *ps,
+			  struct ovpn_peer_stat *rx, struct ovpn_peer_stat *tx);
+void ovpn_peer_stats_fold_drops(const struct ovpn_peer_stats *ps,
+				u64 drops[OVPN_PEER_DROP_REASONS]);
+void ovpn_peer_stats_fold_tx_paths(const struct ovpn_peer_stats *ps,
+				   u64 paths[OVPN_PEER_TX_PATHS]);
+bool ovpn_peer_stats_check_notify(struct ovpn_peer_stats *ps);
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+void ovpn_peer_stats_fold_latency(const struct ovpn_peer_stats *ps,
+				  enum ovpn_peer_lat_stage stage,
+				  u64 hist[OVPN_PEER_LAT_BUCKETS]);
+#endif
+
+struct ovpn_dp_pcpu_stats __percpu *ovpn_dp_stats_alloc(void);
+void ovpn_dp_stats_fold_cpu(const struct ovpn_dp_pcpu_stats __percpu *dp,
+			    int cpu, u64 counters[OVPN_DP_STATS]);
+void ovpn_queue_stats_fetch(const struct ovpn_queue_stats *qs, u64 *runs,
+			    u64 *packets);
+enum ovpn_peer_drop_reason ovpn_peer_drop_reason_from_err(int err);
 
 #endif /* _NET_OVPN_DCO_OVPNSTATS_H_ */
@@ -11,67 +11,164 @@
 #define _NET_OVPN_DCO_OVPNSTATS_COUNTERS_H_
 
 #include "ovpn.h"
+#include "skb.h"
 
-/* increment per-peer stats */
+#include <linux/timekeeping.h>
+
+/* increment per-peer stats. Counters are per-cpu and are folded only when
+ * notifications have to be checked
+ */
 static inline bool ovpn_peer_stats_increment(struct ovpn_peer_stats *stats,
-					     struct ovpn_peer_stat *stat,
-					     const unsigned int n)
+					     bool rx, const unsigned int n)
 {
-	const u64 newval = atomic64_add_return(n, &stat->bytes);
-	bool notify_trigger = false;
+	struct ovpn_peer_pcpu_stats *s;
+	struct ovpn_peer_stat *stat;
+	unsigned long flags;
+
+	s = get_cpu_ptr(stats->pcpu);
+	stat = rx ? &s->rx : &s->tx;
+	flags = u64_stats_update_begin_irqsave(&s->syncp);
+	stat->bytes += n;
+	stat->packets++;
+	u64_stats_update_end_irqrestore(&s->syncp, flags);
+	put_cpu_ptr(stats->pcpu);
 
 	/* for performance, first check for trigger conditions
-	 * before we grab spinlock
+	 * before we fold the counters
 	 */
-	if (!stats->notify_per && !stats->period)
+	if (!READ_ONCE(stats->notify_per) && !READ_ONCE(stats->period))
 		return false;
 
-	if (likely(newval < READ_ONCE(stat->notify) &&
-		   time_before(jiffies, READ_ONCE(stats->revisit))))
+	if (likely(time_before(jiffies, READ_ONCE(stats->revisit))))
 		return false;
 
-	spin_lock_bh(&stats->lock);
+	return ovpn_peer_stats_check_notify(stats);
+}
+
+/* add n to a datapath counter of the current CPU */
+static inline void ovpn_dp_stats_add(struct ovpn_struct *ovpn,
+				     enum ovpn_dp_stat stat,
+				     const unsigned int n)
+{
+	struct ovpn_dp_pcpu_stats *s;
+	unsigned long flags;
+
+	s = get_cpu_ptr(ovpn->dp_stats);
+	flags = u64_stats_update_begin_irqsave(&s->syncp);
+	s->counters[stat] += n;
+	u64_stats_update_end_irqrestore(&s->syncp, flags);
+	put_cpu_ptr(ovpn->dp_stats);
+}
+
+static inline void ovpn_dp_stats_inc(struct ovpn_struct *ovpn,
+				     enum ovpn_dp_stat stat)
+{
+	ovpn_dp_stats_add(ovpn, stat, 1);
+}
 
-	/* did stat cross notification threshold? */
-	if (stats->notify_per && newval - n < stat->notify &&
-	    stat->notify <= newval) {
-		notify_trigger = true;
-		stat->notify += stats->notify_per;
+/* account a run of a queue context, which processed n packets */
+static inline void ovpn_queue_stats_add(struct ovpn_queue_stats *qs,
+					const unsigned int n)
+{
+	u64_stats_update_begin(&qs->syncp);
+	qs->runs++;
+	qs->packets += n;
+	u64_stats_update_end(&qs->syncp);
+}
 
-		if (stats->period)
-			stats->revisit = jiffies + stats->period;
-	}
-	/* did notification time period elapse? */
-	else if (stats->period && time_after_eq(jiffies, stats->revisit)) {
-		notify_trigger = true;
-		stats->revisit = jiffies + stats->period;
-	}
+/* account a packet dropped for the given reason. Ring-full drops are
+ * accounted to the CPU dropping them as well
+ */
+static inline void ovpn_peer_stats_drop(struct ovpn_peer *peer,
+					enum ovpn_peer_drop_reason reason)
+{
+	struct ovpn_peer_pcpu_stats *s;
+	unsigned long flags;
 
-	spin_unlock_bh(&stats->lock);
+	s = get_cpu_ptr(peer->stats.pcpu);
+	flags = u64_stats_update_begin_irqsave(&s->syncp);
+	s->drops[reason]++;
+	u64_stats_update_end_irqrestore(&s->syncp, flags);
+	put_cpu_ptr(peer->stats.pcpu);
 
-	return notify_trigger;
+	if (reason == OVPN_PEER_DROP_RING_FULL)
+		ovpn_dp_stats_inc(peer->ovpn, OVPN_DP_STAT_RING_FULL);
+}
+
+/* account the way a packet was prepared for encryption */
+static inline void ovpn_peer_stats_tx_path(struct ovpn_peer *peer,
+					   enum ovpn_peer_tx_path path)
+{
+	struct ovpn_peer_pcpu_stats *s;
+	unsigned long flags;
+
+	s = get_cpu_ptr(peer->stats.pcpu);
+	flags = u64_stats_update_begin_irqsave(&s->syncp);
+	s->tx_paths[path]++;
+	u64_stats_update_end_irqrestore(&s->syncp, flags);
+	put_cpu_ptr(peer->stats.pcpu);
+}
+
+static inline void ovpn_peer_stats_drop_err(struct ovpn_peer *peer, int err)
+{
+	ovpn_peer_stats_drop(peer, ovpn_peer_drop_reason_from_err(err));
 }
 
 static inline void ovpn_peer_stats_increment_rx(struct ovpn_peer *peer,
 						const unsigned int n)
 {
-	ovpn_peer_stats_increment(&peer->stats, &peer->stats.rx, n);
+	ovpn_peer_stats_increment(&peer->stats, true, n);
 }
 
 static inline void ovpn_peer_stats_increment_tx(struct ovpn_peer *peer,
 						const unsigned int n)
 {
-	ovpn_peer_stats_increment(&peer->stats, &peer->stats.tx, n);
+	ovpn_peer_stats_increment(&peer->stats, false, n);
 }
 
+#ifdef CONFIG_OVPN_DCO_LATENCY_HIST
+/* mark skb as entering a new stage of the pipeline */
+static inline void ovpn_peer_lat_stamp(struct sk_buff *skb)
+{
+	OVPN_SKB_CB(skb)->tstamp = ktime_get_ns();
+}
+
+/* account the time skb spent in stage and mark it as entering the next one */
+static inline void ovpn_peer_lat_record(struct ovpn_peer *peer,
+					struct sk_buff *skb,
+					enum ovpn_peer_lat_stage stage)
+{
+	u64 now = ktime_get_ns();
+	unsigned int bucket;
+
+	bucket = fls64((now - OVPN_SKB_CB(skb)->tstamp) >> 10);
+	bucket = min_t(unsigned int, bucket, OVPN_PEER_LAT_BUCKETS - 1);
+	this_cpu_inc(peer->stats.lat->hist[stage][bucket]);
+
+	OVPN_SKB_CB(skb)->tstamp = now;
+}
+#else
+static inline void ovpn_peer_lat_stamp(struct sk_buff *skb)
+{
+}
+
+#define ovpn_peer_lat_record(peer, skb, stage) do { } while (0)
+#endif
+
 static inline u64 ovpn_peer_stats_get_rx(struct ovpn_peer *peer)
 {
-	return atomic64_read(&peer->stats.rx.bytes);
+	struct ovpn_peer_stat rx, tx;
+
+	ovpn_peer_stats_fold(&peer->stats, &rx, &tx);
+	return rx.bytes;
 }
 
 static inline u64 ovpn_peer_stats_get_tx(struct ovpn_peer *peer)
 {
-	return atomic64_read(&peer->stats.tx.bytes);
+	struct ovpn_peer_stat rx, tx;
+
+	ovpn_peer_stats_fold(&peer->stats, &rx, &tx);
+	return tx.bytes;
 }
 
 #endif /* _NET_OVPN_DCO_OVPNSTATS_COUNTERS_H_ */
@@ -10,11 +10,14 @@
 #include "ovpnstruct.h"
 #include "ovpn.h"
 #include "peer.h"
+#include "stats_counters.h"
 #include "tcp.h"
 
 #include <linux/ptr_ring.h>
 #include <linux/skbuff.h>
 #include <net/route.h>
+#include <net/sock.h>
+#include <net/strparser.h>
 
 static void ovpn_tcp_state_change(struct sock *sk)
 {
@@ -34,7 +37,7 @@ static void ovpn_tcp_data_ready(struct sock *sk)
 	if (!peer)
 		return;
 
-	queue_work(peer->ovpn->events_wq, &peer->tcp.rx_work);
+	strp_data_ready(&peer->tcp->strp);
 	ovpn_peer_put(peer);
 }
 
@@ -52,7 +55,7 @@ static void ovpn_tcp_write_space(struct sock *sk)
 	if (!peer)
 		return;
 
-	queue_work(peer->ovpn->events_wq, &peer->tcp.tx_work);
+	queue_work(peer->ovpn->events_wq, &peer->tcp->tx_work);
 	ovpn_peer_put(peer);
 }
 
@@ -72,16 +75,17 @@ void ovpn_tcp_sock_detach(struct socket *sock)
 
 	/* restore CBs that were saved in ovpn_sock_set_tcp_cb() */
 	write_lock_bh(&sock->sk->sk_callback_lock);
-	sock->sk->sk_state_change = peer->tcp.sk_cb.sk_state_change;
-	sock->sk->sk_data_ready = peer->tcp.sk_cb.sk_data_ready;
-	sock->sk->sk_write_space = peer->tcp.sk_cb.sk_write_space;
+	strp_stop(&peer->tcp->strp);
+	sock->sk->sk_state_change = peer->tcp->sk_cb.sk_state_change;
+	sock->sk->sk_data_ready = peer->tcp->sk_cb.sk_data_ready;
+	sock->sk->sk_write_space = peer->tcp->sk_cb.sk_write_space;
 	write_unlock_bh(&sock->sk->sk_callback_lock);
 
 	/* cancel any ongoing work. Done after removing the CBs so that these workers cannot be
 	 * re-armed
 	 */
-	cancel_work_sync(&peer->tcp.tx_work);
-	cancel_work_sync(&peer->tcp.rx_work);
+	cancel_work_sync(&peer->tcp->tx_work);
+	strp_done(&peer->tcp->strp);
 
 	ovpn_peer_put(peer);
 
@@ -90,11 +94,111 @@ release:
 	sock_release(sock);
 }
 
+/* Parse the 2 bytes prefix of the next packet in the stream and return the
+ * full length of the message (prefix included), 0 if more data is needed or
+ * a negative error code if the stream is corrupted
+ */
+static int ovpn_tcp_parse(struct strparser *strp, struct sk_buff *skb)
+{
+	struct strp_msg *rxm = strp_msg(skb);
+	__be16 blen;
+	u16 len;
+	int err;
+
+	/* when packets are written to the TCP stream, they are prepended with
+	 * two bytes indicating the actual packet size.
+	 * Here we read those two bytes and move the skb data pointer to the
+	 * beginning of the packet
+	 */
+
+	if (skb->len < rxm->offset + 2)
+		return 0;
+
+	err = skb_copy_bits(skb, rxm->offset, &blen, sizeof(blen));
+	if (err < 0)
+		return err;
+
+	len = be16_to_cpu(blen);
+	/* invalid packet length: this is a fatal TCP error */
+	if (!len) {
+		pr_err_ratelimited("%s: received invalid packet length\n", __func__);
+		return -EINVAL;
+	}
+
+	return len + 2;
+}
+
+/* Receive one full message out of the stream. skb may share data with the
+ * socket receive queue, therefore it is only trimmed here, while the crypto
+ * layer takes care of making it writable when needed
+ */
+static void ovpn_tcp_rcv(struct strparser *strp, struct sk_buff *skb)
+{
+	struct ovpn_peer *peer = container_of(strp, struct ovpn_peer_tcp,
+					      strp)->peer;
+	struct strp_msg *msg = strp_msg(skb);
+	size_t pkt_len = msg->full_len - 2;
+	size_t off = msg->offset + 2;
+	bool ret;
+
+	/* ensure skb->data points to the beginning of the openvpn packet */
+	if (!pskb_pull(skb, off)) {
+		pr_warn_ratelimited("%s: packet too small\n", __func__);
+		goto err;
+	}
+
+	/* strparser does not trim the skb for us, therefore we do it now */
+	if (pskb_trim(skb, pkt_len) != 0) {
+		pr_warn_ratelimited("%s: trimming skb failed\n", __func__);
+		goto err;
+	}
+
+	/* hold reference to peer as required by ovpn_recv() */
+	if (unlikely(!ovpn_peer_hold(peer)))
+		goto err;
+
+	ret = ovpn_recv(peer->ovpn, peer, skb);
+	ovpn_peer_put(peer);
+	if (!ret)
+		goto err;
+
+	return;
+err:
+	kfree_skb(skb);
+}
+
+/* The stream cannot be parsed anymore: the peer can't be reached */
+static void ovpn_tcp_abort(struct strparser *strp, int err)
+{
+	struct ovpn_peer *peer = container_of(strp, struct ovpn_peer_tcp,
+					      strp)->peer;
+
+	pr_err_ratelimited("%s: TCP socket error: %d\n", __func__, err);
+	ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_TRANSPORT_ERROR);
+}
+
 /* Set TCP encapsulation callbacks */
 int ovpn_tcp_sock_attach(struct socket *sock, struct ovpn_peer *peer)
 {
+	struct strp_callbacks cb = {
+		.rcv_msg = ovpn_tcp_rcv,
+		.parse_msg = ovpn_tcp_parse,
+		.abort_parser = ovpn_tcp_abort,
+	};
 	void *old_data;
-	int ret = 0;
+	int ret;
+
+	/* verify TCP socket */
+	if (sock->sk->sk_protocol != IPPROTO_TCP) {
+		pr_err("expected TCP socket\n");
+		return -EINVAL;
+	}
+
+	ret = strp_init(&peer->tcp->strp, sock->sk, &cb);
+	if (ret < 0) {
+		pr_err("cannot initialize stream parser: %d\n", ret);
+		return ret;
+	}
 
 	write_lock_bh(&sock->sk->sk_callback_lock);
 
@@ -108,13 +212,6 @@ int ovpn_tcp_sock_attach(struct socket *sock, struct ovpn_peer *peer)
 		goto out;
 	}
 
-	/* verify UDP socket */
-	if (sock->sk->sk_protocol != IPPROTO_TCP) {
-		pr_err("expected TCP socket\n");
-		ret = -EINVAL;
-		goto out;
-	}
-
 	if (sock->sk->sk_state != TCP_ESTABLISHED) {
 		pr_err("unexpected state for TCP socket: %d\n", sock->sk->sk_state);
 		ret = -EINVAL;
@@ -124,9 +221,9 @@ int ovpn_tcp_sock_attach(struct socket *sock, struct ovpn_peer *peer)
 	rcu_assign_sk_user_data(sock->sk, peer->ovpn);
 
 	/* save current CBs so that they can be restored upon socket release */
-	peer->tcp.sk_cb.sk_state_change = sock->sk->sk_state_change;
-	peer->tcp.sk_cb.sk_data_ready = sock->sk->sk_data_ready;
-	peer->tcp.sk_cb.sk_write_space = sock->sk->sk_write_space;
+	peer->tcp->sk_cb.sk_state_change = sock->sk->sk_state_change;
+	peer->tcp->sk_cb.sk_data_ready = sock->sk->sk_data_ready;
+	peer->tcp->sk_cb.sk_write_space = sock->sk->sk_write_space;
 
 	/* assign our static CBs */
 	sock->sk->sk_state_change = ovpn_tcp_state_change;
@@ -134,156 +231,101 @@ int ovpn_tcp_sock_attach(struct socket *sock, struct ovpn_peer *peer)
 	sock->sk->sk_write_space = ovpn_tcp_write_space;
 out:
 	write_unlock_bh(&sock->sk->sk_callback_lock);
-	return ret;
+
+	if (ret < 0) {
+		strp_done(&peer->tcp->strp);
+		return ret;
+	}
+
+	/* parse any data that was already queued before attaching */
+	strp_check_rcv(&peer->tcp->strp);
+
+	return 0;
 }
 
-/* Try to send one skb (or part of it) over the TCP stream.
+/* Try to send one skb (or what is left of it) over the TCP stream.
+ * Linear data and page frags are pushed to the socket as they are, therefore
+ * the skb is neither linearized nor copied here.
  *
- * Return 0 on success or a negative error code otherwise.
+ * Must be called with the socket lock held.
  *
- * Note that the skb is modified by putting away the data being sent, therefore
- * the caller should check if skb->len is zero to understand if the full skb was
- * sent or not.
+ * Return 0 when the skb was entirely sent, -EAGAIN if the socket could not
+ * take all of it (peer->tcp->tx_offset remembers how much was sent) or another
+ * negative error code on failure.
  */
-static int ovpn_tcp_send_one(struct ovpn_struct *ovpn, struct sk_buff *skb)
+static int ovpn_tcp_send_one(struct ovpn_peer *peer, struct sock *sk,
+			     struct sk_buff *skb)
 {
-	struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
-	struct kvec iv = { .iov_base = skb->data, .iov_len = skb->len };
 	int ret;
 
-	if (skb_linearize(skb) < 0) {
-		pr_err_ratelimited("%s: can't linearize packet\n", __func__);
-		return -ENOMEM;
-	}
+	ret = skb_send_sock_locked(sk, skb, peer->tcp->tx_offset,
+				   skb->len - peer->tcp->tx_offset);
+	if (ret <= 0)
+		return ret ? ret : -EAGAIN;
 
-	ret = kernel_sendmsg(ovpn->sock, &msg, &iv, 1, iv.iov_len);
-	if (ret > 0) {
-		__skb_pull(skb, ret);
+	peer->tcp->tx_offset += ret;
+	if (peer->tcp->tx_offset < skb->len)
+		return -EAGAIN;
 
-		/* since we update per-cpu stats in process context,
-		 * we need to disable softirqs
-		 */
-		local_bh_disable();
-		dev_sw_netstats_tx_add(ovpn->dev, 1, ret);
-		local_bh_enable();
+	peer->tcp->tx_offset = 0;
 
-		return 0;
-	}
+	/* since we update per-cpu stats in process context,
+	 * we need to disable softirqs
+	 */
+	local_bh_disable();
+	dev_sw_netstats_tx_add(peer->ovpn->dev, 1, skb->len);
+	local_bh_enable();
 
-	return ret;
+	return 0;
 }
 
-/* Process packets in TCP TX queue */
+/* Process packets in TCP TX queue.
+ *
+ * The socket lock is held across the whole queue, so that all the packets
+ * found in tx_ring are appended to the socket write queue back to back and
+ * TCP can pack them into full-sized segments.
+ */
 void ovpn_tcp_tx_work(struct work_struct *work)
 {
 	struct ovpn_peer *peer;
+	struct socket *sock;
 	struct sk_buff *skb;
-	int ret;
+	int ret = 0;
 
-	peer = container_of(work, struct ovpn_peer, tcp.tx_work);
-	while ((skb = __ptr_ring_peek(&peer->tcp.tx_ring))) {
-		ret = ovpn_tcp_send_one(peer->ovpn, skb);
-		if (ret < 0 && ret != -EAGAIN) {
-			pr_warn_ratelimited("%s: cannot send TCP packet: %d\n", __func__, ret);
-			/* in case of TCP error stop sending loop, and, if peer is
-			 * attached to ovpn_struct, delete it and notify userspace
-			 */
-			ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_TRANSPORT_ERROR);
+	peer = container_of(work, struct ovpn_peer_tcp, tx_work)->peer;
+	sock = READ_ONCE(peer->ovpn->sock);
+	if (unlikely(!sock))
+		return;
+
+	lock_sock(sock->sk);
+	while ((skb = __ptr_ring_peek(&peer->tcp->tx_ring))) {
+		ret = ovpn_tcp_send_one(peer, sock->sk, skb);
+		/* on -EAGAIN the socket buffer is full: ovpn_tcp_write_space()
+		 * will reschedule us once there is room again
+		 */
+		if (ret < 0)
 			break;
-		} else if (!skb->len) {
-			/* skb was entirely consumed and can now be removed from the ring */
-			__ptr_ring_discard_one(&peer->tcp.tx_ring);
-			consume_skb(skb);
-		}
+
+		/* skb was entirely consumed and can now be removed from the ring */
+		__ptr_ring_discard_one(&peer->tcp->tx_ring);
+		consume_skb(skb);
 
 		/* give a chance to be rescheduled if needed */
-		if (need_resched())
+		if (need_resched()) {
+			release_sock(sock->sk);
 			cond_resched();
-	}
-}
-
-static int ovpn_tcp_rx_one(struct ovpn_peer *peer)
-{
-	struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
-	int ret;
-
-	/* no skb allocated means that we have to read (or finish reading) the 2 bytes prefix
-	 * containing the actual packet size.
-	 */
-	if (!peer->tcp.skb) {
-		struct kvec iv = {
-			.iov_base = peer->tcp.raw_len + peer->tcp.offset,
-			.iov_len = sizeof(u16) - peer->tcp.offset,
-		};
-
-		ret = kernel_recvmsg(peer->ovpn->sock, &msg, &iv, 1, iv.iov_len, msg.msg_flags);
-		if (ret <= 0)
-			return ret;
-
-		peer->tcp.offset += ret;
-		/* the entire packet size was read, prepare skb for reading data */
-		if (peer->tcp.offset == sizeof(u16)) {
-			u16 len = ntohs(*(__be16 *)peer->tcp.raw_len);
-			/* invalid packet length: this is a fatal TCP error */
-			if (!len) {
-				pr_err("%s: received invalid packet length\n", __func__);
-				return -EINVAL;
-			}
-
-			peer->tcp.skb = netdev_alloc_skb_ip_align(peer->ovpn->dev, len);
-			peer->tcp.offset = 0;
-			peer->tcp.data_len = len;
-		}
-	} else {
-		struct kvec iv = {
-			.iov_base = peer->tcp.skb->data + peer->tcp.offset,
-			.iov_len = peer->tcp.data_len - peer->tcp.offset,
-		};
-
-		ret = kernel_recvmsg(peer->ovpn->sock, &msg, &iv, 1, iv.iov_len, msg.msg_flags);
-		if (ret <= 0)
-			return ret;
-
-		peer->tcp.offset += ret;
-		/* full packet received, send it up for processing */
-		if (peer->tcp.offset == peer->tcp.data_len) {
-			/* update the skb data structure with the amount of data written by
-			 * kernel_recvmsg()
-			 */
-			skb_put(peer->tcp.skb, peer->tcp.data_len);
-
-			/* hold reference to peer as requird by ovpn_recv() */
-			ovpn_peer_hold(peer);
-			if (!ovpn_recv(peer->ovpn, peer, peer->tcp.skb))
-				/* skb not handled - free it now */
-				kfree_skb(peer->tcp.skb);
-
-			peer->tcp.skb = NULL;
-			peer->tcp.offset = 0;
-			peer->tcp.data_len = 0;
+			lock_sock(sock->sk);
 		}
 	}
+	release_sock(sock->sk);
 
-	return ret;
-}
-
-void ovpn_tcp_rx_work(struct work_struct *work)
-{
-	struct ovpn_peer *peer = container_of(work, struct ovpn_peer, tcp.rx_work);
-	int ret;
-
-	while (true) {
-		/* give a chance to be rescheduled if needed */
-		if (need_resched())
-			cond_resched();
-
-		ret = ovpn_tcp_rx_one(peer);
-		if (ret <= 0)
-			break;
+	if (ret < 0 && ret != -EAGAIN) {
+		pr_warn_ratelimited("%s: cannot send TCP packet: %d\n", __func__, ret);
+		/* in case of TCP error stop sending loop, and, if peer is
+		 * attached to ovpn_struct, delete it and notify userspace
+		 */
+		ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_TRANSPORT_ERROR);
 	}
-
-	if (ret < 0 && ret != -EAGAIN)
-		pr_err("%s: TCP socket error: %d\n", __func__, ret);
 }
 
 /* Put packet into TCP TX queue and schedule a consumer */
@@ -291,11 +333,12 @@ void ovpn_queue_tcp_skb(struct ovpn_peer *peer, struct sk_buff *skb)
 {
 	int ret;
 
-	ret = __ptr_ring_produce(&peer->tcp.tx_ring, skb);
+	ret = ptr_ring_produce_bh(&peer->tcp->tx_ring, skb);
 	if (ret < 0) {
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_RING_FULL);
 		kfree_skb_list(skb);
 		return;
 	}
 
-	queue_work(peer->ovpn->events_wq, &peer->tcp.tx_work);
+	queue_work(peer->ovpn->events_wq, &peer->tcp->tx_work);
 }
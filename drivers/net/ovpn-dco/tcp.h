@@ -12,7 +12,6 @@
 #include <linux/workqueue.h>
 
 void ovpn_tcp_tx_work(struct work_struct *work);
-void ovpn_tcp_rx_work(struct work_struct *work);
 
 void ovpn_queue_tcp_skb(struct ovpn_peer *peer, struct sk_buff *skb);
 
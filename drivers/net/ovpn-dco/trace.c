@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
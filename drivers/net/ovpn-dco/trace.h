@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ovpn_dco
+
+#if !defined(_NET_OVPN_DCO_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _NET_OVPN_DCO_TRACE_H_
+
+#include "peer.h"
+#include "skb.h"
+
+#include <linux/ptr_ring.h>
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+
+#ifndef _NET_OVPN_DCO_TRACE_HELPERS_
+#define _NET_OVPN_DCO_TRACE_HELPERS_
+
+/* Number of entries queued in ring. The ring is read without locking, hence
+ * the result is only a snapshot
+ */
+static inline unsigned int ovpn_trace_ring_depth(struct ptr_ring *ring)
+{
+	int size = READ_ONCE(ring->size), producer, consumer;
+
+	if (!size)
+		return 0;
+
+	producer = READ_ONCE(ring->producer);
+	consumer = READ_ONCE(ring->consumer_head);
+
+	/* producer and consumer are equal both on an empty and on a full ring */
+	if (producer == consumer)
+		return READ_ONCE(ring->queue[producer]) ? size : 0;
+
+	return (producer - consumer + size) % size;
+}
+
+#endif /* _NET_OVPN_DCO_TRACE_HELPERS_ */
+
+/* a packet is being queued on ring, before being processed by the next stage
+ * of the pipeline. qlen is the number of packets already waiting on the ring
+ */
+DECLARE_EVENT_CLASS(ovpn_queue,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 struct ptr_ring *ring),
+
+	TP_ARGS(peer, skb, ring),
+
+	TP_STRUCT__entry(
+		__field(u32, peer_id)
+		__field(unsigned int, len)
+		__field(unsigned int, qlen)
+	),
+
+	TP_fast_assign(
+		__entry->peer_id = peer->id;
+		__entry->len = skb->len;
+		__entry->qlen = ovpn_trace_ring_depth(ring);
+	),
+
+	TP_printk("peer=%u len=%u qlen=%u", __entry->peer_id, __entry->len,
+		  __entry->qlen)
+);
+
+DEFINE_EVENT(ovpn_queue, ovpn_tx_queue,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 struct ptr_ring *ring),
+	TP_ARGS(peer, skb, ring)
+);
+
+DEFINE_EVENT(ovpn_queue, ovpn_rx_queue,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 struct ptr_ring *ring),
+	TP_ARGS(peer, skb, ring)
+);
+
+DEFINE_EVENT(ovpn_queue, ovpn_netif_queue,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 struct ptr_ring *ring),
+	TP_ARGS(peer, skb, ring)
+);
+
+/* a packet is entering a stage of the pipeline. The packet ID is known
+ * only once the packet has gone through the crypto layer, 0 otherwise
+ */
+DECLARE_EVENT_CLASS(ovpn_pkt,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb),
+
+	TP_ARGS(peer, skb),
+
+	TP_STRUCT__entry(
+		__field(u32, peer_id)
+		__field(u8, key_id)
+		__field(u32, pktid)
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__entry->peer_id = peer->id;
+		__entry->key_id = OVPN_SKB_CB(skb)->key_id;
+		__entry->pktid = OVPN_SKB_CB(skb)->pktid;
+		__entry->len = skb->len;
+	),
+
+	TP_printk("peer=%u key=%u pktid=%u len=%u", __entry->peer_id,
+		  __entry->key_id, __entry->pktid, __entry->len)
+);
+
+DEFINE_EVENT(ovpn_pkt, ovpn_encrypt_start,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb),
+	TP_ARGS(peer, skb)
+);
+
+DEFINE_EVENT(ovpn_pkt, ovpn_tx_xmit,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb),
+	TP_ARGS(peer, skb)
+);
+
+DEFINE_EVENT(ovpn_pkt, ovpn_decrypt_start,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb),
+	TP_ARGS(peer, skb)
+);
+
+DEFINE_EVENT(ovpn_pkt, ovpn_rx_deliver,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb),
+	TP_ARGS(peer, skb)
+);
+
+/* encryption or decryption of a packet completed, successfully or not */
+DECLARE_EVENT_CLASS(ovpn_crypto_done,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 int ret),
+
+	TP_ARGS(peer, skb, ret),
+
+	TP_STRUCT__entry(
+		__field(u32, peer_id)
+		__field(u8, key_id)
+		__field(u32, pktid)
+		__field(unsigned int, len)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->peer_id = peer->id;
+		__entry->key_id = OVPN_SKB_CB(skb)->key_id;
+		__entry->pktid = OVPN_SKB_CB(skb)->pktid;
+		__entry->len = skb->len;
+		__entry->ret = ret;
+	),
+
+	TP_printk("peer=%u key=%u pktid=%u len=%u ret=%d", __entry->peer_id,
+		  __entry->key_id, __entry->pktid, __entry->len, __entry->ret)
+);
+
+DEFINE_EVENT(ovpn_crypto_done, ovpn_encrypt_done,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 int ret),
+	TP_ARGS(peer, skb, ret)
+);
+
+DEFINE_EVENT(ovpn_crypto_done, ovpn_decrypt_done,
+	TP_PROTO(const struct ovpn_peer *peer, const struct sk_buff *skb,
+		 int ret),
+	TP_ARGS(peer, skb, ret)
+);
+
+#endif /* _NET_OVPN_DCO_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
@@ -8,49 +8,135 @@
 
 #include "main.h"
 #include "bind.h"
+#include "crypto.h"
 #include "ovpn.h"
 #include "ovpnstruct.h"
 #include "peer.h"
 #include "proto.h"
+#include "stats_counters.h"
 #include "udp.h"
 
+#include <linux/jhash.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+#include <linux/random.h>
 #include <net/dst_cache.h>
+#include <net/ip.h>
+#include <net/ip6_checksum.h>
+#include <net/ip_tunnels.h>
 #include <net/route.h>
 #include <net/ip6_route.h>
+#include <net/udp.h>
 #include <net/udp_tunnel.h>
 
 /* Lookup ovpn_peer using incoming encrypted transport packet.
- * This is for looking up transport -> ovpn packets.
+ * This is for looking up transport -> ovpn packets. No reference is taken,
+ * therefore the caller must be in an RCU read-side critical section.
+ *
+ * DATA_V2 packets are matched by peer-id only, regardless of the transport
+ * address they come from: packets that fail authentication are dropped by
+ * the crypto layer anyway, while authenticated ones from a new address let
+ * the peer float (see ovpn_peer_float())
  */
 static struct ovpn_peer *
 ovpn_lookup_peer_via_transport(struct ovpn_struct *ovpn,
 			       struct sk_buff *skb)
 {
-	struct ovpn_peer *peer;
-	struct ovpn_bind *bind;
+	int peer_id = -1;
+	u32 op;
+
+	switch (ovpn->mode) {
+	case OVPN_MODE_CLIENT:
+		return rcu_dereference(ovpn->peer);
+	case OVPN_MODE_SERVER:
+		/* all the packets not carrying the peer-id of the sender
+		 * have to be matched against the transport endpoint they
+		 * come from
+		 */
+		op = ovpn_op32_from_skb(skb, &peer_id);
+		if (!ovpn_opcode_is_data_v2(op) || peer_id < 0)
+			return ovpn_peer_lookup_transp_addr_rcu(ovpn, skb);
+
+		return ovpn_peer_lookup_id_rcu(ovpn, peer_id);
+	default:
+		return NULL;
+	}
+}
 
-	rcu_read_lock();
-	peer = ovpn_peer_get(ovpn);
-	if (unlikely(!peer))
-		goto err;
+int ovpn_udp_ctrl_ratelimit_init(struct ovpn_struct *ovpn)
+{
+	unsigned int i;
 
-	bind = rcu_dereference(peer->bind);
-	if (unlikely(!bind))
-		goto err;
+	ovpn->ctrl_buckets = kvcalloc(1 << OVPN_CTRL_RATELIMIT_BITS,
+				      sizeof(*ovpn->ctrl_buckets), GFP_KERNEL);
+	if (!ovpn->ctrl_buckets)
+		return -ENOMEM;
 
-	/* only one peer is supported at the moment. check if it's the one the
-	 * skb was received from and return it
-	 */
-	if (unlikely(!ovpn_bind_skb_match(bind, skb)))
-		goto err;
+	for (i = 0; i < (1 << OVPN_CTRL_RATELIMIT_BITS); i++)
+		spin_lock_init(&ovpn->ctrl_buckets[i].lock);
 
-	rcu_read_unlock();
-	return peer;
+	ovpn->ctrl_rate = OVPN_CTRL_RATE;
+	ovpn->ctrl_seed = get_random_u32();
 
-err:
-	ovpn_peer_put(peer);
-	rcu_read_unlock();
-	return NULL;
+	return 0;
+}
+
+void ovpn_udp_ctrl_ratelimit_release(struct ovpn_struct *ovpn)
+{
+	kvfree(ovpn->ctrl_buckets);
+	ovpn->ctrl_buckets = NULL;
+}
+
+/* Check whether a control packet can be accepted from the source address of
+ * skb. Sources are hashed to a fixed number of token buckets: sources sharing
+ * a bucket share its budget too, which is fine as long as the default rate is
+ * generous enough for the handshakes of several clients.
+ * Called in softirq context.
+ */
+static bool ovpn_udp_ctrl_ratelimit(struct ovpn_struct *ovpn,
+				    struct sk_buff *skb)
+{
+	u32 rate = READ_ONCE(ovpn->ctrl_rate);
+	struct ovpn_ctrl_bucket *b;
+	unsigned long now = jiffies;
+	unsigned long delta;
+	bool pass = false;
+	u32 hash;
+
+	if (!rate)
+		return true;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		hash = jhash_1word((__force u32)ip_hdr(skb)->saddr,
+				   ovpn->ctrl_seed);
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case htons(ETH_P_IPV6):
+		hash = jhash2((__force u32 *)ipv6_hdr(skb)->saddr.s6_addr32,
+			      4, ovpn->ctrl_seed);
+		break;
+#endif
+	default:
+		return false;
+	}
+
+	b = &ovpn->ctrl_buckets[hash & ((1 << OVPN_CTRL_RATELIMIT_BITS) - 1)];
+
+	/* refill the bucket by rate tokens per second, holding at most one
+	 * second worth of packets
+	 */
+	spin_lock(&b->lock);
+	delta = min_t(unsigned long, now - b->last, HZ);
+	b->last = now;
+	b->tokens = min_t(u64, b->tokens + (u64)delta * rate, (u64)rate * HZ);
+	if (b->tokens >= HZ) {
+		b->tokens -= HZ;
+		pass = true;
+	}
+	spin_unlock(&b->lock);
+
+	return pass;
 }
 
 /* Here we look at an incoming OpenVPN UDP packet.  If we are able
@@ -63,10 +149,11 @@ err:
  * >0 : skb should be passed up to userspace as UDP (packet not consumed)
  * <0 : skb should be resubmitted as proto -N (packet not consumed)
  */
-int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
+static int ovpn_udp_encap_recv_one(struct sock *sk, struct sk_buff *skb)
 {
 	struct ovpn_struct *ovpn;
 	struct ovpn_peer *peer;
+	bool data;
 
 	/* pop off outer UDP header */
 	__skb_pull(skb, sizeof(struct udphdr));
@@ -75,26 +162,386 @@ int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
 	if (unlikely(!ovpn))
 		goto drop;
 
-	/* lookup peer */
+	/* only DATA_V2 packets enter the crypto pipeline. Control packets are
+	 * rate-limited per source address before anything else is done with
+	 * them, so that a flood cannot starve data traffic
+	 */
+	data = ovpn_opcode_is_data_v2(ovpn_op32_from_skb(skb, NULL));
+
+	/* lookup peer, which is used without taking a reference */
+	rcu_read_lock();
 	peer = ovpn_lookup_peer_via_transport(ovpn, skb);
-	if (!peer)
+
+	if (unlikely(!data) && !ovpn_udp_ctrl_ratelimit(ovpn, skb)) {
+		net_dbg_ratelimited("%s: control packet rate exceeded\n",
+				    ovpn->dev->name);
+		if (peer)
+			ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_CTRL);
+		else
+			atomic_long_inc(&ovpn->dev->rx_dropped);
+		goto drop_unlock;
+	}
+
+	if (!peer) {
+		rcu_read_unlock();
+
+		/* in server mode, control packets coming from unknown sources
+		 * may be initiating a new connection: let userspace read them
+		 * from the socket
+		 */
+		if (ovpn->mode == OVPN_MODE_SERVER && !data) {
+			__skb_push(skb, sizeof(struct udphdr));
+			return 1;
+		}
 		goto drop;
+	}
 
+	/* control packets of known peers are diverted to userspace by
+	 * ovpn_recv() before being queued
+	 */
 	if (!ovpn_recv(ovpn, peer, skb))
-		goto drop;
+		goto drop_unlock;
 
+	rcu_read_unlock();
 	return 0;
 
+drop_unlock:
+	rcu_read_unlock();
 drop:
 	kfree_skb(skb);
 	return 0;
 }
 
+/* Entry point of the UDP encapsulation. Since UDP GRO is enabled on the
+ * socket, skb may be a GRO train carrying several datagrams received from
+ * the same 4-tuple: split it and process each datagram on its own.
+ * Return codes are the same as ovpn_udp_encap_recv_one()
+ */
+int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff *segs, *next;
+
+	if (likely(!skb_is_gso(skb)))
+		return ovpn_udp_encap_recv_one(sk, skb);
+
+	/* as in udp_queue_rcv_skb(), segmentation expects skb->data at the mac
+	 * header, from which it computes the header offsets of the segments
+	 */
+	__skb_push(skb, -skb_mac_offset(skb));
+
+	/* udp_rcv_segment() frees the train on failure */
+	segs = udp_rcv_segment(sk, skb, skb->protocol == htons(ETH_P_IP));
+	if (unlikely(!segs))
+		return 0;
+
+	skb_list_walk_safe(segs, skb, next) {
+		skb_mark_not_on_list(skb);
+		udp_post_segment_fix_csum(skb);
+		/* segments start at the mac header */
+		__skb_pull(skb, skb_transport_offset(skb));
+
+		if (likely(ovpn_udp_encap_recv_one(sk, skb) <= 0))
+			continue;
+
+		/* the datagram should reach userspace, but we cannot hand it
+		 * back to the UDP stack: queue it to the socket directly
+		 */
+		if (__udp_enqueue_schedule_skb(sk, skb) < 0) {
+			atomic_inc(&sk->sk_drops);
+			kfree_skb(skb);
+		}
+	}
+
+	return 0;
+}
+
+/* Return the reason the early filter has to drop skb for, or -1 if skb should
+ * go through the UDP stack. off is the offset of the UDP payload.
+ * Packets are matched against the same peer tables used by
+ * ovpn_lookup_peer_via_transport(), so that DATA_V2 packets of unknown peers
+ * or keys are dropped, along with those rejected by the replay window.
+ * Peers are used under the RCU read lock held by the netfilter core
+ */
+static int ovpn_udp_filter(struct ovpn_struct *ovpn, struct sk_buff *skb,
+			   unsigned int off)
+{
+	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_peer *peer;
+	unsigned int opcode;
+	const __be32 *hdr;
+	__be32 buf[2];
+	u32 op, peer_id;
+
+	/* any OpenVPN packet is longer than opcode and packet ID of DATA_V2
+	 * packets: control packets also carry an 8 bytes session ID
+	 */
+	hdr = skb_header_pointer(skb, off, sizeof(buf), buf);
+	if (unlikely(!hdr))
+		return OVPN_FILTER_DROP_OPCODE;
+
+	op = ntohl(hdr[0]);
+	opcode = ovpn_opcode_extract(op >> 24);
+	if (opcode < OVPN_OPCODE_FIRST || opcode > OVPN_OPCODE_LAST)
+		return OVPN_FILTER_DROP_OPCODE;
+
+	/* control packets are checked in ovpn_udp_encap_recv_one() */
+	if (opcode != OVPN_DATA_V2)
+		return -1;
+
+	switch (ovpn->mode) {
+	case OVPN_MODE_CLIENT:
+		peer = rcu_dereference(ovpn->peer);
+		break;
+	case OVPN_MODE_SERVER:
+		peer_id = op & 0x00FFFFFF;
+		if (peer_id == OVPN_OP_PEER_ID_UNDEF)
+			peer = ovpn_peer_lookup_transp_addr_rcu(ovpn, skb);
+		else
+			peer = ovpn_peer_lookup_id_rcu(ovpn, peer_id);
+		break;
+	default:
+		return -1;
+	}
+
+	if (!peer)
+		return OVPN_FILTER_DROP_PEER_ID;
+
+	ks = ovpn_crypto_key_id_to_slot_rcu(&peer->crypto,
+					    ovpn_key_id_extract(op >> 24));
+	if (!ks) {
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_NO_KEY);
+		return OVPN_FILTER_DROP_KEY_ID;
+	}
+
+	if (ovpn_pktid_recv_stale(&ks->pid_recv, ntohl(hdr[1]))) {
+		ovpn_peer_stats_drop(peer, OVPN_PEER_DROP_REPLAY);
+		return OVPN_FILTER_DROP_REPLAY;
+	}
+
+	return -1;
+}
+
+/* Netfilter hook of the early filter, registered by ovpn_udp_filter_start().
+ * It runs before the UDP stack, and before conntrack and routing if the
+ * socket is bound to a specific address, therefore packets have to be matched
+ * against the address and port of the socket first.
+ * Called in softirq context with the RCU read lock held
+ */
+static unsigned int ovpn_udp_filter_hook(void *priv, struct sk_buff *skb,
+					 const struct nf_hook_state *state)
+{
+	struct ovpn_struct *ovpn = priv;
+	struct sock *sk = ovpn->sock->sk;
+	unsigned int off;
+	int reason;
+
+	/* GRO trains may mix valid and invalid datagrams of the same flow.
+	 * They are split and checked one by one in ovpn_udp_encap_recv()
+	 */
+	if (skb_is_gso(skb))
+		return NF_ACCEPT;
+
+	switch (state->pf) {
+	case NFPROTO_IPV4:
+		if (ip_hdr(skb)->protocol != IPPROTO_UDP ||
+		    ip_is_fragment(ip_hdr(skb)))
+			return NF_ACCEPT;
+		if (sk->sk_rcv_saddr && ip_hdr(skb)->daddr != sk->sk_rcv_saddr)
+			return NF_ACCEPT;
+		off = skb_network_offset(skb) + ip_hdrlen(skb);
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case NFPROTO_IPV6:
+		/* packets with extension headers are left to the UDP stack */
+		if (ipv6_hdr(skb)->nexthdr != IPPROTO_UDP)
+			return NF_ACCEPT;
+		if (!ipv6_addr_any(&sk->sk_v6_rcv_saddr) &&
+		    !ipv6_addr_equal(&ipv6_hdr(skb)->daddr,
+				     &sk->sk_v6_rcv_saddr))
+			return NF_ACCEPT;
+		off = skb_network_offset(skb) + sizeof(struct ipv6hdr);
+		break;
+#endif
+	default:
+		return NF_ACCEPT;
+	}
+
+	if (unlikely(!pskb_may_pull(skb, off + sizeof(struct udphdr))))
+		return NF_ACCEPT;
+
+	if (udp_hdr(skb)->dest != inet_sk(sk)->inet_sport)
+		return NF_ACCEPT;
+
+	reason = ovpn_udp_filter(ovpn, skb, off + sizeof(struct udphdr));
+	if (likely(reason < 0))
+		return NF_ACCEPT;
+
+	this_cpu_inc(ovpn->filter_stats->drops[reason]);
+	return NF_DROP;
+}
+
+/* A socket bound to a specific address only receives packets sent to it,
+ * which can be matched before conntrack and routing. Otherwise the filter has
+ * to wait for packets to be routed to this host
+ */
+static void ovpn_udp_filter_ops_init(struct ovpn_struct *ovpn,
+				     struct nf_hook_ops *ops, u8 pf,
+				     bool bound)
+{
+	ops->hook = ovpn_udp_filter_hook;
+	ops->priv = ovpn;
+	ops->pf = pf;
+	ops->hooknum = bound ? NF_INET_PRE_ROUTING : NF_INET_LOCAL_IN;
+	ops->priority = pf == NFPROTO_IPV4 ? NF_IP_PRI_FIRST : NF_IP6_PRI_FIRST;
+}
+
+/* Register the hooks of the early filter, if enabled, for the UDP socket
+ * attached to ovpn. Serialized by the netlink command handlers
+ */
+int ovpn_udp_filter_start(struct ovpn_struct *ovpn)
+{
+	unsigned int n = 0;
+	struct sock *sk;
+	int ret;
+
+	if (!ovpn->early_filter || !ovpn->sock || ovpn->filter_hooks)
+		return 0;
+
+	sk = ovpn->sock->sk;
+	if (sk->sk_protocol != IPPROTO_UDP)
+		return 0;
+
+	switch (sk->sk_family) {
+#if IS_ENABLED(CONFIG_IPV6)
+	case AF_INET6:
+		ovpn_udp_filter_ops_init(ovpn, &ovpn->filter_ops[n++],
+					 NFPROTO_IPV6,
+					 !ipv6_addr_any(&sk->sk_v6_rcv_saddr));
+		if (ipv6_only_sock(sk))
+			break;
+
+		/* dual-stack socket: IPv4 packets reach it too */
+		ovpn_udp_filter_ops_init(ovpn, &ovpn->filter_ops[n++],
+					 NFPROTO_IPV4, !!sk->sk_rcv_saddr);
+		break;
+#endif
+	case AF_INET:
+		ovpn_udp_filter_ops_init(ovpn, &ovpn->filter_ops[n++],
+					 NFPROTO_IPV4, !!sk->sk_rcv_saddr);
+		break;
+	default:
+		return 0;
+	}
+
+	ret = nf_register_net_hooks(sock_net(sk), ovpn->filter_ops, n);
+	if (ret < 0) {
+		pr_err("%s: cannot register early filter: %d\n",
+		       ovpn->dev->name, ret);
+		return ret;
+	}
+
+	ovpn->filter_hooks = n;
+
+	return 0;
+}
+
+/* Unregister the hooks of the early filter. Must be invoked before the socket
+ * is detached from ovpn
+ */
+void ovpn_udp_filter_stop(struct ovpn_struct *ovpn)
+{
+	if (!ovpn->filter_hooks)
+		return;
+
+	nf_unregister_net_hooks(sock_net(ovpn->sock->sk), ovpn->filter_ops,
+				ovpn->filter_hooks);
+	ovpn->filter_hooks = 0;
+}
+
+/* Enable or disable the early filter, which then applies to the current and
+ * to the following VPN sessions
+ */
+int ovpn_udp_filter_set(struct ovpn_struct *ovpn, bool enable)
+{
+	int ret;
+
+	if (!enable) {
+		ovpn->early_filter = false;
+		ovpn_udp_filter_stop(ovpn);
+		return 0;
+	}
+
+	if (!ovpn->filter_stats) {
+		ovpn->filter_stats = alloc_percpu(struct ovpn_filter_stats);
+		if (!ovpn->filter_stats)
+			return -ENOMEM;
+	}
+
+	ovpn->early_filter = true;
+
+	ret = ovpn_udp_filter_start(ovpn);
+	if (ret < 0)
+		ovpn->early_filter = false;
+
+	return ret;
+}
+
+void ovpn_udp_filter_release(struct ovpn_struct *ovpn)
+{
+	ovpn_udp_filter_stop(ovpn);
+	free_percpu(ovpn->filter_stats);
+	ovpn->filter_stats = NULL;
+}
+
+/* Sum the packets dropped by the early filter on all CPUs */
+void ovpn_udp_filter_drops(struct ovpn_struct *ovpn,
+			   u64 drops[OVPN_FILTER_DROP_REASONS])
+{
+	const struct ovpn_filter_stats *s;
+	int cpu, i;
+
+	memset(drops, 0, sizeof(*drops) * OVPN_FILTER_DROP_REASONS);
+
+	if (!ovpn->filter_stats)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(ovpn->filter_stats, cpu);
+		for (i = 0; i < OVPN_FILTER_DROP_REASONS; i++)
+			drops[i] += READ_ONCE(s->drops[i]);
+	}
+}
+
+/* Record the path MTU of the route to the remote of bind, as seen by the
+ * packets encapsulated with hdr_len bytes of outer headers
+ */
+static void ovpn_udp_update_pmtu(struct ovpn_bind *bind,
+				 const struct dst_entry *dst,
+				 unsigned int hdr_len)
+{
+	unsigned int pmtu = dst_mtu(dst);
+
+	pmtu = pmtu > hdr_len ? pmtu - hdr_len : 0;
+
+	/* avoid dirtying the cache line shared with readers in the common case
+	 * of an unchanged MTU
+	 */
+	if (unlikely(READ_ONCE(bind->pmtu) != pmtu))
+		WRITE_ONCE(bind->pmtu, pmtu);
+}
+
+/* Route skb to the remote of bind and prepend the outer headers. This does
+ * what udp_tunnel_xmit_skb() would do, except that the headers are copied
+ * from the template of the bind rather than built field by field
+ */
 static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
-			    struct dst_cache *cache, struct sock *sk,
-			    struct sk_buff *skb)
+			    struct sock *sk, struct sk_buff *skb)
 {
 	struct rtable *rt;
+	struct iphdr *iph;
+	int pkt_len, err;
+	struct net *net;
+	unsigned int len;
 	struct flowi4 fl = {
 		.saddr = bind->sapair.local.u.in4.sin_addr.s_addr,
 		.daddr = bind->sapair.remote.u.in4.sin_addr.s_addr,
@@ -105,7 +552,7 @@ static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 		.flowi4_oif = sk->sk_bound_dev_if,
 	};
 
-	rt = dst_cache_get_ip4(cache, &fl.saddr);
+	rt = dst_cache_get_ip4(&bind->dst_cache, &fl.saddr);
 	if (rt)
 		goto transmit;
 
@@ -116,22 +563,58 @@ static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 				    &bind->sapair.remote.u.in4);
 		return -EHOSTUNREACH;
 	}
-	dst_cache_set_ip4(cache, &rt->dst, fl.saddr);
+	dst_cache_set_ip4(&bind->dst_cache, &rt->dst, fl.saddr);
 
 transmit:
-	udp_tunnel_xmit_skb(rt, sk, skb, fl.saddr, fl.daddr, 0,
-			    ip4_dst_hoplimit(&rt->dst), 0, fl.fl4_sport,
-			    fl.fl4_dport, false, sk->sk_no_check_tx);
+	net = dev_net(rt->dst.dev);
+	pkt_len = skb->len - skb_inner_network_offset(skb);
+	ovpn_udp_update_pmtu(bind, &rt->dst, sizeof(bind->hdr.v4));
+
+	__skb_push(skb, sizeof(bind->hdr.v4));
+	memcpy(skb->data, &bind->hdr.v4, sizeof(bind->hdr.v4));
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, sizeof(*iph));
+
+	iph = ip_hdr(skb);
+	/* the source address may have been picked by the route lookup */
+	iph->saddr = fl.saddr;
+	iph->ttl = ip4_dst_hoplimit(&rt->dst);
+	/* packets too big for the path were already refused by
+	 * ovpn_pmtu_check(), except for those the sender allowed to fragment
+	 */
+	if (READ_ONCE(ovpn->pmtu_discovery) && !skb->ignore_df)
+		iph->frag_off = htons(IP_DF);
+
+	len = skb->len - sizeof(*iph);
+	udp_hdr(skb)->len = htons(len);
+	udp_set_csum(sk->sk_no_check_tx, skb, iph->saddr, iph->daddr, len);
+
+	skb_scrub_packet(skb, false);
+	skb_clear_hash_if_not_l4(skb);
+	skb_dst_set(skb, &rt->dst);
+	memset(IPCB(skb), 0, sizeof(*IPCB(skb)));
+
+	/* tot_len and the IP checksum are filled in by ip_local_out() */
+	__ip_select_ident(net, iph, skb_shinfo(skb)->gso_segs ?: 1);
+
+	err = ip_local_out(net, sk, skb);
+	/* packets refused by the stack are accounted as tx_dropped */
+	if (unlikely(net_xmit_eval(err)))
+		pkt_len = 0;
+	iptunnel_xmit_stats(ovpn->dev, pkt_len);
+
 	return 0;
 }
 
 #if IS_ENABLED(CONFIG_IPV6)
+/* IPv6 counterpart of ovpn_udp4_output(), replacing udp_tunnel6_xmit_skb() */
 static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
-			    struct dst_cache *cache, struct sock *sk,
-			    struct sk_buff *skb)
+			    struct sock *sk, struct sk_buff *skb)
 {
 	struct dst_entry *dst;
-	int ret;
+	struct ipv6hdr *ip6h;
+	int pkt_len, ret;
+	unsigned int len;
 
 	struct flowi6 fl = {
 		.saddr = bind->sapair.local.u.in6.sin6_addr,
@@ -147,7 +630,7 @@ static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 	    __ipv6_addr_needs_scope_id(__ipv6_addr_type(&fl.daddr)))
 		fl.flowi6_oif = bind->sapair.remote.u.in6.sin6_scope_id;
 
-	dst = dst_cache_get_ip6(cache, &fl.saddr);
+	dst = dst_cache_get_ip6(&bind->dst_cache, &fl.saddr);
 	if (dst)
 		goto transmit;
 
@@ -157,12 +640,36 @@ static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 		dst_release(dst);
 		return ret;
 	}
-	dst_cache_set_ip6(cache, dst, &fl.saddr);
+	dst_cache_set_ip6(&bind->dst_cache, dst, &fl.saddr);
 
 transmit:
-	udp_tunnel6_xmit_skb(dst, sk, skb, skb->dev, &fl.saddr, &fl.daddr, 0,
-			     ip6_dst_hoplimit(dst), 0, fl.fl6_sport,
-			     fl.fl6_dport, udp_get_no_check6_tx(sk));
+	pkt_len = skb->len - skb_inner_network_offset(skb);
+	ovpn_udp_update_pmtu(bind, dst, sizeof(bind->hdr.v6));
+
+	__skb_push(skb, sizeof(bind->hdr.v6));
+	memcpy(skb->data, &bind->hdr.v6, sizeof(bind->hdr.v6));
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, sizeof(*ip6h));
+
+	ip6h = ipv6_hdr(skb);
+	ip6h->saddr = fl.saddr;
+	ip6h->hop_limit = ip6_dst_hoplimit(dst);
+
+	len = skb->len - sizeof(*ip6h);
+	udp_hdr(skb)->len = htons(len);
+	udp6_set_csum(udp_get_no_check6_tx(sk), skb, &ip6h->saddr,
+		      &ip6h->daddr, len);
+
+	skb_dst_set(skb, dst);
+	memset(IP6CB(skb), 0, sizeof(*IP6CB(skb)));
+
+	/* payload_len is filled in by ip6_local_out() */
+	ret = ip6_local_out(dev_net(dst->dev), sk, skb);
+	/* accounted as tx_dropped, like in ovpn_udp4_output() */
+	if (unlikely(net_xmit_eval(ret)))
+		pkt_len = 0;
+	iptunnel_xmit_stats(ovpn->dev, pkt_len);
+
 	return 0;
 }
 #endif
@@ -173,8 +680,7 @@ transmit:
  * On return, the skb is consumed.
  */
 static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
-			   struct dst_cache *cache, struct sock *sk,
-			   struct sk_buff *skb)
+			   struct sock *sk, struct sk_buff *skb)
 {
 	int ret;
 
@@ -186,11 +692,11 @@ static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 
 	switch (bind->sapair.local.family) {
 	case AF_INET:
-		ret = ovpn_udp4_output(ovpn, bind, cache, sk, skb);
+		ret = ovpn_udp4_output(ovpn, bind, sk, skb);
 		break;
 #if IS_ENABLED(CONFIG_IPV6)
 	case AF_INET6:
-		ret = ovpn_udp6_output(ovpn, bind, cache, sk, skb);
+		ret = ovpn_udp6_output(ovpn, bind, sk, skb);
 		break;
 #endif
 	default:
@@ -201,6 +707,31 @@ static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 	return ret;
 }
 
+/* Socket to send the packets of peer through. When several sockets of a
+ * reuseport group are attached, each CPU sends through its own: no lock is
+ * taken on the socket either way, but the send buffer accounting
+ * (sk_wmem_alloc) and the other socket fields written per packet are then
+ * spread over several sockets, rather than bouncing between all CPUs.
+ * The sockets share the local address and port, so the flows seen by the
+ * peer and the network are unchanged.
+ * Called with the RCU read lock held, see ovpn_sock_release_reuseport()
+ */
+static struct socket *ovpn_udp_sock_tx(struct ovpn_struct *ovpn,
+				       struct ovpn_peer *peer)
+{
+	unsigned int n = smp_load_acquire(&ovpn->num_reuseport_socks);
+	unsigned int i;
+
+	if (likely(!n))
+		return peer->sock;
+
+	i = raw_smp_processor_id() % (n + 1);
+	if (!i)
+		return peer->sock;
+
+	return READ_ONCE(ovpn->reuseport_socks[i - 1]);
+}
+
 /* Called after encrypt to write IP packet to UDP port.
  * This method is expected to manage/free skb.
  */
@@ -212,15 +743,25 @@ void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 	int ret = -1;
 
 	skb->dev = ovpn->dev;
-	/* no checksum performed at this layer */
-	skb->ip_summed = CHECKSUM_NONE;
+	if (skb_is_gso(skb)) {
+		/* GSO requires the UDP checksum to be offloaded: point it to
+		 * the UDP header that is about to be pushed
+		 */
+		skb->ip_summed = CHECKSUM_PARTIAL;
+		skb->csum_start = skb_headroom(skb) - sizeof(struct udphdr);
+		skb->csum_offset = offsetof(struct udphdr, check);
+	} else {
+		/* no checksum performed at this layer */
+		skb->ip_summed = CHECKSUM_NONE;
+	}
 
 	/* get socket info */
-	sock = peer->sock;
-	if (unlikely(!sock))
+	if (unlikely(!peer->sock))
 		goto out;
 
 	rcu_read_lock();
+	sock = ovpn_udp_sock_tx(ovpn, peer);
+
 	/* get binding */
 	bind = rcu_dereference(peer->bind);
 	if (unlikely(!bind))
@@ -230,7 +771,7 @@ void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 	ovpn_peer_keepalive_xmit_reset(peer);
 
 	/* crypto layer -> transport (UDP) */
-	ret = ovpn_udp_output(ovpn, bind, &peer->dst_cache, sock->sk, skb);
+	ret = ovpn_udp_output(ovpn, bind, sock->sk, skb);
 
 out_unlock:
 	rcu_read_unlock();
@@ -238,3 +779,55 @@ out:
 	if (ret < 0)
 		kfree_skb(skb);
 }
+
+/* Send the encrypted segments of a GSO packet.
+ *
+ * Consecutive segments having the same size (except for the last one, that
+ * may be shorter) are chained to the frag_list of the first one and sent as a
+ * single SKB_GSO_UDP_L4 packet, so that they traverse the stack only once
+ * and get segmented late, by the lower device or by software GSO.
+ *
+ * list is emptied and all its skbs are consumed.
+ */
+void ovpn_udp_send_skb_list(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			    struct sk_buff_head *list)
+{
+	struct sk_buff *head, *skb, **tail;
+	unsigned int mss, segs;
+
+	while ((head = __skb_dequeue(list))) {
+		mss = head->len;
+		segs = 1;
+		tail = &skb_shinfo(head)->frag_list;
+
+		while (!skb_has_frag_list(head) && (skb = skb_peek(list))) {
+			if (skb->len > mss || skb_has_frag_list(skb) ||
+			    segs >= UDP_MAX_SEGMENTS ||
+			    head->len + skb->len > OVPN_GSO_MAX_SIZE)
+				break;
+
+			__skb_unlink(skb, list);
+			*tail = skb;
+			tail = &skb->next;
+			segs++;
+
+			/* truesize is left untouched, as it may be charged to
+			 * the socket the packet originates from
+			 */
+			head->len += skb->len;
+			head->data_len += skb->len;
+
+			/* a shorter segment can only be the last one */
+			if (skb->len < mss)
+				break;
+		}
+
+		if (segs > 1) {
+			skb_shinfo(head)->gso_size = mss;
+			skb_shinfo(head)->gso_type = SKB_GSO_UDP_L4;
+			skb_shinfo(head)->gso_segs = segs;
+		}
+
+		ovpn_udp_send_skb(ovpn, peer, head);
+	}
+}
@@ -15,10 +15,23 @@
 
 #include <linux/skbuff.h>
 #include <linux/types.h>
+#include <linux/udp.h>
 #include <net/sock.h>
 
+int ovpn_udp_ctrl_ratelimit_init(struct ovpn_struct *ovpn);
+void ovpn_udp_ctrl_ratelimit_release(struct ovpn_struct *ovpn);
+
+int ovpn_udp_filter_start(struct ovpn_struct *ovpn);
+void ovpn_udp_filter_stop(struct ovpn_struct *ovpn);
+int ovpn_udp_filter_set(struct ovpn_struct *ovpn, bool enable);
+void ovpn_udp_filter_release(struct ovpn_struct *ovpn);
+void ovpn_udp_filter_drops(struct ovpn_struct *ovpn,
+			   u64 drops[OVPN_FILTER_DROP_REASONS]);
+
 int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb);
 void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 		       struct sk_buff *skb);
+void ovpn_udp_send_skb_list(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			    struct sk_buff_head *list);
 
 #endif /* _NET_OVPN_DCO_UDP_H_ */
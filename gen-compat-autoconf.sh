@@ -40,6 +40,8 @@ gen_config() {
 }
 
 gen_config 'CONFIG_OVPN_DCO_DEBUG' ${CONFIG_OVPN_DCO_DEBUG:="n"} >> "${TMP}"
+gen_config 'CONFIG_OVPN_DCO_LATENCY_HIST' ${CONFIG_OVPN_DCO_LATENCY_HIST:="n"} >> "${TMP}"
+gen_config 'CONFIG_OVPN_DCO_KUNIT_TEST' ${CONFIG_OVPN_DCO_KUNIT_TEST:="n"} >> "${TMP}"
 
 # only regenerate compat-autoconf.h when config was changed
 diff "${TMP}" "${TARGET}" > /dev/null 2>&1 || cp "${TMP}" "${TARGET}"
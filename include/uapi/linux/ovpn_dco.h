@@ -45,7 +45,8 @@ enum ovpn_nl_commands {
 	OVPN_CMD_SET_PEER,
 
 	/**
-	 * @OVPN_CMD_DEL_PEER: Remove peer from internal table
+	 * @OVPN_CMD_DEL_PEER: Remove peer from internal table. Also used to
+	 * notify userspace about peers being removed by the kernel
 	 */
 	OVPN_CMD_DEL_PEER,
 
@@ -67,6 +68,58 @@ enum ovpn_nl_commands {
 	 * with OVPN_CMD_REGISTER_PACKET
 	 */
 	OVPN_CMD_PACKET,
+
+	/**
+	 * @OVPN_CMD_NEW_IROUTE: Route a network via a specific peer (server mode)
+	 */
+	OVPN_CMD_NEW_IROUTE,
+
+	/**
+	 * @OVPN_CMD_DEL_IROUTE: Remove a network previously routed via a peer
+	 */
+	OVPN_CMD_DEL_IROUTE,
+
+	/**
+	 * @OVPN_CMD_SET_VPN: Tweak parameters of a running VPN session
+	 */
+	OVPN_CMD_SET_VPN,
+
+	/**
+	 * @OVPN_CMD_GET_KEY: Retrieve the state of the key installed in a slot
+	 */
+	OVPN_CMD_GET_KEY,
+
+	/**
+	 * @OVPN_CMD_GET_PEER: Retrieve the state of a peer, or of all peers
+	 * when issued as a dump
+	 */
+	OVPN_CMD_GET_PEER,
+
+	/**
+	 * @OVPN_CMD_NEW_KEYS: Install keys for several peers at once. Each
+	 * entry of OVPN_ATTR_KEYS carries the attributes of an OVPN_CMD_NEW_KEY
+	 * request
+	 */
+	OVPN_CMD_NEW_KEYS,
+
+	/**
+	 * @OVPN_CMD_GET_MEM: Retrieve the memory used by the interface and its
+	 * peers, reported in OVPN_ATTR_MEM
+	 */
+	OVPN_CMD_GET_MEM,
+
+	/**
+	 * @OVPN_CMD_GET_FILTER: Retrieve the state of the early filter of the
+	 * interface and the packets it dropped, reported in
+	 * OVPN_ATTR_FILTER_STATS
+	 */
+	OVPN_CMD_GET_FILTER,
+
+	/**
+	 * @OVPN_CMD_ADD_SOCKET: Attach another UDP socket of the SO_REUSEPORT
+	 * group of the transport socket, passed in OVPN_ATTR_SOCKET
+	 */
+	OVPN_CMD_ADD_SOCKET,
 };
 
 enum ovpn_mode {
@@ -83,6 +136,19 @@ enum ovpn_proto {
 	OVPN_PROTO_TCP6,
 };
 
+/**
+ * enum ovpn_rx_mode - how received packets are scheduled for decryption
+ * @OVPN_RX_MODE_DEFAULT: decrypt in the receive path when possible, otherwise
+ *	in a per-peer worker
+ * @OVPN_RX_MODE_NAPI: decrypt in batches in the NAPI poll of each peer
+ */
+enum ovpn_rx_mode {
+	OVPN_RX_MODE_DEFAULT = 0,
+	OVPN_RX_MODE_NAPI,
+	__OVPN_RX_MODE_AFTER_LAST,
+	OVPN_RX_MODE_MAX = __OVPN_RX_MODE_AFTER_LAST - 1,
+};
+
 enum ovpn_cipher_alg {
 	OVPN_CIPHER_ALG_NONE = 0,
 	OVPN_CIPHER_ALG_AES_GCM,
@@ -123,6 +189,111 @@ enum ovpn_sockaddr_attrs {
 	OVPN_SOCKADDR_ATTR_MAX = __OVPN_SOCKADDR_ATTR_AFTER_LAST,
 };
 
+enum ovpn_iroute_attrs {
+	OVPN_IROUTE_ATTR_UNSPEC,
+
+	OVPN_IROUTE_ATTR_ADDRESS,
+	OVPN_IROUTE_ATTR_PREFIX_LEN,
+	__OVPN_IROUTE_ATTR_AFTER_LAST,
+	OVPN_IROUTE_ATTR_MAX = __OVPN_IROUTE_ATTR_AFTER_LAST - 1,
+};
+
+enum ovpn_peer_stats_attrs {
+	OVPN_PEER_STATS_ATTR_UNSPEC,
+
+	OVPN_PEER_STATS_ATTR_RX_BYTES,
+	OVPN_PEER_STATS_ATTR_RX_PACKETS,
+	OVPN_PEER_STATS_ATTR_TX_BYTES,
+	OVPN_PEER_STATS_ATTR_TX_PACKETS,
+
+	/* packets dropped, by reason */
+	OVPN_PEER_STATS_ATTR_DROPS_REPLAY,
+	OVPN_PEER_STATS_ATTR_DROPS_AUTH,
+	OVPN_PEER_STATS_ATTR_DROPS_RING_FULL,
+	OVPN_PEER_STATS_ATTR_DROPS_NO_KEY,
+	OVPN_PEER_STATS_ATTR_DROPS_MALFORMED,
+	/* control packets that could not be delivered to userspace */
+	OVPN_PEER_STATS_ATTR_DROPS_CTRL,
+
+	/* packets encrypted in place, or after being made private */
+	OVPN_PEER_STATS_ATTR_TX_INPLACE,
+	OVPN_PEER_STATS_ATTR_TX_COW,
+
+	OVPN_PEER_STATS_ATTR_PAD,
+
+	__OVPN_PEER_STATS_ATTR_AFTER_LAST,
+	OVPN_PEER_STATS_ATTR_MAX = __OVPN_PEER_STATS_ATTR_AFTER_LAST - 1,
+};
+
+/* log2 histograms of the time spent by packets in each stage of the pipeline,
+ * reported only when the module is built with CONFIG_OVPN_DCO_LATENCY_HIST.
+ * Each attribute is an array of u64: element 0 counts packets that took less
+ * than 1024ns, element i >= 1 those that took [2^(9 + i), 2^(10 + i)) ns.
+ * The last element also counts anything slower.
+ */
+enum ovpn_peer_latency_attrs {
+	OVPN_PEER_LATENCY_ATTR_UNSPEC,
+
+	/* queued before encryption */
+	OVPN_PEER_LATENCY_ATTR_TX_QUEUE,
+	/* encryption */
+	OVPN_PEER_LATENCY_ATTR_TX_CRYPTO,
+	/* queued before decryption */
+	OVPN_PEER_LATENCY_ATTR_RX_QUEUE,
+	/* decryption */
+	OVPN_PEER_LATENCY_ATTR_RX_CRYPTO,
+
+	__OVPN_PEER_LATENCY_ATTR_AFTER_LAST,
+	OVPN_PEER_LATENCY_ATTR_MAX = __OVPN_PEER_LATENCY_ATTR_AFTER_LAST - 1,
+};
+
+/* memory used by an interface, in bytes unless noted otherwise. Sizes are
+ * estimates, based on the objects allocated by the module
+ */
+enum ovpn_mem_attrs {
+	OVPN_MEM_ATTR_UNSPEC,
+
+	/* structures shared by all peers */
+	OVPN_MEM_ATTR_IFACE_BYTES,
+	/* number of peers and size of their objects, without rings and keys */
+	OVPN_MEM_ATTR_PEERS,
+	OVPN_MEM_ATTR_PEER_BYTES,
+	/* number and size of the packet rings and reorder buffers currently
+	 * allocated to peers
+	 */
+	OVPN_MEM_ATTR_RINGS,
+	OVPN_MEM_ATTR_RING_BYTES,
+	/* number and size of the key slots, with their crypto transforms and
+	 * request objects
+	 */
+	OVPN_MEM_ATTR_KEY_SLOTS,
+	OVPN_MEM_ATTR_KEY_BYTES,
+
+	OVPN_MEM_ATTR_PAD,
+
+	__OVPN_MEM_ATTR_AFTER_LAST,
+	OVPN_MEM_ATTR_MAX = __OVPN_MEM_ATTR_AFTER_LAST - 1,
+};
+
+/* packets dropped by the early filter, by reason */
+enum ovpn_filter_stats_attrs {
+	OVPN_FILTER_STATS_ATTR_UNSPEC,
+
+	/* not an OpenVPN packet */
+	OVPN_FILTER_STATS_ATTR_DROPS_OPCODE,
+	/* DATA_V2 packets of unknown peers */
+	OVPN_FILTER_STATS_ATTR_DROPS_PEER_ID,
+	/* DATA_V2 packets for a key not installed */
+	OVPN_FILTER_STATS_ATTR_DROPS_KEY_ID,
+	/* DATA_V2 packets replayed or out of the replay window */
+	OVPN_FILTER_STATS_ATTR_DROPS_REPLAY,
+
+	OVPN_FILTER_STATS_ATTR_PAD,
+
+	__OVPN_FILTER_STATS_ATTR_AFTER_LAST,
+	OVPN_FILTER_STATS_ATTR_MAX = __OVPN_FILTER_STATS_ATTR_AFTER_LAST - 1,
+};
+
 enum ovpn_attrs {
 	OVPN_ATTR_UNSPEC,
 
@@ -150,6 +321,63 @@ enum ovpn_attrs {
 
 	OVPN_ATTR_DEL_PEER_REASON,
 
+	OVPN_ATTR_PEER_ID,
+	OVPN_ATTR_VPN_IPV4,
+	OVPN_ATTR_VPN_IPV6,
+
+	OVPN_ATTR_IROUTE,
+
+	OVPN_ATTR_CRYPTO_PARALLEL,
+	OVPN_ATTR_RX_MODE,
+
+	/* replay window size in packets, 0 selects the default */
+	OVPN_ATTR_REPLAY_WINDOW,
+	OVPN_ATTR_REPLAY_MAX_BACKTRACK,
+	OVPN_ATTR_REPLAY_DROPS,
+
+	OVPN_ATTR_PAD,
+
+	OVPN_ATTR_PEER_STATS,
+	OVPN_ATTR_PEER_LATENCY,
+
+	/* number of packets each ring of a peer can hold */
+	OVPN_ATTR_QUEUE_LEN,
+
+	/* encrypt packets on the device TX queue they were sent to (u8 0/1) */
+	OVPN_ATTR_TX_MULTIQUEUE,
+
+	/* max control packets per second accepted from a source address over
+	 * UDP, 0 for no limit (u32)
+	 */
+	OVPN_ATTR_CTRL_RATE,
+
+	/* list of nested OVPN_CMD_NEW_KEY requests, see OVPN_CMD_NEW_KEYS */
+	OVPN_ATTR_KEYS,
+
+	/* seconds after which peers release the packet rings and crypto
+	 * request objects they haven't used, 0 for never (u32)
+	 */
+	OVPN_ATTR_IDLE_TIMEOUT,
+	OVPN_ATTR_MEM,
+
+	/* drop invalid packets sent to the UDP transport socket before they go
+	 * through the UDP stack (u8 0/1)
+	 */
+	OVPN_ATTR_EARLY_FILTER,
+	OVPN_ATTR_FILTER_STATS,
+
+	/* set DF on the outer IPv4 header and reply with ICMP "fragmentation
+	 * needed"/"packet too big" to packets that would not fit the path MTU
+	 * to the peer once encapsulated (u8 0/1)
+	 */
+	OVPN_ATTR_PMTU_DISCOVERY,
+	/* clamp the MSS of TCP SYNs to the MTU of the peer (u8 0/1) */
+	OVPN_ATTR_MSS_CLAMP,
+	/* largest packet that can be sent to a peer without fragmenting its
+	 * encapsulation, as learnt from the outer route (u32)
+	 */
+	OVPN_ATTR_PEER_MTU,
+
 	__OVPN_ATTR_AFTER_LAST,
 	OVPN_ATTR_MAX = __OVPN_ATTR_AFTER_LAST - 1,
 };
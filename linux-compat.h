@@ -13,6 +13,27 @@
 #include <linux/kconfig.h>
 #include <linux/version.h>
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
+
+/* udp_post_segment_fix_csum() appeared in 5.13. The header is included first
+ * so that only the callers are renamed, whichever release introduced it
+ */
+#include <net/udp.h>
+
+#define udp_post_segment_fix_csum ovpn_udp_post_segment_fix_csum
+
+/* Mark the checksum of a segment of a UDP GRO train as verified and fix up
+ * its UDP control block, as the GRO engine validated it before aggregating
+ */
+static inline void ovpn_udp_post_segment_fix_csum(struct sk_buff *skb)
+{
+	UDP_SKB_CB(skb)->cscov = skb->len;
+	if (skb->ip_summed == CHECKSUM_NONE && !skb->csum_valid)
+		skb->csum_valid = 1;
+}
+
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0) */
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
 
 #define dev_get_tstats64 ip_tunnel_get_stats64
@@ -49,8 +70,26 @@ static inline void dev_sw_netstats_rx_add(struct net_device *dev, unsigned int l
 
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0) */
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+
+/* commit 453431a54934 renamed kzfree to kfree_sensitive */
+#define kfree_sensitive kzfree
+
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0) */
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
 
+/* icmp{,v6}_ndo_send were introduced in 5.6 and only differ from
+ * icmp{,v6}_send for packets whose source was NATed. The headers are included
+ * first so that only the callers are renamed, also on the stable kernels the
+ * helpers were backported to
+ */
+#include <linux/icmpv6.h>
+#include <net/icmp.h>
+
+#define icmp_ndo_send icmp_send
+#define icmpv6_ndo_send icmpv6_send
+
 /* Iterate through singly-linked GSO fragments of an skb. */
 #define skb_list_walk_safe(first, skb, next_skb)				\
 	for ((skb) = (first), (next_skb) = (skb) ? (skb)->next : NULL; (skb);	\
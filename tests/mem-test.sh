@@ -0,0 +1,54 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2021 OpenVPN, Inc.
+#
+# Measure the memory used by a server-mode interface with many peers: creates
+# PEERS peers with keys, then prints the report of OVPN_CMD_GET_MEM and how
+# much slab and per-cpu memory the kernel allocated meanwhile.
+#
+# Usage: mem-test.sh [peers [idle_timeout]]
+
+OVPN_CLI=./ovpn-cli
+ALG=${ALG:-aes}
+PEERS=${1:-1000}
+IDLE_TIMEOUT=${2:-30}
+
+function meminfo() {
+	awk -v key="$1:" '$1 == key { print $2 }' /proc/meminfo
+}
+
+ip netns del mem0 2>/dev/null
+ip netns add mem0
+ip -n mem0 link set lo up
+ip -n mem0 addr add 10.10.0.1/16 dev lo
+
+slab=$(meminfo Slab)
+percpu=$(meminfo Percpu)
+
+ip -n mem0 link add tun0 type ovpn-dco
+ip -n mem0 addr add 5.5.0.1/16 dev tun0
+ip -n mem0 link set tun0 up
+
+ip netns exec mem0 $OVPN_CLI tun0 start_udp 1 server
+ip netns exec mem0 $OVPN_CLI tun0 set_vpn idle_timeout $IDLE_TIMEOUT
+
+for i in $(seq 1 $PEERS); do
+	ip netns exec mem0 $OVPN_CLI tun0 new_peer 10.10.0.1 1 \
+		10.10.$((i / 250)).$((i % 250 + 2)) $((i + 1)) $i \
+		5.5.$((i / 250)).$((i % 250 + 2)) || exit 1
+done
+ip netns exec mem0 $OVPN_CLI tun0 new_keys $ALG 0 data64.key 1 $PEERS || exit 1
+
+echo "after adding $PEERS peers:"
+ip netns exec mem0 $OVPN_CLI tun0 get_mem
+echo "slab: $(($(meminfo Slab) - slab)) kB, percpu: $(($(meminfo Percpu) - percpu)) kB"
+
+if [ $IDLE_TIMEOUT -gt 0 ]; then
+	# the idle scan runs every 10 seconds
+	sleep $((IDLE_TIMEOUT + 10))
+	echo "after $((IDLE_TIMEOUT + 10))s idle:"
+	ip netns exec mem0 $OVPN_CLI tun0 get_mem
+	echo "slab: $(($(meminfo Slab) - slab)) kB, percpu: $(($(meminfo Percpu) - percpu)) kB"
+fi
+
+ip netns del mem0
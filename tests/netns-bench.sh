@@ -0,0 +1,193 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2021 OpenVPN, Inc.
+#
+# Throughput and latency benchmark of tun0 between two namespaces, set up as
+# in netns-test.sh. For every combination of transport, cipher and MTU it
+# measures:
+# - TCP bulk throughput (iperf3)
+# - UDP small packet rate (iperf3, 64 bytes payload)
+# - TCP request/response latency (netperf TCP_RR)
+# along with the utilization of each CPU (mpstat) while each test runs.
+#
+# Results are written as JSON to $RESULTS, one object per test, so that runs
+# on different commits can be compared with e.g. jq or diff.
+#
+# Requires iperf3, netperf/netserver, mpstat (sysstat) and jq.
+#
+# Usage: netns-bench.sh [-q]
+#	-q: quick run, UDP4 with AES-GCM and MTU 1500 only
+#
+# The following variables override the defaults:
+#	TRANSPORTS	transports to test (default: "udp4 udp6 tcp4 tcp6")
+#	ALGS		ciphers to test (default: "aes chachapoly")
+#	MTUS		MTUs of tun0 to test (default: "1500 9000")
+#	DURATION	seconds per test (default: 10)
+#	RESULTS		output file (default: bench-<commit>-<time>.json)
+
+OVPN_CLI=./ovpn-cli
+TRANSPORTS=${TRANSPORTS:-udp4 udp6 tcp4 tcp6}
+ALGS=${ALGS:-aes chachapoly}
+MTUS=${MTUS:-1500 9000}
+DURATION=${DURATION:-10}
+
+if [ "$1" == "-q" ]; then
+	TRANSPORTS=udp4
+	ALGS=aes
+	MTUS=1500
+	shift
+fi
+
+COMMIT=$(git describe --always --dirty 2>/dev/null || echo unknown)
+RESULTS=${RESULTS:-bench-$COMMIT-$(date +%Y%m%d%H%M%S).json}
+
+for tool in iperf3 netperf netserver mpstat jq; do
+	if ! command -v $tool >/dev/null; then
+		echo "$tool is required" >&2
+		exit 1
+	fi
+done
+
+function cleanup() {
+	ip netns pids peer0 2>/dev/null | xargs -r kill
+	ip netns pids peer1 2>/dev/null | xargs -r kill
+	ip netns del peer0 2>/dev/null
+	ip netns del peer1 2>/dev/null
+}
+
+# setup_ns <n> <addr> <prefix> <tun addr> <lport> <raddr> <rport> <alg> <mtu>
+function setup_ns() {
+	ip link set veth$1 netns peer$1
+	ip -n peer$1 addr add $2/$3 dev veth$1 nodad
+	# leave room for the encapsulation
+	ip -n peer$1 link set veth$1 mtu $(($9 + 100)) up
+	ip -n peer$1 link set lo up
+
+	ip -n peer$1 link add tun0 type ovpn-dco
+	ip -n peer$1 addr add $4 dev tun0
+	ip -n peer$1 link set tun0 mtu $9 up
+
+	if [ $tcp -eq 0 ]; then
+		ip netns exec peer$1 $OVPN_CLI tun0 start_udp $5 $family || return 1
+		ip netns exec peer$1 $OVPN_CLI tun0 new_peer $2 $5 $6 $7 || return 1
+		ip netns exec peer$1 $OVPN_CLI tun0 new_key $8 $1 data64.key || return 1
+	elif [ $1 -eq 0 ]; then
+		(ip netns exec peer$1 $OVPN_CLI tun0 listen $5 $family && \
+			ip netns exec peer$1 $OVPN_CLI tun0 new_key $8 $1 data64.key) &
+		sleep 1
+	else
+		ip netns exec peer$1 $OVPN_CLI tun0 connect $6 $7 || return 1
+		ip netns exec peer$1 $OVPN_CLI tun0 new_key $8 $1 data64.key || return 1
+		wait
+	fi
+}
+
+# setup <transport> <alg> <mtu>
+function setup() {
+	cleanup
+	ip netns add peer0
+	ip netns add peer1
+	ip link add veth0 type veth peer name veth1
+
+	family=
+	tcp=0
+	case $1 in
+	udp6|tcp6)
+		family=ipv6
+		;;
+	esac
+	case $1 in
+	tcp4|tcp6)
+		tcp=1
+		;;
+	esac
+
+	if [ "$family" == "ipv6" ]; then
+		setup_ns 0 fc00::1 64 5.5.5.1/24 1 fc00::2 2 $2 $3 &&
+			setup_ns 1 fc00::2 64 5.5.5.2/24 2 fc00::1 1 $2 $3
+	else
+		setup_ns 0 10.10.10.1 24 5.5.5.1/24 1 10.10.10.2 2 $2 $3 &&
+			setup_ns 1 10.10.10.2 24 5.5.5.2/24 2 10.10.10.1 1 $2 $3
+	fi || return 1
+
+	ip netns exec peer1 ping -qfc 500 -w 5 5.5.5.1 >/dev/null || return 1
+
+	ip netns exec peer0 iperf3 -s -D >/dev/null || return 1
+	ip netns exec peer0 netserver >/dev/null || return 1
+	sleep 1
+}
+
+# start sampling the CPUs while a test runs
+function cpu_start() {
+	mpstat -P ALL -o JSON 1 $DURATION >/tmp/netns-bench-cpu.json &
+	mpstat_pid=$!
+}
+
+# average busy percentage of each CPU during the test
+function cpu_stop() {
+	wait $mpstat_pid
+	jq -c '[.sysstat.hosts[0].statistics | map(."cpu-load") | transpose[] |
+		{cpu: .[0].cpu, busy: (map(100 - .idle) | add / length)}]' \
+		/tmp/netns-bench-cpu.json
+}
+
+# result <test> <transport> <alg> <mtu> <metrics> <cpu>
+function result() {
+	jq -nc --arg test $1 --arg transport $2 --arg alg $3 \
+		--argjson mtu $4 --argjson metrics "$5" --argjson cpu "$6" \
+		'{test: $test, transport: $transport, alg: $alg, mtu: $mtu,
+		  metrics: $metrics, cpu: $cpu}' >>/tmp/netns-bench-results.json
+	echo "$1 $2 $3 mtu $4: $5"
+}
+
+# run_tests <transport> <alg> <mtu>
+function run_tests() {
+	local out metrics
+
+	cpu_start
+	out=$(ip netns exec peer1 iperf3 -J -c 5.5.5.1 -t $DURATION)
+	metrics=$(echo "$out" | jq -c \
+		'{bits_per_second: .end.sum_received.bits_per_second,
+		  retransmits: .end.sum_sent.retransmits}')
+	result tcp_stream $1 $2 $3 "$metrics" "$(cpu_stop)"
+
+	cpu_start
+	out=$(ip netns exec peer1 iperf3 -J -u -b 0 -l 64 -c 5.5.5.1 \
+		-t $DURATION)
+	metrics=$(echo "$out" | jq -c \
+		'{packets_per_second: ((.end.sum.packets - .end.sum.lost_packets) /
+				       .end.sum.seconds),
+		  lost_percent: .end.sum.lost_percent,
+		  jitter_ms: .end.sum.jitter_ms}')
+	result udp_pps $1 $2 $3 "$metrics" "$(cpu_stop)"
+
+	cpu_start
+	out=$(ip netns exec peer1 netperf -P 0 -H 5.5.5.1 -t TCP_RR \
+		-l $DURATION -- -o THROUGHPUT,MEAN_LATENCY,P50_LATENCY,P99_LATENCY)
+	metrics=$(echo "$out" | tail -n 1 | jq -Rc 'split(",") | map(tonumber) |
+		{transactions_per_second: .[0], mean_latency_us: .[1],
+		 p50_latency_us: .[2], p99_latency_us: .[3]}')
+	result tcp_rr $1 $2 $3 "$metrics" "$(cpu_stop)"
+}
+
+trap cleanup EXIT
+: >/tmp/netns-bench-results.json
+
+for transport in $TRANSPORTS; do
+	for alg in $ALGS; do
+		for mtu in $MTUS; do
+			if ! setup $transport $alg $mtu; then
+				echo "cannot set up $transport $alg mtu $mtu" >&2
+				exit 1
+			fi
+			run_tests $transport $alg $mtu
+		done
+	done
+done
+
+jq -s --arg commit $COMMIT --arg kernel "$(uname -r)" \
+	--argjson cpus $(nproc) --argjson duration $DURATION \
+	'{commit: $commit, kernel: $kernel, cpus: $cpus, duration: $duration,
+	  results: .}' /tmp/netns-bench-results.json >$RESULTS
+
+echo "results written to $RESULTS"
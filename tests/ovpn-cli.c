@@ -6,14 +6,19 @@
  *  Author:	Antonio Quartulli <antonio@openvpn.net>
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/in.h>
 
+#include <linux/filter.h>
 #include <linux/ovpn_dco.h>
 #include <linux/types.h>
 #include <linux/netlink.h>
@@ -44,12 +49,18 @@ enum ovpn_key_direction {
 #define KEY_LEN (256 / 8)
 #define NONCE_LEN 8
 
+/* peer-ids are 24 bits long, all-ones is reserved */
+#define OVPN_PEER_ID_UNDEF 0x00FFFFFF
+
 struct nl_ctx {
 	struct nl_sock *nl_sock;
 	struct nl_msg *nl_msg;
 	struct nl_cb *nl_cb;
 
 	int ovpn_dco_id;
+
+	/* where the message handler stores what it parsed, if anything */
+	void *data;
 };
 
 struct ovpn_ctx {
@@ -81,8 +92,59 @@ struct ovpn_ctx {
 	__u32 keepalive_timeout;
 
 	enum ovpn_key_direction key_dir;
+
+	enum ovpn_mode mode;
+
+	/* peer-id selecting the peer to operate on (server mode) */
+	__u32 peer_id;
+	bool peer_id_set;
+
+	/* VPN IP assigned to the peer (server mode) */
+	sa_family_t vpn_family;
+	union {
+		struct in_addr in4;
+		struct in6_addr in6;
+	} vpn_ip;
+
+	/* network routed via the peer (server mode) */
+	sa_family_t iroute_family;
+	union {
+		struct in_addr in4;
+		struct in6_addr in6;
+	} iroute;
+	__u8 iroute_prefix_len;
+
+	/* VPN session options, -1 when not set */
+	int crypto_parallel;
+	int tx_multiqueue;
+	int rx_mode;
+	int early_filter;
+	int pmtu_discovery;
+	int mss_clamp;
+	long ctrl_rate;
+	long idle_timeout;
+	/* size of the peer rings, 0 if not set */
+	__u32 queue_len;
+
+	/* replay window of new keys, 0 for the kernel default */
+	__u32 replay_window;
+
+	/* slot and ID of new keys, primary slot and ID 0 by default */
+	__u8 key_slot;
+	__u16 key_id;
 };
 
+/* time spent by the last request between its sending and the kernel reply */
+static __u64 ovpn_nl_last_ns;
+
+static __u64 ovpn_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static int ovpn_nl_recvmsgs(struct nl_ctx *ctx)
 {
 	int ret;
@@ -229,6 +291,7 @@ static int ovpn_nl_cb_finish(struct nl_msg (*msg)__attribute__((unused)),
 static int ovpn_nl_msg_send(struct nl_ctx *ctx, ovpn_nl_cb cb)
 {
 	int status = 1;
+	__u64 start;
 
 	nl_cb_err(ctx->nl_cb, NL_CB_CUSTOM, ovpn_nl_cb_error, &status);
 	nl_cb_set(ctx->nl_cb, NL_CB_FINISH, NL_CB_CUSTOM, ovpn_nl_cb_finish,
@@ -239,11 +302,14 @@ static int ovpn_nl_msg_send(struct nl_ctx *ctx, ovpn_nl_cb cb)
 	if (cb)
 		nl_cb_set(ctx->nl_cb, NL_CB_VALID, NL_CB_CUSTOM, cb, ctx);
 
+	start = ovpn_now_ns();
 	nl_send_auto_complete(ctx->nl_sock, ctx->nl_msg);
 
 	while (status == 1)
 		ovpn_nl_recvmsgs(ctx);
 
+	ovpn_nl_last_ns = ovpn_now_ns() - start;
+
 	if (status < 0)
 		fprintf(stderr, "failed to send netlink message: %s (%d)\n",
 			strerror(-status), status);
@@ -588,6 +654,17 @@ err:
 	return ret;
 }
 
+static int ovpn_put_peer_id(struct nl_ctx *ctx, const struct ovpn_ctx *ovpn)
+{
+	if (!ovpn->peer_id_set)
+		return 0;
+
+	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_PEER_ID, ovpn->peer_id);
+	return 0;
+nla_put_failure:
+	return -1;
+}
+
 static int ovpn_start(struct ovpn_ctx *ovpn, enum ovpn_proto proto)
 {
 	struct nl_ctx *ctx;
@@ -599,7 +676,24 @@ static int ovpn_start(struct ovpn_ctx *ovpn, enum ovpn_proto proto)
 
 	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_SOCKET, ovpn->socket);
 	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_PROTO, proto);
-	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_MODE, OVPN_MODE_CLIENT);
+	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_MODE, ovpn->mode);
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_add_socket(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_ADD_SOCKET);
+	if (!ctx)
+		return -ENOMEM;
+
+	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_SOCKET, ovpn->socket);
 
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
@@ -607,6 +701,31 @@ nla_put_failure:
 	return ret;
 }
 
+/* Steer the datagrams received by the reuseport group of fd to the socket
+ * matching the CPU they were received on, so that the receive path of each
+ * socket runs on the CPU the NIC spread the packets to
+ */
+static int ovpn_reuseport_steer_cpu(int fd, unsigned int socks)
+{
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, socks },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+		       sizeof(prog)) < 0) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int ovpn_new_peer(struct ovpn_ctx *ovpn)
 {
 	struct nlattr *addr;
@@ -644,6 +763,22 @@ static int ovpn_new_peer(struct ovpn_ctx *ovpn)
 
 	nla_nest_end(ctx->nl_msg, addr);
 
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	switch (ovpn->vpn_family) {
+	case AF_INET:
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_VPN_IPV4,
+			    ovpn->vpn_ip.in4.s_addr);
+		break;
+	case AF_INET6:
+		NLA_PUT(ctx->nl_msg, OVPN_ATTR_VPN_IPV6,
+			sizeof(struct in6_addr), &ovpn->vpn_ip.in6);
+		break;
+	default:
+		break;
+	}
+
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
 	nl_ctx_free(ctx);
@@ -659,6 +794,9 @@ static int ovpn_set_peer(struct ovpn_ctx *ovpn)
 	if (!ctx)
 		return -ENOMEM;
 
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
 	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_KEEPALIVE_INTERVAL,
 		    ovpn->keepalive_interval);
 	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_KEEPALIVE_TIMEOUT,
@@ -670,52 +808,49 @@ nla_put_failure:
 	return ret;
 }
 
-static int ovpn_new_key(struct ovpn_ctx *ovpn)
+/* put the attributes of a NEW_KEY request, except for the peer-id */
+static int ovpn_put_key(struct nl_msg *msg, const struct ovpn_ctx *ovpn)
 {
 	struct nlattr *key_dir;
-	struct nl_ctx *ctx;
-	int ret = -1;
 
-	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_NEW_KEY);
-	if (!ctx)
-		return -ENOMEM;
+	NLA_PUT_U32(msg, OVPN_ATTR_REMOTE_PEER_ID, 0);
+	NLA_PUT_U8(msg, OVPN_ATTR_KEY_SLOT, ovpn->key_slot);
+	NLA_PUT_U16(msg, OVPN_ATTR_KEY_ID, ovpn->key_id);
 
-	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_REMOTE_PEER_ID, 0);
-	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, OVPN_KEY_SLOT_PRIMARY);
-	NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_KEY_ID, 0);
+	NLA_PUT_U16(msg, OVPN_ATTR_CIPHER_ALG, ovpn->cipher);
 
-	NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_CIPHER_ALG, ovpn->cipher);
+	key_dir = nla_nest_start(msg, OVPN_ATTR_ENCRYPT_KEY);
+	NLA_PUT(msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, KEY_LEN, ovpn->key_enc);
+	NLA_PUT(msg, OVPN_KEY_DIR_ATTR_NONCE_TAIL, NONCE_LEN, ovpn->nonce);
+	nla_nest_end(msg, key_dir);
 
-	key_dir = nla_nest_start(ctx->nl_msg, OVPN_ATTR_ENCRYPT_KEY);
-	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, KEY_LEN,
-		ovpn->key_enc);
-	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_NONCE_TAIL, NONCE_LEN,
-		ovpn->nonce);
-	nla_nest_end(ctx->nl_msg, key_dir);
+	key_dir = nla_nest_start(msg, OVPN_ATTR_DECRYPT_KEY);
+	NLA_PUT(msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, KEY_LEN, ovpn->key_dec);
+	NLA_PUT(msg, OVPN_KEY_DIR_ATTR_NONCE_TAIL, NONCE_LEN, ovpn->nonce);
+	nla_nest_end(msg, key_dir);
 
-	key_dir = nla_nest_start(ctx->nl_msg, OVPN_ATTR_DECRYPT_KEY);
-	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, KEY_LEN,
-		ovpn->key_dec);
-	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_NONCE_TAIL, NONCE_LEN,
-		ovpn->nonce);
-	nla_nest_end(ctx->nl_msg, key_dir);
+	if (ovpn->replay_window)
+		NLA_PUT_U32(msg, OVPN_ATTR_REPLAY_WINDOW, ovpn->replay_window);
 
-	ret = ovpn_nl_msg_send(ctx, NULL);
+	return 0;
 nla_put_failure:
-	nl_ctx_free(ctx);
-	return ret;
+	return -1;
 }
 
-static int ovpn_del_key(struct ovpn_ctx *ovpn)
+static int ovpn_new_key(struct ovpn_ctx *ovpn)
 {
 	struct nl_ctx *ctx;
 	int ret = -1;
 
-	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_DEL_KEY);
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_NEW_KEY);
 	if (!ctx)
 		return -ENOMEM;
 
-	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, OVPN_KEY_SLOT_PRIMARY);
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	if (ovpn_put_key(ctx->nl_msg, ovpn) < 0)
+		goto nla_put_failure;
 
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
@@ -723,194 +858,670 @@ nla_put_failure:
 	return ret;
 }
 
-static int ovpn_swap_keys(struct ovpn_ctx *ovpn)
+/* max keys sent in a single NEW_KEYS request, so that it fits a page */
+#define NEW_KEYS_BATCH 16
+
+static int ovpn_new_keys_batch(struct ovpn_ctx *ovpn, __u32 first_id,
+			       unsigned int n)
 {
+	struct nlattr *keys, *entry;
 	struct nl_ctx *ctx;
+	unsigned int i;
 	int ret = -1;
 
-	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_SWAP_KEYS);
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_NEW_KEYS);
 	if (!ctx)
 		return -ENOMEM;
 
+	keys = nla_nest_start(ctx->nl_msg, OVPN_ATTR_KEYS);
+	if (!keys)
+		goto nla_put_failure;
+
+	for (i = 0; i < n; i++) {
+		entry = nla_nest_start(ctx->nl_msg, i + 1);
+		if (!entry)
+			goto nla_put_failure;
+
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_PEER_ID, first_id + i);
+		if (ovpn_put_key(ctx->nl_msg, ovpn) < 0)
+			goto nla_put_failure;
+
+		nla_nest_end(ctx->nl_msg, entry);
+	}
+
+	nla_nest_end(ctx->nl_msg, keys);
+
 	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
 	nl_ctx_free(ctx);
 	return ret;
 }
 
-static int ovpn_send_data(struct ovpn_ctx *ovpn, const void *data, size_t len)
+/* install the same key for count peers with consecutive IDs */
+static int ovpn_new_keys(struct ovpn_ctx *ovpn, __u32 first_id, __u32 count)
+{
+	unsigned int n;
+	__u32 i;
+	int ret;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < NEW_KEYS_BATCH ? count - i : NEW_KEYS_BATCH;
+
+		ret = ovpn_new_keys_batch(ovpn, first_id + i, n);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int ovpn_handle_key(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+
+	nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+
+	if (attrs[OVPN_ATTR_PEER_ID])
+		fprintf(stderr, "peer-id: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_PEER_ID]));
+	if (attrs[OVPN_ATTR_KEY_ID])
+		fprintf(stderr, "key-id: %u\n",
+			nla_get_u16(attrs[OVPN_ATTR_KEY_ID]));
+	if (attrs[OVPN_ATTR_REPLAY_WINDOW])
+		fprintf(stderr, "replay window: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_REPLAY_WINDOW]));
+	if (attrs[OVPN_ATTR_REPLAY_MAX_BACKTRACK])
+		fprintf(stderr, "max backtrack: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_REPLAY_MAX_BACKTRACK]));
+	if (attrs[OVPN_ATTR_REPLAY_DROPS])
+		fprintf(stderr, "replay drops: %llu\n",
+			(unsigned long long)nla_get_u64(attrs[OVPN_ATTR_REPLAY_DROPS]));
+
+	return NL_SKIP;
+}
+
+static int ovpn_get_key(struct ovpn_ctx *ovpn)
 {
 	struct nl_ctx *ctx;
 	int ret = -1;
 
-	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_PACKET);
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_KEY);
 	if (!ctx)
 		return -ENOMEM;
 
-	NLA_PUT(ctx->nl_msg, OVPN_ATTR_PACKET, len, data);
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
 
-	ret = ovpn_nl_msg_send(ctx, NULL);
+	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, OVPN_KEY_SLOT_PRIMARY);
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_key);
 nla_put_failure:
 	nl_ctx_free(ctx);
 	return ret;
 }
 
-static int ovpn_handle_packet(struct nl_msg *msg, void *arg)
+static int ovpn_handle_mem(struct nl_msg *msg, void *arg)
 {
 	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *mem[OVPN_MEM_ATTR_MAX + 1];
 	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
-	const __u8 *data;
-	size_t i, len;
-
-	fprintf(stderr, "received message\n");
+	unsigned long long peer_bytes;
+	unsigned int peers;
 
 	nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
 
-	if (!attrs[OVPN_ATTR_PACKET]) {
-		fprintf(stderr, "no packet content in netlink message\n");
+	if (attrs[OVPN_ATTR_IDLE_TIMEOUT])
+		fprintf(stderr, "idle timeout: %us\n",
+			nla_get_u32(attrs[OVPN_ATTR_IDLE_TIMEOUT]));
+
+	if (!attrs[OVPN_ATTR_MEM] ||
+	    nla_parse_nested(mem, OVPN_MEM_ATTR_MAX, attrs[OVPN_ATTR_MEM],
+			     NULL))
 		return NL_SKIP;
-	}
 
-	len = nla_len(attrs[OVPN_ATTR_PACKET]);
-	data = nla_data(attrs[OVPN_ATTR_PACKET]);
+	if (mem[OVPN_MEM_ATTR_IFACE_BYTES])
+		fprintf(stderr, "interface: %llu bytes\n",
+			(unsigned long long)nla_get_u64(mem[OVPN_MEM_ATTR_IFACE_BYTES]));
 
-	fprintf(stderr, "received message, len=%zd:\n", len);
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16))
-			fprintf(stderr, "\n");
-		fprintf(stderr, "%.2x ", data[i]);
+	if (mem[OVPN_MEM_ATTR_PEERS] && mem[OVPN_MEM_ATTR_PEER_BYTES]) {
+		peers = nla_get_u32(mem[OVPN_MEM_ATTR_PEERS]);
+		peer_bytes = nla_get_u64(mem[OVPN_MEM_ATTR_PEER_BYTES]);
+		fprintf(stderr, "peers: %u, %llu bytes (%llu per peer)\n",
+			peers, peer_bytes, peers ? peer_bytes / peers : 0);
 	}
-	fprintf(stderr, "\n");
 
-	return NL_SKIP;
-}
+	if (mem[OVPN_MEM_ATTR_RINGS] && mem[OVPN_MEM_ATTR_RING_BYTES])
+		fprintf(stderr, "rings: %u, %llu bytes\n",
+			nla_get_u32(mem[OVPN_MEM_ATTR_RINGS]),
+			(unsigned long long)nla_get_u64(mem[OVPN_MEM_ATTR_RING_BYTES]));
 
-static int nl_seq_check(struct nl_msg *msg, void *arg)
-{
-	return NL_OK;
+	if (mem[OVPN_MEM_ATTR_KEY_SLOTS] && mem[OVPN_MEM_ATTR_KEY_BYTES])
+		fprintf(stderr, "key slots: %u, %llu bytes\n",
+			nla_get_u32(mem[OVPN_MEM_ATTR_KEY_SLOTS]),
+			(unsigned long long)nla_get_u64(mem[OVPN_MEM_ATTR_KEY_BYTES]));
+
+	return NL_SKIP;
 }
 
-static struct nl_ctx *ovpn_register(struct ovpn_ctx *ovpn)
+static int ovpn_get_mem(struct ovpn_ctx *ovpn)
 {
 	struct nl_ctx *ctx;
 	int ret;
 
-	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_REGISTER_PACKET);
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_MEM);
 	if (!ctx)
-		return NULL;
-
-	nl_cb_set(ctx->nl_cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, nl_seq_check,
-		  NULL);
-
-	ret = ovpn_nl_msg_send(ctx, ovpn_handle_packet);
-	if (ret < 0) {
-		nl_ctx_free(ctx);
-		return NULL;
-	}
+		return -ENOMEM;
 
-	return ctx;
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_mem);
+	nl_ctx_free(ctx);
+	return ret;
 }
 
-struct mcast_handler_args {
-	const char *group;
-	int id;
-};
-
-static int mcast_family_handler(struct nl_msg *msg, void *arg)
+static int ovpn_handle_filter(struct nl_msg *msg, void *arg)
 {
-	struct mcast_handler_args *grp = arg;
-	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	static const char * const reasons[] = {
+		[OVPN_FILTER_STATS_ATTR_DROPS_OPCODE] = "invalid opcode",
+		[OVPN_FILTER_STATS_ATTR_DROPS_PEER_ID] = "unknown peer-id",
+		[OVPN_FILTER_STATS_ATTR_DROPS_KEY_ID] = "unknown key-id",
+		[OVPN_FILTER_STATS_ATTR_DROPS_REPLAY] = "replay",
+	};
 	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-	struct nlattr *mcgrp;
-	int rem_mcgrp;
+	struct nlattr *stats[OVPN_FILTER_STATS_ATTR_MAX + 1];
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	int i;
 
-	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+	nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
 
-	if (!tb[CTRL_ATTR_MCAST_GROUPS])
-		return NL_SKIP;
-
-	nla_for_each_nested(mcgrp, tb[CTRL_ATTR_MCAST_GROUPS], rem_mcgrp) {
-		struct nlattr *tb_mcgrp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+	if (attrs[OVPN_ATTR_EARLY_FILTER])
+		fprintf(stderr, "early filter: %s\n",
+			nla_get_u8(attrs[OVPN_ATTR_EARLY_FILTER]) ?
+			"enabled" : "disabled");
 
-		nla_parse(tb_mcgrp, CTRL_ATTR_MCAST_GRP_MAX,
-			  nla_data(mcgrp), nla_len(mcgrp), NULL);
+	if (!attrs[OVPN_ATTR_FILTER_STATS] ||
+	    nla_parse_nested(stats, OVPN_FILTER_STATS_ATTR_MAX,
+			     attrs[OVPN_ATTR_FILTER_STATS], NULL))
+		return NL_SKIP;
 
-		if (!tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME] ||
-		    !tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID])
-			continue;
-		if (strncmp(nla_data(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME]),
-			    grp->group, nla_len(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME])))
-			continue;
-		grp->id = nla_get_u32(tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID]);
-		break;
+	for (i = OVPN_FILTER_STATS_ATTR_DROPS_OPCODE;
+	     i <= OVPN_FILTER_STATS_ATTR_DROPS_REPLAY; i++) {
+		if (stats[i])
+			fprintf(stderr, "\tdropped (%s): %llu\n", reasons[i],
+				(unsigned long long)nla_get_u64(stats[i]));
 	}
 
 	return NL_SKIP;
 }
 
-static int mcast_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
-			       void *arg)
+static int ovpn_get_filter(struct ovpn_ctx *ovpn)
 {
-	int *ret = arg;
+	struct nl_ctx *ctx;
+	int ret;
 
-	*ret = err->error;
-	return NL_STOP;
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_FILTER);
+	if (!ctx)
+		return -ENOMEM;
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_filter);
+	nl_ctx_free(ctx);
+	return ret;
 }
 
-static int mcast_ack_handler(struct nl_msg *msg, void *arg)
+static void ovpn_print_latency(struct nlattr *attr)
 {
-	int *ret = arg;
+	static const char * const stage_names[] = {
+		[OVPN_PEER_LATENCY_ATTR_TX_QUEUE] = "tx queue",
+		[OVPN_PEER_LATENCY_ATTR_TX_CRYPTO] = "tx crypto",
+		[OVPN_PEER_LATENCY_ATTR_RX_QUEUE] = "rx queue",
+		[OVPN_PEER_LATENCY_ATTR_RX_CRYPTO] = "rx crypto",
+	};
+	struct nlattr *lat[OVPN_PEER_LATENCY_ATTR_MAX + 1];
+	const uint64_t *hist;
+	int i, j, n;
 
-	*ret = 0;
-	return NL_STOP;
+	if (nla_parse_nested(lat, OVPN_PEER_LATENCY_ATTR_MAX, attr, NULL))
+		return;
+
+	for (i = OVPN_PEER_LATENCY_ATTR_TX_QUEUE;
+	     i <= OVPN_PEER_LATENCY_ATTR_RX_CRYPTO; i++) {
+		if (!lat[i])
+			continue;
+
+		fprintf(stderr, "\tlatency (%s):\n", stage_names[i]);
+
+		hist = nla_data(lat[i]);
+		n = nla_len(lat[i]) / sizeof(*hist);
+		for (j = 0; j < n; j++) {
+			if (!hist[j])
+				continue;
+
+			/* bucket 0 counts anything below 1024ns */
+			fprintf(stderr, "\t\t< %llu ns: %llu\n", 1ULL << (10 + j),
+				(unsigned long long)hist[j]);
+		}
+	}
 }
 
-static int ovpn_handle_msg(struct nl_msg *msg, void *arg)
+static int ovpn_handle_peer(struct nl_msg *msg, void *arg)
 {
+	static const char * const drop_names[] = {
+		[OVPN_PEER_STATS_ATTR_DROPS_REPLAY] = "replay",
+		[OVPN_PEER_STATS_ATTR_DROPS_AUTH] = "auth",
+		[OVPN_PEER_STATS_ATTR_DROPS_RING_FULL] = "ring full",
+		[OVPN_PEER_STATS_ATTR_DROPS_NO_KEY] = "no key",
+		[OVPN_PEER_STATS_ATTR_DROPS_MALFORMED] = "malformed",
+		[OVPN_PEER_STATS_ATTR_DROPS_CTRL] = "control",
+	};
 	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *stats[OVPN_PEER_STATS_ATTR_MAX + 1];
 	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
-	struct nlmsghdr *nlh = nlmsg_hdr(msg);
-	enum ovpn_del_peer_reason reason;
-	char ifname[IF_NAMESIZE];
-	__u32 ifindex;
+	char buf[INET6_ADDRSTRLEN];
+	int i;
 
-	fprintf(stderr, "received message from ovpn-dco\n");
+	nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
 
-	if (!genlmsg_valid_hdr(nlh, 0)) {
-		fprintf(stderr, "invalid header\n");
-		return NL_STOP;
-	}
+	if (attrs[OVPN_ATTR_PEER_ID])
+		fprintf(stderr, "peer-id: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_PEER_ID]));
+	if (attrs[OVPN_ATTR_VPN_IPV4]) {
+		__u32 addr = nla_get_u32(attrs[OVPN_ATTR_VPN_IPV4]);
 
-	if (nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
-		      genlmsg_attrlen(gnlh, 0), NULL)) {
-		fprintf(stderr, "received bogus data from ovpn-dco\n");
-		return NL_STOP;
+		inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+		fprintf(stderr, "\tvpn ipv4: %s\n", buf);
 	}
-
-	if (!attrs[OVPN_ATTR_IFINDEX]) {
-		fprintf(stderr, "no ifindex in this message\n");
-		return NL_STOP;
+	if (attrs[OVPN_ATTR_VPN_IPV6]) {
+		inet_ntop(AF_INET6, nla_data(attrs[OVPN_ATTR_VPN_IPV6]), buf,
+			  sizeof(buf));
+		fprintf(stderr, "\tvpn ipv6: %s\n", buf);
 	}
+	if (attrs[OVPN_ATTR_KEEPALIVE_INTERVAL])
+		fprintf(stderr, "\tkeepalive interval: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_KEEPALIVE_INTERVAL]));
+	if (attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT])
+		fprintf(stderr, "\tkeepalive timeout: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT]));
+	if (attrs[OVPN_ATTR_QUEUE_LEN])
+		fprintf(stderr, "\tqueue length: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_QUEUE_LEN]));
+	if (attrs[OVPN_ATTR_PEER_MTU])
+		fprintf(stderr, "\tpath MTU: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_PEER_MTU]));
+
+	if (attrs[OVPN_ATTR_PEER_LATENCY])
+		ovpn_print_latency(attrs[OVPN_ATTR_PEER_LATENCY]);
+
+	if (!attrs[OVPN_ATTR_PEER_STATS] ||
+	    nla_parse_nested(stats, OVPN_PEER_STATS_ATTR_MAX,
+			     attrs[OVPN_ATTR_PEER_STATS], NULL))
+		return NL_SKIP;
 
-	ifindex = nla_get_u32(attrs[OVPN_ATTR_IFINDEX]);
-	if (!if_indextoname(ifindex, ifname)) {
-		fprintf(stderr, "cannot resolve ifname for ifinxed: %u\n",
-			ifindex);
-		return NL_STOP;
+	if (stats[OVPN_PEER_STATS_ATTR_RX_BYTES] &&
+	    stats[OVPN_PEER_STATS_ATTR_RX_PACKETS])
+		fprintf(stderr, "\trx: %llu bytes, %llu packets\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_PEER_STATS_ATTR_RX_BYTES]),
+			(unsigned long long)nla_get_u64(stats[OVPN_PEER_STATS_ATTR_RX_PACKETS]));
+	if (stats[OVPN_PEER_STATS_ATTR_TX_BYTES] &&
+	    stats[OVPN_PEER_STATS_ATTR_TX_PACKETS])
+		fprintf(stderr, "\ttx: %llu bytes, %llu packets\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_PEER_STATS_ATTR_TX_BYTES]),
+			(unsigned long long)nla_get_u64(stats[OVPN_PEER_STATS_ATTR_TX_PACKETS]));
+
+	for (i = OVPN_PEER_STATS_ATTR_DROPS_REPLAY;
+	     i <= OVPN_PEER_STATS_ATTR_DROPS_CTRL; i++) {
+		if (stats[i])
+			fprintf(stderr, "\tdrops (%s): %llu\n", drop_names[i],
+				(unsigned long long)nla_get_u64(stats[i]));
 	}
 
-	switch (gnlh->cmd) {
-	case OVPN_CMD_DEL_PEER:
-		if (!attrs[OVPN_ATTR_DEL_PEER_REASON]) {
-			fprintf(stderr, "no reason in DEL_PEER message\n");
-			return NL_STOP;
-		}
-		reason = nla_get_u8(attrs[OVPN_ATTR_DEL_PEER_REASON]);
-		fprintf(stderr,
-			"received CMD_DEL_PEER, ifname: %s reason: %d\n",
-			ifname, reason);
-		break;
+	if (stats[OVPN_PEER_STATS_ATTR_TX_INPLACE] &&
+	    stats[OVPN_PEER_STATS_ATTR_TX_COW])
+		fprintf(stderr, "\ttx encrypted: %llu in place, %llu after copy\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_PEER_STATS_ATTR_TX_INPLACE]),
+			(unsigned long long)nla_get_u64(stats[OVPN_PEER_STATS_ATTR_TX_COW]));
+
+	return NL_SKIP;
+}
+
+/* retrieve a single peer, or dump all of them when no peer-id was given */
+static int ovpn_get_peer(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_PEER);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn->peer_id_set) {
+		if (ovpn_put_peer_id(ctx, ovpn) < 0)
+			goto nla_put_failure;
+	} else {
+		nlmsg_hdr(ctx->nl_msg)->nlmsg_flags |= NLM_F_DUMP;
+	}
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_peer);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_del_key(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_DEL_KEY);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, OVPN_KEY_SLOT_PRIMARY);
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_swap_keys(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_SWAP_KEYS);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_del_peer(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_DEL_PEER);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_set_vpn(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_SET_VPN);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn->crypto_parallel >= 0)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_CRYPTO_PARALLEL,
+			   ovpn->crypto_parallel);
+
+	if (ovpn->tx_multiqueue >= 0)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_TX_MULTIQUEUE,
+			   ovpn->tx_multiqueue);
+
+	if (ovpn->rx_mode >= 0)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_RX_MODE, ovpn->rx_mode);
+
+	if (ovpn->queue_len)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_QUEUE_LEN, ovpn->queue_len);
+
+	if (ovpn->ctrl_rate >= 0)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_CTRL_RATE, ovpn->ctrl_rate);
+
+	if (ovpn->idle_timeout >= 0)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_IDLE_TIMEOUT,
+			    ovpn->idle_timeout);
+
+	if (ovpn->early_filter >= 0)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_EARLY_FILTER,
+			   ovpn->early_filter);
+
+	if (ovpn->pmtu_discovery >= 0)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_PMTU_DISCOVERY,
+			   ovpn->pmtu_discovery);
+
+	if (ovpn->mss_clamp >= 0)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_MSS_CLAMP, ovpn->mss_clamp);
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_iroute(struct ovpn_ctx *ovpn, enum ovpn_nl_commands cmd)
+{
+	struct nlattr *iroute;
+	struct nl_ctx *ctx;
+	size_t alen;
+	int ret = -1;
+
+	alen = ovpn->iroute_family == AF_INET6 ? sizeof(struct in6_addr) :
+						 sizeof(struct in_addr);
+
+	ctx = nl_ctx_alloc(ovpn, cmd);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	iroute = nla_nest_start(ctx->nl_msg, OVPN_ATTR_IROUTE);
+	NLA_PUT(ctx->nl_msg, OVPN_IROUTE_ATTR_ADDRESS, alen, &ovpn->iroute);
+	NLA_PUT_U8(ctx->nl_msg, OVPN_IROUTE_ATTR_PREFIX_LEN,
+		   ovpn->iroute_prefix_len);
+	nla_nest_end(ctx->nl_msg, iroute);
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_send_data(struct ovpn_ctx *ovpn, const void *data, size_t len)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_PACKET);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn_put_peer_id(ctx, ovpn) < 0)
+		goto nla_put_failure;
+
+	NLA_PUT(ctx->nl_msg, OVPN_ATTR_PACKET, len, data);
+
+	ret = ovpn_nl_msg_send(ctx, NULL);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_handle_packet(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	const __u8 *data;
+	size_t i, len;
+
+	fprintf(stderr, "received message\n");
+
+	nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+
+	if (!attrs[OVPN_ATTR_PACKET]) {
+		fprintf(stderr, "no packet content in netlink message\n");
+		return NL_SKIP;
+	}
+
+	if (attrs[OVPN_ATTR_PEER_ID])
+		fprintf(stderr, "peer-id: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_PEER_ID]));
+
+	len = nla_len(attrs[OVPN_ATTR_PACKET]);
+	data = nla_data(attrs[OVPN_ATTR_PACKET]);
+
+	fprintf(stderr, "received message, len=%zd:\n", len);
+	for (i = 0; i < len; i++) {
+		if (i && !(i % 16))
+			fprintf(stderr, "\n");
+		fprintf(stderr, "%.2x ", data[i]);
+	}
+	fprintf(stderr, "\n");
+
+	return NL_SKIP;
+}
+
+static int nl_seq_check(struct nl_msg *msg, void *arg)
+{
+	return NL_OK;
+}
+
+static struct nl_ctx *ovpn_register(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_REGISTER_PACKET);
+	if (!ctx)
+		return NULL;
+
+	nl_cb_set(ctx->nl_cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, nl_seq_check,
+		  NULL);
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_packet);
+	if (ret < 0) {
+		nl_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+struct mcast_handler_args {
+	const char *group;
+	int id;
+};
+
+static int mcast_family_handler(struct nl_msg *msg, void *arg)
+{
+	struct mcast_handler_args *grp = arg;
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *mcgrp;
+	int rem_mcgrp;
+
+	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+
+	if (!tb[CTRL_ATTR_MCAST_GROUPS])
+		return NL_SKIP;
+
+	nla_for_each_nested(mcgrp, tb[CTRL_ATTR_MCAST_GROUPS], rem_mcgrp) {
+		struct nlattr *tb_mcgrp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+
+		nla_parse(tb_mcgrp, CTRL_ATTR_MCAST_GRP_MAX,
+			  nla_data(mcgrp), nla_len(mcgrp), NULL);
+
+		if (!tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME] ||
+		    !tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID])
+			continue;
+		if (strncmp(nla_data(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME]),
+			    grp->group, nla_len(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME])))
+			continue;
+		grp->id = nla_get_u32(tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID]);
+		break;
+	}
+
+	return NL_SKIP;
+}
+
+static int mcast_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
+			       void *arg)
+{
+	int *ret = arg;
+
+	*ret = err->error;
+	return NL_STOP;
+}
+
+static int mcast_ack_handler(struct nl_msg *msg, void *arg)
+{
+	int *ret = arg;
+
+	*ret = 0;
+	return NL_STOP;
+}
+
+static int ovpn_handle_msg(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	enum ovpn_del_peer_reason reason;
+	char ifname[IF_NAMESIZE];
+	__u32 ifindex;
+
+	fprintf(stderr, "received message from ovpn-dco\n");
+
+	if (!genlmsg_valid_hdr(nlh, 0)) {
+		fprintf(stderr, "invalid header\n");
+		return NL_STOP;
+	}
+
+	if (nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		      genlmsg_attrlen(gnlh, 0), NULL)) {
+		fprintf(stderr, "received bogus data from ovpn-dco\n");
+		return NL_STOP;
+	}
+
+	if (!attrs[OVPN_ATTR_IFINDEX]) {
+		fprintf(stderr, "no ifindex in this message\n");
+		return NL_STOP;
+	}
+
+	ifindex = nla_get_u32(attrs[OVPN_ATTR_IFINDEX]);
+	if (!if_indextoname(ifindex, ifname)) {
+		fprintf(stderr, "cannot resolve ifname for ifinxed: %u\n",
+			ifindex);
+		return NL_STOP;
+	}
+
+	switch (gnlh->cmd) {
+	case OVPN_CMD_DEL_PEER:
+		if (!attrs[OVPN_ATTR_DEL_PEER_REASON]) {
+			fprintf(stderr, "no reason in DEL_PEER message\n");
+			return NL_STOP;
+		}
+		reason = nla_get_u8(attrs[OVPN_ATTR_DEL_PEER_REASON]);
+		fprintf(stderr,
+			"received CMD_DEL_PEER, ifname: %s reason: %d\n",
+			ifname, reason);
+		break;
 	default:
 		fprintf(stderr, "received unknown command: %d\n", gnlh->cmd);
 		return NL_STOP;
@@ -1018,16 +1629,423 @@ err_free:
 	nl_socket_free(sock);
 }
 
+/* Load generator: simulates count peers with consecutive peer-ids on a server
+ * mode interface, then hits them with bursts of rekeys (NEW_KEY into the
+ * secondary slot followed by SWAP_KEYS) and, optionally, of deletions and
+ * re-additions. The latency of every request is measured and, if a monitor
+ * peer carrying real traffic is given, so is the impact of the storm on its
+ * datapath.
+ */
+
+/* distinct transport addresses of the simulated peers: each remote address
+ * hosts LOADGEN_PORTS of them
+ */
+#define LOADGEN_PORT_BASE 10000
+#define LOADGEN_PORTS 50000
+
+/* min time between two samples of the monitor peer (ns) */
+#define LOADGEN_SAMPLE_NS 100000000ULL
+
+struct ovpn_loadgen_stat {
+	const char *name;
+	unsigned long ok;
+	unsigned long err;
+	__u64 sum_ns;
+	__u64 max_ns;
+	/* hist[i] counts the requests that took less than 2^i us */
+	unsigned long hist[32];
+};
+
+struct ovpn_loadgen_sample {
+	__u64 time_ns;
+	__u64 packets;
+	__u64 drops;
+};
+
+struct ovpn_loadgen {
+	__u32 first_id;
+	__u32 count;
+	unsigned int rounds;
+	unsigned int burst;
+	unsigned int pause_ms;
+	bool churn;
+
+	/* peer carrying traffic meanwhile, if monitor_set */
+	__u32 monitor_id;
+	bool monitor_set;
+
+	/* last sample of the monitor peer */
+	struct ovpn_loadgen_sample last;
+	/* lowest packet rate and longest time without packets seen */
+	double min_pps;
+	__u64 max_stall_ns;
+	__u64 stall_start_ns;
+};
+
+enum ovpn_loadgen_op {
+	LOADGEN_NEW_PEER,
+	LOADGEN_NEW_KEYS,
+	LOADGEN_NEW_KEY,
+	LOADGEN_SWAP_KEYS,
+	LOADGEN_DEL_PEER,
+	__LOADGEN_OP_MAX,
+};
+
+static struct ovpn_loadgen_stat ovpn_loadgen_stats[__LOADGEN_OP_MAX] = {
+	[LOADGEN_NEW_PEER] = { .name = "new_peer" },
+	[LOADGEN_NEW_KEYS] = { .name = "new_keys" },
+	[LOADGEN_NEW_KEY] = { .name = "new_key" },
+	[LOADGEN_SWAP_KEYS] = { .name = "swap_keys" },
+	[LOADGEN_DEL_PEER] = { .name = "del_peer" },
+};
+
+static void ovpn_loadgen_account(enum ovpn_loadgen_op op, int ret)
+{
+	struct ovpn_loadgen_stat *stat = &ovpn_loadgen_stats[op];
+	__u64 us = ovpn_nl_last_ns / 1000;
+	unsigned int i = 0;
+
+	if (ret < 0) {
+		stat->err++;
+		return;
+	}
+
+	stat->ok++;
+	stat->sum_ns += ovpn_nl_last_ns;
+	if (ovpn_nl_last_ns > stat->max_ns)
+		stat->max_ns = ovpn_nl_last_ns;
+
+	while (i < 31 && (us >> i))
+		i++;
+	stat->hist[i]++;
+}
+
+/* upper bound of the latency of pct percent of the requests (us) */
+static unsigned long ovpn_loadgen_percentile(const struct ovpn_loadgen_stat *stat,
+					     unsigned int pct)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < 32; i++) {
+		sum += stat->hist[i];
+		if (sum * 100 >= stat->ok * pct)
+			break;
+	}
+
+	return 1UL << i;
+}
+
+/* peer-id and transport address of the simulated peer n */
+static void ovpn_loadgen_peer(struct ovpn_ctx *peer, const struct ovpn_ctx *base,
+			      const struct ovpn_loadgen *lg, __u32 n)
+{
+	__u32 host = n / LOADGEN_PORTS;
+
+	*peer = *base;
+	peer->peer_id = lg->first_id + n;
+	peer->peer_id_set = true;
+	peer->rport = LOADGEN_PORT_BASE + n % LOADGEN_PORTS;
+
+	if (peer->sa_family == AF_INET)
+		peer->remote.in4.s_addr =
+			htonl(ntohl(base->remote.in4.s_addr) + host);
+	else
+		peer->remote.in6.s6_addr32[3] =
+			htonl(ntohl(base->remote.in6.s6_addr32[3]) + host);
+}
+
+static int ovpn_handle_peer_sample(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *stats[OVPN_PEER_STATS_ATTR_MAX + 1];
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	struct nl_ctx *ctx = arg;
+	struct ovpn_loadgen_sample *sample = ctx->data;
+	int i;
+
+	nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+
+	if (!attrs[OVPN_ATTR_PEER_STATS] ||
+	    nla_parse_nested(stats, OVPN_PEER_STATS_ATTR_MAX,
+			     attrs[OVPN_ATTR_PEER_STATS], NULL))
+		return NL_SKIP;
+
+	if (stats[OVPN_PEER_STATS_ATTR_RX_PACKETS])
+		sample->packets += nla_get_u64(stats[OVPN_PEER_STATS_ATTR_RX_PACKETS]);
+	if (stats[OVPN_PEER_STATS_ATTR_TX_PACKETS])
+		sample->packets += nla_get_u64(stats[OVPN_PEER_STATS_ATTR_TX_PACKETS]);
+
+	for (i = OVPN_PEER_STATS_ATTR_DROPS_REPLAY;
+	     i <= OVPN_PEER_STATS_ATTR_DROPS_CTRL; i++) {
+		if (stats[i])
+			sample->drops += nla_get_u64(stats[i]);
+	}
+
+	return NL_SKIP;
+}
+
+/* read the packet and drop counters of the monitor peer */
+static int ovpn_loadgen_sample(const struct ovpn_ctx *ovpn,
+			       const struct ovpn_loadgen *lg,
+			       struct ovpn_loadgen_sample *sample)
+{
+	struct ovpn_ctx peer = *ovpn;
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	peer.peer_id = lg->monitor_id;
+	peer.peer_id_set = true;
+
+	ctx = nl_ctx_alloc(&peer, OVPN_CMD_GET_PEER);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (ovpn_put_peer_id(ctx, &peer) < 0)
+		goto nla_put_failure;
+
+	memset(sample, 0, sizeof(*sample));
+	ctx->data = sample;
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_peer_sample);
+	sample->time_ns = ovpn_now_ns();
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+/* sample the monitor peer, if enough time has passed since the last sample,
+ * and take note of how much its traffic slowed down
+ */
+static void ovpn_loadgen_monitor(const struct ovpn_ctx *ovpn,
+				 struct ovpn_loadgen *lg)
+{
+	struct ovpn_loadgen_sample sample;
+	double pps;
+
+	if (!lg->monitor_set ||
+	    ovpn_now_ns() - lg->last.time_ns < LOADGEN_SAMPLE_NS)
+		return;
+
+	if (ovpn_loadgen_sample(ovpn, lg, &sample) < 0)
+		return;
+
+	pps = (sample.packets - lg->last.packets) * 1e9 /
+	      (sample.time_ns - lg->last.time_ns);
+	if (lg->min_pps < 0 || pps < lg->min_pps)
+		lg->min_pps = pps;
+
+	if (sample.packets != lg->last.packets) {
+		lg->stall_start_ns = sample.time_ns;
+	} else if (sample.time_ns - lg->stall_start_ns > lg->max_stall_ns) {
+		lg->max_stall_ns = sample.time_ns - lg->stall_start_ns;
+	}
+
+	lg->last.time_ns = sample.time_ns;
+	lg->last.packets = sample.packets;
+}
+
+static int ovpn_loadgen_add(const struct ovpn_ctx *ovpn,
+			    const struct ovpn_loadgen *lg, __u32 n)
+{
+	struct ovpn_ctx peer;
+	int ret;
+
+	ovpn_loadgen_peer(&peer, ovpn, lg, n);
+
+	ret = ovpn_new_peer(&peer);
+	ovpn_loadgen_account(LOADGEN_NEW_PEER, ret);
+
+	return ret;
+}
+
+/* rekey the simulated peers first..first + n - 1, then optionally re-create
+ * them from scratch
+ */
+static void ovpn_loadgen_burst(const struct ovpn_ctx *ovpn,
+			       struct ovpn_loadgen *lg, unsigned int round,
+			       __u32 first, __u32 n)
+{
+	struct ovpn_ctx peer;
+	__u32 i;
+	int ret;
+
+	for (i = first; i < first + n; i++) {
+		ovpn_loadgen_peer(&peer, ovpn, lg, i);
+		peer.key_slot = OVPN_KEY_SLOT_SECONDARY;
+		peer.key_id = (round + 1) & 7;
+
+		ret = ovpn_new_key(&peer);
+		ovpn_loadgen_account(LOADGEN_NEW_KEY, ret);
+	}
+
+	ovpn_loadgen_monitor(ovpn, lg);
+
+	for (i = first; i < first + n; i++) {
+		ovpn_loadgen_peer(&peer, ovpn, lg, i);
+
+		ret = ovpn_swap_keys(&peer);
+		ovpn_loadgen_account(LOADGEN_SWAP_KEYS, ret);
+	}
+
+	ovpn_loadgen_monitor(ovpn, lg);
+
+	if (!lg->churn)
+		return;
+
+	for (i = first; i < first + n; i++) {
+		ovpn_loadgen_peer(&peer, ovpn, lg, i);
+
+		ret = ovpn_del_peer(&peer);
+		ovpn_loadgen_account(LOADGEN_DEL_PEER, ret);
+		if (ret < 0 || ovpn_loadgen_add(ovpn, lg, i) < 0)
+			continue;
+
+		ret = ovpn_new_key(&peer);
+		ovpn_loadgen_account(LOADGEN_NEW_KEY, ret);
+	}
+
+	ovpn_loadgen_monitor(ovpn, lg);
+}
+
+static void ovpn_loadgen_report(const struct ovpn_loadgen *lg,
+				const struct ovpn_loadgen_sample *before,
+				const struct ovpn_loadgen_sample *after,
+				double base_pps, __u64 storm_ns)
+{
+	const struct ovpn_loadgen_stat *stat;
+	unsigned int i;
+
+	fprintf(stderr, "%u peers, %u rounds in %.3fs\n", lg->count, lg->rounds,
+		storm_ns / 1e9);
+
+	for (i = 0; i < __LOADGEN_OP_MAX; i++) {
+		stat = &ovpn_loadgen_stats[i];
+		if (!stat->ok && !stat->err)
+			continue;
+
+		fprintf(stderr, "%s: %lu ok, %lu failed", stat->name, stat->ok,
+			stat->err);
+		if (stat->ok)
+			fprintf(stderr,
+				", latency avg %lluus, p50 <%luus, p99 <%luus, max %lluus",
+				(unsigned long long)(stat->sum_ns / stat->ok / 1000),
+				ovpn_loadgen_percentile(stat, 50),
+				ovpn_loadgen_percentile(stat, 99),
+				(unsigned long long)(stat->max_ns / 1000));
+		fprintf(stderr, "\n");
+	}
+
+	if (!lg->monitor_set)
+		return;
+
+	fprintf(stderr, "monitor peer %u: %.0f pkt/s before, %.0f pkt/s during, min %.0f pkt/s\n",
+		lg->monitor_id, base_pps,
+		storm_ns ? (after->packets - before->packets) * 1e9 / storm_ns : 0.,
+		lg->min_pps < 0 ? 0. : lg->min_pps);
+	fprintf(stderr, "monitor peer %u: longest stall %.3fs, %llu drops\n",
+		lg->monitor_id, lg->max_stall_ns / 1e9,
+		(unsigned long long)(after->drops - before->drops));
+}
+
+static int ovpn_loadgen(struct ovpn_ctx *ovpn, struct ovpn_loadgen *lg)
+{
+	struct ovpn_loadgen_sample start, before = { 0 }, after = { 0 };
+	__u64 storm_start, storm_ns = 0;
+	double base_pps = 0;
+	unsigned int round;
+	struct ovpn_ctx peer;
+	__u32 i, n;
+	int ret;
+
+	for (i = 0; i < lg->count; i++) {
+		ret = ovpn_loadgen_add(ovpn, lg, i);
+		if (ret < 0) {
+			fprintf(stderr, "cannot add peer %u\n", lg->first_id + i);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < lg->count; i += n) {
+		n = lg->count - i < NEW_KEYS_BATCH ? lg->count - i : NEW_KEYS_BATCH;
+
+		ret = ovpn_new_keys_batch(ovpn, lg->first_id + i, n);
+		ovpn_loadgen_account(LOADGEN_NEW_KEYS, ret);
+		if (ret < 0) {
+			fprintf(stderr, "cannot set keys\n");
+			goto out;
+		}
+	}
+
+	/* baseline rate of the monitor peer */
+	lg->min_pps = -1;
+	if (lg->monitor_set) {
+		if (ovpn_loadgen_sample(ovpn, lg, &start) < 0) {
+			fprintf(stderr, "cannot read monitor peer %u\n",
+				lg->monitor_id);
+			ret = -1;
+			goto out;
+		}
+		sleep(1);
+		if (ovpn_loadgen_sample(ovpn, lg, &before) < 0) {
+			ret = -1;
+			goto out;
+		}
+
+		base_pps = (before.packets - start.packets) * 1e9 /
+			   (before.time_ns - start.time_ns);
+		lg->last = before;
+		lg->stall_start_ns = before.time_ns;
+	}
+
+	storm_start = ovpn_now_ns();
+	for (round = 0; round < lg->rounds; round++) {
+		for (i = 0; i < lg->count; i += n) {
+			n = lg->count - i < lg->burst ? lg->count - i : lg->burst;
+
+			ovpn_loadgen_burst(ovpn, lg, round, i, n);
+			if (lg->pause_ms)
+				usleep(lg->pause_ms * 1000);
+		}
+	}
+	storm_ns = ovpn_now_ns() - storm_start;
+
+	if (lg->monitor_set && ovpn_loadgen_sample(ovpn, lg, &after) < 0)
+		after = before;
+
+	ret = 0;
+out:
+	for (i = 0; i < lg->count; i++) {
+		ovpn_loadgen_peer(&peer, ovpn, lg, i);
+		ovpn_loadgen_account(LOADGEN_DEL_PEER, ovpn_del_peer(&peer));
+	}
+
+	if (!ret)
+		ovpn_loadgen_report(lg, &before, &after, base_pps, storm_ns);
+
+	return ret;
+}
+
 static void usage(const char *cmd)
 {
 	fprintf(stderr, "Error: invalid arguments.\n\n");
 	fprintf(stderr,
-		"Usage %s <iface> <start_udp|connect|listen|new_peer|set_peer|new_key|del_key|recv|send> [arguments..]\n",
+		"Usage %s <iface> <start_udp|connect|listen|set_vpn|new_peer|del_peer|new_iroute|del_iroute|set_peer|get_peer|new_key|new_keys|get_key|del_key|swap_keys|get_mem|get_filter|add_sockets|loadgen|recv|send> [arguments..]\n",
 		cmd);
 	fprintf(stderr, "\tiface: tun interface name\n\n");
 
-	fprintf(stderr, "* start_udp <lport>: start UDP-based VPN session on port\n");
-	fprintf(stderr, "\tlocal-port: UDP port to listen to\n\n");
+	fprintf(stderr, "* start_udp <lport> [ipv6] [server]: start UDP-based VPN session on port\n");
+	fprintf(stderr, "\tlocal-port: UDP port to listen to\n");
+	fprintf(stderr, "\tipv6: use an IPv6 socket\n");
+	fprintf(stderr, "\tserver: run in multi-peer server mode\n\n");
+
+	fprintf(stderr, "* add_sockets <lport> <n> [ipv6]: attach n more UDP sockets bound to the port of the running UDP session\n");
+	fprintf(stderr, "\tlocal-port: UDP port the session listens to\n");
+	fprintf(stderr, "\tn: number of sockets to add, datagrams are then spread over all the sockets by receiving CPU\n");
+	fprintf(stderr, "\tipv6: use IPv6 sockets\n\n");
+
+	fprintf(stderr, "In server mode, commands operating on a peer take an additional <peer_id> argument\n\n");
 
 	fprintf(stderr, "* connect <raddr> <rport>: start connecting peer of TCP-based VPN session\n");
 	fprintf(stderr, "\tremote-addr: peer IP address\n");
@@ -1036,38 +2054,149 @@ static void usage(const char *cmd)
 	fprintf(stderr, "* listen <lport>: start listening peer of TCP-based VPN session\n");
 	fprintf(stderr, "\tlocal-port: src TCP port\n\n");
 
+	fprintf(stderr, "* set_vpn <option> <value> [<option> <value> ...]: tweak running VPN session\n");
+	fprintf(stderr, "\tparallel <0|1>: spread crypto of each peer across all CPUs\n");
+	fprintf(stderr, "\tmultiqueue <0|1>: encrypt packets on the CPU of the TX queue they were sent to\n");
+	fprintf(stderr, "\trx_mode <default|napi>: where received packets are decrypted\n");
+	fprintf(stderr, "\tqueue_len <n>: number of packets the rings of new peers can hold\n");
+	fprintf(stderr, "\tctrl_rate <n>: max control packets per second from a source address (0: unlimited)\n");
+	fprintf(stderr, "\tidle_timeout <n>: seconds after which peers release the rings and crypto requests they don't use (0: never)\n");
+	fprintf(stderr, "\tearly_filter <0|1>: drop invalid packets sent to the UDP socket before the UDP stack\n");
+	fprintf(stderr, "\tpmtu <0|1>: set DF on the transport packets and reply with ICMP to packets exceeding the path MTU\n");
+	fprintf(stderr, "\tmss_clamp <0|1>: clamp the MSS of TCP SYNs to the MTU of the tunnel\n\n");
+
 	fprintf(stderr,
-		"* new_peer <laddr> <lport> <raddr> <rport>: set peer link\n");
+		"* new_peer <laddr> <lport> <raddr> <rport> [peer_id [vpn_ip]]: set peer link\n");
 	fprintf(stderr, "\tlocal-addr: src IP address\n");
 	fprintf(stderr, "\tlocal-port: src UDP port\n");
 	fprintf(stderr, "\tremote-addr: peer IP address\n");
-	fprintf(stderr, "\tremote-port: peer UDP port\n\n");
+	fprintf(stderr, "\tremote-port: peer UDP port\n");
+	fprintf(stderr, "\tpeer_id: ID assigned to the peer (server mode)\n");
+	fprintf(stderr, "\tvpn_ip: IPv4/IPv6 address assigned to the peer within the VPN (server mode)\n\n");
+
+	fprintf(stderr, "* del_peer <peer_id>: remove peer from the VPN\n");
+	fprintf(stderr, "\tpeer_id: ID of the peer to remove\n\n");
+
+	fprintf(stderr,
+		"* new_iroute <peer_id> <addr> <prefix_len>: route network via peer\n");
+	fprintf(stderr, "\tpeer_id: ID of the peer the network is routed to\n");
+	fprintf(stderr, "\taddr: IPv4/IPv6 network address\n");
+	fprintf(stderr, "\tprefix_len: network prefix length\n\n");
 
 	fprintf(stderr,
-		"* set_peer <keepalive_interval> <keepalive_timeout>: set peer attributes\n");
+		"* del_iroute <peer_id> <addr> <prefix_len>: remove network routed via peer\n\n");
+
+	fprintf(stderr,
+		"* set_peer <keepalive_interval> <keepalive_timeout> [peer_id]: set peer attributes\n");
 	fprintf(stderr,
 		"\tkeepalive_interval: interval for sending ping messages\n");
 	fprintf(stderr,
 		"\tkeepalive_timeout: time after which a peer is timed out\n\n");
 
 	fprintf(stderr,
-		"* new_key <cipher> <key_dir> <key_file>: set data channel key\n");
+		"* new_key <cipher> <key_dir> <key_file> [peer_id] [window <size>]: set data channel key\n");
 	fprintf(stderr,
 		"\tcipher: cipher to use, supported: aes (AES-GCM), chachapoly (CHACHA20POLY1305), none\n");
 	fprintf(stderr,
 		"\tkey_dir: key direction, must 0 on one host and 1 on the other\n");
-	fprintf(stderr, "\tkey_file: file containing the pre-shared key\n\n");
+	fprintf(stderr, "\tkey_file: file containing the pre-shared key\n");
+	fprintf(stderr, "\twindow: replay window size in packets\n\n");
+
+	fprintf(stderr,
+		"* new_keys <cipher> <key_dir> <key_file> <peer_id> <count> [window <size>]: set the same data channel key for count peers at once (server mode)\n");
+	fprintf(stderr, "\tpeer_id: ID of the first peer, the others follow it\n");
+	fprintf(stderr, "\tcount: number of peers\n\n");
+
+	fprintf(stderr, "* get_peer [peer_id]: show state and counters of one peer, or of all peers if peer_id is omitted\n\n");
+
+	fprintf(stderr, "* get_key [peer_id]: show replay protection state of the primary key\n\n");
+
+	fprintf(stderr, "* del_key [peer_id]: erase existing data channel key\n\n");
+
+	fprintf(stderr, "* swap_keys [peer_id]: swap primary and seconday key slots\n\n");
 
-	fprintf(stderr, "* del_key: erase existing data channel key\n\n");
+	fprintf(stderr, "* get_mem: show the memory used by the interface and its peers\n\n");
 
-	fprintf(stderr, "* swap_keys: swap primary and seconday key slots\n\n");
+	fprintf(stderr, "* get_filter: show the packets dropped by the early filter\n\n");
+
+	fprintf(stderr,
+		"* loadgen <laddr> <lport> <raddr> <cipher> <key_file> <peer_id> <count> [<option> <value> ...]: simulate count peers and storm them with rekeys (server mode)\n");
+	fprintf(stderr, "\traddr: remote address of the first peers, each address is used by %d peers\n",
+		LOADGEN_PORTS);
+	fprintf(stderr, "\tpeer_id: ID of the first peer, the others follow it\n");
+	fprintf(stderr, "\trounds <n>: number of times each peer is rekeyed (default: 1)\n");
+	fprintf(stderr, "\tburst <n>: peers rekeyed back to back (default: 100)\n");
+	fprintf(stderr, "\tpause <ms>: time between two bursts (default: 0)\n");
+	fprintf(stderr, "\tchurn <0|1>: also delete and re-create the peers of each burst\n");
+	fprintf(stderr, "\tmonitor <peer_id>: peer carrying traffic meanwhile, whose packet rate is measured\n\n");
 
 	fprintf(stderr, "* recv: receive packet and exit\n\n");
 
-	fprintf(stderr, "* send <string>: send packet with string\n");
+	fprintf(stderr, "* send <string> [peer_id]: send packet with string\n");
 	fprintf(stderr, "\tstring: message to send to the peer\n");
 }
 
+static int ovpn_parse_peer_id(struct ovpn_ctx *ovpn, const char *arg)
+{
+	unsigned long id;
+	char *end;
+
+	errno = 0;
+	id = strtoul(arg, &end, 10);
+	if (errno == ERANGE || *end != '\0' || id >= OVPN_PEER_ID_UNDEF) {
+		fprintf(stderr, "invalid peer-id: %s\n", arg);
+		return -1;
+	}
+
+	ovpn->peer_id = id;
+	ovpn->peer_id_set = true;
+
+	return 0;
+}
+
+/* parse the optional trailing peer-id found at argv[idx] */
+static int ovpn_parse_opt_peer_id(struct ovpn_ctx *ovpn, int argc, char *argv[],
+				  int idx)
+{
+	if (argc <= idx)
+		return 0;
+
+	return ovpn_parse_peer_id(ovpn, argv[idx]);
+}
+
+/* parse the optional arguments of new_key, starting at argv[start] */
+static int ovpn_parse_new_key_opts(struct ovpn_ctx *ovpn, int argc,
+				   char *argv[], int start)
+{
+	unsigned long window;
+	char *end;
+	int i;
+
+	for (i = start; i < argc; i++) {
+		if (strcmp(argv[i], "window")) {
+			if (ovpn_parse_peer_id(ovpn, argv[i]) < 0)
+				return -1;
+			continue;
+		}
+
+		if (++i == argc) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		errno = 0;
+		window = strtoul(argv[i], &end, 10);
+		if (errno == ERANGE || *end != '\0' || window > UINT32_MAX) {
+			fprintf(stderr, "invalid replay window: %s\n", argv[i]);
+			return -1;
+		}
+
+		ovpn->replay_window = window;
+	}
+
+	return 0;
+}
+
 static int ovpn_parse_new_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 {
 	int ret;
@@ -1120,6 +2249,191 @@ static int ovpn_parse_new_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 		return -1;
 	}
 
+	if (argc > 7 && ovpn_parse_peer_id(ovpn, argv[7]) < 0)
+		return -1;
+
+	if (argc > 8) {
+		ovpn->vpn_family = AF_INET;
+		ret = inet_pton(AF_INET, argv[8], &ovpn->vpn_ip.in4);
+		if (ret < 1) {
+			ovpn->vpn_family = AF_INET6;
+			ret = inet_pton(AF_INET6, argv[8], &ovpn->vpn_ip.in6);
+			if (ret < 1) {
+				fprintf(stderr, "invalid VPN IP address\n");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int ovpn_parse_iroute(struct ovpn_ctx *ovpn, int argc, char *argv[])
+{
+	unsigned long prefix_len, max_len = 32;
+	int ret;
+
+	if (argc < 6) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (ovpn_parse_peer_id(ovpn, argv[3]) < 0)
+		return -1;
+
+	ovpn->iroute_family = AF_INET;
+	ret = inet_pton(AF_INET, argv[4], &ovpn->iroute.in4);
+	if (ret < 1) {
+		ovpn->iroute_family = AF_INET6;
+		max_len = 128;
+		ret = inet_pton(AF_INET6, argv[4], &ovpn->iroute.in6);
+		if (ret < 1) {
+			fprintf(stderr, "invalid iroute address\n");
+			return -1;
+		}
+	}
+
+	prefix_len = strtoul(argv[5], NULL, 10);
+	if (errno == ERANGE || prefix_len > max_len) {
+		fprintf(stderr, "prefix length out of range\n");
+		return -1;
+	}
+	ovpn->iroute_prefix_len = prefix_len;
+
+	return 0;
+}
+
+static int ovpn_parse_set_vpn(struct ovpn_ctx *ovpn, int argc, char *argv[])
+{
+	int i;
+
+	if (argc < 5 || (argc - 3) % 2) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (i = 3; i < argc; i += 2) {
+		if (!strcmp(argv[i], "parallel")) {
+			ovpn->crypto_parallel = !!strtoul(argv[i + 1], NULL, 10);
+		} else if (!strcmp(argv[i], "multiqueue")) {
+			ovpn->tx_multiqueue = !!strtoul(argv[i + 1], NULL, 10);
+		} else if (!strcmp(argv[i], "early_filter")) {
+			ovpn->early_filter = !!strtoul(argv[i + 1], NULL, 10);
+		} else if (!strcmp(argv[i], "pmtu")) {
+			ovpn->pmtu_discovery = !!strtoul(argv[i + 1], NULL, 10);
+		} else if (!strcmp(argv[i], "mss_clamp")) {
+			ovpn->mss_clamp = !!strtoul(argv[i + 1], NULL, 10);
+		} else if (!strcmp(argv[i], "rx_mode")) {
+			if (!strcmp(argv[i + 1], "default")) {
+				ovpn->rx_mode = OVPN_RX_MODE_DEFAULT;
+			} else if (!strcmp(argv[i + 1], "napi")) {
+				ovpn->rx_mode = OVPN_RX_MODE_NAPI;
+			} else {
+				fprintf(stderr, "unknown RX mode: %s\n",
+					argv[i + 1]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "ctrl_rate")) {
+			ovpn->ctrl_rate = strtol(argv[i + 1], NULL, 10);
+			if (ovpn->ctrl_rate < 0) {
+				fprintf(stderr, "invalid control packet rate: %s\n",
+					argv[i + 1]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "idle_timeout")) {
+			ovpn->idle_timeout = strtol(argv[i + 1], NULL, 10);
+			if (ovpn->idle_timeout < 0) {
+				fprintf(stderr, "invalid idle timeout: %s\n",
+					argv[i + 1]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "queue_len")) {
+			ovpn->queue_len = strtoul(argv[i + 1], NULL, 10);
+			if (!ovpn->queue_len) {
+				fprintf(stderr, "invalid queue length: %s\n",
+					argv[i + 1]);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "unknown VPN option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int ovpn_parse_loadgen(struct ovpn_ctx *ovpn, struct ovpn_loadgen *lg,
+			      int argc, char *argv[])
+{
+	char *peer_argv[7];
+	unsigned long val;
+	char *end;
+	int i;
+
+	if (argc < 10) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	/* reuse the new_peer parser, the remote port is picked per peer */
+	memcpy(peer_argv, argv, 6 * sizeof(*argv));
+	peer_argv[6] = "0";
+	if (ovpn_parse_new_peer(ovpn, 7, peer_argv) < 0)
+		return -1;
+
+	if (ovpn_read_cipher(argv[6], ovpn) < 0 ||
+	    ovpn_read_key(argv[7], ovpn))
+		return -1;
+
+	if (ovpn_parse_peer_id(ovpn, argv[8]) < 0)
+		return -1;
+	lg->first_id = ovpn->peer_id;
+
+	errno = 0;
+	val = strtoul(argv[9], &end, 10);
+	if (errno == ERANGE || *end != '\0' || !val ||
+	    val > OVPN_PEER_ID_UNDEF - lg->first_id) {
+		fprintf(stderr, "invalid peer count: %s\n", argv[9]);
+		return -1;
+	}
+	lg->count = val;
+
+	lg->rounds = 1;
+	lg->burst = 100;
+
+	for (i = 10; i < argc; i += 2) {
+		if (i + 1 == argc) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		errno = 0;
+		val = strtoul(argv[i + 1], &end, 10);
+		if (errno == ERANGE || *end != '\0' || val > UINT32_MAX) {
+			fprintf(stderr, "invalid %s value: %s\n", argv[i],
+				argv[i + 1]);
+			return -1;
+		}
+
+		if (!strcmp(argv[i], "rounds")) {
+			lg->rounds = val;
+		} else if (!strcmp(argv[i], "burst") && val) {
+			lg->burst = val;
+		} else if (!strcmp(argv[i], "pause")) {
+			lg->pause_ms = val;
+		} else if (!strcmp(argv[i], "churn")) {
+			lg->churn = !!val;
+		} else if (!strcmp(argv[i], "monitor") &&
+			   val < OVPN_PEER_ID_UNDEF) {
+			lg->monitor_id = val;
+			lg->monitor_set = true;
+		} else {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -1142,7 +2456,7 @@ static int ovpn_parse_set_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 		return -1;
 	}
 
-	return 0;
+	return ovpn_parse_opt_peer_id(ovpn, argc, argv, 5);
 }
 
 int main(int argc, char *argv[])
@@ -1150,7 +2464,7 @@ int main(int argc, char *argv[])
 	sa_family_t family = AF_INET;
 	struct ovpn_ctx ovpn;
 	struct nl_ctx *ctx;
-	int ret;
+	int i, ret;
 
 	if (argc < 3) {
 		usage(argv[0]);
@@ -1158,6 +2472,15 @@ int main(int argc, char *argv[])
 	}
 
 	memset(&ovpn, 0, sizeof(ovpn));
+	ovpn.mode = OVPN_MODE_CLIENT;
+	ovpn.crypto_parallel = -1;
+	ovpn.tx_multiqueue = -1;
+	ovpn.rx_mode = -1;
+	ovpn.early_filter = -1;
+	ovpn.pmtu_discovery = -1;
+	ovpn.mss_clamp = -1;
+	ovpn.ctrl_rate = -1;
+	ovpn.idle_timeout = -1;
 
 	ovpn.ifindex = if_nametoindex(argv[1]);
 	if (!ovpn.ifindex) {
@@ -1178,8 +2501,16 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
-		if (argc > 4 && !strcmp(argv[4], "ipv6"))
-			family = AF_INET6;
+		for (i = 4; i < argc; i++) {
+			if (!strcmp(argv[i], "ipv6")) {
+				family = AF_INET6;
+			} else if (!strcmp(argv[i], "server")) {
+				ovpn.mode = OVPN_MODE_SERVER;
+			} else {
+				usage(argv[0]);
+				return -1;
+			}
+		}
 
 		ret = ovpn_udp_socket(&ovpn, family);
 		if (ret < 0)
@@ -1280,6 +2611,51 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "cannot add peer to VPN\n");
 			return ret;
 		}
+	} else if (!strcmp(argv[2], "del_peer")) {
+		if (argc < 4) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ret = ovpn_parse_peer_id(&ovpn, argv[3]);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_del_peer(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot delete peer\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "new_iroute")) {
+		ret = ovpn_parse_iroute(&ovpn, argc, argv);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_iroute(&ovpn, OVPN_CMD_NEW_IROUTE);
+		if (ret < 0) {
+			fprintf(stderr, "cannot add iroute\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "del_iroute")) {
+		ret = ovpn_parse_iroute(&ovpn, argc, argv);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_iroute(&ovpn, OVPN_CMD_DEL_IROUTE);
+		if (ret < 0) {
+			fprintf(stderr, "cannot delete iroute\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "set_vpn")) {
+		ret = ovpn_parse_set_vpn(&ovpn, argc, argv);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_set_vpn(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot set VPN attributes\n");
+			return ret;
+		}
 	} else if (!strcmp(argv[2], "set_peer")) {
 		ret = ovpn_parse_set_peer(&ovpn, argc, argv);
 		if (ret < 0)
@@ -1308,23 +2684,173 @@ int main(int argc, char *argv[])
 		if (ret)
 			return ret;
 
+		ret = ovpn_parse_new_key_opts(&ovpn, argc, argv, 6);
+		if (ret < 0)
+			return ret;
+
 		ret = ovpn_new_key(&ovpn);
 		if (ret < 0) {
 			fprintf(stderr, "cannot set key\n");
 			return ret;
 		}
+	} else if (!strcmp(argv[2], "new_keys")) {
+		unsigned long count;
+		__u32 first_id;
+		char *end;
+
+		if (argc < 8) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ret = ovpn_read_cipher(argv[3], &ovpn);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_read_key_direction(argv[4], &ovpn);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_read_key(argv[5], &ovpn);
+		if (ret)
+			return ret;
+
+		ret = ovpn_parse_peer_id(&ovpn, argv[6]);
+		if (ret < 0)
+			return ret;
+
+		errno = 0;
+		count = strtoul(argv[7], &end, 10);
+		if (errno == ERANGE || *end != '\0' || !count ||
+		    count > OVPN_PEER_ID_UNDEF - ovpn.peer_id) {
+			fprintf(stderr, "invalid peer count: %s\n", argv[7]);
+			return -1;
+		}
+
+		first_id = ovpn.peer_id;
+
+		ret = ovpn_parse_new_key_opts(&ovpn, argc, argv, 8);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_new_keys(&ovpn, first_id, count);
+		if (ret < 0) {
+			fprintf(stderr, "cannot set keys\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "get_peer")) {
+		ret = ovpn_parse_opt_peer_id(&ovpn, argc, argv, 3);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_get_peer(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get peer\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "get_key")) {
+		ret = ovpn_parse_opt_peer_id(&ovpn, argc, argv, 3);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_get_key(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get key\n");
+			return ret;
+		}
 	} else if (!strcmp(argv[2], "del_key")) {
+		ret = ovpn_parse_opt_peer_id(&ovpn, argc, argv, 3);
+		if (ret < 0)
+			return ret;
+
 		ret = ovpn_del_key(&ovpn);
 		if (ret < 0) {
 			fprintf(stderr, "cannot delete key\n");
 			return ret;
 		}
 	} else if (!strcmp(argv[2], "swap_keys")) {
+		ret = ovpn_parse_opt_peer_id(&ovpn, argc, argv, 3);
+		if (ret < 0)
+			return ret;
+
 		ret = ovpn_swap_keys(&ovpn);
 		if (ret < 0) {
 			fprintf(stderr, "cannot swap keys\n");
 			return ret;
 		}
+	} else if (!strcmp(argv[2], "get_mem")) {
+		ret = ovpn_get_mem(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get memory usage\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "add_sockets")) {
+		unsigned int n;
+
+		if (argc < 5) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ovpn.lport = strtoul(argv[3], NULL, 10);
+		if (errno == ERANGE || ovpn.lport > 65535) {
+			fprintf(stderr, "lport value out of range\n");
+			return -1;
+		}
+
+		n = strtoul(argv[4], NULL, 10);
+		if (!n) {
+			fprintf(stderr, "invalid number of sockets: %s\n",
+				argv[4]);
+			return -1;
+		}
+
+		if (argc > 5 && !strcmp(argv[5], "ipv6"))
+			family = AF_INET6;
+
+		for (i = 0; i < n; i++) {
+			ret = ovpn_udp_socket(&ovpn, family);
+			if (ret < 0)
+				return ret;
+
+			/* the group is complete once the last socket is bound:
+			 * the one started with start_udp plus n
+			 */
+			if (i == n - 1) {
+				ret = ovpn_reuseport_steer_cpu(ovpn.socket,
+							       n + 1);
+				if (ret < 0) {
+					close(ovpn.socket);
+					return ret;
+				}
+			}
+
+			/* the kernel holds its own reference to the socket */
+			ret = ovpn_add_socket(&ovpn);
+			close(ovpn.socket);
+			if (ret < 0) {
+				fprintf(stderr, "cannot add socket\n");
+				return ret;
+			}
+		}
+	} else if (!strcmp(argv[2], "get_filter")) {
+		ret = ovpn_get_filter(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get early filter state\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "loadgen")) {
+		struct ovpn_loadgen lg = { 0 };
+
+		ret = ovpn_parse_loadgen(&ovpn, &lg, argc, argv);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_loadgen(&ovpn, &lg);
+		if (ret < 0) {
+			fprintf(stderr, "load generation failed\n");
+			return ret;
+		}
 	} else if (!strcmp(argv[2], "recv")) {
 		ctx = ovpn_register(&ovpn);
 		if (!ctx) {
@@ -1340,6 +2866,10 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
+		ret = ovpn_parse_opt_peer_id(&ovpn, argc, argv, 4);
+		if (ret < 0)
+			return ret;
+
 		ret = ovpn_send_data(&ovpn, argv[3], strlen(argv[3]) + 1);
 		if (ret < 0)
 			fprintf(stderr, "cannot send data\n");
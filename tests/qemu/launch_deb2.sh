@@ -1,10 +1,25 @@
 #!/bin/bash
+#
+# Boot a kernel built with config.net-next, sharing $SHARE with the guest
+# (mount_tag k1).
+#
+# For benchmarks (see ../netns-bench.sh) the vCPUs can be pinned to the host
+# CPUs listed in $PIN (taskset syntax, e.g. 2-5), so that runs of different
+# commits are comparable; $SMP should then match the number of CPUs in $PIN.
 
-DISK=emulation/debian2.img
-BZIMAGE=linux-kernel/arch/x86/boot/bzImage
-SHARE=/home/user/share
+DISK=${DISK:-emulation/debian2.img}
+BZIMAGE=${BZIMAGE:-linux-kernel/arch/x86/boot/bzImage}
+SHARE=${SHARE:-/home/user/share}
+SMP=${SMP:-1}
+MEM=${MEM:-2048}
 
-sudo qemu-system-x86_64 \
+PINNING=
+if [ -n "$PIN" ]; then
+	PINNING="taskset -c $PIN"
+fi
+
+sudo $PINNING qemu-system-x86_64 \
+    -smp ${SMP} \
     -device virtio-balloon \
     -enable-kvm \
     -accel kvm \
@@ -16,5 +31,5 @@ sudo qemu-system-x86_64 \
     -display none \
     -nographic \
     -serial mon:stdio \
-    -m 2048 -boot c \
+    -m ${MEM} -boot c \
     -snapshot -s